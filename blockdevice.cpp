@@ -0,0 +1,637 @@
+/* This file is part of XTVFS Reader.
+ * Copyright (C) 2014 S. Blackburn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * XTVFS Reader is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with XTVFS Reader.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "blockdevice.h"
+#include "iostats.h"
+#include "log.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(HAVE_ZSTD)
+#include <zstd.h>
+#endif
+
+using namespace std;
+using namespace fs;
+
+#define Read32Bits(block, index) ((unsigned long long)block[index+3]<<24 | block[index+2]<<16 | block[index+1]<<8 | block[index])
+
+
+// ===========================================================================
+// ==                 B L O C K D E V I C E   C L A S S                     ==
+// ===========================================================================
+
+BlockDevice::~BlockDevice()
+{
+
+}
+
+
+bool BlockDevice::locate(unsigned long long, int &, unsigned long long &) const
+{
+    return false;
+}
+
+
+BlockDevicePtr BlockDevice::open(const std::string &filepath, bool directIo)
+{
+    shared_ptr<RawBlockDevice> raw(new RawBlockDevice());
+    if (!raw->open(filepath, directIo))
+        return BlockDevicePtr();
+
+    // Sniff the first few bytes to see what we've been given
+    unsigned char magic[4] = { 0, 0, 0, 0 };
+    raw->read(0, magic, sizeof(magic));
+    const unsigned long long magicNumber = Read32Bits(magic, 0);
+
+    if (magicNumber == 0xFD2FB528) // zstd frame
+    {
+#if defined(HAVE_ZSTD)
+        shared_ptr<ZstdBlockDevice> zstd(new ZstdBlockDevice());
+        if (!zstd->open(filepath))
+            return BlockDevicePtr();
+        return zstd;
+#else
+        XTVFS_ERROR(filepath << " is zstd compressed, but zstd support was not built in");
+        return BlockDevicePtr();
+#endif
+    }
+    else if (magic[0] == 0x1F && magic[1] == 0x8B)
+    {
+        XTVFS_ERROR(filepath << " is gzip compressed, which can't be read in place. "
+                               "Recompress it in the zstd seekable format instead.");
+        return BlockDevicePtr();
+    }
+
+    return raw;
+}
+
+
+// ===========================================================================
+// ==             R A W B L O C K D E V I C E   C L A S S                   ==
+// ===========================================================================
+
+RawBlockDevice::RawBlockDevice() :
+    m_fd(-1),
+    m_direct(false),
+    m_size(0),
+    m_lastEnd(0)
+{
+}
+
+
+RawBlockDevice::~RawBlockDevice()
+{
+    if (m_fd >= 0)
+        ::close(m_fd);
+}
+
+
+bool RawBlockDevice::open(const std::string &filepath, bool directIo)
+{
+    int flags = O_RDONLY;
+#if defined(O_DIRECT)
+    if (directIo)
+        flags |= O_DIRECT;
+#endif
+
+    m_fd = ::open(filepath.c_str(), flags);
+    if (m_fd < 0 && directIo)
+    {
+        // Not every file system supports O_DIRECT (e.g. tmpfs), so fall back to buffered reads
+        XTVFS_WARNING("Direct I/O not available for " << filepath << ", using buffered reads");
+        directIo = false;
+        m_fd = ::open(filepath.c_str(), O_RDONLY);
+    }
+    if (m_fd < 0)
+    {
+        XTVFS_ERROR("Error opening " << filepath << ": " << strerror(errno));
+        return false;
+    }
+#if defined(O_DIRECT)
+    m_direct = directIo;
+#else
+    m_direct = false;
+#endif
+
+    // lseek works for block devices as well as files, where st_size would be zero
+    const off_t end = ::lseek(m_fd, 0, SEEK_END);
+    m_size = (end > 0) ? end : 0;
+
+    return true;
+}
+
+
+bool RawBlockDevice::read(unsigned long long offset, void *buffer, size_t length)
+{
+    char *dest = static_cast<char*>(buffer);
+
+    // O_DIRECT only accepts aligned transfers. Metadata reads usually aren't, so bounce those.
+    if (m_direct && ((offset | length | (size_t)dest) & (directIoAlignment - 1)) != 0)
+        return readUnaligned(offset, dest, length);
+
+    // How far the disk has to move from where the last read left it
+    const unsigned long long lastEnd = m_lastEnd.exchange(offset + length, memory_order_relaxed);
+    unsigned long long seek = (offset > lastEnd) ? offset - lastEnd : lastEnd - offset;
+
+    while (length > 0)
+    {
+        const chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        const ssize_t got = ::pread(m_fd, dest, length, offset);
+        ioStats().countDeviceRead(seek, (got > 0) ? got : 0,
+                                  chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+        seek = 0; // Anything left of a short read carries on from where it stopped
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+        {
+            // Past the end of the image, or an I/O error
+            memset(dest, 0, length);
+            return false;
+        }
+
+        dest += got;
+        offset += got;
+        length -= got;
+    }
+
+    return true;
+}
+
+
+bool RawBlockDevice::locate(unsigned long long offset, int &fd, unsigned long long &fileOffset) const
+{
+    // Direct I/O has its own alignment rules, which sendfile() doesn't keep to
+    if (m_fd < 0 || m_direct || offset >= m_size)
+        return false;
+
+    fd = m_fd;
+    fileOffset = offset;
+    return true;
+}
+
+
+bool RawBlockDevice::readUnaligned(unsigned long long offset, char *buffer, size_t length)
+{
+    const unsigned long long alignedStart = offset & ~(unsigned long long)(directIoAlignment - 1);
+    const unsigned long long alignedEnd = (offset + length + directIoAlignment - 1) & ~(unsigned long long)(directIoAlignment - 1);
+    const size_t alignedLength = alignedEnd - alignedStart;
+
+    void *bounce = NULL;
+    if (posix_memalign(&bounce, directIoAlignment, alignedLength) != 0)
+        return false;
+
+    const bool okay = read(alignedStart, bounce, alignedLength);
+    memcpy(buffer, static_cast<char*>(bounce) + (offset - alignedStart), length);
+    free(bounce);
+
+    return okay;
+}
+
+
+
+// ===========================================================================
+// ==      P A R T I T I O N B L O C K D E V I C E   C L A S S              ==
+// ===========================================================================
+
+PartitionBlockDevice::PartitionBlockDevice(const BlockDevicePtr &device, unsigned long long offset, unsigned long long size) :
+    m_device(device),
+    m_offset(offset),
+    m_size(size)
+{
+}
+
+
+bool PartitionBlockDevice::read(unsigned long long offset, void *buffer, size_t length)
+{
+    char *dest = static_cast<char*>(buffer);
+
+    // Don't let a read run on into the next partition
+    const size_t inside = (offset >= m_size) ? 0 : (size_t)min<unsigned long long>(length, m_size - offset);
+    bool okay = (inside == length);
+    memset(dest + inside, 0, length - inside);
+
+    if (inside > 0)
+        okay = m_device->read(m_offset + offset, dest, inside) && okay;
+
+    return okay;
+}
+
+
+bool PartitionBlockDevice::locate(unsigned long long offset, int &fd, unsigned long long &fileOffset) const
+{
+    return offset < m_size && m_device->locate(m_offset + offset, fd, fileOffset);
+}
+
+
+
+// ===========================================================================
+// ==         C A C H E D B L O C K D E V I C E   C L A S S                 ==
+// ===========================================================================
+
+// std::min() takes it by reference, so it needs defining somewhere
+const size_t CachedBlockDevice::maxReadAheadBlocks;
+
+CachedBlockDevice::CachedBlockDevice(const BlockDevicePtr &device, size_t cacheSize) :
+    m_device(device),
+    m_cacheLimit(cacheSize)
+{
+}
+
+
+void CachedBlockDevice::setCacheSize(size_t bytes)
+{
+    lock_guard<mutex> lock(m_cacheMutex);
+    m_cacheLimit = bytes;
+    evict();
+}
+
+
+bool CachedBlockDevice::read(unsigned long long offset, void *buffer, size_t length, Pool pool)
+{
+    if (length == 0)
+        return true;
+
+    const unsigned long long first = offset / blockSize;
+    const unsigned long long last = (offset + length - 1) / blockSize;
+
+    // Spot sequential reads, and decide how far to read ahead of any block that's missing
+    size_t readAhead = 0;
+    bool continuing;
+    size_t limit;
+    {
+        lock_guard<mutex> lock(m_cacheMutex);
+        limit = m_cacheLimit;
+        PoolState &state = m_pools[pool];
+        continuing = (offset == state.nextOffset);
+        state.streak = continuing ? min(state.streak + 1, 4u) : 0;
+        state.nextOffset = offset + length;
+        if (state.streak > 0)
+            readAhead = min(maxReadAheadBlocks, (size_t)1 << state.streak);
+    }
+
+    if (limit == 0 || (pool == Data && length >= maxReadAheadBlocks * blockSize))
+        return m_device->read(offset, buffer, length);
+
+    unsigned char *dest = static_cast<unsigned char*>(buffer);
+    for (unsigned long long block = first; block <= last; ++block)
+    {
+        // Carrying on through the block the last read finished in isn't using it again
+        const bool reference = !(block == first && continuing && offset % blockSize != 0);
+        BlockPtr data = find(block, reference);
+        ioStats().countBlockCache((bool)data);
+        if (!data)
+            data = fetch(block, last, readAhead, pool);
+        if (!data)
+            return false;
+
+        const unsigned long long blockStart = block * blockSize;
+        const size_t from = (block == first) ? offset - blockStart : 0;
+        const size_t to = (block == last) ? offset + length - blockStart : blockSize;
+        memcpy(dest, &(*data)[from], to - from);
+        dest += to - from;
+    }
+
+    return offset + length <= size();
+}
+
+
+CachedBlockDevice::BlockPtr CachedBlockDevice::find(unsigned long long block, bool reference)
+{
+    lock_guard<mutex> lock(m_cacheMutex);
+    map<unsigned long long, CachedBlock>::iterator i = m_cache.find(block);
+    if (i == m_cache.end())
+        return BlockPtr();
+
+    // A block is only protected the second time it's used, so a scan passes through on probation
+    CachedBlock &cached = i->second;
+    PoolState &state = m_pools[cached.pool];
+    if (reference)
+    {
+        if (cached.reused)
+            state.protect.splice(state.protect.begin(), state.protect, cached.lruPosition);
+        else if (cached.used)
+        {
+            state.protect.splice(state.protect.begin(), state.probation, cached.lruPosition);
+            cached.reused = true;
+        }
+        else
+        {
+            state.probation.splice(state.probation.begin(), state.probation, cached.lruPosition);
+            cached.used = true;
+        }
+    }
+    return cached.data;
+}
+
+
+CachedBlockDevice::BlockPtr CachedBlockDevice::fetch(unsigned long long block, unsigned long long lastWanted,
+                                                     size_t readAhead, Pool pool)
+{
+    const unsigned long long deviceBlocks = (size() + blockSize - 1) / blockSize;
+    if (block >= deviceBlocks)
+        return BlockPtr(new ByteArray(blockSize)); // Past the end, so zeros
+
+    // Read the rest of what was asked for and anything ahead of it in one go,
+    // stopping at the end of the device or at a block that's already cached
+    const unsigned long long end = min(deviceBlocks, lastWanted + 1 + readAhead);
+    size_t count = 1;
+    {
+        lock_guard<mutex> lock(m_cacheMutex);
+        while (block + count < end && m_cache.find(block + count) == m_cache.end())
+            ++count;
+    }
+
+    ByteArray run(count * blockSize);
+    const unsigned long long start = block * blockSize;
+    const bool okay = m_device->read(start, &run[0], min<unsigned long long>(run.size(), size() - start));
+    if (block + count - 1 > lastWanted)
+        ioStats().countReadAhead((block + count - 1 - lastWanted) * blockSize);
+
+    // Don't keep anything from a read that failed, so it's tried again next time
+    if (!okay)
+        return BlockPtr();
+    BlockPtr wanted(new ByteArray(run.begin(), run.begin() + blockSize));
+
+    lock_guard<mutex> lock(m_cacheMutex);
+    if (m_cacheLimit == 0)
+        return wanted;
+    insert(block, wanted, pool, true);
+    for (size_t i=1; i<count; ++i)
+    {
+        BlockPtr data(new ByteArray(run.begin() + i * blockSize, run.begin() + (i + 1) * blockSize));
+        insert(block + i, data, pool, block + i <= lastWanted);
+    }
+    evict();
+
+    return wanted;
+}
+
+
+void CachedBlockDevice::insert(unsigned long long block, const BlockPtr &data, Pool pool, bool used)
+{
+    if (m_cache.find(block) != m_cache.end())
+        return; // Another thread got there first
+
+    PoolState &state = m_pools[pool];
+    state.probation.push_front(block);
+    CachedBlock &cached = m_cache[block];
+    cached.data = data;
+    cached.pool = pool;
+    cached.used = used;
+    cached.reused = false;
+    cached.lruPosition = state.probation.begin();
+    state.bytes += data->size();
+}
+
+
+void CachedBlockDevice::evict()
+{
+    while (m_pools[Metadata].bytes + m_pools[Data].bytes > m_cacheLimit)
+    {
+        // Metadata keeps a quarter of the cache, so data is evicted first unless metadata has more than that
+        const Pool pool = (m_pools[Metadata].bytes > m_cacheLimit / 4 || m_pools[Data].bytes == 0) ? Metadata : Data;
+        PoolState &state = m_pools[pool];
+        LruList &lru = state.probation.empty() ? state.protect : state.probation;
+
+        map<unsigned long long, CachedBlock>::iterator victim = m_cache.find(lru.back());
+        state.bytes -= victim->second.data->size();
+        m_cache.erase(victim);
+        lru.pop_back();
+    }
+}
+
+
+
+#if defined(HAVE_ZSTD)
+// ===========================================================================
+// ==            Z S T D B L O C K D E V I C E   C L A S S                  ==
+// ===========================================================================
+
+const unsigned long long SkippableFrameMagic = 0x184D2A5E;
+const unsigned long long SeekableMagic = 0x8F92EAB1;
+const size_t SeekTableFooterSize = 9;
+
+ZstdBlockDevice::ZstdBlockDevice() :
+    m_size(0),
+    m_cacheBytes(0),
+    m_cacheLimit(64 * 1024 * 1024)
+{
+}
+
+
+bool ZstdBlockDevice::open(const std::string &filepath)
+{
+    if (!m_file.open(filepath))
+        return false;
+
+    if (!readSeekTable())
+    {
+        XTVFS_ERROR(filepath << " has no zstd seek table. Only the seekable format can be read in place.");
+        return false;
+    }
+
+    return true;
+}
+
+
+/// The seek table lives in a skippable frame at the end of the file:
+///   [magic 0x184D2A5E][frame size][entries...][number of frames][descriptor][magic 0x8F92EAB1]
+/// Each entry is the compressed size and decompressed size of one frame,
+/// optionally followed by a checksum.
+bool ZstdBlockDevice::readSeekTable()
+{
+    const unsigned long long fileSize = m_file.size();
+    if (fileSize < SeekTableFooterSize + 8)
+        return false;
+
+    unsigned char footer[SeekTableFooterSize];
+    m_file.read(fileSize - SeekTableFooterSize, footer, sizeof(footer));
+    if (Read32Bits(footer, 5) != SeekableMagic)
+        return false;
+
+    const size_t numFrames = Read32Bits(footer, 0);
+    const unsigned char descriptor = footer[4];
+    const size_t entrySize = (descriptor & 0x80) ? 12 : 8;
+    const unsigned long long tableSize = (unsigned long long)numFrames * entrySize + SeekTableFooterSize;
+    if (tableSize + 8 > fileSize)
+        return false;
+
+    const unsigned long long tableStart = fileSize - tableSize - 8;
+    std::vector<unsigned char> table(tableSize + 8);
+    m_file.read(tableStart, &table[0], table.size());
+    if (Read32Bits(table, 0) != SkippableFrameMagic || Read32Bits(table, 4) != tableSize)
+        return false;
+
+    m_frames.resize(numFrames);
+    unsigned long long compressedOffset = 0;
+    unsigned long long offset = 0;
+    for (size_t i=0; i<numFrames; ++i)
+    {
+        const size_t entry = 8 + i * entrySize;
+        Frame &f = m_frames[i];
+        f.compressedOffset = compressedOffset;
+        f.compressedSize = Read32Bits(table, entry);
+        f.offset = offset;
+        f.size = Read32Bits(table, entry + 4);
+
+        compressedOffset += f.compressedSize;
+        offset += f.size;
+    }
+    m_size = offset;
+
+    // The frames should account for everything before the seek table
+    return compressedOffset <= tableStart;
+}
+
+
+void ZstdBlockDevice::setCacheSize(size_t bytes)
+{
+    lock_guard<mutex> lock(m_cacheMutex);
+    m_cacheLimit = bytes;
+    evict(0);
+}
+
+
+size_t ZstdBlockDevice::frameFor(unsigned long long offset) const
+{
+    // Find the first frame starting after offset, the one we want is just before it
+    size_t lo = 0, hi = m_frames.size();
+    while (lo < hi)
+    {
+        const size_t mid = (lo + hi) / 2;
+        if (m_frames[mid].offset <= offset)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo - 1;
+}
+
+
+ZstdBlockDevice::FramePtr ZstdBlockDevice::decompressFrame(size_t index)
+{
+    const Frame &f = m_frames[index];
+
+    ByteArray compressed(f.compressedSize);
+    if (f.compressedSize > 0 && !m_file.read(f.compressedOffset, &compressed[0], compressed.size()))
+        return FramePtr();
+
+    shared_ptr<ByteArray> data(new ByteArray(f.size));
+    if (f.size > 0)
+    {
+        const size_t result = ZSTD_decompress(&(*data)[0], data->size(), &compressed[0], compressed.size());
+        if (ZSTD_isError(result) || result != f.size)
+        {
+            XTVFS_ERROR("Error decompressing zstd frame " << index << ": "
+                        << (ZSTD_isError(result) ? ZSTD_getErrorName(result) : "wrong size"));
+            return FramePtr();
+        }
+    }
+
+    return data;
+}
+
+
+ZstdBlockDevice::FramePtr ZstdBlockDevice::frame(size_t index)
+{
+    {
+        lock_guard<mutex> lock(m_cacheMutex);
+        map<size_t, CachedFrame>::iterator i = m_cache.find(index);
+        if (i != m_cache.end())
+        {
+            m_lru.splice(m_lru.begin(), m_lru, i->second.lruPosition);
+            ioStats().countFrame(true);
+            return i->second.data;
+        }
+    }
+    ioStats().countFrame(false);
+
+    // Decompress without holding the lock so other threads can carry on.
+    // Two threads may occasionally decompress the same frame, which is harmless.
+    FramePtr data = decompressFrame(index);
+    if (!data)
+        return data;
+
+    lock_guard<mutex> lock(m_cacheMutex);
+    if (m_cache.find(index) == m_cache.end())
+    {
+        m_lru.push_front(index);
+        CachedFrame &cached = m_cache[index];
+        cached.data = data;
+        cached.lruPosition = m_lru.begin();
+        m_cacheBytes += data->size();
+    }
+
+    // Always keep the frame just used
+    evict(1);
+
+    return data;
+}
+
+
+void ZstdBlockDevice::evict(size_t keepFrames)
+{
+    while (m_cacheBytes > m_cacheLimit && m_lru.size() > keepFrames)
+    {
+        map<size_t, CachedFrame>::iterator victim = m_cache.find(m_lru.back());
+        m_cacheBytes -= victim->second.data->size();
+        m_cache.erase(victim);
+        m_lru.pop_back();
+    }
+}
+
+
+bool ZstdBlockDevice::read(unsigned long long offset, void *buffer, size_t length)
+{
+    unsigned char *dest = static_cast<unsigned char*>(buffer);
+
+    size_t index = (offset < m_size) ? frameFor(offset) : m_frames.size();
+    while (length > 0 && index < m_frames.size())
+    {
+        const Frame &f = m_frames[index];
+        const FramePtr data = frame(index);
+        if (!data)
+            break;
+
+        const size_t offsetInFrame = offset - f.offset;
+        const size_t bytesThisFrame = min<unsigned long long>(length, f.size - offsetInFrame);
+        if (bytesThisFrame > 0)
+            memcpy(dest, &(*data)[offsetInFrame], bytesThisFrame);
+
+        dest += bytesThisFrame;
+        offset += bytesThisFrame;
+        length -= bytesThisFrame;
+        ++index;
+    }
+
+    if (length > 0)
+    {
+        memset(dest, 0, length);
+        return false;
+    }
+
+    return true;
+}
+#endif
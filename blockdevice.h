@@ -0,0 +1,283 @@
+/* This file is part of XTVFS Reader.
+ * Copyright (C) 2014 S. Blackburn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * XTVFS Reader is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with XTVFS Reader.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef XTVFS_BLOCKDEVICE_H
+#define XTVFS_BLOCKDEVICE_H
+
+#include <atomic>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace fs
+{
+
+
+/**
+ * A read-only source of disk image bytes, addressed by byte offset.
+ * The file systems read everything through one of these, so an image
+ * does not have to be a plain file on disk.
+ *
+ * read() takes an absolute offset and keeps no position of its own,
+ * so implementations must be safe to call from several threads at once.
+ */
+class BlockDevice
+{
+public:
+    virtual ~BlockDevice();
+
+    /**
+     * Open an image or disk, picking the backend by looking at the file's contents.
+     * @param filepath The image or device to open
+     * @param directIo Bypass the operating system's cache for plain images (O_DIRECT)
+     * @return An empty pointer if the file can't be opened or its format isn't supported
+     */
+    static std::shared_ptr<BlockDevice> open(const std::string &filepath, bool directIo = false);
+
+    /// Read length bytes starting at offset.
+    /// Anything past the end of the image is returned as zeros, and false is returned.
+    virtual bool read(unsigned long long offset, void *buffer, size_t length) = 0;
+
+    /// Size of the image in bytes, as the file system sees it (i.e. uncompressed)
+    virtual unsigned long long size() const = 0;
+
+    /**
+     * Where a byte of the image is kept as it is in an ordinary file, so the
+     * kernel can be asked to copy it straight out, e.g. with sendfile().
+     * @param fd The file descriptor to read with
+     * @param fileOffset Where the byte is in that file
+     * @return False if it isn't kept as it is, e.g. in a compressed image, or the file bypasses the kernel's cache
+     */
+    virtual bool locate(unsigned long long offset, int &fd, unsigned long long &fileOffset) const;
+};
+
+typedef std::shared_ptr<BlockDevice> BlockDevicePtr;
+
+
+/**
+ * A plain image file or device node.
+ * Sparse images need no special handling: holes read back as zeros
+ * without the operating system touching the disk.
+ */
+class RawBlockDevice : public BlockDevice
+{
+public:
+    RawBlockDevice();
+    ~RawBlockDevice();
+
+    /// Open the file. With directIo, reads bypass the operating system's cache,
+    /// which stops a multi-GB extraction from pushing everything else out of memory.
+    bool open(const std::string &filepath, bool directIo = false);
+
+    virtual bool read(unsigned long long offset, void *buffer, size_t length);
+    virtual unsigned long long size() const { return m_size; }
+    virtual bool locate(unsigned long long offset, int &fd, unsigned long long &fileOffset) const;
+
+    /// The underlying file descriptor, or -1 if not open
+    int fileDescriptor() const { return m_fd; }
+
+    /// Buffers, offsets and lengths that are multiples of this can be read directly with directIo
+    static const size_t directIoAlignment = 4096;
+
+private:
+    bool readUnaligned(unsigned long long offset, char *buffer, size_t length);
+
+    int m_fd;
+    bool m_direct;
+    unsigned long long m_size;
+    std::atomic<unsigned long long> m_lastEnd;  ///< Where the last read finished, for measuring seeks
+};
+
+
+/**
+ * One partition of another device: a window starting part way into it.
+ * A file system opened on this sees its volume start at offset 0, so it
+ * never needs to know where the partition is.
+ */
+class PartitionBlockDevice : public BlockDevice
+{
+public:
+    PartitionBlockDevice(const BlockDevicePtr &device, unsigned long long offset, unsigned long long size);
+
+    virtual bool read(unsigned long long offset, void *buffer, size_t length);
+    virtual unsigned long long size() const { return m_size; }
+    virtual bool locate(unsigned long long offset, int &fd, unsigned long long &fileOffset) const;
+
+    /// Where the partition starts on the underlying device, in bytes
+    unsigned long long offset() const { return m_offset; }
+
+private:
+    BlockDevicePtr m_device;
+    unsigned long long m_offset;
+    unsigned long long m_size;
+};
+
+
+/**
+ * A cache of blocks of another device, which the file systems read through.
+ *
+ * Blocks are kept in two pools, one for metadata (tables and directories) and
+ * one for file data, sharing a single memory limit. Metadata is always allowed
+ * a quarter of it, so copying a big file can't push the tables out.
+ * Within each pool a block starts on probation and is only protected once it
+ * has been used again, so a one-off scan is evicted before anything reused.
+ *
+ * Reads that carry on from where the last one in the same pool finished are
+ * taken as sequential, and missing blocks are then read with a growing window
+ * of the blocks after them. Data reads as big as the window go straight to
+ * the device, since caching them would only copy them.
+ */
+class CachedBlockDevice : public BlockDevice
+{
+public:
+    enum Pool { Metadata, Data, PoolCount };
+
+    CachedBlockDevice(const BlockDevicePtr &device, size_t cacheSize = defaultCacheSize);
+
+    /// Read through the data pool
+    virtual bool read(unsigned long long offset, void *buffer, size_t length) { return read(offset, buffer, length, Data); }
+
+    /// Read through one of the pools
+    bool read(unsigned long long offset, void *buffer, size_t length, Pool pool);
+
+    virtual unsigned long long size() const { return m_device->size(); }
+
+    /// Where the device underneath keeps the byte, bypassing the cache
+    virtual bool locate(unsigned long long offset, int &fd, unsigned long long &fileOffset) const
+    {
+        return m_device->locate(offset, fd, fileOffset);
+    }
+
+    /// Set the number of bytes of blocks to keep across both pools. 0 turns the cache off.
+    void setCacheSize(size_t bytes);
+
+    static const size_t blockSize = 64 * 1024;
+    static const size_t defaultCacheSize = 64 * 1024 * 1024;
+
+    /// The most read ahead of a sequential read, in blocks
+    static const size_t maxReadAheadBlocks = 16;
+
+private:
+    typedef std::vector<unsigned char> ByteArray;
+    typedef std::shared_ptr<const ByteArray> BlockPtr;
+    typedef std::list<unsigned long long> LruList;
+
+    struct CachedBlock
+    {
+        BlockPtr data;
+        Pool pool;
+        bool used;                  ///< Read since it was cached, rather than only read ahead
+        bool reused;                ///< Read again since then, so in the protected list rather than on probation
+        LruList::iterator lruPosition;
+    };
+
+    /// Each pool's lists have the most recently used at the front
+    struct PoolState
+    {
+        PoolState() : bytes(0), nextOffset(0), streak(0) {}
+
+        LruList probation;
+        LruList protect;
+        size_t bytes;
+        unsigned long long nextOffset;  ///< Where the last read in this pool finished, for spotting sequential reads
+        unsigned int streak;            ///< Sequential reads in a row
+    };
+
+    BlockPtr find(unsigned long long block, bool reference);
+
+    /// Read a missing block, and the blocks after it, into the cache. Empty if the device couldn't be read.
+    BlockPtr fetch(unsigned long long block, unsigned long long lastWanted, size_t readAhead, Pool pool);
+    void insert(unsigned long long block, const BlockPtr &data, Pool pool, bool used);
+    void evict();
+
+    BlockDevicePtr m_device;
+
+    std::mutex m_cacheMutex;
+    std::map<unsigned long long, CachedBlock> m_cache;
+    PoolState m_pools[PoolCount];
+    size_t m_cacheLimit;
+};
+
+
+#if defined(HAVE_ZSTD)
+/**
+ * An image compressed in the zstd seekable format, i.e. a series of
+ * independent zstd frames followed by a seek table in a skippable frame.
+ * See contrib/seekable_format in the zstd sources; images can be made with
+ * t2sz or any other seekable-format writer.
+ *
+ * Only the frames covering a read are decompressed, and the most recently
+ * used frames are kept so that neighbouring reads don't decompress them again.
+ */
+class ZstdBlockDevice : public BlockDevice
+{
+public:
+    ZstdBlockDevice();
+
+    /// Open a seekable zstd image. Fails if the file has no seek table.
+    bool open(const std::string &filepath);
+
+    virtual bool read(unsigned long long offset, void *buffer, size_t length);
+    virtual unsigned long long size() const { return m_size; }
+
+    /// Set the number of bytes of decompressed frames to keep. Default is 64MB.
+    void setCacheSize(size_t bytes);
+
+private:
+    typedef std::vector<unsigned char> ByteArray;
+    typedef std::shared_ptr<const ByteArray> FramePtr;
+
+    struct Frame
+    {
+        unsigned long long compressedOffset;
+        size_t compressedSize;
+        unsigned long long offset;  ///< Offset of the frame's first byte in the decompressed image
+        size_t size;                ///< Decompressed size
+    };
+
+    bool readSeekTable();
+    size_t frameFor(unsigned long long offset) const;
+    FramePtr frame(size_t index);
+    FramePtr decompressFrame(size_t index);
+
+    /// Drop the least recently used frames until the cache fits, but keep at least the newest keepFrames
+    void evict(size_t keepFrames);
+
+    RawBlockDevice m_file;
+    std::vector<Frame> m_frames;
+    unsigned long long m_size;
+
+    // LRU of decompressed frames: most recently used at the front of the list
+    typedef std::list<size_t> LruList;
+    struct CachedFrame
+    {
+        FramePtr data;
+        LruList::iterator lruPosition;
+    };
+    std::mutex m_cacheMutex;
+    LruList m_lru;
+    std::map<size_t, CachedFrame> m_cache;
+    size_t m_cacheBytes;
+    size_t m_cacheLimit;
+};
+#endif
+
+} // end of namespace fs
+
+#endif // XTVFS_BLOCKDEVICE_H
@@ -0,0 +1,108 @@
+/* This file is part of XTVFS Reader.
+ * Copyright (C) 2014 S. Blackburn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * XTVFS Reader is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with XTVFS Reader.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "clustercache.h"
+
+#include <algorithm>
+
+using namespace std;
+using namespace fs;
+
+
+ClusterCache::ClusterCache(size_t limit) :
+    m_bytes(0),
+    m_limit(limit)
+{
+}
+
+
+ClusterCache::ClusterPtr ClusterCache::find(unsigned long long diskOffset)
+{
+    lock_guard<mutex> lock(m_mutex);
+    map<unsigned long long, Entry>::iterator i = m_clusters.find(diskOffset);
+    if (i == m_clusters.end())
+        return ClusterPtr();
+
+    m_lru.splice(m_lru.begin(), m_lru, i->second.lruPosition);
+    return i->second.data;
+}
+
+
+void ClusterCache::insert(unsigned long long diskOffset, const ClusterPtr &data)
+{
+    lock_guard<mutex> lock(m_mutex);
+    if (m_clusters.find(diskOffset) != m_clusters.end())
+        return; // Another thread got there first
+
+    m_lru.push_front(diskOffset);
+    Entry &entry = m_clusters[diskOffset];
+    entry.data = data;
+    entry.lruPosition = m_lru.begin();
+    m_bytes += data->size();
+
+    while (m_bytes > m_limit && m_lru.size() > 1)
+    {
+        map<unsigned long long, Entry>::iterator victim = m_clusters.find(m_lru.back());
+        m_bytes -= victim->second.data->size();
+        m_clusters.erase(victim);
+        m_lru.pop_back();
+    }
+}
+
+
+static bool startsAfter(size_t fileCluster, const Extent &extent)
+{
+    return fileCluster < extent.fileCluster;
+}
+
+
+ClusterCache::ClusterPtr ClusterCache::read(FileSystem &fileSystem, const DirEntry &entry, const Extents &extents,
+                                            size_t fileCluster, size_t readAhead)
+{
+    // Find the extent the cluster lives in: the one before the first extent starting after it
+    Extents::const_iterator e = std::upper_bound(extents.begin(), extents.end(), fileCluster, startsAfter);
+    if (e == extents.begin())
+        return ClusterPtr();
+    const Extent &extent = *(--e);
+    if (fileCluster >= extent.fileCluster + extent.clusterCount)
+        return ClusterPtr();
+
+    const size_t diskCluster = extent.firstCluster + (fileCluster - extent.fileCluster);
+    const unsigned long long diskOffset = fileSystem.clusterOffsetFor(entry, diskCluster);
+
+    ClusterPtr data = find(diskOffset);
+    if (data)
+        return data;
+
+    // Missed: fetch this cluster and the ones after it in the same extent
+    const size_t count = 1 + std::min(readAhead, extent.fileCluster + extent.clusterCount - fileCluster - 1);
+    const size_t clusterSize = fileSystem.clusterSizeFor(entry);
+    const unsigned long long fileOffset = (unsigned long long)fileCluster * clusterSize;
+    std::vector<char> run(count * clusterSize);
+    const size_t got = fileSystem.readFile(entry, extents, fileOffset, &run[0], run.size());
+
+    for (size_t n=0; n<count && n * clusterSize < got; ++n)
+    {
+        const size_t begin = n * clusterSize;
+        const size_t end = std::min(begin + clusterSize, got);
+        ClusterPtr c(new std::vector<char>(run.begin() + begin, run.begin() + end));
+        insert(fileSystem.clusterOffsetFor(entry, diskCluster + n), c);
+        if (n == 0)
+            data = c;
+    }
+
+    return data;
+}
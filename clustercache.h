@@ -0,0 +1,89 @@
+/* This file is part of XTVFS Reader.
+ * Copyright (C) 2014 S. Blackburn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * XTVFS Reader is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with XTVFS Reader.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef XTVFS_CLUSTERCACHE_H
+#define XTVFS_CLUSTERCACHE_H
+
+#include "filesystem.h"
+
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace fs
+{
+
+
+/**
+ * Whole clusters recently read from the image, for serving files to several
+ * readers at once, e.g. FUSE's worker threads or the HTTP server's connections.
+ * Clusters are keyed by their offset on the disk, so readers of the same file
+ * share them, and the least recently used go first when it is full.
+ */
+class ClusterCache
+{
+public:
+    typedef std::shared_ptr<const std::vector<char> > ClusterPtr;
+
+    /// @param limit Bytes of clusters to keep
+    explicit ClusterCache(size_t limit);
+
+    ClusterPtr find(unsigned long long diskOffset);
+
+    void insert(unsigned long long diskOffset, const ClusterPtr &data);
+
+    /**
+     * One of a file's clusters, from the cache, or else read from the image
+     * along with up to readAhead of the clusters after it in the same extent.
+     * A cluster at the end of the file is cut short at the file's size.
+     * @return Empty if the file's chain doesn't reach that far
+     */
+    ClusterPtr read(FileSystem &fileSystem, const DirEntry &entry, const Extents &extents,
+                    size_t fileCluster, size_t readAhead);
+
+private:
+    typedef std::list<unsigned long long> LruList;
+    struct Entry
+    {
+        ClusterPtr data;
+        LruList::iterator lruPosition;
+    };
+
+    std::mutex m_mutex;
+    LruList m_lru;
+    std::map<unsigned long long, Entry> m_clusters;
+    size_t m_bytes;
+    size_t m_limit;
+};
+
+/**
+ * How a daemon shares its memory for caching between the file system's block
+ * cache and a ClusterCache. The block cache mostly holds tables and
+ * directories, so it gets a quarter and the clusters the rest.
+ */
+struct CacheBudget
+{
+    explicit CacheBudget(size_t bytes) : blockCache(bytes / 4), clusterCache(bytes - bytes / 4) {}
+
+    size_t blockCache;
+    size_t clusterCache;
+};
+
+} // end of namespace fs
+
+#endif // XTVFS_CLUSTERCACHE_H
@@ -15,22 +15,31 @@
  * along with XTVFS Reader.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include "filesystem.h"
+#include "iostats.h"
+#include "log.h"
+#include "tsanalysis.h"
 
 #include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fstream>
 #include <iostream>
 
 using namespace std;
 using namespace fs;
 
 #include <iomanip>
-static void dumpBlock(ostream &s, const Fat32::ByteArray &block, unsigned int wrap = 16, unsigned int pad = 4)
+/// A block as hex and ASCII, for looking at in the log
+static string hexDump(const Fat32::ByteArray &block, unsigned int wrap = 16, unsigned int pad = 4)
 {
+    ostringstream s;
     string ascii;
     for (unsigned int i=0; i<block.size(); ++i)
     {
         if (i % wrap == 0)
         {
-            s << " " << ascii << endl;
+            s << " " << ascii << '\n';
             ascii.clear();
         }
         else if (i % pad == 0)
@@ -44,34 +53,48 @@ static void dumpBlock(ostream &s, const Fat32::ByteArray &block, unsigned int wr
         else
             ascii += '.';
     }
-    s << endl;
+    s << " " << ascii;
+    return s.str();
 }
 
 #define Read8Bits(block, index) (block[index])
 #define Read16Bits(block, index) (block[index+1]<<8 | block[index])
-#define Read24Bits(block, index) (block[index+1]<<16 | block[index+1]<<8 | block[index])
 //#define Read32Bits(block, index) (block[index+3]<<24 | block[index+2]<<16 | block[index+1]<<8 | block[index])
 #define Read32Bits(block, index) ((unsigned long long)block[index+3]<<24 | block[index+2]<<16 | block[index+1]<<8 | block[index])
 
+/// Write part of a cluster to a stream, counting the time it takes
+static void writeBlock(ostream &s, const Fat32::ByteArray &block, size_t length, size_t cluster)
+{
+    const chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    s.write((const char*)&block[0], length);
+    const chrono::steady_clock::time_point end = chrono::steady_clock::now();
+
+    ioStats().countWrite(length, chrono::duration_cast<chrono::nanoseconds>(end - start).count());
+    if (ioStats().tracing())
+        ioStats().traceEvent("write", start, end, "cluster", cluster, "bytes", length);
+}
+
 const size_t NoMoreClusters = 0x0FFFFFF8;
 const size_t BadCluster = 0x0FFFFFF7;
 
+/// What nextCluster() gives when the table couldn't be read. Being past the end of chain markers, it stops any walk along a chain.
+const size_t unreadableCluster = (size_t)-2;
+
 
 string fs::to11CharFormat(const std::string &s)
 {
     // Convert to 11-char format
+    // Anything too long for 8.3 is cut short, as it can't match a short name anyway
     string eleven;
     size_t period = s.find_first_of(".");
     if (period != string::npos)
         eleven = s.substr(0, period);
     else
         eleven = s.substr(0, 8);
-    while (eleven.size() != 8)
-        eleven.push_back(' ');
+    eleven.resize(8, ' ');
     if (period != string::npos)
-        eleven += s.substr(period+1);
-    while (eleven.size() != 11)
-        eleven.push_back(' ');
+        eleven += s.substr(period+1, 3);
+    eleven.resize(11, ' ');
     std::transform(eleven.begin(), eleven.end(), eleven.begin(), ::toupper);
 
     return eleven;
@@ -97,6 +120,8 @@ string fs::from11CharFormat(const std::string &s)
 
 std::string DirEntry::toString() const
 {
+    if (!longName.empty())
+        return longName;
     return from11CharFormat(filename);
 }
 
@@ -164,15 +189,35 @@ const size_t FileSystem::lbaBlockSize = 512;
 
 bool FileSystem::open(const std::string &filepath)
 {
-    disk.open(filepath.c_str(), ios::in | ios::binary);
+    BlockDevicePtr device = BlockDevice::open(filepath);
 
-    if (!disk)
+    if (!device)
     {
-        cerr << "Error opening " << filepath << endl;
+        XTVFS_ERROR("Error opening " << filepath);
         return false;
     }
     else
-        return true;
+        return open(device);
+}
+
+
+bool FileSystem::open(const BlockDevicePtr &device)
+{
+    if (!device)
+    {
+        m_device.reset();
+        return false;
+    }
+
+    // Everything is read through a cache of our own, whatever the device
+    m_device.reset(new CachedBlockDevice(device, m_cacheSize));
+    return true;
+}
+
+
+FileSystem::FileSystem() :
+    m_cacheSize(CachedBlockDevice::defaultCacheSize)
+{
 }
 
 
@@ -182,100 +227,246 @@ FileSystem::~FileSystem()
 }
 
 
-bool FileSystem::readPartition(const ByteArray &mbr, unsigned int partition)
+void FileSystem::setCacheSize(size_t bytes)
+{
+    m_cacheSize = bytes;
+    if (m_device)
+        m_device->setCacheSize(bytes);
+}
+
+
+FileSystem::ByteArray FileSystem::readLBA(size_t lba)
+{
+    return readLBA(lba, 1);
+}
+
+
+FileSystem::ByteArray FileSystem::readLBA(size_t lba, size_t blocksToRead, CachedBlockDevice::Pool pool)
 {
-    if (partition > 3)
+    TraceScope trace("readLBA", "lba", lba, "sectors", blocksToRead);
+    ioStats().countSectors(blocksToRead);
+
+    // One read for the whole run, rather than a sector at a time
+    ByteArray whole(blocksToRead * lbaBlockSize);
+    if (!whole.empty() && !m_device->read((unsigned long long)lba * lbaBlockSize, &whole[0], whole.size(), pool))
     {
-        cerr << "Invalid partition number:" << partition << endl;
-        return false;
+        XTVFS_ERROR("Unable to read " << blocksToRead << " sectors at LBA " << lba);
+        whole.clear();
     }
 
-    const unsigned int offset = 446 + (partition * 16);
+    return whole;
+}
 
-    unsigned char boot_flag = Read8Bits(mbr, offset + 0);
-    unsigned int  CHS_begin = Read24Bits(mbr, offset + 1);
-    unsigned char type_code = Read8Bits(mbr, offset + 4);
-    unsigned int  CHS_end = Read24Bits(mbr, offset + 5);
-    unsigned int LBA_begin = Read32Bits(mbr, offset + 8);
-    unsigned int Number_of_sectors = Read32Bits(mbr, offset + 12);
 
-    cout << "Partition " << (partition+1) << ": " << (int)boot_flag << ", "
-         << CHS_begin << ", " << (int)type_code << ", " << CHS_end << ", "
-         << LBA_begin << ", " << Number_of_sectors << endl;
+bool FileSystem::cacheAllocationTables()
+{
+    return false;
+}
+
 
-    // Basic sanity check that the partition has been allocated some sectors
-    return (Number_of_sectors > 0);
+const AllocationTable *FileSystem::allocationTable(bool) const
+{
+    return NULL;
 }
 
 
-/// The first 446 bytes of the MBR are code that boots the computer. This
-/// is followed by a 64 byte partition table, and the last two bytes are
-/// always 0x55 and 0xAA. You should always check these last two bytes, as
-/// a simple "sanity check" that the MBR is ok.
-bool FileSystem::convertToMBR(const ByteArray &block)
+size_t FileSystem::areaClusterSize(bool) const
 {
-    if ( (block.size() != 512) || (block[510] != 0x55) || (block[511]  != 0xAA) )
+    return 0;
+}
+
+
+/// The index of the extent that should hold a cluster of the file: the one before the first extent starting beyond it
+static size_t findExtent(const Extents &extents, size_t fileCluster)
+{
+    size_t e = 0, hi = extents.size();
+    while (e < hi)
     {
-        cerr << "Sanity check for MBR failed" << endl;
-        return false;
+        const size_t mid = (e + hi) / 2;
+        if (extents[mid].fileCluster <= fileCluster)
+            e = mid + 1;
+        else
+            hi = mid;
     }
+    return e == 0 ? extents.size() : e - 1;
+}
 
-    bool okay = true;
 
-    // Read partition 1 at block[446-461]
-    okay = readPartition(block, 0);
-    if (!okay)
+size_t FileSystem::readFile(const DirEntry &entry, const Extents &extents,
+                            unsigned long long offset, void *buffer, size_t length)
+{
+    if (offset >= entry.filesize)
+        return 0;
+    if (length > entry.filesize - offset)
+        length = entry.filesize - offset;
+
+    const size_t clusterSize = clusterSizeFor(entry);
+    char *dest = static_cast<char*>(buffer);
+    size_t bytesRead = 0;
+
+    size_t e = findExtent(extents, offset / clusterSize);
+
+    while (length > 0 && e < extents.size())
     {
-        cerr << "Failed to read first partition information!" << endl;
-        return false;
-    }
+        const Extent &extent = extents[e];
+        const unsigned long long extentStart = (unsigned long long)extent.fileCluster * clusterSize;
+        const unsigned long long extentBytes = (unsigned long long)extent.clusterCount * clusterSize;
+        const unsigned long long offsetInExtent = offset - extentStart;
+        if (offsetInExtent >= extentBytes)
+            break; // Chain is shorter than the file size says
+
+        // The extent is contiguous on the disk, so read as much of it as we need in one go
+        const size_t bytesThisExtent = std::min<unsigned long long>(length, extentBytes - offsetInExtent);
+        const unsigned long long diskOffset = clusterOffsetFor(entry, extent.firstCluster) + offsetInExtent;
+        {
+            TraceScope trace("readExtent", "cluster", extent.firstCluster + offsetInExtent / clusterSize, "bytes", bytesThisExtent);
+            if (!m_device->read(diskOffset, dest, bytesThisExtent, CachedBlockDevice::Data))
+                break;
+        }
+        ioStats().countFileBytes(bytesThisExtent);
 
-    // Read partition 2 at block[462-477]
-    okay = okay && readPartition(block, 1);
-    // Read partition 3 at block[478-493]
-    okay = okay && readPartition(block, 2);
-    // Read partition 4 at block[494-509]
-    okay = okay && readPartition(block, 3);
-    // Each partition is:
-    // [0] = boot flag
-    // [1-3] = CHS begin
-    // [4] = Type code
-    // [5-7] = CHS end
-    // [8-11] = LBA begin
-    // [12-15] = Number of sectors
+        dest += bytesThisExtent;
+        offset += bytesThisExtent;
+        length -= bytesThisExtent;
+        bytesRead += bytesThisExtent;
+        ++e;
+    }
 
-    return okay;
+    return bytesRead;
 }
 
 
-FileSystem::ByteArray FileSystem::readLBA(size_t lba)
+size_t FileSystem::locateFile(const DirEntry &entry, const Extents &extents, unsigned long long offset, size_t length,
+                              int &fd, unsigned long long &fileOffset)
 {
-    static char buffer[lbaBlockSize];
+    if (offset >= entry.filesize)
+        return 0;
+    if (length > entry.filesize - offset)
+        length = entry.filesize - offset;
+
+    const size_t clusterSize = clusterSizeFor(entry);
+    const size_t e = findExtent(extents, offset / clusterSize);
+    if (e == extents.size())
+        return 0;
+
+    const Extent &extent = extents[e];
+    const unsigned long long offsetInExtent = offset - (unsigned long long)extent.fileCluster * clusterSize;
+    const unsigned long long extentBytes = (unsigned long long)extent.clusterCount * clusterSize;
+    if (offsetInExtent >= extentBytes)
+        return 0; // Chain is shorter than the file size says
+
+    const unsigned long long diskOffset = clusterOffsetFor(entry, extent.firstCluster) + offsetInExtent;
+    const size_t bytes = std::min<unsigned long long>(length, extentBytes - offsetInExtent);
+    if (diskOffset + bytes > m_device->size() || !m_device->locate(diskOffset, fd, fileOffset))
+        return 0;
+
+    return bytes;
+}
+
 
-    disk.seekg(lba * lbaBlockSize);
-    disk.read(buffer, lbaBlockSize);
+SweepSink::~SweepSink()
+{
 
-    return ByteArray(buffer, buffer + sizeof(buffer) / sizeof(buffer[0]) );
 }
 
 
-FileSystem::ByteArray FileSystem::readLBA(size_t lba, size_t blocksToRead)
+bool FileSystem::sweepFiles(const DirEntries &entries, SweepSink &sink, size_t bufferSize)
 {
-    ByteArray whole;
-    for (unsigned int n=0; n<blocksToRead; n++)
+    /// A run of a file that is contiguous on the disk
+    struct Piece
+    {
+        unsigned long long diskOffset;
+        unsigned long long fileOffset;
+        unsigned long long length;
+        size_t file;
+        bool operator<(const Piece &o) const { return diskOffset < o.diskOffset; }
+    };
+
+    cacheAllocationTables();
+
+    // Map every cluster of every file back to where it belongs
+    vector<Piece> pieces;
+    for (size_t f=0; f<entries.size(); ++f)
     {
-        const ByteArray part(readLBA(lba+n));
-        whole.insert(whole.end(), part.begin(), part.end());
+        const DirEntry &entry = entries[f];
+        if (entry.isDirectory() || entry.firstCluster == 0 || entry.filesize == 0)
+            continue;
+
+        const size_t clusterSize = clusterSizeFor(entry);
+        const Extents extents = extentsFor(entry);
+        for (size_t e=0; e<extents.size(); ++e)
+        {
+            Piece p;
+            p.fileOffset = (unsigned long long)extents[e].fileCluster * clusterSize;
+            if (p.fileOffset >= entry.filesize)
+                break;
+            p.diskOffset = clusterOffsetFor(entry, extents[e].firstCluster);
+            p.length = min<unsigned long long>((unsigned long long)extents[e].clusterCount * clusterSize,
+                                               entry.filesize - p.fileOffset);
+            p.file = f;
+            pieces.push_back(p);
+        }
     }
+    sort(pieces.begin(), pieces.end());
 
-    return whole;
+    vector<char> buffer(max(bufferSize, (size_t)lbaBlockSize));
+
+    // Pieces before first are finished with. Those after it that start before the end of a read
+    // are cut down to what comes after it, which keeps them in order.
+    bool okay = true;
+    size_t first = 0;
+    while (first < pieces.size())
+    {
+        // Read from the start of the next piece, carrying on through the pieces after it while they're close
+        const unsigned long long start = pieces[first].diskOffset;
+        const unsigned long long limit = start + buffer.size();
+        unsigned long long end = start;
+        size_t last = first;
+        for (; last < pieces.size() && pieces[last].diskOffset < limit && pieces[last].diskOffset <= end + sweepGapLimit; ++last)
+            end = max(end, min(limit, pieces[last].diskOffset + pieces[last].length));
+
+        bool readOkay;
+        {
+            TraceScope trace("sweepRead", "offset", start, "bytes", end - start);
+            readOkay = m_device->read(start, &buffer[0], end - start, CachedBlockDevice::Data);
+        }
+        if (!readOkay)
+        {
+            // e.g. a damaged chain pointing off the end of the disk. Leave those pieces out and carry on.
+            XTVFS_ERROR("Unable to read " << (end - start) << " bytes at " << start << " while sweeping");
+            okay = false;
+        }
+
+        // Hand out what was read, keeping what's left of any piece that carries on past it
+        size_t kept = last;
+        for (size_t i=last; i-- > first; )
+        {
+            Piece &p = pieces[i];
+            const size_t n = min(end, p.diskOffset + p.length) - p.diskOffset;
+            if (readOkay)
+            {
+                if (!sink.write(p.file, p.fileOffset, &buffer[p.diskOffset - start], n))
+                    return false;
+                ioStats().countFileBytes(n);
+            }
+
+            p.diskOffset += n;
+            p.fileOffset += n;
+            p.length -= n;
+            if (p.length > 0)
+                pieces[--kept] = p;
+        }
+        first = kept;
+    }
+
+    return okay;
 }
 
 
-FileSystem::ByteArray Fat32::readCluster(size_t clusterNumber)
+FileSystem::ByteArray Fat32::readCluster(size_t clusterNumber, CachedBlockDevice::Pool pool)
 {
     const size_t lbaAddr = m_clusterBeginLBA + (clusterNumber - 2) * m_sectorsPerCluster;
-    return readLBA(lbaAddr, m_sectorsPerCluster);
+    return readLBA(lbaAddr, m_sectorsPerCluster, pool);
 }
 
 
@@ -284,36 +475,30 @@ FileSystem::ByteArray Fat32::readCluster(size_t clusterNumber)
 // ==                    F A T 3 2   C L A S S                              ==
 // ===========================================================================
 
-Fat32::Fat32()
+Fat32::Fat32() :
+    m_fileSizeHighByte(false),
+    m_fsInfoFreeClusters(0xFFFFFFFF)
 {
 }
 
 
-bool Fat32::open(const std::string &filepath)
+bool Fat32::open(const BlockDevicePtr &device)
 {
-    if (!inherited::open(filepath))
+    if (!inherited::open(device))
         return false;
 
+    m_fat.entries.clear();
+
     bool okay;
 
-    // Read the MBR?
+    // The device starts at the volume, as probeImage() opens partitions through a PartitionBlockDevice
     ByteArray block = readLBA(0);
-#ifdef READ_MBR
-    okay = convertToMBR(block);
-    if (okay)
-    {
-        // We found an MBR, so read the first parition?
-        // Need to get the data back from the call, but just guess for now
-        block = read_lba(1);
-    }
-#endif
-    // Try it as a FAT32 volume ID
     okay = convertToVolumeId(block);
     if (!okay)
         return okay;
 
     block = readLBA(1);
-    okay = convertToFsInfo(block);
+    okay = block.size() == lbaBlockSize && convertToFsInfo(block);
     if (!okay)
         return okay;
 
@@ -321,30 +506,6 @@ bool Fat32::open(const std::string &filepath)
 }
 
 
-DirEntry Xtvfs::readDirectoryentry(const ByteArray &block, const int offset)
-{
-    DirEntry dirEntry = Fat32::readDirectoryentry(block, offset);
-    dirEntry.filesize += (unsigned long long)Read8Bits(block, offset + 0x10) << 32;
-    return dirEntry;
-}
-
-
-DirEntry Fat32::readDirectoryentry(const ByteArray &block, const int offset)
-{
-    DirEntry dirEntry;
-
-    dirEntry.filename.resize(11);
-    for (int i=0; i<11; i++)
-        dirEntry.filename[i] = block[offset+i];
-    dirEntry.attrib = Read8Bits(block, offset + 0x0B);
-    const size_t firstClusterHigh = Read16Bits(block, offset + 0x14);
-    const size_t firstClusterLow = Read16Bits(block, offset + 0x1A);
-    dirEntry.firstCluster = (firstClusterHigh << 16) | firstClusterLow;
-    dirEntry.filesize = Read32Bits(block, offset + 0x1C);
-
-    return dirEntry;
-}
-
 #include <sstream>
 #include <cmath>
 string humanReadableByteCount(unsigned long long bytes)
@@ -365,53 +526,215 @@ string humanReadableByteCount(unsigned long long bytes)
 }
 
 
+/**
+ * Puts a VFAT long file name back together from its directory entries.
+ * Each holds 13 UCS-2 characters, and they come before the short entry they
+ * belong to, last part first. See http://wiki.osdev.org/FAT#Long_File_Names
+ */
+class LongNameAssembler
+{
+public:
+    LongNameAssembler() : m_count(0) {}
+
+    /// Forget any part-assembled name, e.g. after a deleted entry
+    void reset() { m_count = 0; }
+
+    /// Add the long file name entry at slot
+    void add(const unsigned char *slot)
+    {
+        const int ordinal = slot[0] & 0x1F;
+        if (slot[0] & 0x40)
+        {
+            // The last part of the name, which comes first, says how many parts there are
+            m_count = m_expected = ordinal;
+            m_checksum = slot[0x0D];
+        }
+        if (m_count == 0 || ordinal == 0 || ordinal > maxParts || ordinal != m_expected || slot[0x0D] != m_checksum)
+        {
+            reset();
+            return;
+        }
+
+        static const int offsets[charsPerPart] = { 1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30 };
+        unsigned short *chars = m_chars + (ordinal - 1) * charsPerPart;
+        for (int i=0; i<charsPerPart; ++i)
+            chars[i] = Read16Bits(slot, offsets[i]);
+        --m_expected;
+    }
+
+    /**
+     * Finish off the name for the short entry at slot, appending it to name.
+     * @return The bytes appended, 0 if the parts before it were incomplete or belong to something else
+     */
+    size_t finish(const unsigned char *slot, std::string &name)
+    {
+        const bool complete = (m_count > 0 && m_expected == 0 && checksum(slot) == m_checksum);
+        const int length = m_count * charsPerPart;
+        reset();
+        if (!complete)
+            return 0;
+
+        const size_t start = name.size();
+        for (int i=0; i<length && m_chars[i] != 0x0000; ++i)
+        {
+            unsigned long c = m_chars[i];
+
+            // Windows stores UTF-16, so put any surrogate pairs back together
+            if (c >= 0xD800 && c < 0xDC00 && i+1 < length && m_chars[i+1] >= 0xDC00 && m_chars[i+1] < 0xE000)
+                c = 0x10000 + ((c - 0xD800) << 10) + (m_chars[++i] - 0xDC00);
+
+            if (c < 0x80)
+                name += (char)c;
+            else if (c < 0x800)
+            {
+                name += (char)(0xC0 | (c >> 6));
+                name += (char)(0x80 | (c & 0x3F));
+            }
+            else if (c < 0x10000)
+            {
+                name += (char)(0xE0 | (c >> 12));
+                name += (char)(0x80 | ((c >> 6) & 0x3F));
+                name += (char)(0x80 | (c & 0x3F));
+            }
+            else
+            {
+                name += (char)(0xF0 | (c >> 18));
+                name += (char)(0x80 | ((c >> 12) & 0x3F));
+                name += (char)(0x80 | ((c >> 6) & 0x3F));
+                name += (char)(0x80 | (c & 0x3F));
+            }
+        }
+        return name.size() - start;
+    }
+
+private:
+    enum { charsPerPart = 13, maxParts = 20 };
+
+    /// The checksum of the short name that each long file name entry carries
+    static unsigned char checksum(const unsigned char *shortName)
+    {
+        unsigned char sum = 0;
+        for (int i=0; i<11; ++i)
+            sum = ((sum & 1) << 7) + (sum >> 1) + shortName[i];
+        return sum;
+    }
+
+    unsigned short m_chars[maxParts * charsPerPart];
+    unsigned char m_checksum;
+    int m_count;        ///< Parts in the name being assembled, 0 if there isn't one
+    int m_expected;     ///< Ordinal of the next part
+};
+
+
+/// Compare a name of b.size() bytes at a with b, ignoring the case of ASCII letters as Windows does for long names
+static bool sameNameIgnoringCase(const char *a, const string &b)
+{
+    for (size_t i=0; i<b.size(); ++i)
+        if (toupper((unsigned char)a[i]) != toupper((unsigned char)b[i]))
+            return false;
+    return true;
+}
+
+
+// ===========================================================================
+// ==                D I R L I S T I N G   C L A S S                        ==
+// ===========================================================================
+
+bool PackedDirEntry::hasFilename(const char *eleven) const
+{
+    return memcmp(filename, eleven, sizeof(filename)) == 0;
+}
+
+
+DirEntry DirListing::toDirEntry(const PackedDirEntry &entry) const
+{
+    DirEntry dirEntry;
+    dirEntry.filename.assign(entry.filename, sizeof(entry.filename));
+    dirEntry.longName.assign(names, entry.longNameOffset, entry.longNameLength);
+    dirEntry.attrib = entry.attrib;
+    dirEntry.firstCluster = entry.firstCluster;
+    dirEntry.filesize = entry.filesize;
+    return dirEntry;
+}
+
+
 DirEntries Fat32::readDirectory(size_t startCluster)
+{
+    DirListing listing;
+    if (!scanDirectory(listing, startCluster))
+        XTVFS_ERROR("Only part of the directory at cluster " << (startCluster == (size_t)-1 ? m_rootDirFirstCluster : startCluster) << " could be read");
+
+    DirEntries entries;
+    entries.reserve(listing.entries.size());
+    for (size_t i=0; i<listing.entries.size(); ++i)
+        entries.push_back(listing.toDirEntry(listing.entries[i]));
+    return entries;
+}
+
+
+bool Fat32::scanDirectory(DirListing &listing, size_t startCluster)
 {
     if (startCluster == (size_t)-1)
         startCluster = m_rootDirFirstCluster;
 
-    DirEntries entries;
+    listing.clear();
 
     ByteArray block = readCluster(startCluster);
-//block.resize(50 * 32);
-//dumpBlock(cout, block, 32);
+    LongNameAssembler longName;
     bool foundEndOfDirectoryMarker = false;
     while (!foundEndOfDirectoryMarker)
     {
-        const int numBytesPerEntry = 32;
-        const int numEntries = block.size() / numBytesPerEntry;
-        for (int f=0; f<numEntries; ++f)
+        // A cluster or a sector of the FAT that couldn't be read mustn't pass for the end of the directory
+        if (block.empty())
+            return false;
+
+        const size_t numBytesPerEntry = 32;
+        const unsigned char *slot = block.data();
+        const unsigned char *const end = slot + (block.size() / numBytesPerEntry) * numBytesPerEntry;
+        for (; slot != end; slot += numBytesPerEntry)
         {
-            const int offset = f * numBytesPerEntry;
-
-            DirEntry dirEntry = readDirectoryentry(block, offset);
-
-            if (dirEntry.isDeleted())
+            if (slot[0] == 0xE5)
+            {
+                longName.reset();
                 continue; // Deleted file found
-            if (dirEntry.isEndOfList())
+            }
+            if (slot[0] == 0x00)
             {
                 foundEndOfDirectoryMarker = true;
                 break; // End of directory
             }
-#ifdef DEBUG
-cout << dirEntry.filename << " " << (int)Read8Bits(block, offset + 0x10) << " " << humanReadableByteCount(dirEntry.filesize) << endl;
-#endif
-            if (!dirEntry.isLFN())
-                entries.push_back(dirEntry);
-
-            if (dirEntry.isLFN())
-                // http://wiki.osdev.org/FAT#Long_File_Names
-                cout << "Skipping LFN entry." << endl;
-#ifdef DEBUG
-            else
-                cout << "'" << dirEntry.filename << "' " << dirEntry.attribToString() << " " << dirEntry.filesize << " bytes [" << dirEntry.firstCluster << "]" << endl;
-#endif
+
+            // Long file names come in pieces before the entry they're for, and may carry on into the next cluster
+            const unsigned char attrib = Read8Bits(slot, 0x0B);
+            if ((attrib & 0x0F) == 0x0F)
+            {
+                longName.add(slot);
+                continue;
+            }
+
+            listing.entries.push_back(PackedDirEntry());
+            PackedDirEntry &entry = listing.entries.back();
+            memcpy(entry.filename, slot, sizeof(entry.filename));
+            entry.attrib = attrib;
+            const unsigned int firstClusterHigh = Read16Bits(slot, 0x14);
+            const unsigned int firstClusterLow = Read16Bits(slot, 0x1A);
+            entry.firstCluster = (firstClusterHigh << 16) | firstClusterLow;
+            entry.filesize = Read32Bits(slot, 0x1C);
+            if (m_fileSizeHighByte)
+                entry.filesize += (unsigned long long)Read8Bits(slot, 0x10) << 32;
+            entry.longNameOffset = listing.names.size();
+            entry.longNameLength = longName.finish(slot, listing.names);
+
+            XTVFS_TRACE("'" << string(entry.filename, sizeof(entry.filename)) << "' '" << listing.longName(entry) << "' "
+                        << listing.toDirEntry(entry).attribToString() << " " << entry.filesize << " bytes [" << entry.firstCluster << "]");
         }
 
         // Fetch the next directory block
         if (!foundEndOfDirectoryMarker)
         {
             startCluster = nextCluster(startCluster);
+            if (startCluster == unreadableCluster)
+                return false;
             if (startCluster >= 0x0FFFFFFF)
             {
                 //cerr << "End of directory blocks without an end-of-dir marker" << endl;
@@ -420,8 +743,7 @@ cout << dirEntry.filename << " " << (int)Read8Bits(block, offset + 0x10) << " "
             block = readCluster(startCluster);
         }
     }
-
-    return entries;
+    return true;
 }
 
 
@@ -429,12 +751,15 @@ DirEntry Fat32::infoFor(const std::string &path)
 {
     size_t cluster = m_rootDirFirstCluster;
 
+    // One listing for the whole path, so each directory on the way reuses the memory of the one before
+    DirListing listing;
+
     string s, p(path);
     size_t n = 0;
     while (!p.empty())
     {
         // Determine the next bit of path to process
-        n = p.find_first_of("\\/", n);
+        n = p.find_first_of("\\/");
         if (n != string::npos)
         {
             s = p.substr(0, n);
@@ -446,18 +771,24 @@ DirEntry Fat32::infoFor(const std::string &path)
             p.clear();
         }
 
-        // Convert to 11-char format, to make searching quicker
-        const string eleven = to11CharFormat(s);
+        // Convert to 11-char format, to make searching quicker.
+        // Names that don't fit 8.3 can only be long names.
+        const size_t period = s.find('.');
+        const bool fitsShortName = (period == string::npos) ? s.size() <= 8 : (period <= 8 && s.size() - period - 1 <= 3);
+        const string eleven = fitsShortName ? to11CharFormat(s) : string();
 
-        const DirEntries entries = readDirectory(cluster);
-        for (size_t i=0; i<entries.size(); ++i)
+        if (!scanDirectory(listing, cluster))
+            return DirEntry();
+        size_t i = 0;
+        for (; i<listing.entries.size(); ++i)
         {
-            const DirEntry &d = entries[i];
-            if (d.filename == eleven)
+            const PackedDirEntry &d = listing.entries[i];
+            if ((fitsShortName && d.hasFilename(eleven.c_str())) ||
+                (d.longNameLength == s.size() && sameNameIgnoringCase(listing.names.c_str() + d.longNameOffset, s)))
             {
                 // Found it, but are we there yet?
                 if (p.empty())
-                    return d; // Found the leaf!
+                    return listing.toDirEntry(d); // Found the leaf!
                 else if (d.isDirectory())
                 {
                     // Note the cluster number for the next time round the loop
@@ -466,11 +797,15 @@ DirEntry Fat32::infoFor(const std::string &path)
                 }
                 else
                 {
-                    cout << "Unable to recurse but not found the leaf" << endl;
+                    XTVFS_DEBUG("Unable to recurse but not found the leaf");
                     return DirEntry();
                 }
             }
         }
+
+        // Not in this directory, so don't go looking for the rest of the path in it
+        if (i == listing.entries.size())
+            return DirEntry();
     }
 
     return DirEntry();
@@ -487,11 +822,11 @@ bool Fat32::convertToVolumeId(const ByteArray &block)
 {
     if ( (block.size() != 512) || (block[510] != 0x55) || (block[511]  != 0xAA) )
     {
-        cerr << "Sanity check for Volume ID failed" << endl;
+        XTVFS_INFO("Sanity check for Volume ID failed");
         return false;
     }
 
-    dumpBlock(cerr, block);
+    XTVFS_TRACE("Volume ID:\n" << hexDump(block));
 
     BPB_BytsPerSec = Read16Bits( block, 0x0B);  // Bytes per sector. Always 512
     BPB_SecPerClus = Read8Bits ( block, 0x0D);  // Sectors per cluster. 1,2,4,8,16,32,64,128
@@ -502,21 +837,21 @@ bool Fat32::convertToVolumeId(const ByteArray &block)
     BPB_RootClus   = Read32Bits( block, 0x2C);  // Root directory first cluster. Usually 0x00000002
     const int signature      = Read16Bits( block, 0x1FE); // Always 0xAA55
 
-    cout << BPB_BytsPerSec << ", " << BPB_SecPerClus << ", "
-         << BPB_RsvdSecCnt << ", " << BPB_NumFATs << ", "
-         << BPB_TotSec32 << ", "
-         << BPB_FATSz32 << ", " << BPB_RootClus << ", "
-         << signature << endl;
-   cout << "FFAT ends at 0x549800? == " << (BPB_RsvdSecCnt + (BPB_FATSz32 * BPB_NumFATs)) << endl;
+    XTVFS_DEBUG(BPB_BytsPerSec << ", " << BPB_SecPerClus << ", "
+                << BPB_RsvdSecCnt << ", " << BPB_NumFATs << ", "
+                << BPB_TotSec32 << ", "
+                << BPB_FATSz32 << ", " << BPB_RootClus << ", "
+                << signature);
+    XTVFS_DEBUG("FFAT ends at " << (BPB_RsvdSecCnt + (BPB_FATSz32 * BPB_NumFATs)));
 
-    const unsigned long Partition_LBA_Begin = 0; ///< @todo get this passed in?
-    m_fatBeginLBA = Partition_LBA_Begin + BPB_RsvdSecCnt;
-    m_clusterBeginLBA = Partition_LBA_Begin + BPB_RsvdSecCnt + (BPB_NumFATs * BPB_FATSz32);
+    // Relative to the start of the volume, which is where the device starts
+    m_fatBeginLBA = BPB_RsvdSecCnt;
+    m_clusterBeginLBA = BPB_RsvdSecCnt + (BPB_NumFATs * BPB_FATSz32);
     m_sectorsPerCluster = BPB_SecPerClus;
     m_rootDirFirstCluster = BPB_RootClus;
-    cout << " FFAT begin LBA = 0x" << hex << m_fatBeginLBA << dec << endl;
-    cout << " Cluster begin LBA = 0x" << hex << m_clusterBeginLBA << dec << endl;
-    cout << " Sectors Per Cluster" << m_sectorsPerCluster << endl;
+    XTVFS_DEBUG(" FFAT begin LBA = 0x" << hex << m_fatBeginLBA);
+    XTVFS_DEBUG(" Cluster begin LBA = 0x" << hex << m_clusterBeginLBA);
+    XTVFS_DEBUG(" Sectors Per Cluster " << (int)m_sectorsPerCluster);
 
     return ((BPB_BytsPerSec==512) && (BPB_NumFATs==2) && (signature==0xAA55));
 }
@@ -529,8 +864,9 @@ bool Fat32::convertToFsInfo(const ByteArray &block)
     const unsigned int sig2 = Read32Bits(block, 0x1E4); // FS information sector signature (0x72 0x72 0x41 0x61 = "rrAa")
     const unsigned int freeClusters = Read32Bits(block, 0x1E8); // Last known number of free data clusters on the volume, or 0xFFFFFFFF if unknown
     const unsigned int lastAllocatedCluster = Read32Bits(block, 0x1EC); // Number of the most recently known to be allocated data cluster. Should be set to 0xFFFFFFFF during format.
-    cout << "Free clusters=" << freeClusters << endl;
-    cout << "Last allocated cluster=" << lastAllocatedCluster << endl;
+    XTVFS_DEBUG("Free clusters=" << freeClusters);
+    m_fsInfoFreeClusters = freeClusters;
+    XTVFS_DEBUG("Last allocated cluster=" << lastAllocatedCluster);
     // 0x1F0 for 12 bytes reserved
     const unsigned int sig3 = Read32Bits(block, 0x1FC); // FS information sector signature (0x00 0x00 0x55 0xAA)
 
@@ -540,17 +876,174 @@ bool Fat32::convertToFsInfo(const ByteArray &block)
 
 size_t Fat32::nextCluster(size_t clusterNumber)
 {
+    ioStats().countFatLookup(!m_fat.empty());
+    if (!m_fat.empty())
+        return m_fat.next(clusterNumber);
+
     // Determine the sector of FAT that the current cluster is in
     const size_t sectorOfFat = clusterNumber >> 7;
     const size_t offsetInFat = clusterNumber & 0x7F;
 
     ByteArray block = readLBA(m_fatBeginLBA + sectorOfFat);
+    if (block.empty())
+        return unreadableCluster;
     const size_t next = Read32Bits(block, offsetInFat * 4);
 
     return next;
 }
 
 
+Extents Fat32::chainExtents(unsigned long tableBeginLBA, const AllocationTable &cached, size_t startCluster, size_t maxClusters)
+{
+    Extents extents;
+
+    ByteArray block;
+    size_t blockSector = (size_t)-1;
+    size_t fileCluster = 0;
+    size_t currentCluster = startCluster;
+    while (currentCluster >= 2 && currentCluster < 0x0FFFFFFF && fileCluster < maxClusters)
+    {
+        if (!extents.empty() && extents.back().firstCluster + extents.back().clusterCount == currentCluster)
+            extents.back().clusterCount++;
+        else
+        {
+            Extent extent;
+            extent.fileCluster = fileCluster;
+            extent.firstCluster = currentCluster;
+            extent.clusterCount = 1;
+            extents.push_back(extent);
+        }
+        ++fileCluster;
+
+        if (!cached.empty())
+        {
+            ioStats().countFatLookup(true);
+            currentCluster = cached.next(currentCluster);
+            continue;
+        }
+
+        // Neighbouring clusters share a sector of the table, so only read it when we move off it
+        const size_t sectorOfFat = currentCluster >> 7;
+        ioStats().countFatLookup(sectorOfFat == blockSector);
+        if (sectorOfFat != blockSector)
+        {
+            block = readLBA(tableBeginLBA + sectorOfFat);
+            blockSector = sectorOfFat;
+        }
+        if (block.empty())
+            break; // Cut short, which shows up as the chain not matching the file's size
+        currentCluster = Read32Bits(block, (currentCluster & 0x7F) * 4);
+    }
+
+    return extents;
+}
+
+
+bool Fat32::loadTable(unsigned long tableBeginLBA, size_t clusterCount, AllocationTable &table)
+{
+    const size_t entriesPerSector = lbaBlockSize / 4;
+    const size_t sectors = (clusterCount + entriesPerSector - 1) / entriesPerSector;
+
+    // Read it in big pieces, as it can be several megabytes
+    const size_t sectorsPerRead = 2048;
+    AllocationTable loaded;
+    loaded.entries.reserve(sectors * entriesPerSector);
+    for (size_t sector = 0; sector < sectors; sector += sectorsPerRead)
+    {
+        const size_t n = min(sectorsPerRead, sectors - sector);
+        const ByteArray block = readLBA(tableBeginLBA + sector, n);
+        if (block.size() != n * lbaBlockSize)
+            return false;
+        for (size_t offset = 0; offset < block.size(); offset += 4)
+            loaded.entries.push_back(Read32Bits(block, offset));
+    }
+
+    loaded.entries.resize(clusterCount);
+    table.entries.swap(loaded.entries);
+    return true;
+}
+
+
+bool Fat32::cacheAllocationTables()
+{
+    if (!m_fat.empty())
+        return true;
+
+    // The FAT can be bigger than the disk needs, so only keep the entries for clusters that exist
+    return loadTable(m_fatBeginLBA, min(fatClusters(), (size_t)BPB_FATSz32 * 128), m_fat);
+}
+
+
+size_t Fat32::fatClusters() const
+{
+    return (BPB_TotSec32 > m_clusterBeginLBA) ? (BPB_TotSec32 - m_clusterBeginLBA) / m_sectorsPerCluster + 2 : 0;
+}
+
+
+const AllocationTable *Fat32::allocationTable(bool video) const
+{
+    return (video || m_fat.empty()) ? NULL : &m_fat;
+}
+
+
+size_t Fat32::areaClusterSize(bool video) const
+{
+    return video ? 0 : (size_t)m_sectorsPerCluster * lbaBlockSize;
+}
+
+
+Extents Fat32::extentsFor(const DirEntry &entry)
+{
+    return followChain(entry);
+}
+
+
+Extents Fat32::followChain(const DirEntry &entry)
+{
+    // Directories don't have a size, so can only be limited by the size of the FAT
+    const size_t maxClusters = entry.isDirectory() ? (size_t)BPB_FATSz32 * 128
+                                                   : entry.filesize / clusterSizeFor(entry) + 1;
+    return chainExtents(m_fatBeginLBA, m_fat, entry.firstCluster, maxClusters);
+}
+
+
+size_t Fat32::clusterSizeFor(const DirEntry &) const
+{
+    return (size_t)m_sectorsPerCluster * lbaBlockSize;
+}
+
+
+unsigned long long Fat32::clusterOffsetFor(const DirEntry &, size_t clusterNumber) const
+{
+    return (m_clusterBeginLBA + (unsigned long long)(clusterNumber - 2) * m_sectorsPerCluster) * lbaBlockSize;
+}
+
+
+bool Fat32::verifyChain(const DirEntry &entry)
+{
+    if (entry.isDirectory())
+        return !extentsFor(entry).empty();
+
+    const size_t clusterSize = clusterSizeFor(entry);
+    const size_t expectedChainLength = (entry.filesize + clusterSize - 1) / clusterSize;
+    if (expectedChainLength == 0)
+        return entry.firstCluster == 0;
+
+    // extentsFor() stops following the chain once it has enough clusters for the size
+    const Extents extents = extentsFor(entry);
+    size_t chainLength = 0;
+    for (size_t i=0; i<extents.size(); ++i)
+        chainLength += extents[i].clusterCount;
+    if (chainLength != expectedChainLength)
+        return false;
+
+    // The last cluster must be marked as the end of the chain, not free or bad
+    const Extent &last = extents.back();
+    const size_t next = nextCluster(last.firstCluster + last.clusterCount - 1);
+    return next >= NoMoreClusters && next != unreadableCluster;
+}
+
+
 bool Fat32::copyFile(std::ostream &s, size_t startCluster, unsigned long long bytesToCopy)
 {
     // Some sanity checks
@@ -563,16 +1056,18 @@ bool Fat32::copyFile(std::ostream &s, size_t startCluster, unsigned long long by
     size_t currentCluster = startCluster;
     while (bytesToCopy > 0 && currentCluster < 0x0FFFFFFF) // Apparently FAT32 would be 0xFFFFFFF8 or greater. XTV is different?
     {
-        block = readCluster(currentCluster);
+        block = readCluster(currentCluster, CachedBlockDevice::Data);
+        if (block.empty())
+            return false;
         const size_t bytesThisBlock =  (bytesToCopy > block.size()) ? block.size() : bytesToCopy;
-        s.write((const char*)&block[0], bytesThisBlock);
+        writeBlock(s, block, bytesThisBlock, currentCluster);
 
         bytesToCopy -= bytesThisBlock;
         currentCluster = nextCluster(currentCluster);
     }
 
     // Final sanity check
-    return (bytesToCopy == 0 && currentCluster >= 0x0FFFFFFF);
+    return (bytesToCopy == 0 && currentCluster >= 0x0FFFFFFF && currentCluster != unreadableCluster);
 }
 
 
@@ -584,9 +1079,7 @@ bool Fat32::copyFile(std::ostream &s, const std::string &path)
         return false;
     else
     {
-#ifdef DEBUG
-        cout << "About to copy " << path << " of " << fileInfo.filesize << " bytes from cluster " << fileInfo.firstCluster << endl;
-#endif
+        XTVFS_DEBUG("About to copy " << path << " of " << fileInfo.filesize << " bytes from cluster " << fileInfo.firstCluster);
         return copyFile(s, fileInfo.firstCluster, fileInfo.filesize);
     }
 }
@@ -610,19 +1103,29 @@ bool Fat32::copyFile(const std::string &srcPath, const std::string &destPath)
 // ==                    X T V F S   C L A S S                              ==
 // ===========================================================================
 
-bool Xtvfs::open(const std::string &filepath)
+Xtvfs::Xtvfs()
 {
-    if (!inherited::open(filepath))
+    m_fileSizeHighByte = true;
+}
+
+
+bool Xtvfs::open(const BlockDevicePtr &device)
+{
+    if (!inherited::open(device))
         return false;
 
+    m_vfat.entries.clear();
+
     bool okay = true;
     ByteArray block = readLBA(2);
+    if (block.size() != lbaBlockSize)
+        return false;
     const unsigned int xfs = Read32Bits(block, 0x00); // XFS marker: 58 46 53 30 = "XFS0"
     //const unsigned int num = Read32Bits(block, 0x64); // 0x0000034c == 844, or 76 and 3
     if (xfs != 0x30534658)
         return false;
 
-    cout << "** XFS marker found" << endl;
+    XTVFS_DEBUG("** XFS marker found");
 
     return okay;
 }
@@ -633,11 +1136,7 @@ bool Xtvfs::convertToVolumeId(const ByteArray &block)
     bool okay = inherited::convertToVolumeId(block);
 
     m_vfatBeginLBA = m_fatBeginLBA + (BPB_FATSz32*BPB_NumFATs);
-    cout << "For block " <<  &block << endl;
-    cout << " FFAT begin LBA = 0x" << hex << m_fatBeginLBA << dec << endl;
-    cout << " Cluster begin LBA = 0x" << hex << m_clusterBeginLBA << dec << endl;
-    cout << " Sectors Per Cluster" << m_sectorsPerCluster << endl;
-    cout << " VFAT begin LBA = 0x" << hex << m_vfatBeginLBA << dec << endl;
+    XTVFS_DEBUG(" VFAT begin LBA = 0x" << hex << m_vfatBeginLBA);
 
     // First get a rough estimate (2% of the partition's total number of sectors)
     const double lbaVidEstimate = BPB_TotSec32 * 0.02;
@@ -647,7 +1146,7 @@ bool Xtvfs::convertToVolumeId(const ByteArray &block)
     // we need to round up to the next cluster
     m_vdataBeginLBA = ( ceil((lbaVidEstimate - m_clusterBeginLBA)/  BPB_SecPerClus)
                         * BPB_SecPerClus) + m_clusterBeginLBA;
-    cout << " VDATA (video data) begin LBA = 0x" << hex << m_vdataBeginLBA << dec << endl;
+    XTVFS_DEBUG(" VDATA (video data) begin LBA = 0x" << hex << m_vdataBeginLBA);
 
     return okay;
 }
@@ -656,17 +1155,23 @@ FileSystem::ByteArray Xtvfs::readVideoCluster(size_t clusterNumber)
 {
     const size_t vsectorsPerCluster = 3008;
     const size_t lbaAddr = m_vdataBeginLBA + (clusterNumber - 2) * vsectorsPerCluster;
-    return readLBA(lbaAddr, vsectorsPerCluster);
+    return readLBA(lbaAddr, vsectorsPerCluster, CachedBlockDevice::Data);
 }
 
 
 size_t Xtvfs::nextVideoCluster(size_t clusterNumber)
 {
+    ioStats().countFatLookup(!m_vfat.empty());
+    if (!m_vfat.empty())
+        return m_vfat.next(clusterNumber);
+
     // Determine the sector of FAT that the current cluster is in
     const size_t sectorOfFat = clusterNumber >> 7;
     const size_t offsetInFat = clusterNumber & 0x7F;
 
     ByteArray block = readLBA(m_vfatBeginLBA + sectorOfFat);
+    if (block.empty())
+        return unreadableCluster;
     const size_t next = Read32Bits(block, offsetInFat * 4);
 
     return next;
@@ -693,7 +1198,7 @@ bool Xtvfs::verifyVideoChain(size_t clusterNumber, size_t filesize)
         // Check for loops:
         if (find(chain.begin(), chain.end(), currentCluster) != chain.end())
         {
-            cerr << "Found a loop!" << endl;
+            XTVFS_INFO("Found a loop!");
             break;
         }
     }
@@ -711,16 +1216,12 @@ bool Xtvfs::copyFile(std::ostream &s, const std::string &path)
         return false;
     else if (fileInfo.isDevice())
     {
-#ifdef DEBUG
-        cout << "About to copy video " << path << " of " << fileInfo.filesize << " bytes from cluster " << fileInfo.firstCluster << endl;
-#endif
+        XTVFS_DEBUG("About to copy video " << path << " of " << fileInfo.filesize << " bytes from cluster " << fileInfo.firstCluster);
         return copyVideoFile(s, fileInfo.firstCluster, fileInfo.filesize);
     }
     else
     {
-#ifdef DEBUG
-        cout << "About to copy " << path << " of " << fileInfo.filesize << " bytes from cluster " << fileInfo.firstCluster << endl;
-#endif
+        XTVFS_DEBUG("About to copy " << path << " of " << fileInfo.filesize << " bytes from cluster " << fileInfo.firstCluster);
         return inherited::copyFile(s, fileInfo.firstCluster, fileInfo.filesize);
     }
 }
@@ -734,9 +1235,7 @@ bool Xtvfs::copyFile(const std::string &srcPath, const std::string &destPath)
         return false;
     else if (fileInfo.isDevice())
     {
-#ifdef DEBUG
-        cout << "About to copy video " << srcPath << " of " << fileInfo.filesize << " bytes from cluster " << fileInfo.firstCluster << endl;
-#endif
+        XTVFS_DEBUG("About to copy video " << srcPath << " of " << fileInfo.filesize << " bytes from cluster " << fileInfo.firstCluster);
 //        return copyVideoFile(s, fileInfo.firstCluster, fileInfo.filesize);
         return copyVideoFile(destPath, fileInfo.firstCluster, fileInfo.filesize);
     }
@@ -760,22 +1259,23 @@ bool Xtvfs::copyVideoFile(std::ostream &s, size_t startCluster, unsigned long lo
     while (bytesToCopy > 0 && currentCluster < 0x0FFFFFFF) // Apparently FAT32 would be 0xFFFFFFF8 or greater. XTV is different?
     {
         block = readVideoCluster(currentCluster);
+        if (block.empty())
+            return false;
         const size_t bytesThisBlock =  (bytesToCopy > block.size()) ? block.size() : bytesToCopy;
-        s.write((const char*)&block[0], bytesThisBlock);
+        writeBlock(s, block, bytesThisBlock, currentCluster);
 
         bytesToCopy -= bytesThisBlock;
         currentCluster = nextVideoCluster(currentCluster);
     }
 
     // Final sanity check
-    return (bytesToCopy == 0 && currentCluster >= 0x0FFFFFFF);
+    return (bytesToCopy == 0 && currentCluster >= 0x0FFFFFFF && currentCluster != unreadableCluster);
 }
 
 
 bool Xtvfs::copyVideoFile(const std::string &dest, size_t startCluster, unsigned long long bytesToCopy)
 {
-    cout << "copyVideoFile(" << dest << "," << startCluster << "," << humanReadableByteCount(bytesToCopy) << ")" << endl;
-    cout << "using fopen to save the file" << endl;
+    XTVFS_DEBUG("copyVideoFile(" << dest << "," << startCluster << "," << humanReadableByteCount(bytesToCopy) << ")");
     FILE *s = fopen(dest.c_str(), "wb");
     if (s == 0)
         return false;
@@ -792,12 +1292,20 @@ bool Xtvfs::copyVideoFile(const std::string &dest, size_t startCluster, unsigned
     while (currentCluster < 0x0FFFFFFF) // Apparently FAT32 would be 0xFFFFFFF8 or greater. XTV is different?
     {
         block = readVideoCluster(currentCluster);
+        if (block.empty())
+        {
+            fclose(s);
+            return false;
+        }
         const size_t bytesThisBlock =  (bytesToCopy > block.size()) ? block.size() : bytesToCopy;
+        const chrono::steady_clock::time_point start = chrono::steady_clock::now();
         const size_t ret = fwrite((const char*)&block[0], 1, bytesThisBlock, s);
+        const chrono::steady_clock::time_point end = chrono::steady_clock::now();
+        ioStats().countWrite(ret, chrono::duration_cast<chrono::nanoseconds>(end - start).count());
+        if (ioStats().tracing())
+            ioStats().traceEvent("write", start, end, "cluster", currentCluster, "bytes", ret);
         if (ret != bytesThisBlock)
-            // cout << "Writing error: " << ret << "  " << errno << endl;
-            // RJLRJL
-            cout << "Writing error: " << ret << "  " << "some error" << endl;
+            XTVFS_ERROR("Error writing " << dest << ": " << strerror(errno));
         else
             bytesCopied += ret;
 
@@ -806,9 +1314,379 @@ bool Xtvfs::copyVideoFile(const std::string &dest, size_t startCluster, unsigned
     }
 
     fclose(s);
-cout << "Copied " << humanReadableByteCount(bytesCopied) << " bytes" << endl;
+    XTVFS_DEBUG("Copied " << humanReadableByteCount(bytesCopied) << " bytes");
     // Final sanity check
-    return (bytesToCopy == 0 && currentCluster >= 0x0FFFFFFF);
+    return (bytesToCopy == 0 && currentCluster >= 0x0FFFFFFF && currentCluster != unreadableCluster);
+}
+
+
+bool Xtvfs::scanDirectory(DirListing &listing, size_t startCluster)
+{
+    if (!inherited::scanDirectory(listing, startCluster))
+        return false;
+
+    // A recording's directory has its video, STREAM.STR, and the STREAM.EXN saying where the video is
+    const PackedDirEntry *video = NULL, *exn = NULL;
+    for (size_t i=0; i<listing.entries.size(); ++i)
+    {
+        const PackedDirEntry &d = listing.entries[i];
+        if (d.isDevice() && d.hasFilename("STREAM  STR"))
+            video = &d;
+        else if (!d.isDirectory() && d.hasFilename("STREAM  EXN"))
+            exn = &d;
+    }
+    if (video == NULL || exn == NULL || video->firstCluster < 2)
+        return true;
+
+    // Directories get read again and again, so only start afresh if the recording has changed
+    lock_guard<mutex> lock(m_extentFilesMutex);
+    const map<size_t, ExtentFile>::const_iterator found = m_extentFiles.find(video->firstCluster);
+    if (found != m_extentFiles.end() && found->second.exn.firstCluster == exn->firstCluster &&
+        found->second.exn.filesize == exn->filesize && found->second.videoSize == video->filesize)
+        return true;
+
+    ExtentFile file;
+    file.exn = listing.toDirEntry(*exn);
+    file.videoSize = video->filesize;
+    m_extentFiles[video->firstCluster] = file;
+    return true;
+}
+
+
+bool Xtvfs::readExtentFile(const DirEntry &exn, const DirEntry &video, Extents &extents)
+{
+    extents.clear();
+
+    // A pair of cluster numbers for each run, so it's usually only a few hundred bytes
+    if (exn.filesize == 0 || exn.filesize % 8 != 0 || exn.filesize > 1024 * 1024)
+    {
+        XTVFS_WARNING("The extent file of the video at cluster " << video.firstCluster << " is " << exn.filesize << " bytes, which isn't a list of runs");
+        return false;
+    }
+
+    ByteArray block(exn.filesize);
+    if (readFile(exn, inherited::extentsFor(exn), 0, &block[0], block.size()) != block.size())
+    {
+        XTVFS_WARNING("Unable to read the extent file of the video at cluster " << video.firstCluster);
+        return false;
+    }
+
+    // Video chains always have one more cluster than the size needs, see verifyVideoChain()
+    const size_t expectedChainLength = (video.filesize / vfatClusterSize) + 1;
+    size_t fileCluster = 0;
+    for (size_t offset = 0; offset < block.size(); offset += 8)
+    {
+        const size_t first = Read32Bits(block, offset);
+        const size_t last = Read32Bits(block, offset + 4);
+        if (first < 2 || last < first || last >= 0x0FFFFFF7 || fileCluster + (last - first + 1) > expectedChainLength)
+        {
+            XTVFS_WARNING("The extent file of the video at cluster " << video.firstCluster << " has a bad run: " << first << " to " << last);
+            extents.clear();
+            return false;
+        }
+
+        // Runs that carry straight on from the one before make one bigger read
+        if (!extents.empty() && extents.back().firstCluster + extents.back().clusterCount == first)
+            extents.back().clusterCount += last - first + 1;
+        else
+        {
+            Extent extent;
+            extent.fileCluster = fileCluster;
+            extent.firstCluster = first;
+            extent.clusterCount = last - first + 1;
+            extents.push_back(extent);
+        }
+        fileCluster += last - first + 1;
+    }
+
+    bool okay = (fileCluster == expectedChainLength && extents.front().firstCluster == video.firstCluster);
+
+    // Each run has to be a piece of the VFAT chain, ending where the next run starts.
+    // Without the VFAT in memory only the ends of the runs are looked up, which is one sector of it for each.
+    for (size_t e=0; e<extents.size() && okay; ++e)
+    {
+        const size_t last = extents[e].firstCluster + extents[e].clusterCount - 1;
+        for (size_t c = extents[e].firstCluster; c < last && okay && !m_vfat.empty(); ++c)
+            okay = (m_vfat.next(c) == c + 1);
+
+        const size_t next = nextVideoCluster(last);
+        okay = okay && ((e + 1 < extents.size()) ? next == extents[e + 1].firstCluster : next >= lastClusterMarker && next != unreadableCluster);
+    }
+
+    if (!okay)
+    {
+        XTVFS_WARNING("The extent file of the video at cluster " << video.firstCluster << " doesn't agree with the VFAT");
+        extents.clear();
+        return false;
+    }
+
+    XTVFS_DEBUG("Extent file for the video at cluster " << video.firstCluster << ": " << expectedChainLength
+                << " clusters in " << extents.size() << " runs");
+    return true;
+}
+
+
+Extents Xtvfs::extentsFor(const DirEntry &entry)
+{
+    if (!entry.isDevice())
+        return inherited::extentsFor(entry);
+
+    // Use the recording's extent file, if its directory has been read and the file checks out
+    DirEntry exn;
+    {
+        lock_guard<mutex> lock(m_extentFilesMutex);
+        map<size_t, ExtentFile>::const_iterator found = m_extentFiles.find(entry.firstCluster);
+        if (found != m_extentFiles.end() && found->second.videoSize == entry.filesize)
+        {
+            if (found->second.read && !found->second.extents.empty())
+                return found->second.extents;
+            if (!found->second.read)
+                exn = found->second.exn;
+        }
+    }
+
+    // Read it without holding the lock, so other recordings' lookups don't wait on the disk.
+    // If another thread reads the same one meanwhile, whichever finishes first is kept.
+    if (!exn.filename.empty())
+    {
+        Extents extents;
+        readExtentFile(exn, entry, extents);
+
+        lock_guard<mutex> lock(m_extentFilesMutex);
+        map<size_t, ExtentFile>::iterator found = m_extentFiles.find(entry.firstCluster);
+        if (found != m_extentFiles.end() && found->second.exn.firstCluster == exn.firstCluster)
+        {
+            if (!found->second.read)
+            {
+                found->second.extents = extents;
+                found->second.read = true;
+            }
+            extents = found->second.extents;
+        }
+        if (!extents.empty())
+            return extents;
+    }
+
+    return followChain(entry);
+}
+
+
+Extents Xtvfs::followChain(const DirEntry &entry)
+{
+    if (!entry.isDevice())
+        return inherited::followChain(entry);
+
+    // Video chains always have one more cluster than the size needs, see verifyVideoChain()
+    return chainExtents(m_vfatBeginLBA, m_vfat, entry.firstCluster, entry.filesize / vfatClusterSize + 1);
+}
+
+
+/// Packets read from each cluster probeRecording() samples, apart from the first, which is read whole to find the PMT
+static const size_t probePackets = 1024;
+
+
+/// The PCR's 27MHz clock, which wraps round after 2^33 ticks of 90kHz
+static const unsigned long long pcrHz = 27000000;
+static const unsigned long long pcrModulus = (1ULL << 33) * 300;
+
+/// A clock that moves on by more than this between two clusters is taken to have jumped, rather than run
+static const unsigned long long probeClockLimit = pcrHz * 60 * 60 * 12;
+
+
+bool Xtvfs::probeRecording(const DirEntry &entry, RecordingProbe &probe, size_t samples)
+{
+    probe = RecordingProbe();
+    if (!entry.isDevice() || entry.isDirectory() || entry.firstCluster == 0 || entry.filesize == 0)
+        return false;
+
+    const Extents extents = extentsFor(entry);
+    probe.expectedClusters = entry.filesize / vfatClusterSize + 1;
+    for (size_t i=0; i<extents.size(); ++i)
+        probe.chainClusters += extents[i].clusterCount;
+
+    // Only look where the chain goes
+    const size_t tsPacketSize = ClusterAnalysis::tsPacketSize;
+    const unsigned long long readable = min<unsigned long long>(entry.filesize, (unsigned long long)probe.chainClusters * vfatClusterSize);
+    const unsigned long long packets = readable / tsPacketSize;
+    if (packets == 0)
+        return false;
+
+    // The first cluster, the last, and the rest spread evenly between them
+    const size_t clusters = (size_t)((packets * tsPacketSize + vfatClusterSize - 1) / vfatClusterSize);
+    vector<size_t> sampled;
+    for (size_t i=0; i<samples + 2; ++i)
+    {
+        const size_t c = (size_t)((unsigned long long)i * (clusters - 1) / (samples + 1));
+        if (sampled.empty() || c != sampled.back())
+            sampled.push_back(c);
+    }
+
+    vector<ClusterAnalysis> analyses(sampled.size());
+    vector<unsigned char> buffer(vfatClusterSize);
+    for (size_t i=0; i<sampled.size(); ++i)
+    {
+        const unsigned long long clusterStart = (unsigned long long)sampled[i] * vfatClusterSize;
+        const unsigned long long clusterEnd = min<unsigned long long>(clusterStart + vfatClusterSize, packets * tsPacketSize);
+        unsigned long long begin = clusterStart, end = clusterEnd;
+        if (i == sampled.size() - 1 && i != 0)
+            begin = max(clusterStart, end - probePackets * tsPacketSize);
+        else if (i != 0)
+            end = min(clusterEnd, begin + probePackets * tsPacketSize);
+
+        const size_t length = (size_t)(end - begin);
+        const size_t read = readFile(entry, extents, begin, &buffer[0], length);
+        analyseCluster(&buffer[0], read, begin / tsPacketSize, analyses[i]);
+        ++probe.sampledClusters;
+
+        if (i == sampled.size() - 1)
+            probe.endMissing = (read < length || analyses[i].syncErrors != 0 || readable < entry.filesize);
+    }
+
+    // The PMT says what the streams are, and which carries the clock
+    for (size_t i=0; i<analyses.size() && probe.streams.empty(); ++i)
+    {
+        probe.pmtPid = analyses[i].pmtPid;
+        probe.pcrPid = analyses[i].pcrPid;
+        probe.streams = analyses[i].streams;
+    }
+
+    map<unsigned int, size_t> pcrCounts;
+    for (size_t i=0; i<analyses.size(); ++i)
+    {
+        const ClusterAnalysis &a = analyses[i];
+        for (map<unsigned int, PidCounts>::const_iterator p = a.pids.begin(); p != a.pids.end(); ++p)
+        {
+            pcrCounts[p->first] += p->second.pcrs.size();
+
+            // Without a PMT, anything that isn't one of DVB's tables or padding is taken as a stream
+            const bool stream = probe.streams.empty() ? (p->first >= 0x20 && p->first != ClusterAnalysis::noPid)
+                                                      : probe.streams.count(p->first) != 0;
+            if (stream)
+            {
+                probe.sampledPackets += p->second.packets;
+                probe.scrambledPackets += p->second.scrambled;
+            }
+        }
+    }
+
+    if (probe.pcrPid == ClusterAnalysis::noPid)
+    {
+        size_t most = 0;
+        for (map<unsigned int, size_t>::const_iterator p = pcrCounts.begin(); p != pcrCounts.end(); ++p)
+        {
+            if (p->second > most)
+            {
+                most = p->second;
+                probe.pcrPid = p->first;
+            }
+        }
+    }
+
+    // Each sample's PCRs on the clock's PID, in order
+    vector<PcrSample> pcrs;
+    vector<size_t> firstInSample;
+    for (size_t i=0; i<analyses.size(); ++i)
+    {
+        map<unsigned int, PidCounts>::const_iterator p = analyses[i].pids.find(probe.pcrPid);
+        firstInSample.push_back(pcrs.size());
+        if (p != analyses[i].pids.end())
+            pcrs.insert(pcrs.end(), p->second.pcrs.begin(), p->second.pcrs.end());
+    }
+    if (pcrs.size() < 2)
+        return true;
+
+    // Time the whole recording by the clock if it runs steadily from the first sample to the last...
+    unsigned long long ticks = 0;
+    bool steady = true;
+    for (size_t i=1; i<pcrs.size() && steady; ++i)
+    {
+        const unsigned long long step = (pcrs[i].value + pcrModulus - pcrs[i-1].value) % pcrModulus;
+        steady = (step <= probeClockLimit && pcrs[i].packet > pcrs[i-1].packet && !pcrs[i].discontinuity);
+        ticks += step;
+    }
+    const unsigned long long spanned = pcrs.back().packet - pcrs.front().packet;
+    if (steady && spanned != 0 && ticks != 0)
+    {
+        probe.duration = (double)ticks / pcrHz * entry.filesize / tsPacketSize / spanned;
+        probe.durationFromClock = true;
+        return true;
+    }
+
+    // ...otherwise scale up the bit rate within the samples, leaving out any jumps
+    ticks = 0;
+    unsigned long long measured = 0;
+    for (size_t i=1; i<pcrs.size(); ++i)
+    {
+        if (find(firstInSample.begin(), firstInSample.end(), i) != firstInSample.end())
+            continue;
+        const unsigned long long step = (pcrs[i].value + pcrModulus - pcrs[i-1].value) % pcrModulus;
+        if (step > pcrHz || pcrs[i].discontinuity)
+            continue;
+        ticks += step;
+        measured += pcrs[i].packet - pcrs[i-1].packet;
+    }
+    if (measured != 0)
+        probe.duration = (double)ticks / pcrHz * entry.filesize / tsPacketSize / measured;
+    return true;
+}
+
+
+size_t Xtvfs::fatClusters() const
+{
+    return (m_vdataBeginLBA > m_clusterBeginLBA) ? (m_vdataBeginLBA - m_clusterBeginLBA) / m_sectorsPerCluster + 2 : 0;
+}
+
+
+bool Xtvfs::cacheAllocationTables()
+{
+    if (!inherited::cacheAllocationTables())
+        return false;
+    if (!m_vfat.empty())
+        return true;
+
+    // One entry for each video cluster between the start of the video data and the end of the disk,
+    // but no more than fit between the start of the VFAT and the video data, whatever the boot sector says
+    const size_t clusters = (BPB_TotSec32 > m_vdataBeginLBA) ? (BPB_TotSec32 - m_vdataBeginLBA) / (vfatClusterSize / lbaBlockSize) + 2 : 0;
+    const size_t vfatEntries = (m_vdataBeginLBA > m_vfatBeginLBA) ? (size_t)(m_vdataBeginLBA - m_vfatBeginLBA) * (lbaBlockSize / 4) : 0;
+    return loadTable(m_vfatBeginLBA, min(clusters, vfatEntries), m_vfat);
+}
+
+
+const AllocationTable *Xtvfs::allocationTable(bool video) const
+{
+    if (!video)
+        return inherited::allocationTable(video);
+    return m_vfat.empty() ? NULL : &m_vfat;
+}
+
+
+size_t Xtvfs::areaClusterSize(bool video) const
+{
+    return video ? vfatClusterSize : inherited::areaClusterSize(video);
+}
+
+
+bool Xtvfs::verifyChain(const DirEntry &entry)
+{
+    if (!entry.isDevice())
+        return inherited::verifyChain(entry);
+
+    return verifyVideoChain(entry.firstCluster, entry.filesize);
+}
+
+
+size_t Xtvfs::clusterSizeFor(const DirEntry &entry) const
+{
+    return entry.isDevice() ? vfatClusterSize : inherited::clusterSizeFor(entry);
+}
+
+
+unsigned long long Xtvfs::clusterOffsetFor(const DirEntry &entry, size_t clusterNumber) const
+{
+    if (!entry.isDevice())
+        return inherited::clusterOffsetFor(entry, clusterNumber);
+
+    return (m_vdataBeginLBA + (unsigned long long)(clusterNumber - 2) * (vfatClusterSize / lbaBlockSize)) * lbaBlockSize;
 }
 
 
@@ -822,7 +1700,7 @@ std::list<size_t> Xtvfs::getAllocationChain(const std::string &srcPath)
         return result;
     else if (fileInfo.isDevice())
     {
-        cout << "Following video cluster chain for " << srcPath << endl;
+        XTVFS_DEBUG("Following video cluster chain for " << srcPath);
           size_t currentCluster = fileInfo.firstCluster;
           while (currentCluster < 0x0FFFFFFF) // Apparently FAT32 would be 0xFFFFFFF8 or greater. XTV is different?
           {
@@ -830,7 +1708,7 @@ std::list<size_t> Xtvfs::getAllocationChain(const std::string &srcPath)
               currentCluster = nextVideoCluster(currentCluster);
           }
 
-cout << "Returning list of " << result.size() << " video clusters: would be " << humanReadableByteCount((unsigned long long)result.size() * 3008 * 512) << endl;
+        XTVFS_DEBUG("Returning list of " << result.size() << " video clusters: would be " << humanReadableByteCount((unsigned long long)result.size() * 3008 * 512));
           return result;
     }
     else
@@ -17,8 +17,11 @@
 #ifndef XTVFS_FILESYSTEM_H
 #define XTVFS_FILESYSTEM_H
 
-#include <fstream>
+#include "blockdevice.h"
+
 #include <list>
+#include <map>
+#include <mutex>
 #include <string>
 #include <vector>
 
@@ -26,11 +29,14 @@
 namespace fs
 {
 
+class RecordingProbe;   // In tsanalysis.h
+
 
 class DirEntry
 {
   public:
     std::string filename;
+    std::string longName;         ///< UTF-8, from the VFAT long file name entries before this one. Empty if there weren't any.
     unsigned char attrib;
     size_t firstCluster;
     unsigned long long filesize;  // Something > 4 bytes
@@ -64,11 +70,78 @@ class DirEntry
     bool isValid() const { return filesize != 0xDEADBEEF && firstCluster != 0xDEADBEEF; }
 
     std::string attribToString(bool pad = true) const;
+
+    /// The long name if there is one, otherwise the 8.3 name, e.g. "main.cpp"
     std::string toString() const;
 };
 
 typedef std::vector<DirEntry> DirEntries;
 
+
+/**
+ * A directory entry as compact as it can be: the 11-char name is kept inline,
+ * and any long name lives in the DirListing's pool of names, so a whole
+ * directory can be read without allocating anything per entry.
+ */
+class PackedDirEntry
+{
+  public:
+    char filename[11];              ///< 11-char format, as on the disk
+    unsigned char attrib;
+    unsigned int firstCluster;
+    unsigned long long filesize;
+    unsigned int longNameOffset;    ///< Where the long name starts in DirListing::names
+    unsigned short longNameLength;  ///< Bytes of long name, 0 if there isn't one
+
+    bool isVolumeId() const { return attrib & (1 << 3); }
+    bool isDirectory() const { return attrib & (1 << 4); }
+    bool isDevice() const { return attrib & (1 << 6); }
+
+    /// Whether the 11-char name is this one
+    bool hasFilename(const char *eleven) const;
+};
+
+
+/// The entries of a directory, read with scanDirectory()
+class DirListing
+{
+  public:
+    std::vector<PackedDirEntry> entries;
+    std::string names;              ///< The long names, one after another
+
+    void clear() { entries.clear(); names.clear(); }
+
+    /// The long name of one of the entries, empty if it hasn't one
+    std::string longName(const PackedDirEntry &entry) const { return names.substr(entry.longNameOffset, entry.longNameLength); }
+
+    /// Unpack an entry, e.g. to keep it after the listing is gone
+    DirEntry toDirEntry(const PackedDirEntry &entry) const;
+};
+
+
+/// A run of physically consecutive clusters belonging to one file
+class Extent
+{
+  public:
+    size_t fileCluster;   ///< Index within the file of the first cluster in the run
+    size_t firstCluster;  ///< Cluster number on the disk of the first cluster in the run
+    size_t clusterCount;  ///< Number of clusters in the run
+};
+
+typedef std::vector<Extent> Extents;
+
+/// A copy of a FAT-style allocation table, held in memory so chains can be followed without going back to the disk
+class AllocationTable
+{
+  public:
+    std::vector<unsigned int> entries;    ///< The next cluster for each cluster
+
+    bool empty() const { return entries.empty(); }
+
+    /// The cluster after this one. Beyond the end of the table is treated as free, which ends any chain.
+    size_t next(size_t cluster) const { return cluster < entries.size() ? entries[cluster] : 0; }
+};
+
 /// Convert a filename in a human-readable format to the 11-char format, e.g. "main.cpp" to "MAIN    CPP"
 std::string to11CharFormat(const std::string &s);
 
@@ -76,19 +149,53 @@ std::string to11CharFormat(const std::string &s);
 std::string from11CharFormat(const std::string &s);
 
 
+/// Somewhere for the pieces of files found by FileSystem::sweepFiles() to go
+class SweepSink
+{
+public:
+    virtual ~SweepSink();
+
+    /**
+     * Take a piece of one of the files.
+     * @param file Index of the file in the entries given to sweepFiles()
+     * @param offset Where the piece goes in the file
+     * @return False to stop the sweep
+     */
+    virtual bool write(size_t file, unsigned long long offset, const char *data, size_t length) = 0;
+};
+
+
 class FileSystem
 {
 public:
     typedef std::vector<unsigned char> ByteArray;
 
+    FileSystem();
     virtual ~FileSystem();
 
     /// Open an image or disk
-    virtual bool open(const std::string &filepath);
+    bool open(const std::string &filepath);
 
-    /// Read directory entries from the specified cluster
+    /// Read from a block device that has already been opened, e.g. with direct I/O
+    virtual bool open(const BlockDevicePtr &device);
+
+    /**
+     * Set the memory the block cache under the file system may use, for metadata and file data together.
+     * Default is CachedBlockDevice::defaultCacheSize. 0 turns the cache off.
+     */
+    void setCacheSize(size_t bytes);
+
+    /// Read directory entries from the specified cluster. Anything after a part that couldn't be read is left out, and logged as an error.
     virtual DirEntries readDirectory(size_t startCluster = (size_t)-1) = 0;
 
+    /**
+     * Read directory entries from the specified cluster into a compact listing.
+     * Deleted entries and long file name pieces are skipped over in place, so nothing is allocated per entry,
+     * and reusing the listing for the next directory reuses its memory too.
+     * @return False if part of the directory couldn't be read, in which case the listing has only what came before it
+     */
+    virtual bool scanDirectory(DirListing &listing, size_t startCluster = (size_t)-1) = 0;
+
     /// Retrieve info for a specified path, recursing as required.
     virtual DirEntry infoFor(const std::string &path) = 0;
 
@@ -98,30 +205,91 @@ public:
     /// Copy a file to a file
     virtual bool copyFile(const std::string &srcPath, const std::string &destPath) = 0;
 
+    /// Follow a file's cluster chain once, and describe it as runs of consecutive clusters.
+    /// Keep the result to read from the file repeatedly without going back to the FAT.
+    virtual Extents extentsFor(const DirEntry &entry) = 0;
+
+    /// Like extentsFor(), but always by following the chain through the allocation table, never by a quicker way round
+    virtual Extents followChain(const DirEntry &entry) = 0;
+
+    /// The size in bytes of each of the file's clusters
+    virtual size_t clusterSizeFor(const DirEntry &entry) const = 0;
+
+    /// The byte offset on the disk of one of the file's clusters
+    virtual unsigned long long clusterOffsetFor(const DirEntry &entry, size_t clusterNumber) const = 0;
+
+    /// Follow the file's cluster chain and check that its length matches the file size
+    virtual bool verifyChain(const DirEntry &entry) = 0;
+
+    /**
+     * Read the allocation tables into memory, so following chains doesn't touch the disk.
+     * Not thread-safe: do it before the file system is shared between threads.
+     * @return False if this file system can't, or the tables couldn't be read
+     */
+    virtual bool cacheAllocationTables();
+
+    /**
+     * An allocation table held in memory by cacheAllocationTables(), for looking at how the disk is used.
+     * @param video XTVFS's VFAT rather than the FAT
+     * @return NULL if there isn't one, or it hasn't been cached
+     */
+    virtual const AllocationTable *allocationTable(bool video) const;
+
+    /// Bytes in each cluster of the FAT's or the VFAT's area, or 0 if there isn't one
+    virtual size_t areaClusterSize(bool video) const;
+
+    /**
+     * Read part of a file, using extents previously fetched with extentsFor().
+     * Safe to call from several threads at once.
+     * @return The number of bytes read, which is less than length at the end of the file
+     */
+    size_t readFile(const DirEntry &entry, const Extents &extents,
+                    unsigned long long offset, void *buffer, size_t length);
+
+    /**
+     * Where part of a file is kept in an ordinary file, so it can be handed to the kernel to copy,
+     * e.g. with sendfile(), rather than read through the block cache. Stops at the end of the extent.
+     * See BlockDevice::locate().
+     * @param fd The file descriptor to read with
+     * @param fileOffset Where the part starts in that file
+     * @return Bytes from offset that lie together there, up to length, or 0 if the image can't be read that way
+     */
+    size_t locateFile(const DirEntry &entry, const Extents &extents, unsigned long long offset, size_t length,
+                      int &fd, unsigned long long &fileOffset);
+
+    /**
+     * Read several files in one pass over the disk, front to back, rather than one after another.
+     * The clusters of all the files are mapped back to where they go, then the disk is read in
+     * big sequential reads and each piece is handed to the sink, so files recorded at the same time
+     * (and so interleaved on the disk) don't make it seek back and forth. Gaps between the files
+     * of up to sweepGapLimit are read through, as that is quicker than seeking over them.
+     * The pieces arrive in disk order, not file order. Clusters beyond a file's size are left out.
+     * Calls cacheAllocationTables(), so not thread-safe.
+     * @param bufferSize Bytes per read
+     * @return False if part of the image couldn't be read (the rest is still handed out), or the sink stopped the sweep
+     */
+    bool sweepFiles(const DirEntries &entries, SweepSink &sink, size_t bufferSize = 8 * 1024 * 1024);
+
+    /// The biggest gap between pieces of files that sweepFiles() reads through rather than seeking over
+    static const size_t sweepGapLimit = 4 * 1024 * 1024;
+
 protected:
 
     /// Define how many bytes are in a LBA block
     static const size_t lbaBlockSize;
 
-    std::ifstream disk;
-
+    /// Where the image's bytes come from, through the block cache
+    std::shared_ptr<CachedBlockDevice> m_device;
 
     /// Read a logical block
     ByteArray readLBA(size_t lba);
 
-    /// Read a number of logical blocks
-    ByteArray readLBA(size_t lba, size_t blocksToRead);
+    /// Read a number of logical blocks, through the metadata or the data pool of the cache.
+    /// Empty if the device couldn't be read, so an error is never taken for zeros on the disk.
+    ByteArray readLBA(size_t lba, size_t blocksToRead, CachedBlockDevice::Pool pool = CachedBlockDevice::Metadata);
 
-    /// Convert a block into an Master Boot Record (MBR)
-    bool convertToMBR(const ByteArray &block);
-
-    /**
-     * Read partition data from an MBR block
-     * @param mbr The full MBR block to read partition data from
-     * @param partition The partition to read, between 0 and 3
-     * @return True if things look okay
-     */
-    bool readPartition(const ByteArray &mbr, unsigned int partition);
+private:
+    size_t m_cacheSize;
 };
 
 
@@ -134,12 +302,17 @@ public:
 
     Fat32();
 
-    /// Open an image or disk
-    virtual bool open(const std::string &filepath);
+    using FileSystem::open;
+
+    /// Read from a block device that has already been opened
+    virtual bool open(const BlockDevicePtr &device);
 
     /// Read directory entries from the specified cluster
     virtual DirEntries readDirectory(size_t startCluster = (size_t)-1);
 
+    /// Read directory entries from the specified cluster into a compact listing
+    virtual bool scanDirectory(DirListing &listing, size_t startCluster = (size_t)-1);
+
     /// Retrieve info for a specified path, recursing as required.
     virtual DirEntry infoFor(const std::string &path);
 
@@ -149,6 +322,31 @@ public:
     /// Copy a file to a file
     virtual bool copyFile(const std::string &srcPath, const std::string &destPath);
 
+    /// Describe a file as runs of consecutive clusters, which a FAT can only learn by following its chain
+    virtual Extents extentsFor(const DirEntry &entry);
+
+    /// Follow a file's cluster chain, and describe it as runs of consecutive clusters
+    virtual Extents followChain(const DirEntry &entry);
+
+    /// The size in bytes of each of the file's clusters
+    virtual size_t clusterSizeFor(const DirEntry &entry) const;
+
+    /// The byte offset on the disk of one of the file's clusters
+    virtual unsigned long long clusterOffsetFor(const DirEntry &entry, size_t clusterNumber) const;
+
+    /// Follow the file's cluster chain and check that its length matches the file size
+    virtual bool verifyChain(const DirEntry &entry);
+
+    /// Read the FAT into memory
+    virtual bool cacheAllocationTables();
+
+    /// The FAT, if it has been cached
+    virtual const AllocationTable *allocationTable(bool video) const;
+    virtual size_t areaClusterSize(bool video) const;
+
+    /// The free cluster count from the FSInfo sector, 0xFFFFFFFF if unknown. Not necessarily up to date.
+    unsigned int fsInfoFreeClusters() const { return m_fsInfoFreeClusters; }
+
 protected:
     /// Convert a block into a FAT32 volume ID
     virtual bool convertToVolumeId(const ByteArray &block);
@@ -156,31 +354,38 @@ protected:
     /// Read a block as FileSystem Info
     bool convertToFsInfo(const ByteArray &block);
 
-    /**
-     * Read a directory entry from the block at the offset specified.
-     * @param block
-     * @param offset
-     * @return A directory entry
-     */
-    virtual DirEntry readDirectoryentry(const ByteArray &block, const int offset);
-
     /// Read a cluster.
     /// The clusters begin their numbering at 2, so there is no cluster #0 or cluster #1.
-    ByteArray readCluster(size_t clusterNumber);
+    ByteArray readCluster(size_t clusterNumber, CachedBlockDevice::Pool pool = CachedBlockDevice::Metadata);
 
-    /// Get the next cluster, given the current cluster
+    /// Get the next cluster, given the current cluster, or unreadableCluster if the FAT couldn't be read
     size_t nextCluster(size_t clusterNumber);
 
     /// Lower-level access function to copy a chain of blocks
     bool copyFile(std::ostream &s, size_t startCluster, unsigned long long bytesToCopy);
 
+    /**
+     * Follow a chain through a FAT laid out like the FAT32 one, reading each sector of the table only once.
+     * @param tableBeginLBA The first sector of the table
+     * @param cached The table in memory, if it has been loaded, otherwise it is read from the disk
+     * @param startCluster The first cluster of the chain
+     * @param maxClusters Stop after this many clusters, so a damaged chain can't loop forever
+     */
+    Extents chainExtents(unsigned long tableBeginLBA, const AllocationTable &cached, size_t startCluster, size_t maxClusters);
+
+    /// Read the entries for the first clusterCount clusters of a table into memory
+    bool loadTable(unsigned long tableBeginLBA, size_t clusterCount, AllocationTable &table);
+
+    /// Entries of the FAT that stand for clusters in the data area, counting the two reserved ones
+    virtual size_t fatClusters() const;
+
 
     // The bios parameter block info
     int BPB_BytsPerSec;  ///< Bytes per sector. Always 512
     int BPB_SecPerClus;  ///< Sectors per cluster. 1,2,4,8,16,32,64,128
     int BPB_RsvdSecCnt;  ///< Number of reserved sectors. Usually 0x20
     int BPB_NumFATs;     ///< Number of FATs. Always 2
-    int BPB_TotSec32;    ///< Total number of sectors
+    unsigned int BPB_TotSec32;   ///< Total number of sectors. Unsigned, as disks over 1TB need all 32 bits
     int BPB_FATSz32;     ///< Sectors per FAT. Value depends on disk size
     int BPB_RootClus;    ///< Root directory first cluster. Usually 0x00000002
 
@@ -190,6 +395,14 @@ protected:
     unsigned char m_sectorsPerCluster;
     unsigned long m_rootDirFirstCluster;
 
+    /// The FAT, once cacheAllocationTables() has been called
+    AllocationTable m_fat;
+
+    /// XTVFS keeps bits 32-39 of a file's size in the directory entry byte at 0x10, which FAT32 leaves alone
+    bool m_fileSizeHighByte;
+
+    unsigned int m_fsInfoFreeClusters;
+
 private:
     typedef FileSystem inherited;
 
@@ -221,8 +434,12 @@ class Xtvfs : public Fat32
 {
 public:
 
-    /// Open an image or disk
-    bool open(const std::string &filepath);
+    Xtvfs();
+
+    using Fat32::open;
+
+    /// Read from a block device that has already been opened
+    virtual bool open(const BlockDevicePtr &device);
 
     /// Copy a file to a stream
     virtual bool copyFile(std::ostream &s, const std::string &path);
@@ -234,16 +451,54 @@ public:
     /// This only expected to be used for low-level inspection tools.
     std::list<size_t> getAllocationChain(const std::string &srcPath);
 
-protected:
+    /// Read a directory, noting the STREAM.EXN of any recording in it for extentsFor()
+    virtual bool scanDirectory(DirListing &listing, size_t startCluster = (size_t)-1);
+
+    /**
+     * Where a file's clusters are. For a recording whose directory has been read,
+     * this comes from its STREAM.EXN rather than from following the VFAT a cluster at a time.
+     */
+    virtual Extents extentsFor(const DirEntry &entry);
+
+    /// Follow the FAT, or for a recording the VFAT, whatever its STREAM.EXN says
+    virtual Extents followChain(const DirEntry &entry);
+
+    /**
+     * Read a recording's extent file (STREAM.EXN), which lists the runs of
+     * video clusters of its STREAM.STR as pairs of 32 bit first and last cluster numbers.
+     * The runs are checked against the video's size and against the VFAT: every entry
+     * if the VFAT has been cached, otherwise just the entry at the end of each run.
+     * @param exn The extent file
+     * @param video The recording it describes
+     * @return False if it can't be read or doesn't agree with the VFAT
+     */
+    bool readExtentFile(const DirEntry &exn, const DirEntry &video, Extents &extents);
 
     /**
-     * Read a directory entry from the block at the offset specified.
-     * @param block
-     * @param offset
-     * @return A directory entry
+     * Size up a recording from a few of its clusters, without reading it all: the start of the first,
+     * the end of the last, and a few spread between, along with how long its chain is.
+     * Gives the streams, whether they're scrambled, roughly how long it lasts and whether it's been cut short.
+     * Safe to call from several threads at once.
+     * @param samples Clusters to look at between the first and last
+     * @return False if it isn't a recording, or none of it could be read
      */
-    virtual DirEntry readDirectoryentry(const ByteArray &block, const int offset);
+    bool probeRecording(const DirEntry &entry, RecordingProbe &probe, size_t samples = 3);
+
+    /// The size in bytes of each of the file's clusters
+    virtual size_t clusterSizeFor(const DirEntry &entry) const;
+
+    /// The byte offset on the disk of one of the file's clusters
+    virtual unsigned long long clusterOffsetFor(const DirEntry &entry, size_t clusterNumber) const;
 
+    /// Follow the file's cluster chain, using the VFAT for video files, and check its length
+    virtual bool verifyChain(const DirEntry &entry);
+
+    /// Read the FAT and the VFAT into memory
+    virtual bool cacheAllocationTables();
+
+    /// The FAT or the VFAT, if they have been cached
+    virtual const AllocationTable *allocationTable(bool video) const;
+    virtual size_t areaClusterSize(bool video) const;
 
 private:
     typedef Fat32 inherited;
@@ -251,6 +506,9 @@ private:
     /// Convert a block into a FAT32 volume ID
     virtual bool convertToVolumeId(const ByteArray &block);
 
+    /// The FAT's data area stops where the video data starts
+    virtual size_t fatClusters() const;
+
     /// Read a video cluster.
     /// The clusters begin their numbering at 2, so there is no cluster #0 or cluster #1.
     ByteArray readVideoCluster(size_t clusterNumber);
@@ -258,7 +516,7 @@ private:
     /// Follow the video fat chain and check it makes sense
     bool verifyVideoChain(size_t clusterNumber, size_t filesize);
 
-    /// Get the next video cluster, given the current cluster
+    /// Get the next video cluster, given the current cluster, or unreadableCluster if the VFAT couldn't be read
     size_t nextVideoCluster(size_t clusterNumber);
 
     bool copyVideoFile(std::ostream &s, size_t startCluster, unsigned long long bytesToCopy);
@@ -266,6 +524,24 @@ private:
 
     unsigned long m_vfatBeginLBA;
     unsigned long m_vdataBeginLBA;
+
+    /// The VFAT, once cacheAllocationTables() has been called
+    AllocationTable m_vfat;
+
+    /// A recording's STREAM.EXN, found by scanDirectory() and read the first time extentsFor() needs it
+    struct ExtentFile
+    {
+        ExtentFile() : videoSize(0), read(false) {}
+
+        DirEntry exn;
+        unsigned long long videoSize;
+        bool read;
+        Extents extents;            ///< Empty if it couldn't be used
+    };
+
+    /// Extent files by the first cluster of the recording they describe
+    std::map<size_t, ExtentFile> m_extentFiles;
+    std::mutex m_extentFilesMutex;
 };
 
 } // end of namespace fs
@@ -0,0 +1,263 @@
+/* This file is part of XTVFS Reader.
+ * Copyright (C) 2014 S. Blackburn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * XTVFS Reader is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with XTVFS Reader.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "iostats.h"
+#include "log.h"
+
+#include <iostream>
+#include <map>
+#include <string>
+#include <thread>
+
+#include <unistd.h>
+
+using namespace std;
+using namespace fs;
+
+
+// ===========================================================================
+// ==                I O C O U N T E R S   C L A S S                        ==
+// ===========================================================================
+
+IoCounters::IoCounters() :
+    deviceReads(0),
+    deviceBytes(0),
+    sectorsRead(0),
+    fileBytes(0),
+    fatLookups(0),
+    fatCacheHits(0),
+    fatCacheMisses(0),
+    frameCacheHits(0),
+    frameCacheMisses(0),
+    blockCacheHits(0),
+    blockCacheMisses(0),
+    readAheadBytes(0),
+    readNanoseconds(0),
+    bytesWritten(0),
+    writeNanoseconds(0)
+{
+    for (int i=0; i<SeekBucketCount; ++i)
+        seeks[i] = 0;
+}
+
+
+IoCounters IoCounters::operator-(const IoCounters &earlier) const
+{
+    IoCounters d;
+    d.deviceReads = deviceReads - earlier.deviceReads;
+    d.deviceBytes = deviceBytes - earlier.deviceBytes;
+    d.sectorsRead = sectorsRead - earlier.sectorsRead;
+    d.fileBytes = fileBytes - earlier.fileBytes;
+    d.fatLookups = fatLookups - earlier.fatLookups;
+    d.fatCacheHits = fatCacheHits - earlier.fatCacheHits;
+    d.fatCacheMisses = fatCacheMisses - earlier.fatCacheMisses;
+    d.frameCacheHits = frameCacheHits - earlier.frameCacheHits;
+    d.frameCacheMisses = frameCacheMisses - earlier.frameCacheMisses;
+    d.blockCacheHits = blockCacheHits - earlier.blockCacheHits;
+    d.blockCacheMisses = blockCacheMisses - earlier.blockCacheMisses;
+    d.readAheadBytes = readAheadBytes - earlier.readAheadBytes;
+    d.readNanoseconds = readNanoseconds - earlier.readNanoseconds;
+    d.bytesWritten = bytesWritten - earlier.bytesWritten;
+    d.writeNanoseconds = writeNanoseconds - earlier.writeNanoseconds;
+    for (int i=0; i<SeekBucketCount; ++i)
+        d.seeks[i] = seeks[i] - earlier.seeks[i];
+    return d;
+}
+
+
+const char *IoCounters::seekBucketName(int bucket)
+{
+    static const char *names[SeekBucketCount] = { "0", "4K", "64K", "1M", "16M", "256M", "4G", "far" };
+    return (bucket >= 0 && bucket < SeekBucketCount) ? names[bucket] : "";
+}
+
+
+void IoCounters::writeJson(std::ostream &s, int indent) const
+{
+    const string pad(indent + 2, ' ');
+    s << std::dec << "{\n"
+      << pad << "\"device_reads\": " << deviceReads << ",\n"
+      << pad << "\"device_bytes\": " << deviceBytes << ",\n"
+      << pad << "\"sectors_read\": " << sectorsRead << ",\n"
+      << pad << "\"file_bytes\": " << fileBytes << ",\n"
+      << pad << "\"fat_lookups\": " << fatLookups << ",\n"
+      << pad << "\"fat_cache_hits\": " << fatCacheHits << ",\n"
+      << pad << "\"fat_cache_misses\": " << fatCacheMisses << ",\n"
+      << pad << "\"frame_cache_hits\": " << frameCacheHits << ",\n"
+      << pad << "\"frame_cache_misses\": " << frameCacheMisses << ",\n"
+      << pad << "\"block_cache_hits\": " << blockCacheHits << ",\n"
+      << pad << "\"block_cache_misses\": " << blockCacheMisses << ",\n"
+      << pad << "\"read_ahead_bytes\": " << readAheadBytes << ",\n"
+      << pad << "\"read_ns\": " << readNanoseconds << ",\n"
+      << pad << "\"bytes_written\": " << bytesWritten << ",\n"
+      << pad << "\"write_ns\": " << writeNanoseconds << ",\n"
+      << pad << "\"seek_histogram\": {";
+    for (int i=0; i<SeekBucketCount; ++i)
+        s << (i ? ", " : " ") << "\"" << seekBucketName(i) << "\": " << seeks[i];
+    s << " }\n"
+      << string(indent, ' ') << "}";
+}
+
+
+
+// ===========================================================================
+// ==                    I O S T A T S   C L A S S                          ==
+// ===========================================================================
+
+IoStats::IoStats() :
+    m_tracing(false),
+    m_trace(NULL),
+    m_firstEvent(true)
+{
+    reset();
+}
+
+
+IoStats::~IoStats()
+{
+    stopTrace();
+}
+
+
+IoStats &IoStats::instance()
+{
+    static IoStats stats;
+    return stats;
+}
+
+
+void IoStats::reset()
+{
+    Counter *counters[] = { &m_deviceReads, &m_deviceBytes, &m_sectorsRead, &m_fileBytes,
+                            &m_fatLookups, &m_fatCacheHits, &m_fatCacheMisses,
+                            &m_frameCacheHits, &m_frameCacheMisses, &m_blockCacheHits,
+                            &m_blockCacheMisses, &m_readAheadBytes, &m_readNanoseconds,
+                            &m_bytesWritten, &m_writeNanoseconds };
+    for (size_t i=0; i<sizeof(counters)/sizeof(counters[0]); ++i)
+        counters[i]->store(0, memory_order_relaxed);
+    for (int i=0; i<IoCounters::SeekBucketCount; ++i)
+        m_seeks[i].store(0, memory_order_relaxed);
+}
+
+
+IoCounters IoStats::snapshot() const
+{
+    IoCounters c;
+    c.deviceReads = m_deviceReads.load(memory_order_relaxed);
+    c.deviceBytes = m_deviceBytes.load(memory_order_relaxed);
+    c.sectorsRead = m_sectorsRead.load(memory_order_relaxed);
+    c.fileBytes = m_fileBytes.load(memory_order_relaxed);
+    c.fatLookups = m_fatLookups.load(memory_order_relaxed);
+    c.fatCacheHits = m_fatCacheHits.load(memory_order_relaxed);
+    c.fatCacheMisses = m_fatCacheMisses.load(memory_order_relaxed);
+    c.frameCacheHits = m_frameCacheHits.load(memory_order_relaxed);
+    c.frameCacheMisses = m_frameCacheMisses.load(memory_order_relaxed);
+    c.blockCacheHits = m_blockCacheHits.load(memory_order_relaxed);
+    c.blockCacheMisses = m_blockCacheMisses.load(memory_order_relaxed);
+    c.readAheadBytes = m_readAheadBytes.load(memory_order_relaxed);
+    c.readNanoseconds = m_readNanoseconds.load(memory_order_relaxed);
+    c.bytesWritten = m_bytesWritten.load(memory_order_relaxed);
+    c.writeNanoseconds = m_writeNanoseconds.load(memory_order_relaxed);
+    for (int i=0; i<IoCounters::SeekBucketCount; ++i)
+        c.seeks[i] = m_seeks[i].load(memory_order_relaxed);
+    return c;
+}
+
+
+void IoStats::writeJson(std::ostream &s) const
+{
+    snapshot().writeJson(s);
+    s << "\n";
+}
+
+
+void IoStats::countDeviceRead(unsigned long long seekDistance, size_t bytes, unsigned long long nanoseconds)
+{
+    add(m_deviceReads, 1);
+    add(m_deviceBytes, bytes);
+    add(m_readNanoseconds, nanoseconds);
+
+    // Each bucket is 16 times the one before, starting from 4K
+    int bucket = IoCounters::SeekNone;
+    if (seekDistance > 0)
+    {
+        bucket = IoCounters::Seek4K;
+        for (unsigned long long limit = 4096; seekDistance > limit && bucket < IoCounters::SeekFar; limit *= 16)
+            ++bucket;
+    }
+    add(m_seeks[bucket], 1);
+}
+
+
+bool IoStats::startTrace(const std::string &path)
+{
+    stopTrace();
+
+    lock_guard<mutex> lock(m_traceMutex);
+    m_trace = fopen(path.c_str(), "w");
+    if (!m_trace)
+    {
+        XTVFS_ERROR("Unable to create trace file " << path);
+        return false;
+    }
+
+    fputs("{\"traceEvents\":[\n", m_trace);
+    m_firstEvent = true;
+    m_epoch = chrono::steady_clock::now();
+    m_tracing.store(true);
+    return true;
+}
+
+
+void IoStats::stopTrace()
+{
+    m_tracing.store(false);
+
+    lock_guard<mutex> lock(m_traceMutex);
+    if (!m_trace)
+        return;
+
+    fputs("\n],\"displayTimeUnit\":\"ms\"}\n", m_trace);
+    fclose(m_trace);
+    m_trace = NULL;
+}
+
+
+void IoStats::traceEvent(const char *name, chrono::steady_clock::time_point start,
+                         chrono::steady_clock::time_point end,
+                         const char *argName1, unsigned long long arg1,
+                         const char *argName2, unsigned long long arg2)
+{
+    // Number the threads in the order they turn up, which reads better than the OS's ids
+    static map<thread::id, int> threadNumbers;
+
+    lock_guard<mutex> lock(m_traceMutex);
+    if (!m_trace)
+        return;
+
+    map<thread::id, int>::iterator t = threadNumbers.find(this_thread::get_id());
+    if (t == threadNumbers.end())
+        t = threadNumbers.insert(make_pair(this_thread::get_id(), (int)threadNumbers.size() + 1)).first;
+
+    const double ts = chrono::duration<double, micro>(start - m_epoch).count();
+    const double dur = chrono::duration<double, micro>(end - start).count();
+    fprintf(m_trace, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"%s\":%llu",
+            m_firstEvent ? "" : ",\n", name, (int)getpid(), t->second, ts, dur, argName1, arg1);
+    if (argName2)
+        fprintf(m_trace, ",\"%s\":%llu", argName2, arg2);
+    fputs("}}", m_trace);
+    m_firstEvent = false;
+}
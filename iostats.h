@@ -0,0 +1,189 @@
+/* This file is part of XTVFS Reader.
+ * Copyright (C) 2014 S. Blackburn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * XTVFS Reader is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with XTVFS Reader.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef XTVFS_IOSTATS_H
+#define XTVFS_IOSTATS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <iosfwd>
+#include <mutex>
+#include <string>
+
+namespace fs
+{
+
+
+/// A copy of the I/O counters at one moment, e.g. to compare before and after something
+class IoCounters
+{
+public:
+    IoCounters();
+
+    /// Buckets of the seek histogram: how far each read on the device was from the end of the previous one
+    enum SeekBucket { SeekNone, Seek4K, Seek64K, Seek1M, Seek16M, Seek256M, Seek4G, SeekFar, SeekBucketCount };
+
+    unsigned long long deviceReads;         ///< Read system calls on the image
+    unsigned long long deviceBytes;         ///< Bytes those read, including any read to align direct I/O
+    unsigned long long sectorsRead;         ///< Sectors the file system asked for through readLBA()
+    unsigned long long fileBytes;           ///< Bytes of files read through readFile()
+    unsigned long long fatLookups;          ///< Clusters looked up in the FAT or VFAT
+    unsigned long long fatCacheHits;        ///< Of those, answered from the tables in memory
+    unsigned long long fatCacheMisses;      ///< Of those, needing a sector of the table from the disk
+    unsigned long long frameCacheHits;      ///< Compressed images: frames already decompressed
+    unsigned long long frameCacheMisses;    ///< Compressed images: frames that had to be decompressed
+    unsigned long long blockCacheHits;      ///< Blocks found in the block cache
+    unsigned long long blockCacheMisses;    ///< Blocks that had to be read from the device
+    unsigned long long readAheadBytes;      ///< Bytes read ahead of a sequential read
+    unsigned long long readNanoseconds;     ///< Time spent in read system calls
+    unsigned long long bytesWritten;        ///< Bytes of extracted files written out
+    unsigned long long writeNanoseconds;    ///< Time spent writing them
+    unsigned long long seeks[SeekBucketCount];
+
+    /// The counts since an earlier snapshot
+    IoCounters operator-(const IoCounters &earlier) const;
+
+    /// Write as a JSON object, indented by indent spaces
+    void writeJson(std::ostream &s, int indent = 0) const;
+
+    static const char *seekBucketName(int bucket);
+};
+
+
+/**
+ * Counters of the I/O the library does, for finding out where the time goes.
+ * The counters are relaxed atomics, cheap enough to leave on all the time.
+ *
+ * Optionally each read and write can also be written to a file in the Chrome
+ * trace event format, to look at in chrome://tracing or Perfetto.
+ */
+class IoStats
+{
+public:
+    /// The one set of counters for the process
+    static IoStats &instance();
+
+    /// Copy the counters
+    IoCounters snapshot() const;
+
+    /// Set all the counters back to zero
+    void reset();
+
+    /// Write the counters as JSON
+    void writeJson(std::ostream &s) const;
+
+    /**
+     * Start writing trace events to a file, replacing any trace already being written.
+     * @return False if the file can't be created
+     */
+    bool startTrace(const std::string &path);
+
+    /// Finish the trace file off
+    void stopTrace();
+
+    /// Whether trace events are being written
+    bool tracing() const { return m_tracing.load(std::memory_order_relaxed); }
+
+    // Counting, from the library and the tools
+    void countDeviceRead(unsigned long long seekDistance, size_t bytes, unsigned long long nanoseconds);
+    void countSectors(size_t sectors) { add(m_sectorsRead, sectors); }
+    void countFileBytes(size_t bytes) { add(m_fileBytes, bytes); }
+    void countFatLookup(bool cached) { add(m_fatLookups, 1); add(cached ? m_fatCacheHits : m_fatCacheMisses, 1); }
+    void countFrame(bool cached) { add(cached ? m_frameCacheHits : m_frameCacheMisses, 1); }
+    void countBlockCache(bool cached) { add(cached ? m_blockCacheHits : m_blockCacheMisses, 1); }
+    void countReadAhead(size_t bytes) { add(m_readAheadBytes, bytes); }
+    void countWrite(size_t bytes, unsigned long long nanoseconds) { add(m_bytesWritten, bytes); add(m_writeNanoseconds, nanoseconds); }
+
+    /// Write a complete event to the trace, if tracing
+    void traceEvent(const char *name, std::chrono::steady_clock::time_point start,
+                    std::chrono::steady_clock::time_point end,
+                    const char *argName1, unsigned long long arg1,
+                    const char *argName2 = NULL, unsigned long long arg2 = 0);
+
+private:
+    IoStats();
+    ~IoStats();
+
+    typedef std::atomic<unsigned long long> Counter;
+    static void add(Counter &counter, unsigned long long n) { counter.fetch_add(n, std::memory_order_relaxed); }
+
+    Counter m_deviceReads;
+    Counter m_deviceBytes;
+    Counter m_sectorsRead;
+    Counter m_fileBytes;
+    Counter m_fatLookups;
+    Counter m_fatCacheHits;
+    Counter m_fatCacheMisses;
+    Counter m_frameCacheHits;
+    Counter m_frameCacheMisses;
+    Counter m_blockCacheHits;
+    Counter m_blockCacheMisses;
+    Counter m_readAheadBytes;
+    Counter m_readNanoseconds;
+    Counter m_bytesWritten;
+    Counter m_writeNanoseconds;
+    Counter m_seeks[IoCounters::SeekBucketCount];
+
+    std::atomic<bool> m_tracing;
+    std::mutex m_traceMutex;
+    FILE *m_trace;
+    bool m_firstEvent;
+    std::chrono::steady_clock::time_point m_epoch;
+};
+
+
+/// Shorthand for IoStats::instance()
+inline IoStats &ioStats() { return IoStats::instance(); }
+
+
+/**
+ * Times an operation for the trace, writing one event when it goes out of scope.
+ * Does nothing but check a flag when no trace is being written.
+ */
+class TraceScope
+{
+public:
+    TraceScope(const char *name, const char *argName1, unsigned long long arg1,
+               const char *argName2 = NULL, unsigned long long arg2 = 0) :
+        m_name(ioStats().tracing() ? name : NULL),
+        m_argName1(argName1), m_arg1(arg1), m_argName2(argName2), m_arg2(arg2)
+    {
+        if (m_name)
+            m_start = std::chrono::steady_clock::now();
+    }
+
+    ~TraceScope()
+    {
+        if (m_name)
+            ioStats().traceEvent(m_name, m_start, std::chrono::steady_clock::now(), m_argName1, m_arg1, m_argName2, m_arg2);
+    }
+
+private:
+    TraceScope(const TraceScope &);
+    TraceScope &operator=(const TraceScope &);
+
+    const char *m_name;
+    const char *m_argName1;
+    unsigned long long m_arg1;
+    const char *m_argName2;
+    unsigned long long m_arg2;
+    std::chrono::steady_clock::time_point m_start;
+};
+
+} // end of namespace fs
+
+#endif // XTVFS_IOSTATS_H
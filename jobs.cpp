@@ -0,0 +1,224 @@
+/* This file is part of XTVFS Reader.
+ * Copyright (C) 2014 S. Blackburn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * XTVFS Reader is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with XTVFS Reader.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "jobs.h"
+#include "probe.h"
+#include "remux.h"
+
+#include <QDebug>
+#include <QFile>
+
+#include <vector>
+
+using namespace fs;
+
+/// Bytes read from the image at a time when extracting
+static const size_t extractBufferSize = 8 * 1024 * 1024;
+
+
+Job::Job(QObject *parent) :
+    QObject(parent),
+    m_cancelled(0)
+{
+    // The GUI deletes the job once it has dealt with finished()
+    setAutoDelete(false);
+}
+
+
+void Job::run()
+{
+    QString message;
+    const bool okay = execute(message);
+    emit finished(okay, message);
+}
+
+
+
+OpenImageJob::OpenImageJob(const QString &filepath, QObject *parent) :
+    Job(parent),
+    m_filepath(filepath),
+    m_hasPlanner(false)
+{
+}
+
+
+bool OpenImageJob::execute(QString &message)
+{
+    const std::string path = m_filepath.toStdString();
+
+    // One look at the start of the image finds each volume and opens it as the right class
+    ProbedVolumes volumes;
+    if (!probeImage(path, volumes))
+    {
+        m_fileSystem.reset();
+        message = tr("Error opening %1").arg(m_filepath);
+        return false;
+    }
+
+    for (size_t v=0; v<volumes.size(); ++v)
+        qDebug() << "Found" << volumes[v].format() << "volume in partition" << volumes[v].partition;
+    m_fileSystem = volumes.front().fileSystem;
+
+    m_root = m_fileSystem->readDirectory();
+
+    // Is this a Sky DB disk image?
+    DirEntry skyDbFileInfo = m_fileSystem->infoFor("FSN_DATA/PCAT.DB");
+    if (skyDbFileInfo.filename.empty())
+    {
+        qDebug() << "Does not appear to be a Sky DB image (FSN_DATA/PCAT.DB not present)";
+        return true;
+    }
+
+    // Query the planner where it is, rather than copying it out first
+    Planner planner;
+    if (!planner.open(*m_fileSystem, "FSN_DATA/PCAT.DB"))
+    {
+        qDebug() << "Error opening the pcat file";
+        return true; // The image itself is fine
+    }
+
+    qDebug() << "Database version = " << planner.majorVersion() << "." << planner.minorVersion();
+    m_recordings = planner.recordings();
+    m_hasPlanner = true;
+
+    // Check every recording's video now, while nothing else is using the image
+    m_resolved = resolveRecordings(*m_fileSystem, m_recordings);
+
+    return true;
+}
+
+
+
+ListDirectoryJob::ListDirectoryJob(const FileSystemPtr &fileSystem, size_t startCluster, QObject *parent) :
+    Job(parent),
+    m_fileSystem(fileSystem),
+    m_startCluster(startCluster)
+{
+}
+
+
+bool ListDirectoryJob::execute(QString &)
+{
+    m_entries = m_fileSystem->readDirectory(m_startCluster);
+    return true;
+}
+
+
+
+ExtractJob::ExtractJob(const FileSystemPtr &fileSystem, const QString &srcPath, const QString &destPath, QObject *parent) :
+    Job(parent),
+    m_fileSystem(fileSystem),
+    m_srcPath(srcPath),
+    m_destPath(destPath),
+    m_remux(false)
+{
+}
+
+
+bool ExtractJob::execute(QString &message)
+{
+    const DirEntry entry = m_fileSystem->infoFor(m_srcPath.toStdString());
+    if (entry.filename.empty() || entry.isDirectory() || entry.firstCluster == 0)
+    {
+        message = tr("%1 not found").arg(m_srcPath);
+        return false;
+    }
+
+    QFile out(m_destPath);
+    if (!out.open(QIODevice::WriteOnly | QIODevice::Truncate))
+    {
+        message = tr("Unable to create %1: %2").arg(m_destPath, out.errorString());
+        return false;
+    }
+
+    // Follow the chain once, then copy big runs of it at a time
+    const Extents extents = m_fileSystem->extentsFor(entry);
+    std::vector<char> buffer(extractBufferSize);
+    ProgramStreamRemuxer remuxer;
+    std::vector<char> remuxed;
+    const qint64 total = entry.filesize;
+    qint64 done = 0;
+
+    emit progress(done, total);
+    while (done < total)
+    {
+        if (isCancelled())
+        {
+            out.close();
+            out.remove();
+            message = tr("Cancelled");
+            return false;
+        }
+
+        const size_t got = m_fileSystem->readFile(entry, extents, done, &buffer[0], buffer.size());
+        if (got == 0)
+            break; // The chain is shorter than the file size
+
+        const char *data = &buffer[0];
+        size_t length = got;
+        if (m_remux)
+        {
+            remuxed.clear();
+            remuxer.write(&buffer[0], got, remuxed);
+            data = remuxed.data();
+            length = remuxed.size();
+        }
+
+        if (out.write(data, length) != (qint64)length)
+        {
+            message = tr("Error writing %1: %2").arg(m_destPath, out.errorString());
+            return false;
+        }
+
+        done += got;
+        emit progress(done, total);
+    }
+
+    if (m_remux)
+    {
+        remuxed.clear();
+        remuxer.finish(remuxed);
+        if (out.write(remuxed.data(), remuxed.size()) != (qint64)remuxed.size())
+        {
+            message = tr("Error writing %1: %2").arg(m_destPath, out.errorString());
+            return false;
+        }
+        if (remuxer.droppedPackets() > 0)
+            qDebug() << remuxer.droppedPackets() << "of" << remuxer.packets() << "packets were scrambled or damaged, and left out";
+    }
+
+    out.close();
+    if (m_remux && remuxer.streams() == 0)
+    {
+        message = tr("No audio or video found in %1 to remux").arg(m_srcPath);
+        return false;
+    }
+    if (m_remux && remuxer.mostlyDropped())
+    {
+        // An encrypted recording leaves next to nothing, so don't leave that lying around as if it were the programme
+        out.remove();
+        message = tr("%1 of %2 audio and video packets in %3 were scrambled or damaged. Save it as a transport stream instead.")
+                  .arg(remuxer.droppedPackets()).arg(remuxer.streamPackets()).arg(m_srcPath);
+        return false;
+    }
+    if (done != total)
+    {
+        message = tr("Only %1 of %2 bytes could be read from %3").arg(done).arg(total).arg(m_srcPath);
+        return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,144 @@
+/* This file is part of XTVFS Reader.
+ * Copyright (C) 2014 S. Blackburn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * XTVFS Reader is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with XTVFS Reader.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef JOBS_H
+#define JOBS_H
+
+#include <QAtomicInt>
+#include <QObject>
+#include <QRunnable>
+#include <QString>
+
+#include "filesystem.h"
+#include "planner.h"
+
+#include <memory>
+
+typedef std::shared_ptr<fs::FileSystem> FileSystemPtr;
+
+
+/**
+ * A piece of disk work run on the thread pool, so the window stays responsive.
+ * Create it in the GUI thread and connect to its signals, which then arrive
+ * in the GUI thread. It is not deleted automatically: call deleteLater()
+ * once finished() has been handled.
+ */
+class Job : public QObject, public QRunnable
+{
+    Q_OBJECT
+
+public:
+    explicit Job(QObject *parent = 0);
+
+    bool isCancelled() const { return m_cancelled.load() != 0; }
+
+    /// The run() of QRunnable: does the work then emits finished()
+    void run();
+
+public slots:
+    /// Ask the job to stop at the next opportunity. Safe to call from any thread.
+    void cancel() { m_cancelled.store(1); }
+
+signals:
+    void progress(qint64 done, qint64 total);
+    void finished(bool okay, const QString &message);
+
+protected:
+    /// Do the work, returning false with a message on failure
+    virtual bool execute(QString &message) = 0;
+
+private:
+    QAtomicInt m_cancelled;
+};
+
+
+/// Open an image, read its root directory and, if there is one, its planner
+class OpenImageJob : public Job
+{
+    Q_OBJECT
+
+public:
+    explicit OpenImageJob(const QString &filepath, QObject *parent = 0);
+
+    const QString &filepath() const { return m_filepath; }
+
+    // Results, valid once finished() has been emitted
+    FileSystemPtr fileSystem() const { return m_fileSystem; }
+    const fs::DirEntries &rootDirectory() const { return m_root; }
+    bool hasPlanner() const { return m_hasPlanner; }
+    const fs::Recordings &recordings() const { return m_recordings; }
+    /// Where each recording's video is, and whether it's intact
+    const fs::ResolvedRecordings &resolvedRecordings() const { return m_resolved; }
+
+protected:
+    bool execute(QString &message);
+
+private:
+    QString m_filepath;
+    FileSystemPtr m_fileSystem;
+    fs::DirEntries m_root;
+    bool m_hasPlanner;
+    fs::Recordings m_recordings;
+    fs::ResolvedRecordings m_resolved;
+};
+
+
+/// Read the entries of a directory
+class ListDirectoryJob : public Job
+{
+    Q_OBJECT
+
+public:
+    ListDirectoryJob(const FileSystemPtr &fileSystem, size_t startCluster, QObject *parent = 0);
+
+    FileSystemPtr fileSystem() const { return m_fileSystem; }
+    const fs::DirEntries &entries() const { return m_entries; }
+
+protected:
+    bool execute(QString &message);
+
+private:
+    FileSystemPtr m_fileSystem;
+    size_t m_startCluster;
+    fs::DirEntries m_entries;
+};
+
+
+/// Copy a file out of the image, reporting progress as it goes
+class ExtractJob : public Job
+{
+    Q_OBJECT
+
+public:
+    ExtractJob(const FileSystemPtr &fileSystem, const QString &srcPath, const QString &destPath, QObject *parent = 0);
+
+    const QString &srcPath() const { return m_srcPath; }
+    const QString &destPath() const { return m_destPath; }
+
+    /// Turn the file's transport stream into an MPEG program stream as it is copied
+    void setRemux(bool remux) { m_remux = remux; }
+
+protected:
+    bool execute(QString &message);
+
+private:
+    FileSystemPtr m_fileSystem;
+    QString m_srcPath;
+    QString m_destPath;
+    bool m_remux;
+};
+
+#endif // JOBS_H
@@ -0,0 +1,43 @@
+/* This file is part of XTVFS Reader.
+ * Copyright (C) 2014 S. Blackburn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * XTVFS Reader is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with XTVFS Reader.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "json.h"
+
+#include <cstdio>
+
+using namespace std;
+using namespace fs;
+
+
+string fs::jsonString(const string &s)
+{
+    string result = "\"";
+    for (size_t i=0; i<s.size(); ++i)
+    {
+        const unsigned char c = s[i];
+        if (c == '"' || c == '\\')
+            result += string("\\") + (char)c;
+        else if (c < 0x20)
+        {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            result += escaped;
+        }
+        else
+            result += c;
+    }
+    return result + "\"";
+}
@@ -0,0 +1,31 @@
+/* This file is part of XTVFS Reader.
+ * Copyright (C) 2014 S. Blackburn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * XTVFS Reader is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with XTVFS Reader.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef XTVFS_JSON_H
+#define XTVFS_JSON_H
+
+#include <string>
+
+namespace fs
+{
+
+
+/// Quote a string for JSON, escaping quotes, backslashes and control characters, for the tools' reports
+std::string jsonString(const std::string &s);
+
+} // end of namespace fs
+
+#endif // XTVFS_JSON_H
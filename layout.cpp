@@ -0,0 +1,393 @@
+/* This file is part of XTVFS Reader.
+ * Copyright (C) 2014 S. Blackburn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * XTVFS Reader is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with XTVFS Reader.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "layout.h"
+#include "json.h"
+#include "log.h"
+
+#include <algorithm>
+#include <bitset>
+#include <iomanip>
+#include <iostream>
+#include <set>
+#include <sstream>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+using namespace fs;
+
+
+FileLayout::FileLayout() :
+    video(false),
+    clusters(0),
+    extents(0),
+    largestRun(0),
+    totalSeek(0),
+    largestSeek(0)
+{
+}
+
+
+AllocationCensus::AllocationCensus() :
+    clusters(0),
+    freeClusters(0),
+    badClusters(0),
+    chainEnds(0)
+{
+}
+
+
+size_t AllocationCensus::allocatedIn(size_t first, size_t end) const
+{
+    end = min(end, bitmap.size() * 64);
+    size_t count = 0;
+    while (first < end)
+    {
+        // Whole words at a time where possible
+        const size_t word = first / 64, bit = first % 64;
+        const size_t bits = min<size_t>(64 - bit, end - first);
+        unsigned long long w = bitmap[word] >> bit;
+        if (bits < 64)
+            w &= (1ULL << bits) - 1;
+        count += bitset<64>(w).count();
+        first += bits;
+    }
+    return count;
+}
+
+
+/// FAT32 entries only use their low 28 bits
+static const unsigned int entryMask = 0x0FFFFFFF;
+static const unsigned int badCluster = 0x0FFFFFF7;   ///< Anything above this ends a chain
+
+
+AllocationCensus fs::takeCensus(const AllocationTable &table)
+{
+    AllocationCensus census;
+    const size_t n = table.entries.size();
+    if (n == 0)
+        return census;
+    const unsigned int *entries = &table.entries[0];
+    census.bitmap.assign((n + 63) / 64, 0);
+
+    size_t i = 0;
+#if defined(__SSE2__)
+    // Four entries to a compare, 64 to a word of the bitmap. Each compare gives all ones
+    // in the lanes that match, i.e. -1, so subtracting it counts them.
+    const __m128i mask = _mm_set1_epi32(entryMask);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i bad = _mm_set1_epi32(badCluster);
+    __m128i freeCount = zero, badCount = zero, endCount = zero;
+    for (; i + 64 <= n; i += 64)
+    {
+        unsigned long long word = 0;
+        for (int j=0; j<64; j += 4)
+        {
+            // Masked entries are below 2^28, so the signed greater-than works for them
+            const __m128i v = _mm_and_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(entries + i + j)), mask);
+            const __m128i isFree = _mm_cmpeq_epi32(v, zero);
+            freeCount = _mm_sub_epi32(freeCount, isFree);
+            badCount = _mm_sub_epi32(badCount, _mm_cmpeq_epi32(v, bad));
+            endCount = _mm_sub_epi32(endCount, _mm_cmpgt_epi32(v, bad));
+            word |= (unsigned long long)(~_mm_movemask_ps(_mm_castsi128_ps(isFree)) & 0xF) << j;
+        }
+        census.bitmap[i / 64] = word;
+    }
+
+    unsigned int lanes[4];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), freeCount);
+    census.freeClusters = (size_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), badCount);
+    census.badClusters = (size_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), endCount);
+    census.chainEnds = (size_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#endif
+
+    // Whatever is left over, or all of it without SSE2
+    for (; i < n; ++i)
+    {
+        const unsigned int v = entries[i] & entryMask;
+        if (v == 0)
+        {
+            ++census.freeClusters;
+            continue;
+        }
+        census.bitmap[i / 64] |= 1ULL << (i % 64);
+        if (v == badCluster)
+            ++census.badClusters;
+        else if (v > badCluster)
+            ++census.chainEnds;
+    }
+
+    // Take the two reserved entries back out again
+    for (i = 0; i < 2 && i < n; ++i)
+    {
+        const unsigned int v = entries[i] & entryMask;
+        if (v == 0)
+            --census.freeClusters;
+        else if (v == badCluster)
+            --census.badClusters;
+        else if (v > badCluster)
+            --census.chainEnds;
+        census.bitmap[0] &= ~(1ULL << i);
+    }
+    census.clusters = (n > 2) ? n - 2 : 0;
+
+    return census;
+}
+
+
+OccupancyMap::OccupancyMap() :
+    video(false),
+    clusterSize(0),
+    clustersPerBucket(0)
+{
+}
+
+
+static const char *areaName(bool video)
+{
+    return video ? "video" : "fat";
+}
+
+
+/// Quote a string for CSV, if it needs it
+static string csvString(const string &s)
+{
+    if (s.find_first_of(",\"\n") == string::npos)
+        return s;
+    string quoted = "\"";
+    for (size_t i=0; i<s.size(); ++i)
+        quoted += (s[i] == '"') ? string("\"\"") : string(1, s[i]);
+    return quoted + "\"";
+}
+
+
+void LayoutReport::writeJson(std::ostream &s) const
+{
+    const ios::fmtflags flags = s.flags();
+    s << dec << fixed << setprecision(3);
+
+    s << "{\n  \"files\": [";
+    for (size_t i=0; i<files.size(); ++i)
+    {
+        const FileLayout &f = files[i];
+        s << (i ? "," : "") << "\n    { \"path\": " << jsonString(f.path)
+          << ", \"area\": \"" << areaName(f.video) << "\""
+          << ", \"size\": " << f.entry.filesize
+          << ", \"clusters\": " << f.clusters
+          << ", \"extents\": " << f.extents
+          << ", \"mean_run\": " << f.meanRun()
+          << ", \"largest_run\": " << f.largestRun
+          << ", \"mean_seek\": " << f.meanSeek()
+          << ", \"largest_seek\": " << f.largestSeek
+          << ", \"total_seek\": " << f.totalSeek << " }";
+    }
+    s << "\n  ],\n  \"areas\": [";
+
+    for (size_t a=0; a<areas.size(); ++a)
+    {
+        const OccupancyMap &m = areas[a];
+
+        // Sum up the files in the area too
+        size_t fileCount = 0, fragmented = 0, extents = 0;
+        for (size_t i=0; i<files.size(); ++i)
+        {
+            if (files[i].video != m.video || files[i].clusters == 0)
+                continue;
+            ++fileCount;
+            extents += files[i].extents;
+            if (files[i].extents > 1)
+                ++fragmented;
+        }
+
+        s << (a ? "," : "") << "\n    {\n"
+          << "      \"area\": \"" << areaName(m.video) << "\",\n"
+          << "      \"cluster_size\": " << m.clusterSize << ",\n"
+          << "      \"clusters\": " << m.census.clusters << ",\n"
+          << "      \"used_clusters\": " << m.census.usedClusters() << ",\n"
+          << "      \"free_clusters\": " << m.census.freeClusters << ",\n"
+          << "      \"bad_clusters\": " << m.census.badClusters << ",\n"
+          << "      \"chain_ends\": " << m.census.chainEnds << ",\n"
+          << "      \"files\": " << fileCount << ",\n"
+          << "      \"fragmented_files\": " << fragmented << ",\n"
+          << "      \"mean_extents\": " << (fileCount ? (double)extents / fileCount : 0) << ",\n"
+          << "      \"clusters_per_bucket\": " << m.clustersPerBucket << ",\n"
+          << "      \"map\": [";
+        for (size_t b=0; b<m.used.size(); ++b)
+            s << (b ? ", " : "") << m.used[b];
+        s << "]\n    }";
+    }
+    s << "\n  ]\n}\n";
+
+    s.flags(flags);
+}
+
+
+void LayoutReport::writeFilesCsv(std::ostream &s) const
+{
+    const ios::fmtflags flags = s.flags();
+    s << dec << fixed << setprecision(3);
+
+    s << "path,area,size,clusters,extents,mean_run,largest_run,mean_seek,largest_seek,total_seek\n";
+    for (size_t i=0; i<files.size(); ++i)
+    {
+        const FileLayout &f = files[i];
+        s << csvString(f.path) << ',' << areaName(f.video) << ',' << f.entry.filesize << ',' << f.clusters << ','
+          << f.extents << ',' << f.meanRun() << ',' << f.largestRun << ',' << f.meanSeek() << ','
+          << f.largestSeek << ',' << f.totalSeek << '\n';
+    }
+
+    s.flags(flags);
+}
+
+
+void LayoutReport::writeMapCsv(std::ostream &s) const
+{
+    const ios::fmtflags flags = s.flags();
+    s << dec << fixed << setprecision(3);
+
+    s << "area,bucket,first_cluster,clusters,used\n";
+    for (size_t a=0; a<areas.size(); ++a)
+    {
+        const OccupancyMap &m = areas[a];
+        for (size_t b=0; b<m.used.size(); ++b)
+        {
+            const size_t first = 2 + b * m.clustersPerBucket;
+            s << areaName(m.video) << ',' << b << ',' << first << ','
+              << min(m.clustersPerBucket, m.census.clusters + 2 - first) << ',' << m.used[b] << '\n';
+        }
+    }
+
+    s.flags(flags);
+}
+
+
+/// Work out how a file's extents lie on the disk
+static void measure(FileSystem &image, FileLayout &layout)
+{
+    const DirEntry &entry = layout.entry;
+    if (entry.firstCluster == 0)
+        return;
+
+    const Extents extents = image.extentsFor(entry);
+    const size_t clusterSize = image.clusterSizeFor(entry);
+    unsigned long long previousEnd = 0;
+    for (size_t e=0; e<extents.size(); ++e)
+    {
+        const Extent &extent = extents[e];
+        layout.clusters += extent.clusterCount;
+        layout.largestRun = max(layout.largestRun, extent.clusterCount);
+
+        const unsigned long long start = image.clusterOffsetFor(entry, extent.firstCluster);
+        if (e > 0)
+        {
+            const unsigned long long seek = (start >= previousEnd) ? start - previousEnd : previousEnd - start;
+            layout.totalSeek += seek;
+            layout.largestSeek = max(layout.largestSeek, seek);
+        }
+        previousEnd = start + (unsigned long long)extent.clusterCount * clusterSize;
+    }
+    layout.extents = extents.size();
+}
+
+
+/// Measure every file below a directory
+static void walk(FileSystem &image, const string &dirPath, size_t cluster, set<size_t> &visited, LayoutReport &report)
+{
+    // A damaged directory could lead back to one of its parents
+    if (!visited.insert(cluster).second)
+        return;
+
+    DirListing listing;
+    if (!image.scanDirectory(listing, cluster))
+        XTVFS_ERROR("Only part of " << (dirPath.empty() ? string("/") : dirPath) << " could be read, so the report leaves out the rest");
+    for (size_t i=0; i<listing.entries.size(); ++i)
+    {
+        const PackedDirEntry &d = listing.entries[i];
+        if (d.isVolumeId() || d.filename[0] == '.')
+            continue;
+
+        const DirEntry entry = listing.toDirEntry(d);
+        if (d.isDirectory())
+        {
+            if (d.firstCluster != 0)
+                walk(image, dirPath + entry.toString() + "/", d.firstCluster, visited, report);
+            continue;
+        }
+
+        report.files.push_back(FileLayout());
+        FileLayout &layout = report.files.back();
+        layout.path = dirPath + entry.toString();
+        layout.entry = entry;
+        layout.video = (image.allocationTable(true) != NULL && entry.isDevice());
+        measure(image, layout);
+    }
+}
+
+
+/// Map how full the area is from a census of its table
+static OccupancyMap occupancy(const AllocationTable &table, bool video, size_t clusterSize, size_t buckets)
+{
+    OccupancyMap map;
+    map.video = video;
+    map.clusterSize = clusterSize;
+    map.census = takeCensus(table);
+    const size_t clusters = map.census.clusters;
+    if (clusters == 0)
+        return map;
+
+    buckets = max<size_t>(1, min(buckets, clusters));
+    map.clustersPerBucket = (clusters + buckets - 1) / buckets;
+    buckets = (clusters + map.clustersPerBucket - 1) / map.clustersPerBucket;
+
+    map.used.resize(buckets);
+    for (size_t b=0; b<buckets; ++b)
+    {
+        const size_t first = 2 + b * map.clustersPerBucket;
+        const size_t end = min(first + map.clustersPerBucket, clusters + 2);
+        map.used[b] = (float)map.census.allocatedIn(first, end) / (end - first);
+    }
+    return map;
+}
+
+
+bool fs::analyseLayout(FileSystem &image, size_t buckets, LayoutReport &report)
+{
+    report.files.clear();
+    report.areas.clear();
+
+    if (!image.cacheAllocationTables())
+    {
+        XTVFS_ERROR("Unable to read the allocation tables into memory");
+        return false;
+    }
+
+    set<size_t> visited;
+    walk(image, "", (size_t)-1, visited, report);
+
+    for (int video=0; video<2; ++video)
+    {
+        const AllocationTable *table = image.allocationTable(video);
+        if (table)
+            report.areas.push_back(occupancy(*table, video, image.areaClusterSize(video), buckets));
+    }
+
+    return true;
+}
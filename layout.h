@@ -0,0 +1,132 @@
+/* This file is part of XTVFS Reader.
+ * Copyright (C) 2014 S. Blackburn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * XTVFS Reader is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with XTVFS Reader.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef XTVFS_LAYOUT_H
+#define XTVFS_LAYOUT_H
+
+#include "filesystem.h"
+
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+namespace fs
+{
+
+
+/// How one file lies on the disk
+class FileLayout
+{
+  public:
+    FileLayout();
+
+    std::string path;
+    DirEntry entry;
+    bool video;                         ///< In the video area, i.e. its chain is in the VFAT
+    size_t clusters;
+    size_t extents;                     ///< Runs of consecutive clusters
+    size_t largestRun;                  ///< Clusters in the longest run
+    unsigned long long totalSeek;       ///< Bytes skipped, forwards or back, going from each run to the next
+    unsigned long long largestSeek;
+
+    double meanRun() const { return extents ? (double)clusters / extents : 0; }
+    double meanSeek() const { return extents > 1 ? (double)totalSeek / (extents - 1) : 0; }
+};
+
+
+/**
+ * What the entries of an allocation table say about its clusters, counted
+ * straight from the table rather than trusting FSInfo's free count, which
+ * Sky boxes don't keep up to date.
+ */
+class AllocationCensus
+{
+  public:
+    AllocationCensus();
+
+    size_t clusters;                    ///< Entries counted, i.e. all but the two reserved ones at the start
+    size_t freeClusters;
+    size_t badClusters;
+    size_t chainEnds;                   ///< Last clusters of chains, so roughly the number of files
+    std::vector<unsigned long long> bitmap;  ///< Bit n % 64 of word n / 64 is set if cluster n isn't free
+
+    /// Clusters that aren't free, including bad ones
+    size_t usedClusters() const { return clusters - freeClusters; }
+
+    /// Clusters in use and pointing at the next one in their chain
+    size_t linkedClusters() const { return clusters - freeClusters - badClusters - chainEnds; }
+
+    bool allocated(size_t cluster) const { return cluster / 64 < bitmap.size() && (bitmap[cluster / 64] >> (cluster % 64) & 1); }
+
+    /// Allocated clusters from first up to but not including end
+    size_t allocatedIn(size_t first, size_t end) const;
+};
+
+
+/**
+ * Count the free, bad, end of chain and linked entries of a table and map which clusters are allocated.
+ * Uses SSE2 where the compiler has it, four entries to a compare, so even the FAT of a 2TB disk takes milliseconds.
+ */
+AllocationCensus takeCensus(const AllocationTable &table);
+
+
+/// How much of each part of an area of the disk is allocated
+class OccupancyMap
+{
+  public:
+    OccupancyMap();
+
+    bool video;                         ///< The video area rather than the FAT area
+    size_t clusterSize;                 ///< Bytes
+    AllocationCensus census;
+    size_t clustersPerBucket;
+    std::vector<float> used;            ///< Fraction of the clusters allocated, for each bucket in order
+};
+
+
+/**
+ * A fragmentation report for a whole image, to predict how long it will
+ * take to copy off and to help choose how to image it.
+ */
+class LayoutReport
+{
+  public:
+    std::vector<FileLayout> files;
+    std::vector<OccupancyMap> areas;
+
+    /// Everything, as one JSON object
+    void writeJson(std::ostream &s) const;
+
+    /// The files as CSV, one row each
+    void writeFilesCsv(std::ostream &s) const;
+
+    /// The occupancy maps as CSV, one row per bucket
+    void writeMapCsv(std::ostream &s) const;
+};
+
+
+/**
+ * Work out how every file on the image lies on the disk, and how full each part of the disk is.
+ * The allocation tables are read into memory first, then each occupancy map is made from a census of its table.
+ * Not thread-safe, as it calls cacheAllocationTables().
+ * @param buckets How many pieces to divide each area into for its occupancy map
+ * @return False if the allocation tables couldn't be read
+ */
+bool analyseLayout(FileSystem &image, size_t buckets, LayoutReport &report);
+
+} // end of namespace fs
+
+#endif // XTVFS_LAYOUT_H
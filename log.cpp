@@ -0,0 +1,96 @@
+/* This file is part of XTVFS Reader.
+ * Copyright (C) 2014 S. Blackburn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * XTVFS Reader is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with XTVFS Reader.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "log.h"
+
+#include <iostream>
+#include <mutex>
+
+using namespace std;
+using namespace fs;
+
+std::atomic<int> Log::s_level(LogOff);
+
+/// The sink and the lock around it, made on first use so logging works during static initialisation
+static mutex &sinkMutex()
+{
+    static mutex m;
+    return m;
+}
+
+static LogSinkPtr &currentSink()
+{
+    static LogSinkPtr sink(new StreamLogSink(cerr));
+    return sink;
+}
+
+
+
+LogSink::~LogSink()
+{
+}
+
+
+void StreamLogSink::write(LogLevel level, const std::string &message)
+{
+    if (level < LogWarning)
+        m_stream << message << '\n';
+    else
+        m_stream << Log::levelName(level) << ": " << message << '\n';
+}
+
+
+
+void Log::setLevel(LogLevel level)
+{
+    s_level.store(level, memory_order_relaxed);
+}
+
+
+LogLevel Log::level()
+{
+    return (LogLevel)s_level.load(memory_order_relaxed);
+}
+
+
+void Log::setSink(const LogSinkPtr &sink)
+{
+    lock_guard<mutex> lock(sinkMutex());
+    currentSink() = sink;
+}
+
+
+void Log::write(LogLevel level, const std::string &message)
+{
+    lock_guard<mutex> lock(sinkMutex());
+    if (currentSink())
+        currentSink()->write(level, message);
+}
+
+
+const char *Log::levelName(LogLevel level)
+{
+    switch (level)
+    {
+    case LogTrace:   return "trace";
+    case LogDebug:   return "debug";
+    case LogInfo:    return "info";
+    case LogWarning: return "warning";
+    case LogError:   return "error";
+    case LogOff:     break;
+    }
+    return "";
+}
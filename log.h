@@ -0,0 +1,116 @@
+/* This file is part of XTVFS Reader.
+ * Copyright (C) 2014 S. Blackburn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * XTVFS Reader is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with XTVFS Reader.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef XTVFS_LOG_H
+#define XTVFS_LOG_H
+
+#include <atomic>
+#include <iosfwd>
+#include <memory>
+#include <sstream>
+#include <string>
+
+namespace fs
+{
+
+
+/// How much a log message matters
+enum LogLevel { LogTrace, LogDebug, LogInfo, LogWarning, LogError, LogOff };
+
+/// Somewhere for log messages to go, e.g. the console or a window
+class LogSink
+{
+public:
+    virtual ~LogSink();
+
+    /// Deal with one message. Called with the log's lock held, so never from two threads at once.
+    virtual void write(LogLevel level, const std::string &message) = 0;
+};
+
+typedef std::shared_ptr<LogSink> LogSinkPtr;
+
+
+/// Writes each message as a line on a stream, without flushing it
+class StreamLogSink : public LogSink
+{
+public:
+    explicit StreamLogSink(std::ostream &s) : m_stream(s) {}
+
+    virtual void write(LogLevel level, const std::string &message);
+
+private:
+    std::ostream &m_stream;
+};
+
+
+/**
+ * The library's diagnostics.
+ * By default nothing is shown; the tools turn on warnings and errors, which go
+ * to stderr unless given another sink. Nothing below the
+ * compile-time floor XTVFS_LOG_LEVEL is even built, so the most verbose
+ * messages cost nothing unless asked for.
+ */
+class Log
+{
+public:
+    /// Show messages at this level and above. Default is LogOff.
+    static void setLevel(LogLevel level);
+    static LogLevel level();
+
+    /// Send messages somewhere else. An empty pointer throws them away.
+    static void setSink(const LogSinkPtr &sink);
+
+    /// Whether messages at this level are wanted
+    static bool enabled(LogLevel level) { return level >= s_level.load(std::memory_order_relaxed); }
+
+    static void write(LogLevel level, const std::string &message);
+
+    static const char *levelName(LogLevel level);
+
+private:
+    static std::atomic<int> s_level;
+};
+
+} // end of namespace fs
+
+
+/// Messages below this level are compiled out: 0 trace, 1 debug, 2 info, 3 warning, 4 error
+#if !defined(XTVFS_LOG_LEVEL)
+#if defined(DEBUG)
+#define XTVFS_LOG_LEVEL 0
+#else
+#define XTVFS_LOG_LEVEL 1
+#endif
+#endif
+
+/// Log a message built with <<, e.g. XTVFS_LOG(fs::LogDebug, "Cluster " << n)
+#define XTVFS_LOG(level, message) \
+    do { \
+        if ((level) >= XTVFS_LOG_LEVEL && fs::Log::enabled(level)) \
+        { \
+            std::ostringstream xtvfsLogStream; \
+            xtvfsLogStream << message; \
+            fs::Log::write(level, xtvfsLogStream.str()); \
+        } \
+    } while (0)
+
+#define XTVFS_TRACE(message)   XTVFS_LOG(fs::LogTrace, message)
+#define XTVFS_DEBUG(message)   XTVFS_LOG(fs::LogDebug, message)
+#define XTVFS_INFO(message)    XTVFS_LOG(fs::LogInfo, message)
+#define XTVFS_WARNING(message) XTVFS_LOG(fs::LogWarning, message)
+#define XTVFS_ERROR(message)   XTVFS_LOG(fs::LogError, message)
+
+#endif // XTVFS_LOG_H
@@ -15,13 +15,31 @@
  * along with XTVFS Reader.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include <QApplication>
+#include <QtDebug>
 #include "mainwindow.h"
+#include "log.h"
+
+/// Passes the library's messages on to Qt's, along with the GUI's own
+class QtLogSink : public fs::LogSink
+{
+public:
+    virtual void write(fs::LogLevel level, const std::string &message)
+    {
+        if (level >= fs::LogWarning)
+            qWarning("%s", message.c_str());
+        else
+            qDebug("%s", message.c_str());
+    }
+};
 
 int main(int argc, char *argv[])
 {
     QApplication a(argc, argv);
     qApp->setApplicationName("XTVFS Reader");
 
+    fs::Log::setSink(fs::LogSinkPtr(new QtLogSink()));
+    fs::Log::setLevel(fs::LogWarning);
+
     MainWindow w;
     w.show();
 
@@ -19,8 +19,18 @@
 
 #include "filesystem.h"
 
+#include <QCloseEvent>
+#include <QDateTime>
+#include <QDebug>
+#include <QDockWidget>
 #include <QFileDialog>
+#include <QHeaderView>
 #include <QMessageBox>
+#include <QProgressBar>
+#include <QPushButton>
+#include <QTextStream>
+#include <QThreadPool>
+#include <QTreeWidget>
 
 #include <fstream>
 #include <sstream>
@@ -29,101 +39,70 @@ using namespace fs;
 
 MainWindow::MainWindow(QWidget *parent) :
     QMainWindow(parent),
-    ui(new Ui::MainWindow),
-    diskImage(NULL),
-    db( QSqlDatabase::addDatabase("QSQLITE") )
+    ui(new Ui::MainWindow)
 {
     ui->setupUi(this);
 
+    // The views format what they show on demand, rather than holding an item per cell
+    m_directoryModel = new DirectoryModel(this);
+    ui->tableWidget->setModel(m_directoryModel);
+    m_recordingsModel = new RecordingsModel(this);
+    ui->recordingsTW->setModel(m_recordingsModel);
+    ui->recordingsTW->sortByColumn(RecordingsModel::TimeColumn, Qt::AscendingOrder);
+
     ui->FilesystemFrame->hide();
     ui->SkyDBFrame->hide();
+
+    // Extractions run in the background, and are listed here while they do
+    m_transfersTW = new QTreeWidget(this);
+    m_transfersTW->setRootIsDecorated(false);
+    m_transfersTW->setHeaderLabels(QStringList() << tr("File") << tr("Progress") << tr("Speed") << tr("Remaining") << QString());
+    m_transfersDock = new QDockWidget(tr("Transfers"), this);
+    m_transfersDock->setObjectName("transfersDock");
+    m_transfersDock->setWidget(m_transfersTW);
+    addDockWidget(Qt::BottomDockWidgetArea, m_transfersDock);
+    m_transfersDock->hide();
 }
 
 MainWindow::~MainWindow()
 {
+    // The jobs are our children, so they mustn't still be running when we go
+    cancelJobs();
     delete ui;
 }
 
-// Format is len(1 byte) + unknown(1 byte) + "13ff1a19"(4 bytes) + data(len bytes)
-// So string data starts 12 bytes in
-QString blobToString(const QVariant &v)
-{
-    QString output;
-    bool okay;
-
-//    QString s(v.toString().mid(12));
-    QString s(v.toString());
 
-    const int len = s.left(2).toInt(&okay, 16);
+void MainWindow::closeEvent(QCloseEvent *event)
+{
+    cancelJobs();
+    QMainWindow::closeEvent(event);
+}
 
-    for (int i=s.length()-(2*len); i<s.length(); i+=2)
-    {
-        const int c = s.mid(i, 2).toInt(&okay, 16);
-        if (isprint(c))
-            output.append(c);
-    }
 
-    //qDebug() << s << "->" << len << output;
-    return output;
+void MainWindow::cancelJobs()
+{
+    // Stop anything still running, and wait for it so it doesn't outlive the window
+    foreach (Job *job, m_jobs)
+        job->cancel();
+    QThreadPool::globalInstance()->waitForDone();
 }
 
-void MainWindow::openSkyDB()
-{
-    db.setDatabaseName(pcatfile.fileName());
 
-    if (!db.open())
-    {
-        QMessageBox::critical(0, qApp->tr("Cannot open database"),
-                              qApp->tr("Unable to establish a database connection.\n"
-                                       "This utility needs SQLite support. Please read "
-                                       "the Qt SQL driver documentation for information how "
-                                       "to build it.\n\n"
-                                       "Click Cancel to exit."), QMessageBox::Cancel);
-    }
-    else
-    {
-        QSqlQuery infoQuery("SELECT DB_SCHEMA_MAJOR_VERSION, DB_SCHEMA_MINOR_VERSION FROM DB_INFO");
-        if ( infoQuery.next() )
-        {
-            const int dbMajorVersion = infoQuery.value(0).toInt();
-            const int dbMinorVersion = infoQuery.value(1).toInt();
-            qDebug() << "Database version = " << dbMajorVersion << "." << dbMinorVersion;
-        }
+void MainWindow::startJob(Job *job)
+{
+    m_jobs.append(job);
+    QThreadPool::globalInstance()->start(job);
+}
 
-        // service_type of 5 is pre-recorded on-demand; 25 is channel BDL (whatever that is); 0, 1, 16 are unknown
 
-        QSqlQuery query("SELECT item.event_id,service_type,event_name,local_start_time,duration,channel_name,shrec_locator,synopsis,av_content.av_content_id,vfile_locator "
-                        "FROM item,booking_info,av_content "
-                        "WHERE item.event_id = booking_info.event_id and booking_info.av_content_id = av_content.av_content_id and service_type!=5  and service_type!=25");
-        int row=0;
-        while (query.next())
-        {
-            qDebug() << query.value(0).toInt() << query.value(1).toString() << blobToString(query.value(2))
-                     << query.value(3).toInt() << query.value(4).toInt() << blobToString(query.value(5))
-                     << query.value(6).toString() << blobToString(query.value(7)) << query.value(8).toString() << query.value(9).toString();
-
-            const int eventId = query.value(0).toInt();
-            const QString eventName(blobToString(query.value(2)));
-            const int startTime = query.value(3).toInt();
-            const int duration = query.value(4).toInt();
-            const QString channel(blobToString(query.value(5)));
-            const QString synopsis(blobToString(query.value(7)));
-            ui->recordingsTW->setRowCount(row+1);
-            //time, duration, name, channel, synopsis
-            //ui->recordingsTW->setItem(row, 0, new QTableWidgetItem(QDateTime::fromTime_t(startTime).toString(Qt::ISODate)));
-            ui->recordingsTW->setItem(row, 0, new QTableWidgetItem(QDateTime::fromTime_t(startTime).toString("yyyy-MM-dd hh:mm")));
-            ui->recordingsTW->setItem(row, 1, new QTableWidgetItem(QString::number(duration/60000)+" mins"));
-            ui->recordingsTW->setItem(row, 2, new QTableWidgetItem(eventName));
-            ui->recordingsTW->setItem(row, 3, new QTableWidgetItem(channel));
-            ui->recordingsTW->setItem(row, 4, new QTableWidgetItem(synopsis));
-            ui->recordingsTW->item(row, 0)->setData(Qt::UserRole, QVariant(eventId));
-            row++;
-        }
-        ui->recordingsTW->resizeColumnsToContents();
-        ui->recordingsTW->resizeRowsToContents();
-        qDebug() << row << "recordings found";
-        ui->statusBar->showMessage(QString("%1 recordings found").arg(row), 10000);
-    }
+void MainWindow::showRecordings(const Recordings &recordings, const ResolvedRecordings &resolved)
+{
+    m_recordingsModel->setRecordings(recordings, resolved);
+    ui->recordingsTW->sortByColumn(ui->recordingsTW->horizontalHeader()->sortIndicatorSection(),
+                                   ui->recordingsTW->horizontalHeader()->sortIndicatorOrder());
+    ui->recordingsTW->resizeColumnsToContents();
+    qDebug() << recordings.size() << "recordings found";
+    ui->statusBar->showMessage(QString("%1 recordings found").arg(recordings.size()), 10000);
 
     ui->SkyDBFrame->show();
 }
@@ -133,8 +112,12 @@ void MainWindow::closeImage()
 {
     ui->SkyDBFrame->hide();
     ui->FilesystemFrame->hide();
-    if (diskImage)
-        delete diskImage;
+
+    // Any extractions still running keep their own reference to the image
+    diskImage.reset();
+    m_directoryModel->clear();
+    m_recordingsModel->clear();
+    m_dirStack.clear();
 }
 
 #include <set>
@@ -149,50 +132,39 @@ void MainWindow::on_actionOpen_triggered()
         return; // User cancelled the loading
 
     closeImage();
-    diskImage = new fs::Xtvfs();
-    bool okay  = diskImage->open(filepath);
-    if (!okay)
-    {
-        // Xtvfs didn't work, try Fat32 instead
-        qDebug() << "Xtvfs didn't work, trying Fat32 instead";
-        delete diskImage;
-        diskImage = new fs::Fat32();
-        okay  = diskImage->open(filepath);
-    }
-    else {
-        qDebug() << "Got an Xtvfs file system";
-    }
+
+    // Reading the boot sector, root directory and planner can take a while, so do it in the background
+    ui->actionOpen->setEnabled(false);
+    ui->statusBar->showMessage("Opening " + QString::fromStdString(filepath) + "...");
+
+    OpenImageJob *job = new OpenImageJob(QString::fromStdString(filepath), this);
+    connect(job, SIGNAL(finished(bool,QString)), this, SLOT(imageOpened(bool,QString)));
+    startJob(job);
+}
+
+
+void MainWindow::imageOpened(bool okay, const QString &message)
+{
+    OpenImageJob *job = qobject_cast<OpenImageJob*>(sender());
+    m_jobs.removeAll(job);
+    job->deleteLater();
+    ui->actionOpen->setEnabled(true);
 
     if (!okay)
     {
-        ui->statusBar->showMessage("Error opening " + QString::fromStdString(filepath), 10000);
+        ui->statusBar->showMessage(message, 10000);
         return;
     }
 
-    ui->FilesystemFrame->show();
-    showDirectory();
+    diskImage = job->fileSystem();
 
-    // Is this a Sky DB disk image?
-    DirEntry skyDbFileInfo = diskImage->infoFor("FSN_DATA/PCAT.DB");
-    if (!skyDbFileInfo.filename.empty())
-    {
-        // Copy the pcat.db file to a temporary
-        pcatfile.open();
-        std::ofstream f(pcatfile.fileName().toStdString().c_str(), std::ios::out | std::ios::binary);
-        qDebug() << "About to copy the pcat file to" << pcatfile.fileName();
-        bool okay = diskImage->copyFile(f, "FSN_DATA/PCAT.DB");
-        f.close();
+    ui->FilesystemFrame->show();
+    showEntries(job->rootDirectory());
 
-        if (okay)
-            // Open sky db
-            openSkyDB();
-        else
-            qDebug() << "Error copying the pcat file";
-    }
-    else {
-        qDebug() << "Does not appear to be a Sky DB image (FSN_DATA/PCAT.DB not present)";
+    if (job->hasPlanner())
+        showRecordings(job->recordings(), job->resolvedRecordings());
+    else
         ui->SkyDBFrame->hide();
-    }
 
 #if defined(TEST_FAT_FOR_REUSED_CLUSTERS)
     // Was using this to validate the FAT chain reader - seeing if there was a clash in clusters used.
@@ -215,7 +187,7 @@ void MainWindow::on_actionOpen_triggered()
     std::set<size_t> allClusters;
     for (int i=0; names[i] != NULL; ++i)
     {
-        const std::list<size_t> clusters = dynamic_cast<Xtvfs*>(diskImage)->getAllocationChain(names[i]);
+        const std::list<size_t> clusters = dynamic_cast<Xtvfs*>(diskImage.get())->getAllocationChain(names[i]);
         // 3008 * 512
         for (std::list<size_t>::const_iterator c=clusters.begin(); c!=clusters.end(); ++c)
         {
@@ -245,26 +217,36 @@ QString MainWindow::currentPath() const
 
 void MainWindow::showDirectory(size_t startCluster)
 {
-    DirEntries entries = diskImage->readDirectory(startCluster);
-    ui->statusBar->showMessage(QString("Read %1 entries").arg(entries.size()), 10000);
+    ListDirectoryJob *job = new ListDirectoryJob(diskImage, startCluster, this);
+    connect(job, SIGNAL(finished(bool,QString)), this, SLOT(directoryListed(bool,QString)));
+    startJob(job);
 
-    DirEntry entry;
-    ui->tableWidget->clear();
-    ui->tableWidget->setRowCount(entries.size());
-    ui->tableWidget->setColumnCount(3);
-    QStringList headers;
-    headers << "Filename" << "Attributes" << "Size";
-    ui->tableWidget->setHorizontalHeaderLabels(headers);
-    int row=0;
-    foreach (entry, entries)
-    {
-        ui->tableWidget->setItem(row, 0, new QTableWidgetItem(QString::fromStdString(entry.toString())));
-        ui->tableWidget->setItem(row, 1, new QTableWidgetItem(QString::fromStdString(entry.attribToString())));
-        ui->tableWidget->setItem(row, 2, new QTableWidgetItem(QString::number(entry.filesize)));
+    ui->tableWidget->setEnabled(false);
+    ui->actionUp->setEnabled(false);
+    ui->pathLbl->setText("/" + currentPath());
+}
 
-        row++;
-    }
 
+void MainWindow::directoryListed(bool, const QString &)
+{
+    ListDirectoryJob *job = qobject_cast<ListDirectoryJob*>(sender());
+    m_jobs.removeAll(job);
+    job->deleteLater();
+
+    // Ignore listings that arrive after their image has been closed
+    if (job->fileSystem() == diskImage)
+        showEntries(job->entries());
+}
+
+
+void MainWindow::showEntries(const DirEntries &entries)
+{
+    ui->statusBar->showMessage(QString("Read %1 entries").arg(entries.size()), 10000);
+
+    m_directoryModel->setEntries(entries);
+    ui->tableWidget->scrollToTop();
+
+    ui->tableWidget->setEnabled(true);
     ui->actionUp->setEnabled(!m_dirStack.empty());
     ui->pathLbl->setText("/" + currentPath());
 }
@@ -274,7 +256,9 @@ void MainWindow::on_tableWidget_activated(const QModelIndex &index)
     if (!index.isValid())
         return;
 
-    const QString name = ui->tableWidget->item(index.row(), 0)->text();
+    // Use the entry we already have, rather than going back to the disk for it
+    const DirEntry fileInfo = m_directoryModel->entry(index.row());
+    const QString name = QString::fromStdString(fileInfo.toString());
     ui->statusBar->showMessage("Something pressed:" + name, 10000);
     if (name == "..")
     {
@@ -282,7 +266,6 @@ void MainWindow::on_tableWidget_activated(const QModelIndex &index)
     }
     else
     {
-        DirEntry fileInfo = diskImage->infoFor((currentPath() + name).toStdString());
         if (fileInfo.isDirectory())
         {
             m_dirStack.push_back(fileInfo);
@@ -294,27 +277,15 @@ void MainWindow::on_tableWidget_activated(const QModelIndex &index)
             QString savePath = QFileDialog::getSaveFileName(this, tr("Copy file as..."), name,
                                                             tr("All Files (*.*)") );
             if (savePath != "")
-            {
-                const QString srcPath = currentPath() + name;
-                ui->statusBar->showMessage(QString("Copying %1 to %2").arg(srcPath,savePath), 10000);
-                // Do the copying!
-                std::ofstream f(savePath.toStdString().c_str(), std::ios::out | std::ios::binary);
-                const bool okay = diskImage->copyFile(f, srcPath.toStdString());
-                f.close();
-                if (!okay)
-                {
-                    ui->statusBar->showMessage("Error copying the file", 10000);
-                    QMessageBox::critical(this, "Error copying", QString("Error copying from:\n  %1\nto:\n  %2").arg(srcPath,savePath));
-                }
-                else
-                    ui->statusBar->showMessage("File copied okay", 10000);
-            }
+                startTransfer(currentPath() + name, savePath);
         }
     }
 }
 
 void MainWindow::on_actionUp_triggered()
 {
+    if (m_dirStack.empty())
+        return;
     m_dirStack.pop_back();
 
     if (!m_dirStack.empty())
@@ -346,24 +317,22 @@ void MainWindow::on_actionExport_Planner_Database_triggered()
         QTextStream data( &f );
         QStringList strList;
 
-        QTableWidget * table = ui->recordingsTW;
-
-        for( int c = 0; c < table->columnCount(); ++c )
+        for( int c = 0; c < m_recordingsModel->columnCount(); ++c )
         {
             strList <<
                     "\" " +
-                    table->horizontalHeaderItem(c)->data(Qt::DisplayRole).toString() +
+                    m_recordingsModel->headerData(c, Qt::Horizontal).toString() +
                     "\" ";
         }
 
         data << strList.join(",") << "\n";
 
-        for( int r = 0; r < table->rowCount(); ++r )
+        for( int r = 0; r < m_recordingsModel->rowCount(); ++r )
         {
             strList.clear();
-            for( int c = 0; c < table->columnCount(); ++c )
+            for( int c = 0; c < m_recordingsModel->columnCount(); ++c )
             {
-                strList << "\" "+table->item( r, c )->text()+"\" ";
+                strList << "\" "+m_recordingsModel->displayText(r, c)+"\" ";
             }
             data << strList.join( "," )+"\n";
         }
@@ -373,58 +342,40 @@ void MainWindow::on_actionExport_Planner_Database_triggered()
 
 void MainWindow::on_actionExtract_Recording_triggered()
 {
-    QTableWidgetItem *item = ui->recordingsTW->selectedItems().front();
-    const int eventId = item->data(Qt::UserRole).toInt();
-    qDebug() << "eventId =" << eventId;
-
-    qDebug() << "Preparing query";
-
-    QSqlQuery query("SELECT item.event_id,service_type,event_name,local_start_time,duration,channel_name,shrec_locator,synopsis,av_content.av_content_id,vfile_locator "
-                    "FROM item,booking_info,av_content "
-                    "WHERE item.event_id = booking_info.event_id and booking_info.av_content_id = av_content.av_content_id and service_type!=5  and service_type!=25 and item.event_id=" + QString::number(eventId));
-    if (!query.next())
-    {
-        qDebug() << "Error querying db for extraction";
+    const QModelIndexList selected = ui->recordingsTW->selectionModel()->selectedRows();
+    if (selected.isEmpty())
         return;
 
-    }
-
-    qDebug() << query.value(0).toInt() << query.value(1).toString() << blobToString(query.value(2))
-             << query.value(3).toInt() << query.value(4).toInt() << blobToString(query.value(5))
-             << query.value(6).toString() << blobToString(query.value(7)) << query.value(8).toString() << query.value(9).toString();
+    const Recording recording = m_recordingsModel->recording(selected.front().row());
+    qDebug() << "eventId =" << recording.eventId;
 
-    const QString eventName(blobToString(query.value(2)));
+    const QString eventName(QString::fromStdString(recording.name));
 
+    // Saving as .mpg remuxes the transport stream into a program stream on the way, which most players prefer
     QString savePath = QFileDialog::getSaveFileName(this, tr("Extract file as..."), eventName + ".STR",
-                                                    tr("All Files (*.*)") );
+                                                    tr("Transport stream (*.STR *.ts);;MPEG program stream (*.mpg);;All Files (*.*)") );
     if (savePath.isEmpty())
         return;
 
-    const QString shrecLocator(query.value(6).toString());
+    const QString shrecLocator(QString::fromStdString(recording.shrecLocator));
     qDebug() << "Locator = " << shrecLocator << ", splits to" << shrecLocator.split(":");
-    const QString stream = shrecLocator.split(":").back();
-
-    qDebug() << "About to save stream" << stream << "to" << savePath;
-    const QString videoFile(stream+"/STREAM.STR");
+    const QString videoFile(QString::fromStdString(recording.streamPath()));
 
-    ui->statusBar->showMessage(QString("Saving %1 to %2").arg(eventName,savePath), 10000);
+    qDebug() << "About to save stream" << videoFile << "to" << savePath;
 #if defined(READ_EXTENT_FILE)
     // Read the extent file - use this to check the calculations of the video sector locations used in the copy.
     // See http://wiki.ph-mb.com/wiki/Video_FAT, e.g. in "/s9/stream.exn"
+    const QString stream = shrecLocator.split(":").back();
     const QString extentFile(stream+"/STREAM.EXN");
-    std::stringstream exn;
-    const bool exn_okay = diskImage->copyFile(exn, extentFile.toStdString());
-    if (exn_okay)
+    const DirEntry exn = diskImage->infoFor(extentFile.toStdString());
+    const DirEntry video = diskImage->infoFor(videoFile.toStdString());
+    Xtvfs *xtvfs = dynamic_cast<Xtvfs*>(diskImage.get());
+    Extents extents;
+    if (xtvfs && xtvfs->readExtentFile(exn, video, extents))
     {
-        qDebug() << "Extent file" << extentFile << "is" << exn.str().size() << "bytes";
-        const unsigned int records = exn.str().size() / 8;
-        unsigned long start, end;
-        for (unsigned int i=0; i<records; i++)
-        {
-            exn.read((char*)&start, sizeof(start));
-            exn.read((char*)&end, sizeof(end));
-            qDebug() << start << end;
-        }
+        qDebug() << "Extent file" << extentFile << "is" << exn.filesize << "bytes";
+        for (size_t i=0; i<extents.size(); i++)
+            qDebug() << extents[i].firstCluster << extents[i].firstCluster + extents[i].clusterCount - 1;
     }
     else
         qDebug() << "Error reading the extent file:" << extentFile;
@@ -432,22 +383,84 @@ void MainWindow::on_actionExtract_Recording_triggered()
 return;
 #endif
 
-//    std::ofstream f(savePath.toStdString().c_str(), std::ios::out | std::ios::binary);
-//    const bool okay = diskImage->copyFile(f, videoFile.toStdString());
-//    f.close();
-//    const bool okay = dynamic_cast<Xtvfs*>(diskImage)->copyVideoFile(savePath.toStdString() size_t startCluster, size_t bytesToCopy);
-    const bool okay = diskImage->copyFile(videoFile.toStdString(), savePath.toStdString());
+    const bool remux = savePath.endsWith(".mpg", Qt::CaseInsensitive) || savePath.endsWith(".mpeg", Qt::CaseInsensitive);
+    startTransfer(videoFile, savePath, remux);
+}
+
 
-    if (!okay)
+void MainWindow::startTransfer(const QString &srcPath, const QString &destPath, bool remux)
+{
+    ExtractJob *job = new ExtractJob(diskImage, srcPath, destPath, this);
+    job->setRemux(remux);
+    connect(job, SIGNAL(progress(qint64,qint64)), this, SLOT(transferProgress(qint64,qint64)));
+    connect(job, SIGNAL(finished(bool,QString)), this, SLOT(transferFinished(bool,QString)));
+
+    Transfer transfer;
+    transfer.item = new QTreeWidgetItem(m_transfersTW, QStringList() << QString("%1 -> %2").arg(srcPath, destPath));
+    transfer.progressBar = new QProgressBar();
+    m_transfersTW->setItemWidget(transfer.item, 1, transfer.progressBar);
+    QPushButton *cancelBtn = new QPushButton(tr("Cancel"));
+    connect(cancelBtn, SIGNAL(clicked()), job, SLOT(cancel()));
+    m_transfersTW->setItemWidget(transfer.item, 4, cancelBtn);
+    m_transfersTW->resizeColumnToContents(0);
+    transfer.timer.start();
+    m_transfers.insert(job, transfer);
+    m_transfersDock->show();
+
+    ui->statusBar->showMessage(QString("Saving %1 to %2").arg(srcPath, destPath), 10000);
+    startJob(job);
+}
+
+
+static QString formatDuration(qint64 seconds)
+{
+    if (seconds >= 3600)
+        return QString("%1:%2:%3").arg(seconds / 3600).arg((seconds / 60) % 60, 2, 10, QChar('0')).arg(seconds % 60, 2, 10, QChar('0'));
+    return QString("%1:%2").arg(seconds / 60).arg(seconds % 60, 2, 10, QChar('0'));
+}
+
+
+void MainWindow::transferProgress(qint64 done, qint64 total)
+{
+    Job *job = qobject_cast<Job*>(sender());
+    if (!m_transfers.contains(job))
+        return;
+
+    Transfer &transfer = m_transfers[job];
+
+    // Progress bars only take ints, so work in per-mille
+    transfer.progressBar->setRange(0, 1000);
+    transfer.progressBar->setValue(total > 0 ? (done * 1000) / total : 1000);
+
+    const qint64 elapsedMs = transfer.timer.elapsed();
+    if (elapsedMs > 0 && done > 0)
+    {
+        const double bytesPerSecond = done * 1000.0 / elapsedMs;
+        transfer.item->setText(2, QString("%1 MB/s").arg(bytesPerSecond / (1024 * 1024), 0, 'f', 1));
+        transfer.item->setText(3, formatDuration((total - done) / bytesPerSecond));
+    }
+}
+
+
+void MainWindow::transferFinished(bool okay, const QString &message)
+{
+    ExtractJob *job = qobject_cast<ExtractJob*>(sender());
+    m_jobs.removeAll(job);
+    job->deleteLater();
+    if (!m_transfers.contains(job))
+        return;
+
+    const Transfer transfer = m_transfers.take(job);
+    m_transfersTW->removeItemWidget(transfer.item, 4);
+    transfer.item->setText(3, okay ? tr("Done") : message);
+
+    if (!okay && !job->isCancelled())
     {
         ui->statusBar->showMessage("Error copying the file", 10000);
-        QMessageBox::critical(this, "Error copying", QString("Error copying from:\n  %1\nto:\n  %2").arg(videoFile,savePath));
+        QMessageBox::critical(this, "Error copying", QString("Error copying from:\n  %1\nto:\n  %2\n\n%3").arg(job->srcPath(), job->destPath(), message));
     }
-    else
+    else if (okay)
         ui->statusBar->showMessage("File copied okay", 10000);
-
-    // Now remux the stream with ffmpeg?
-    //ffmpeg -i oldfile.mpg -vcodec copy -acodec copy newfile.mpg
 }
 
 void MainWindow::on_actionExit_triggered()
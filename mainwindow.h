@@ -17,18 +17,26 @@
 #ifndef MAINWINDOW_H
 #define MAINWINDOW_H
 
+#include <QElapsedTimer>
 #include <QMainWindow>
+#include <QMap>
 #include <QModelIndex>
-#include <QtSql>
-#include <QTemporaryFile>
 
 #include "filesystem.h"
+#include "jobs.h"
+#include "models.h"
+#include "planner.h"
 #include <deque>
 
 namespace Ui {
 class MainWindow;
 }
 
+class QDockWidget;
+class QProgressBar;
+class QTreeWidget;
+class QTreeWidgetItem;
+
 class MainWindow : public QMainWindow
 {
     Q_OBJECT
@@ -54,21 +62,50 @@ private slots:
 
     void on_recordingsTW_doubleClicked(const QModelIndex &index);
 
+    void imageOpened(bool okay, const QString &message);
+
+    void directoryListed(bool okay, const QString &message);
+
+    void transferProgress(qint64 done, qint64 total);
+
+    void transferFinished(bool okay, const QString &message);
+
+protected:
+    void closeEvent(QCloseEvent *event);
+
 private:
     Ui::MainWindow *ui;
-    fs::FileSystem *diskImage;
+    FileSystemPtr diskImage;
 
-    QSqlDatabase db;
-    QTemporaryFile pcatfile;
+    DirectoryModel *m_directoryModel;    ///< The entries shown in tableWidget
+    RecordingsModel *m_recordingsModel;  ///< The planner's recordings, shown in recordingsTW
 
     typedef std::deque<fs::DirEntry> DirStack;
     DirStack m_dirStack;
 
+    /// An extraction running in the background, shown in the transfers list
+    struct Transfer
+    {
+        QTreeWidgetItem *item;
+        QProgressBar *progressBar;
+        QElapsedTimer timer;
+    };
+    QMap<Job*, Transfer> m_transfers;
+    QTreeWidget *m_transfersTW;
+    QDockWidget *m_transfersDock;
+
+    /// Jobs that haven't finished yet, so they can be cancelled on exit
+    QList<Job*> m_jobs;
+
     QString currentPath() const;
     void showDirectory(size_t startCluster = (size_t)-1);
-    void openSkyDB();
+    void showEntries(const fs::DirEntries &entries);
+    void showRecordings(const fs::Recordings &recordings, const fs::ResolvedRecordings &resolved);
     void closeImage();
 
+    void startJob(Job *job);
+    void cancelJobs();
+    void startTransfer(const QString &srcPath, const QString &destPath, bool remux = false);
 };
 
 #endif // MAINWINDOW_H
@@ -0,0 +1,313 @@
+/* This file is part of XTVFS Reader.
+ * Copyright (C) 2014 S. Blackburn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * XTVFS Reader is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with XTVFS Reader.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "models.h"
+
+#include <QColor>
+#include <QDateTime>
+
+#include <algorithm>
+
+using namespace fs;
+
+/// Rows handed to the view at a time by fetchMore()
+static const int fetchBatchSize = 1000;
+
+
+// ===========================================================================
+// ==             D I R E C T O R Y   M O D E L   C L A S S                 ==
+// ===========================================================================
+
+DirectoryModel::DirectoryModel(QObject *parent) :
+    QAbstractTableModel(parent),
+    m_fetched(0)
+{
+}
+
+
+void DirectoryModel::setEntries(const DirEntries &entries)
+{
+    beginResetModel();
+    m_entries = entries;
+    m_fetched = std::min((int)m_entries.size(), fetchBatchSize);
+    endResetModel();
+}
+
+
+void DirectoryModel::clear()
+{
+    setEntries(DirEntries());
+}
+
+
+int DirectoryModel::rowCount(const QModelIndex &parent) const
+{
+    return parent.isValid() ? 0 : m_fetched;
+}
+
+
+int DirectoryModel::columnCount(const QModelIndex &parent) const
+{
+    return parent.isValid() ? 0 : ColumnCount;
+}
+
+
+QVariant DirectoryModel::data(const QModelIndex &index, int role) const
+{
+    if (!index.isValid() || index.row() >= m_fetched)
+        return QVariant();
+
+    const DirEntry &entry = m_entries[index.row()];
+
+    if (role == Qt::DisplayRole)
+    {
+        switch (index.column())
+        {
+        case NameColumn:
+            return QString::fromStdString(entry.toString());
+        case AttributesColumn:
+            return QString::fromStdString(entry.attribToString());
+        case SizeColumn:
+            return QString::number(entry.filesize);
+        }
+    }
+    else if (role == Qt::TextAlignmentRole && index.column() == SizeColumn)
+        return int(Qt::AlignRight | Qt::AlignVCenter);
+
+    return QVariant();
+}
+
+
+QVariant DirectoryModel::headerData(int section, Qt::Orientation orientation, int role) const
+{
+    if (role != Qt::DisplayRole || orientation != Qt::Horizontal)
+        return QAbstractTableModel::headerData(section, orientation, role);
+
+    switch (section)
+    {
+    case NameColumn:       return tr("Filename");
+    case AttributesColumn: return tr("Attributes");
+    case SizeColumn:       return tr("Size");
+    }
+    return QVariant();
+}
+
+
+bool DirectoryModel::canFetchMore(const QModelIndex &parent) const
+{
+    return !parent.isValid() && m_fetched < (int)m_entries.size();
+}
+
+
+void DirectoryModel::fetchMore(const QModelIndex &parent)
+{
+    if (parent.isValid())
+        return;
+
+    const int more = std::min((int)m_entries.size() - m_fetched, fetchBatchSize);
+    if (more <= 0)
+        return;
+
+    beginInsertRows(QModelIndex(), m_fetched, m_fetched + more - 1);
+    m_fetched += more;
+    endInsertRows();
+}
+
+
+
+// ===========================================================================
+// ==            R E C O R D I N G S   M O D E L   C L A S S                ==
+// ===========================================================================
+
+RecordingsModel::RecordingsModel(QObject *parent) :
+    QAbstractTableModel(parent)
+{
+}
+
+
+void RecordingsModel::setRecordings(const Recordings &recordings, const ResolvedRecordings &resolved)
+{
+    beginResetModel();
+    m_recordings = recordings;
+    m_resolved = resolved;
+    m_resolved.resize(m_recordings.size());
+    m_order.resize(m_recordings.size());
+    for (size_t i=0; i<m_order.size(); ++i)
+        m_order[i] = i;
+    endResetModel();
+}
+
+
+void RecordingsModel::clear()
+{
+    setRecordings(Recordings());
+}
+
+
+/// How a recording's video looks, for showing and sorting on
+enum VideoStatus { VideoOkay, VideoDamaged, VideoMissing };
+
+static VideoStatus videoStatus(const ResolvedRecording &resolved)
+{
+    if (!resolved.found)
+        return VideoMissing;
+    return resolved.chainValid ? VideoOkay : VideoDamaged;
+}
+
+
+QString RecordingsModel::displayText(int row, int column) const
+{
+    const Recording &r = recording(row);
+    const ResolvedRecording &resolved = m_resolved[m_order[row]];
+
+    switch (column)
+    {
+    case TimeColumn:
+        return QDateTime::fromTime_t(r.startTime).toString("yyyy-MM-dd hh:mm");
+    case DurationColumn:
+        return QString::number(r.duration/60000)+" mins";
+    case NameColumn:
+        return QString::fromStdString(r.name);
+    case ChannelColumn:
+        return QString::fromStdString(r.channel);
+    case SizeColumn:
+        return resolved.found ? QString("%1 MB").arg(resolved.entry.filesize / (1024 * 1024)) : QString();
+    case StatusColumn:
+        if (resolved.path.empty())
+            return QString(); // Not looked for
+        switch (videoStatus(resolved))
+        {
+        case VideoOkay:    return tr("OK");
+        case VideoDamaged: return tr("Damaged");
+        case VideoMissing: return tr("Missing");
+        }
+        break;
+    case SynopsisColumn:
+        return QString::fromStdString(r.synopsis);
+    }
+    return QString();
+}
+
+
+int RecordingsModel::rowCount(const QModelIndex &parent) const
+{
+    return parent.isValid() ? 0 : m_order.size();
+}
+
+
+int RecordingsModel::columnCount(const QModelIndex &parent) const
+{
+    return parent.isValid() ? 0 : ColumnCount;
+}
+
+
+QVariant RecordingsModel::data(const QModelIndex &index, int role) const
+{
+    if (!index.isValid() || index.row() >= (int)m_order.size())
+        return QVariant();
+
+    if (role == Qt::DisplayRole)
+        return displayText(index.row(), index.column());
+    else if (role == Qt::UserRole)
+        return recording(index.row()).eventId;
+    else if (role == Qt::TextAlignmentRole && index.column() == SizeColumn)
+        return int(Qt::AlignRight | Qt::AlignVCenter);
+    else if (role == Qt::ForegroundRole && index.column() == StatusColumn)
+    {
+        const ResolvedRecording &resolved = m_resolved[m_order[index.row()]];
+        if (!resolved.path.empty() && videoStatus(resolved) != VideoOkay)
+            return QColor(Qt::red);
+    }
+
+    return QVariant();
+}
+
+
+QVariant RecordingsModel::headerData(int section, Qt::Orientation orientation, int role) const
+{
+    if (role != Qt::DisplayRole || orientation != Qt::Horizontal)
+        return QAbstractTableModel::headerData(section, orientation, role);
+
+    switch (section)
+    {
+    case TimeColumn:     return tr("Time");
+    case DurationColumn: return tr("Duration");
+    case NameColumn:     return tr("Name");
+    case ChannelColumn:  return tr("Channel");
+    case SizeColumn:     return tr("Size");
+    case StatusColumn:   return tr("Status");
+    case SynopsisColumn: return tr("Synopsis");
+    }
+    return QVariant();
+}
+
+
+/// Orders indexes into the recordings by one column
+class RecordingLess
+{
+public:
+    RecordingLess(const Recordings &recordings, const ResolvedRecordings &resolved, int column) :
+        m_recordings(recordings), m_resolved(resolved), m_column(column) {}
+
+    bool operator()(int a, int b) const
+    {
+        const Recording &ra = m_recordings[a];
+        const Recording &rb = m_recordings[b];
+        switch (m_column)
+        {
+        case RecordingsModel::TimeColumn:     return ra.startTime < rb.startTime;
+        case RecordingsModel::DurationColumn: return ra.duration < rb.duration;
+        case RecordingsModel::NameColumn:     return ra.name < rb.name;
+        case RecordingsModel::ChannelColumn:  return ra.channel < rb.channel;
+        case RecordingsModel::SizeColumn:     return m_resolved[a].entry.filesize < m_resolved[b].entry.filesize;
+        case RecordingsModel::StatusColumn:   return videoStatus(m_resolved[a]) < videoStatus(m_resolved[b]);
+        case RecordingsModel::SynopsisColumn: return ra.synopsis < rb.synopsis;
+        }
+        return a < b;
+    }
+
+private:
+    const Recordings &m_recordings;
+    const ResolvedRecordings &m_resolved;
+    int m_column;
+};
+
+
+void RecordingsModel::sort(int column, Qt::SortOrder order)
+{
+    emit layoutAboutToBeChanged();
+
+    // Remember which recording each persistent index (e.g. the selection) points at
+    const QModelIndexList before = persistentIndexList();
+    std::vector<int> recordingFor(before.size());
+    for (int i=0; i<before.size(); ++i)
+        recordingFor[i] = m_order[before[i].row()];
+
+    // Sort on the underlying values, so times and durations sort as numbers rather than text
+    std::stable_sort(m_order.begin(), m_order.end(), RecordingLess(m_recordings, m_resolved, column));
+    if (order == Qt::DescendingOrder)
+        std::reverse(m_order.begin(), m_order.end());
+
+    std::vector<int> rowFor(m_order.size());
+    for (size_t row=0; row<m_order.size(); ++row)
+        rowFor[m_order[row]] = row;
+    QModelIndexList after;
+    for (int i=0; i<before.size(); ++i)
+        after << index(rowFor[recordingFor[i]], before[i].column());
+    changePersistentIndexList(before, after);
+
+    emit layoutChanged();
+}
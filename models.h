@@ -0,0 +1,98 @@
+/* This file is part of XTVFS Reader.
+ * Copyright (C) 2014 S. Blackburn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * XTVFS Reader is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with XTVFS Reader.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef MODELS_H
+#define MODELS_H
+
+#include <QAbstractTableModel>
+
+#include "filesystem.h"
+#include "planner.h"
+
+#include <vector>
+
+
+/**
+ * The entries of one directory, for a QTableView.
+ * Cells are formatted as they're drawn, and rows are handed to the view a
+ * batch at a time through fetchMore(), so huge directories show straight away.
+ */
+class DirectoryModel : public QAbstractTableModel
+{
+    Q_OBJECT
+
+public:
+    enum Column { NameColumn, AttributesColumn, SizeColumn, ColumnCount };
+
+    explicit DirectoryModel(QObject *parent = 0);
+
+    /// Replace the listing
+    void setEntries(const fs::DirEntries &entries);
+    void clear();
+
+    const fs::DirEntries &entries() const { return m_entries; }
+    const fs::DirEntry &entry(int row) const { return m_entries[row]; }
+
+    int rowCount(const QModelIndex &parent = QModelIndex()) const;
+    int columnCount(const QModelIndex &parent = QModelIndex()) const;
+    QVariant data(const QModelIndex &index, int role = Qt::DisplayRole) const;
+    QVariant headerData(int section, Qt::Orientation orientation, int role = Qt::DisplayRole) const;
+
+    bool canFetchMore(const QModelIndex &parent) const;
+    void fetchMore(const QModelIndex &parent);
+
+private:
+    fs::DirEntries m_entries;
+    int m_fetched;      ///< How many of m_entries the view has been told about
+};
+
+
+/**
+ * The planner's recordings, for a QTableView, along with the state of their videos.
+ * Sorting only reorders an index into the recordings, which are left as they are.
+ */
+class RecordingsModel : public QAbstractTableModel
+{
+    Q_OBJECT
+
+public:
+    enum Column { TimeColumn, DurationColumn, NameColumn, ChannelColumn, SizeColumn, StatusColumn, SynopsisColumn, ColumnCount };
+
+    explicit RecordingsModel(QObject *parent = 0);
+
+    /// Replace the recordings. resolved has one entry per recording, or is empty if they haven't been looked for.
+    void setRecordings(const fs::Recordings &recordings, const fs::ResolvedRecordings &resolved = fs::ResolvedRecordings());
+    void clear();
+
+    /// The recording shown in a row
+    const fs::Recording &recording(int row) const { return m_recordings[m_order[row]]; }
+
+    /// The text of one cell, e.g. for exporting
+    QString displayText(int row, int column) const;
+
+    int rowCount(const QModelIndex &parent = QModelIndex()) const;
+    int columnCount(const QModelIndex &parent = QModelIndex()) const;
+    QVariant data(const QModelIndex &index, int role = Qt::DisplayRole) const;
+    QVariant headerData(int section, Qt::Orientation orientation, int role = Qt::DisplayRole) const;
+    void sort(int column, Qt::SortOrder order = Qt::AscendingOrder);
+
+private:
+    fs::Recordings m_recordings;
+    fs::ResolvedRecordings m_resolved;
+    std::vector<int> m_order;   ///< Row to index into m_recordings
+};
+
+#endif // MODELS_H
@@ -0,0 +1,125 @@
+/* This file is part of XTVFS Reader.
+ * Copyright (C) 2014 S. Blackburn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * XTVFS Reader is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with XTVFS Reader.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "pathcache.h"
+
+using namespace std;
+using namespace fs;
+
+
+PathCache::PathCache(FileSystem *fileSystem) :
+    m_fs(fileSystem)
+{
+}
+
+
+DirEntry PathCache::rootEntry()
+{
+    DirEntry root;
+    root.filename = "/";
+    root.attrib = 1 << 4;
+    root.firstCluster = (size_t)-1;
+    root.filesize = 0;
+    return root;
+}
+
+
+ListingPtr PathCache::listing(const string &path)
+{
+    {
+        lock_guard<mutex> lock(m_mutex);
+        map<string, ListingPtr>::const_iterator i = m_listings.find(path);
+        if (i != m_listings.end())
+            return i->second;
+    }
+
+    DirEntry dir;
+    if (!lookup(path, dir) || !dir.isDirectory())
+        return ListingPtr();
+
+    // Only keep what should be visible: no volume labels, and the daemons supply . and .. themselves
+    const DirEntries all = m_fs->readDirectory(dir.firstCluster);
+    std::shared_ptr<DirEntries> entries(new DirEntries);
+    for (size_t i=0; i<all.size(); ++i)
+    {
+        const DirEntry &d = all[i];
+        if (d.isVolumeId() || d.filename[0] == '.')
+            continue;
+        entries->push_back(d);
+    }
+
+    lock_guard<mutex> lock(m_mutex);
+    ListingPtr &cached = m_listings[path];
+    if (!cached)
+        cached = entries;
+    return cached;
+}
+
+
+bool PathCache::lookup(const string &path, DirEntry &entry)
+{
+    if (path == "/")
+    {
+        entry = rootEntry();
+        return true;
+    }
+
+    const size_t slash = path.find_last_of('/');
+    const string parent = (slash == 0) ? string("/") : path.substr(0, slash);
+    const string name = path.substr(slash + 1);
+
+    const ListingPtr entries = listing(parent);
+    if (!entries)
+        return false;
+
+    for (size_t i=0; i<entries->size(); ++i)
+    {
+        if ((*entries)[i].toString() == name)
+        {
+            entry = (*entries)[i];
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+OpenFilePtr PathCache::openFile(const string &path)
+{
+    {
+        lock_guard<mutex> lock(m_mutex);
+        map<string, OpenFilePtr>::const_iterator i = m_files.find(path);
+        if (i != m_files.end())
+            return i->second;
+    }
+
+    DirEntry entry;
+    if (!lookup(path, entry) || entry.isDirectory())
+        return OpenFilePtr();
+
+    OpenFilePtr file(new OpenFile);
+    file->entry = entry;
+    file->extents = m_fs->extentsFor(entry);
+    file->clusterSize = m_fs->clusterSizeFor(entry);
+    file->nextOffset = 0;
+
+    lock_guard<mutex> lock(m_mutex);
+    OpenFilePtr &cached = m_files[path];
+    if (!cached)
+        cached = file;
+    return cached;
+}
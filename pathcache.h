@@ -0,0 +1,79 @@
+/* This file is part of XTVFS Reader.
+ * Copyright (C) 2014 S. Blackburn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * XTVFS Reader is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with XTVFS Reader.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef XTVFS_PATHCACHE_H
+#define XTVFS_PATHCACHE_H
+
+#include "filesystem.h"
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+namespace fs
+{
+
+
+/// A file that has been opened at least once. Its extents are kept so reads never go near the FAT.
+struct OpenFile
+{
+    DirEntry entry;
+    Extents extents;
+    size_t clusterSize;
+
+    std::mutex mutex;
+    unsigned long long nextOffset;  ///< Where a sequential reader would read next
+};
+
+typedef std::shared_ptr<OpenFile> OpenFilePtr;
+
+typedef std::shared_ptr<const DirEntries> ListingPtr;
+
+
+/**
+ * Directory listings and open files, found by path, e.g. "/s9/stream.str",
+ * and kept so each directory is read and each chain followed only once.
+ * For the FUSE and HTTP daemons, whose threads all look up paths at once.
+ */
+class PathCache
+{
+public:
+    explicit PathCache(FileSystem *fileSystem);
+
+    /// The root directory doesn't have an entry of its own, so make one up
+    static DirEntry rootEntry();
+
+    /// Find the entry for a path, e.g. "/s9/stream.str"
+    bool lookup(const std::string &path, DirEntry &entry);
+
+    /// The directory's entries, as they are shown to the user: no volume labels, . or ..
+    ListingPtr listing(const std::string &path);
+
+    /// The file with its extents. Empty if there's no such file.
+    OpenFilePtr openFile(const std::string &path);
+
+private:
+    FileSystem *m_fs;
+
+    std::mutex m_mutex;
+    std::map<std::string, ListingPtr> m_listings;  ///< Keyed by directory path
+    std::map<std::string, OpenFilePtr> m_files;    ///< Keyed by file path
+};
+
+} // end of namespace fs
+
+#endif // XTVFS_PATHCACHE_H
@@ -0,0 +1,842 @@
+/* This file is part of XTVFS Reader.
+ * Copyright (C) 2014 S. Blackburn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * XTVFS Reader is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with XTVFS Reader.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "planner.h"
+#include "filesystem.h"
+#include "log.h"
+
+#include <algorithm>
+#include <cstring>
+#include <list>
+#include <map>
+#include <mutex>
+#include <sstream>
+
+#include <sqlite3.h>
+
+using namespace std;
+using namespace fs;
+
+
+string Recording::streamPath() const
+{
+    // The locator is a list of fields separated by ':', the stream directory is the last
+    const size_t colon = shrecLocator.find_last_of(':');
+    const string stream = (colon == string::npos) ? shrecLocator : shrecLocator.substr(colon + 1);
+
+    return stream + "/STREAM.STR";
+}
+
+
+/// The value of a hex digit, or -1
+static inline int hexDigit(unsigned char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+
+/// Parse up to two hex digits, stopping at the first that isn't one, as strtol() would
+static inline int hexByte(const unsigned char *p, size_t available)
+{
+    const int high = available > 0 ? hexDigit(p[0]) : -1;
+    if (high < 0)
+        return 0;
+    const int low = available > 1 ? hexDigit(p[1]) : -1;
+    return (low < 0) ? high : (high << 4) | low;
+}
+
+
+static inline bool isPrintable(int c)
+{
+    return c >= 0x20 && c < 0x7f;
+}
+
+
+size_t fs::decodePlannerString(const unsigned char *data, size_t length, char *out)
+{
+    static const unsigned char marker[] = { 0x13, 0xff, 0x1a, 0x19 };
+    char *o = out;
+
+    if (length >= 6 && memcmp(data + 2, marker, sizeof(marker)) == 0)
+    {
+        // Raw bytes: the text is the last len bytes
+        const size_t len = data[0];
+        for (size_t i = (len < length) ? length - len : 0; i < length; ++i)
+            if (isPrintable(data[i]))
+                *o++ = data[i];
+    }
+    else
+    {
+        // Hex encoded: the text is the last len pairs of digits
+        // If there aren't enough digits, the pairs are still counted back from the end
+        const size_t len = hexByte(data, length);
+        for (size_t i = (2*len <= length) ? length - 2*len : length % 2; i < length; i += 2)
+        {
+            const int c = hexByte(data + i, length - i);
+            if (isPrintable(c))
+                *o++ = c;
+        }
+    }
+
+    return o - out;
+}
+
+
+string fs::plannerString(const std::string &hex)
+{
+    string output(hex.size(), '\0');
+    output.resize(decodePlannerString((const unsigned char*)hex.data(), hex.size(), &output[0]));
+    return output;
+}
+
+
+
+
+
+namespace
+{
+
+/// The entries of a directory, sorted by their 11-char names to look them up quickly
+class DirectoryIndex
+{
+  public:
+    void read(FileSystem &image, size_t cluster = (size_t)-1)
+    {
+        if (!image.scanDirectory(m_listing, cluster))
+            XTVFS_ERROR("Only part of a directory could be read, so recordings in the rest of it won't be found");
+        m_byName.resize(m_listing.entries.size());
+        for (size_t i=0; i<m_byName.size(); ++i)
+            m_byName[i] = i;
+        std::sort(m_byName.begin(), m_byName.end(), ByName(m_listing));
+    }
+
+    /// The entry with an 11-char name, NULL if there isn't one
+    const PackedDirEntry *find(const std::string &eleven) const
+    {
+        const std::vector<unsigned int>::const_iterator i =
+                std::lower_bound(m_byName.begin(), m_byName.end(), eleven.c_str(), ByName(m_listing));
+        if (i == m_byName.end() || !m_listing.entries[*i].hasFilename(eleven.c_str()))
+            return NULL;
+        return &m_listing.entries[*i];
+    }
+
+    DirEntry toDirEntry(const PackedDirEntry &entry) const { return m_listing.toDirEntry(entry); }
+
+  private:
+    class ByName
+    {
+      public:
+        explicit ByName(const DirListing &listing) : m_entries(listing.entries) {}
+        bool operator()(unsigned int a, unsigned int b) const { return memcmp(m_entries[a].filename, m_entries[b].filename, 11) < 0; }
+        bool operator()(unsigned int a, const char *b) const { return memcmp(m_entries[a].filename, b, 11) < 0; }
+
+      private:
+        const std::vector<PackedDirEntry> &m_entries;
+    };
+
+    DirListing m_listing;
+    std::vector<unsigned int> m_byName;
+};
+
+} // end of anonymous namespace
+
+
+ResolvedRecordings fs::resolveRecordings(FileSystem &image, const Recordings &recordings)
+{
+    ResolvedRecordings result(recordings.size());
+
+    // Without the tables in memory every chain is followed a sector at a time, which still works
+    if (!image.cacheAllocationTables())
+        XTVFS_INFO("Following chains on the disk, as the allocation tables couldn't be read into memory");
+
+    DirectoryIndex root;
+    root.read(image);
+
+    // Recordings can share a stream directory, so keep each one once it has been read
+    std::map<std::string, DirectoryIndex> streams;
+
+    for (size_t i=0; i<recordings.size(); ++i)
+    {
+        ResolvedRecording &r = result[i];
+        r.path = recordings[i].streamPath();
+
+        const size_t slash = r.path.find('/');
+        const string dirName = to11CharFormat(r.path.substr(0, slash));
+        const string fileName = to11CharFormat(r.path.substr(slash + 1));
+
+        const PackedDirEntry *dir = root.find(dirName);
+        if (!dir || !dir->isDirectory())
+            continue;
+
+        std::map<std::string, DirectoryIndex>::iterator stream = streams.find(dirName);
+        if (stream == streams.end())
+        {
+            stream = streams.insert(std::make_pair(dirName, DirectoryIndex())).first;
+            stream->second.read(image, dir->firstCluster);
+        }
+
+        const PackedDirEntry *file = stream->second.find(fileName);
+        if (!file || file->isDirectory())
+            continue;
+
+        r.found = true;
+        r.entry = stream->second.toDirEntry(*file);
+        r.extents = image.extentsFor(r.entry);
+        r.chainValid = image.verifyChain(r.entry);
+    }
+
+    return result;
+}
+
+
+// ===========================================================================
+// ==                      I M A G E   V F S                                ==
+// ===========================================================================
+//
+// A read-only SQLite VFS whose files are read through a FileSystem's extents,
+// so the planner can be queried where it lies on the image.
+// Anything other than opening, reading and locking is passed to the default VFS.
+
+/// SQLite's reads are small, so they're served from blocks of this size
+static const size_t vfsBlockSize = 64 * 1024;
+
+/// Blocks kept per open database, 16MB worth
+static const size_t vfsCacheBlocks = 256;
+
+static const char *imageVfsName = "xtvfs-image";
+
+
+namespace
+{
+
+/// A file on an image that is about to be opened by SQLite
+class ImageFileSource
+{
+  public:
+    FileSystem *image;
+    DirEntry entry;
+    Extents extents;
+};
+
+/// Files waiting to be opened, by the name given to SQLite
+std::mutex sourcesMutex;
+std::map<std::string, ImageFileSource> sources;
+
+
+/// A database file open on an image, with a cache of recently read blocks
+class ImageFile
+{
+  public:
+    ImageFile(const ImageFileSource &source) :
+        m_source(source)
+    {
+    }
+
+    unsigned long long size() const { return m_source.entry.filesize; }
+
+    /// Read part of the file, returning the number of bytes read
+    size_t read(unsigned long long offset, char *buffer, size_t length)
+    {
+        size_t done = 0;
+        while (done < length && offset + done < size())
+        {
+            const unsigned long long blockOffset = (offset + done) - (offset + done) % vfsBlockSize;
+            const Block &block = blockAt(blockOffset);
+
+            const size_t within = (offset + done) - blockOffset;
+            if (within >= block.size())
+                break; // The chain is shorter than the file size
+            const size_t n = std::min(length - done, block.size() - within);
+            memcpy(buffer + done, &block[within], n);
+            done += n;
+        }
+        return done;
+    }
+
+  private:
+    typedef std::vector<char> Block;
+
+    /// Find a block in the cache, reading it from the image if it isn't there
+    const Block &blockAt(unsigned long long blockOffset)
+    {
+        std::map<unsigned long long, Block>::iterator cached = m_blocks.find(blockOffset);
+        if (cached != m_blocks.end())
+        {
+            m_lru.remove(blockOffset);
+            m_lru.push_front(blockOffset);
+            return cached->second;
+        }
+
+        if (m_blocks.size() >= vfsCacheBlocks)
+        {
+            m_blocks.erase(m_lru.back());
+            m_lru.pop_back();
+        }
+
+        Block &block = m_blocks[blockOffset];
+        block.resize(vfsBlockSize);
+        block.resize(m_source.image->readFile(m_source.entry, m_source.extents, blockOffset, &block[0], vfsBlockSize));
+        m_lru.push_front(blockOffset);
+
+        return block;
+    }
+
+    ImageFileSource m_source;
+    std::map<unsigned long long, Block> m_blocks;
+    std::list<unsigned long long> m_lru;    ///< Block offsets, most recently used first
+};
+
+
+/// What SQLite allocates for each open file
+struct VfsFile
+{
+    sqlite3_file base;
+    ImageFile *file;
+};
+
+
+int vfsClose(sqlite3_file *f)
+{
+    VfsFile *p = reinterpret_cast<VfsFile*>(f);
+    delete p->file;
+    p->file = NULL;
+    return SQLITE_OK;
+}
+
+int vfsRead(sqlite3_file *f, void *buffer, int amount, sqlite3_int64 offset)
+{
+    VfsFile *p = reinterpret_cast<VfsFile*>(f);
+    const size_t got = p->file->read(offset, static_cast<char*>(buffer), amount);
+    if (got < (size_t)amount)
+    {
+        // SQLite requires the rest of the buffer to be zeroed on a short read
+        memset(static_cast<char*>(buffer) + got, 0, amount - got);
+        return SQLITE_IOERR_SHORT_READ;
+    }
+    return SQLITE_OK;
+}
+
+int vfsWrite(sqlite3_file *, const void *, int, sqlite3_int64)
+{
+    return SQLITE_READONLY;
+}
+
+int vfsTruncate(sqlite3_file *, sqlite3_int64)
+{
+    return SQLITE_READONLY;
+}
+
+int vfsSync(sqlite3_file *, int)
+{
+    return SQLITE_OK;
+}
+
+int vfsFileSize(sqlite3_file *f, sqlite3_int64 *size)
+{
+    *size = reinterpret_cast<VfsFile*>(f)->file->size();
+    return SQLITE_OK;
+}
+
+int vfsLock(sqlite3_file *, int)
+{
+    // Nothing else can be writing to the image through us
+    return SQLITE_OK;
+}
+
+int vfsCheckReservedLock(sqlite3_file *, int *reserved)
+{
+    *reserved = 0;
+    return SQLITE_OK;
+}
+
+int vfsFileControl(sqlite3_file *, int, void *)
+{
+    return SQLITE_NOTFOUND;
+}
+
+int vfsSectorSize(sqlite3_file *)
+{
+    return 512;
+}
+
+int vfsDeviceCharacteristics(sqlite3_file *)
+{
+    return SQLITE_IOCAP_IMMUTABLE;
+}
+
+const sqlite3_io_methods vfsIoMethods =
+{
+    1,                          // iVersion
+    vfsClose,
+    vfsRead,
+    vfsWrite,
+    vfsTruncate,
+    vfsSync,
+    vfsFileSize,
+    vfsLock,
+    vfsLock,                    // xUnlock
+    vfsCheckReservedLock,
+    vfsFileControl,
+    vfsSectorSize,
+    vfsDeviceCharacteristics,
+    NULL, NULL, NULL, NULL,     // No shared memory, so no WAL
+    NULL, NULL                  // No memory mapping
+};
+
+
+int vfsOpen(sqlite3_vfs *, const char *name, sqlite3_file *f, int flags, int *outFlags)
+{
+    VfsFile *p = reinterpret_cast<VfsFile*>(f);
+    p->base.pMethods = NULL;
+    p->file = NULL;
+
+    // Only the main database can be opened, and never for writing
+    if (!name || !(flags & SQLITE_OPEN_MAIN_DB) || (flags & SQLITE_OPEN_READWRITE))
+        return SQLITE_CANTOPEN;
+
+    std::lock_guard<std::mutex> lock(sourcesMutex);
+    std::map<std::string, ImageFileSource>::const_iterator source = sources.find(name);
+    if (source == sources.end())
+        return SQLITE_CANTOPEN;
+
+    p->file = new ImageFile(source->second);
+    p->base.pMethods = &vfsIoMethods;
+    if (outFlags)
+        *outFlags = SQLITE_OPEN_READONLY;
+    return SQLITE_OK;
+}
+
+int vfsDelete(sqlite3_vfs *, const char *, int)
+{
+    return SQLITE_READONLY;
+}
+
+int vfsAccess(sqlite3_vfs *, const char *name, int flags, int *result)
+{
+    // Journals and WAL files never exist, and nothing is writable
+    std::lock_guard<std::mutex> lock(sourcesMutex);
+    *result = (flags == SQLITE_ACCESS_EXISTS && sources.count(name)) ? 1 : 0;
+    return SQLITE_OK;
+}
+
+int vfsFullPathname(sqlite3_vfs *, const char *name, int size, char *out)
+{
+    sqlite3_snprintf(size, out, "%s", name);
+    return SQLITE_OK;
+}
+
+sqlite3_vfs *defaultVfs()
+{
+    return sqlite3_vfs_find(NULL);
+}
+
+int vfsRandomness(sqlite3_vfs *, int n, char *out)
+{
+    return defaultVfs()->xRandomness(defaultVfs(), n, out);
+}
+
+int vfsSleep(sqlite3_vfs *, int microseconds)
+{
+    return defaultVfs()->xSleep(defaultVfs(), microseconds);
+}
+
+int vfsCurrentTime(sqlite3_vfs *, double *now)
+{
+    return defaultVfs()->xCurrentTime(defaultVfs(), now);
+}
+
+int vfsGetLastError(sqlite3_vfs *, int, char *)
+{
+    return 0;
+}
+
+
+/// Register the VFS with SQLite the first time it's needed
+bool registerImageVfs()
+{
+    static std::once_flag once;
+    static bool registered = false;
+    std::call_once(once, []()
+    {
+        static sqlite3_vfs vfs;
+        memset(&vfs, 0, sizeof(vfs));
+        vfs.iVersion = 1;
+        vfs.szOsFile = sizeof(VfsFile);
+        vfs.mxPathname = 512;
+        vfs.zName = imageVfsName;
+        vfs.xOpen = vfsOpen;
+        vfs.xDelete = vfsDelete;
+        vfs.xAccess = vfsAccess;
+        vfs.xFullPathname = vfsFullPathname;
+        vfs.xRandomness = vfsRandomness;
+        vfs.xSleep = vfsSleep;
+        vfs.xCurrentTime = vfsCurrentTime;
+        vfs.xGetLastError = vfsGetLastError;
+        registered = sqlite3_vfs_register(&vfs, 0) == SQLITE_OK;
+    });
+    return registered;
+}
+
+} // end of anonymous namespace
+
+
+
+// ===========================================================================
+// ==            R E C O R D I N G   T A B L E   C L A S S                  ==
+// ===========================================================================
+
+Recording RecordingTable::recording(size_t i) const
+{
+    const Row &row = m_rows[i];
+
+    Recording r;
+    r.eventId = row.eventId;
+    r.serviceType = row.serviceType;
+    r.name = text(row.name);
+    r.startTime = row.startTime;
+    r.duration = row.duration;
+    r.channel = text(row.channel);
+    r.shrecLocator = text(row.shrecLocator);
+    r.synopsis = text(row.synopsis);
+    r.avContentId = text(row.avContentId);
+    r.vfileLocator = text(row.vfileLocator);
+    return r;
+}
+
+
+Recordings RecordingTable::recordings() const
+{
+    Recordings result;
+    result.reserve(m_rows.size());
+    for (size_t i=0; i<m_rows.size(); ++i)
+        result.push_back(recording(i));
+    return result;
+}
+
+
+void RecordingTable::clear()
+{
+    m_rows.clear();
+    m_strings.clear();
+    m_byEvent.clear();
+}
+
+
+void RecordingTable::reserve(size_t rows, size_t stringBytes)
+{
+    m_rows.reserve(rows);
+    m_strings.reserve(stringBytes);
+}
+
+
+int RecordingTable::find(int eventId) const
+{
+    std::vector<std::pair<int, unsigned int> >::const_iterator i =
+            std::lower_bound(m_byEvent.begin(), m_byEvent.end(), std::make_pair(eventId, 0u));
+    return (i != m_byEvent.end() && i->first == eventId) ? (int)i->second : -1;
+}
+
+
+void RecordingTable::finish()
+{
+    m_byEvent.resize(m_rows.size());
+    for (size_t i=0; i<m_rows.size(); ++i)
+        m_byEvent[i] = std::make_pair(m_rows[i].eventId, (unsigned int)i);
+    std::sort(m_byEvent.begin(), m_byEvent.end());
+}
+
+
+RecordingTable::Row &RecordingTable::addRow()
+{
+    m_rows.push_back(Row());
+    return m_rows.back();
+}
+
+
+char *RecordingTable::beginString(size_t maxLength)
+{
+    m_stringStart = m_strings.size();
+    m_strings.resize(m_stringStart + maxLength);
+    return m_strings.data() + m_stringStart;
+}
+
+
+RecordingTable::StringRef RecordingTable::endString(size_t length)
+{
+    StringRef ref;
+    ref.offset = m_stringStart;
+    ref.length = length;
+    m_strings.resize(m_stringStart + length);
+    return ref;
+}
+
+
+
+// ===========================================================================
+// ==                    P L A N N E R   C L A S S                          ==
+// ===========================================================================
+
+Planner::Planner() :
+    m_db(NULL),
+    m_majorVersion(-1),
+    m_minorVersion(-1),
+    m_recordingsStmt(NULL),
+    m_tableRead(false)
+{
+}
+
+
+Planner::~Planner()
+{
+    close();
+}
+
+
+bool Planner::open(const std::string &dbPath)
+{
+    close();
+
+    if (sqlite3_open_v2(dbPath.c_str(), &m_db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK)
+    {
+        XTVFS_ERROR("Unable to open planner database " << dbPath << ": " << lastError());
+        close();
+        return false;
+    }
+
+    readVersion();
+    prepare();
+    return true;
+}
+
+
+bool Planner::open(FileSystem &image, const std::string &path)
+{
+    close();
+
+    if (!registerImageVfs())
+    {
+        XTVFS_ERROR("Unable to register the image VFS with SQLite");
+        return false;
+    }
+
+    ImageFileSource source;
+    source.image = &image;
+    source.entry = image.infoFor(path);
+    if (source.entry.filename.empty() || source.entry.isDirectory())
+    {
+        XTVFS_INFO("Planner database " << path << " not found");
+        return false;
+    }
+    source.extents = image.extentsFor(source.entry);
+
+    // Give the file a name that's unique to this open, for the VFS to find it by
+    std::ostringstream name;
+    name << "/" << imageVfsName << "/" << (void*)this << "/" << path;
+    {
+        std::lock_guard<std::mutex> lock(sourcesMutex);
+        sources[name.str()] = source;
+    }
+
+    // Immutable means SQLite won't look for journals or take locks
+    const string uri = "file:" + name.str() + "?immutable=1";
+    const int rc = sqlite3_open_v2(uri.c_str(), &m_db, SQLITE_OPEN_READONLY | SQLITE_OPEN_URI, imageVfsName);
+
+    // The VFS has taken what it needs, or failed
+    {
+        std::lock_guard<std::mutex> lock(sourcesMutex);
+        sources.erase(name.str());
+    }
+
+    if (rc != SQLITE_OK)
+    {
+        XTVFS_ERROR("Unable to open planner database " << path << " on the image: " << lastError());
+        close();
+        return false;
+    }
+
+    readVersion();
+    prepare();
+    return true;
+}
+
+
+void Planner::readVersion()
+{
+    sqlite3_stmt *stmt = NULL;
+    if (sqlite3_prepare_v2(m_db, "SELECT DB_SCHEMA_MAJOR_VERSION, DB_SCHEMA_MINOR_VERSION FROM DB_INFO", -1, &stmt, NULL) == SQLITE_OK
+        && sqlite3_step(stmt) == SQLITE_ROW)
+    {
+        m_majorVersion = sqlite3_column_int(stmt, 0);
+        m_minorVersion = sqlite3_column_int(stmt, 1);
+    }
+    sqlite3_finalize(stmt);
+}
+
+
+void Planner::prepare()
+{
+    // The planner's own tables have no indexes to join on, and can't be given any as the
+    // database is opened read-only. Copy the two small link tables into memory and index those.
+    const char *setup =
+        "PRAGMA temp_store=MEMORY;"
+        "CREATE TEMP TABLE booking AS SELECT event_id, av_content_id FROM main.booking_info;"
+        "CREATE INDEX temp.booking_event_id ON booking(event_id);"
+        "CREATE TEMP TABLE content AS SELECT av_content_id, shrec_locator, vfile_locator FROM main.av_content;"
+        "CREATE INDEX temp.content_av_content_id ON content(av_content_id);";
+    if (sqlite3_exec(m_db, setup, NULL, NULL, NULL) != SQLITE_OK)
+    {
+        XTVFS_ERROR("Unable to index the planner: " << lastError());
+        return;
+    }
+
+    const char *sql =
+        "SELECT item.event_id,service_type,event_name,local_start_time,duration,channel_name,shrec_locator,synopsis,content.av_content_id,vfile_locator "
+        "FROM main.item "
+        "JOIN temp.booking ON booking.event_id = item.event_id "
+        "JOIN temp.content ON content.av_content_id = booking.av_content_id "
+        "WHERE service_type != ?1 AND service_type != ?2";
+    if (sqlite3_prepare_v2(m_db, sql, -1, &m_recordingsStmt, NULL) != SQLITE_OK)
+    {
+        XTVFS_ERROR("Error preparing the planner query: " << lastError());
+        m_recordingsStmt = NULL;
+    }
+}
+
+
+void Planner::close()
+{
+    sqlite3_finalize(m_recordingsStmt);
+    m_recordingsStmt = NULL;
+    m_table.clear();
+    m_tableRead = false;
+
+    if (m_db)
+        sqlite3_close(m_db);
+    m_db = NULL;
+    m_majorVersion = m_minorVersion = -1;
+}
+
+
+string Planner::lastError() const
+{
+    return m_db ? sqlite3_errmsg(m_db) : "not open";
+}
+
+
+Recordings Planner::recordings()
+{
+    return recordingTable().recordings();
+}
+
+
+const RecordingTable &Planner::recordingTable()
+{
+    if (!m_tableRead)
+        m_tableRead = readRecordings(m_table);
+    return m_table;
+}
+
+
+bool Planner::recordingFor(int eventId, Recording &recording)
+{
+    const RecordingTable &table = recordingTable();
+    const int row = table.find(eventId);
+    if (row < 0)
+        return false;
+
+    recording = table.recording(row);
+    return true;
+}
+
+
+/// Decode a planner text column into the table
+static RecordingTable::StringRef decodeColumn(RecordingTable &table, sqlite3_stmt *stmt, int column)
+{
+    // Ask for the bytes as they're stored, so there's no conversion to text
+    const unsigned char *data = (const unsigned char*)sqlite3_column_blob(stmt, column);
+    const size_t length = sqlite3_column_bytes(stmt, column);
+
+    char *out = table.beginString(length);
+    return table.endString(data ? decodePlannerString(data, length, out) : 0);
+}
+
+
+/// Copy a column into the table as it is
+static RecordingTable::StringRef copyColumn(RecordingTable &table, sqlite3_stmt *stmt, int column)
+{
+    const unsigned char *text = sqlite3_column_text(stmt, column);
+    const size_t length = sqlite3_column_bytes(stmt, column);
+
+    char *out = table.beginString(length);
+    if (text)
+        memcpy(out, text, length);
+    return table.endString(text ? length : 0);
+}
+
+
+bool Planner::readRecordings(RecordingTable &table)
+{
+    table.clear();
+    if (!m_db)
+        return false;
+
+    sqlite3_stmt *stmt = m_recordingsStmt;
+    if (!stmt)
+    {
+        XTVFS_ERROR("Error querying the planner: " << lastError());
+        return false;
+    }
+
+    // service_type of 5 is pre-recorded on-demand; 25 is channel BDL (whatever that is); 0, 1, 16 are unknown
+    sqlite3_reset(stmt);
+    sqlite3_bind_int(stmt, 1, 5);
+    sqlite3_bind_int(stmt, 2, 25);
+
+    int result;
+    while ((result = sqlite3_step(stmt)) == SQLITE_ROW)
+    {
+        RecordingTable::Row &r = table.addRow();
+        r.eventId = sqlite3_column_int(stmt, 0);
+        r.serviceType = sqlite3_column_int(stmt, 1);
+        r.name = decodeColumn(table, stmt, 2);
+        r.startTime = sqlite3_column_int64(stmt, 3);
+        r.duration = sqlite3_column_int(stmt, 4);
+        r.channel = decodeColumn(table, stmt, 5);
+        r.shrecLocator = copyColumn(table, stmt, 6);
+        r.synopsis = decodeColumn(table, stmt, 7);
+        r.avContentId = copyColumn(table, stmt, 8);
+        r.vfileLocator = copyColumn(table, stmt, 9);
+    }
+
+    // A damaged database stops the rows early, which mustn't pass for the end of them
+    if (result != SQLITE_DONE)
+    {
+        XTVFS_ERROR("Error reading the planner's recordings: " << lastError());
+        sqlite3_reset(stmt);
+        table.clear();
+        return false;
+    }
+    sqlite3_reset(stmt);
+    table.finish();
+
+    return true;
+}
@@ -0,0 +1,220 @@
+/* This file is part of XTVFS Reader.
+ * Copyright (C) 2014 S. Blackburn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * XTVFS Reader is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with XTVFS Reader.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef XTVFS_PLANNER_H
+#define XTVFS_PLANNER_H
+
+#include "filesystem.h"
+
+#include <string>
+#include <vector>
+
+struct sqlite3;
+struct sqlite3_stmt;
+
+namespace fs
+{
+
+/// One recording from the Sky+ planner database (FSN_DATA/PCAT.DB)
+class Recording
+{
+  public:
+    int eventId;
+    int serviceType;
+    std::string name;
+    long long startTime;    ///< Local start time, seconds since 1970
+    int duration;           ///< Milliseconds
+    std::string channel;
+    std::string shrecLocator;
+    std::string synopsis;
+    std::string avContentId;
+    std::string vfileLocator;
+
+    /// The recording's video file, e.g. "s9/STREAM.STR", worked out from the shrec locator
+    std::string streamPath() const;
+};
+
+typedef std::vector<Recording> Recordings;
+
+
+/**
+ * The recordings as one flat table, with all their text in a single pool.
+ * Filling it costs a handful of allocations however many rows there are.
+ */
+class RecordingTable
+{
+  public:
+    /// Where a row's string lives in the pool
+    class StringRef
+    {
+      public:
+        unsigned int offset;
+        unsigned int length;
+    };
+
+    class Row
+    {
+      public:
+        int eventId;
+        int serviceType;
+        long long startTime;    ///< Local start time, seconds since 1970
+        int duration;           ///< Milliseconds
+        StringRef name;
+        StringRef channel;
+        StringRef shrecLocator;
+        StringRef synopsis;
+        StringRef avContentId;
+        StringRef vfileLocator;
+    };
+
+    RecordingTable() : m_stringStart(0) {}
+
+    size_t size() const { return m_rows.size(); }
+    bool empty() const { return m_rows.empty(); }
+    const Row &row(size_t i) const { return m_rows[i]; }
+
+    /// The text of one of a row's strings
+    std::string text(const StringRef &ref) const { return std::string(m_strings.data() + ref.offset, ref.length); }
+
+    /// One row as a Recording
+    Recording recording(size_t i) const;
+
+    /// The row for an event, or -1 if there isn't one
+    int find(int eventId) const;
+
+    /// All the rows as Recordings
+    Recordings recordings() const;
+
+    void clear();
+
+    // Used when filling the table
+    void reserve(size_t rows, size_t stringBytes);
+    Row &addRow();
+    /// Get room for up to maxLength characters at the end of the pool, to be finished with endString()
+    char *beginString(size_t maxLength);
+    StringRef endString(size_t length);
+    /// Call once all the rows have been added, to index them for find()
+    void finish();
+
+  private:
+    std::vector<Row> m_rows;
+    std::vector<char> m_strings;
+    std::vector<std::pair<int, unsigned int> > m_byEvent;   ///< (eventId, row), sorted
+    size_t m_stringStart;       ///< Where the string being added starts
+};
+
+
+/**
+ * Decode one of the planner's text columns straight into out, which must have room for length characters.
+ * Format is len(1 byte) + unknown(1 byte) + "13ff1a19"(4 bytes) + data(len bytes), either as raw
+ * bytes or hex encoded; the marker tells which. Only printable characters are kept.
+ * @return The number of characters written
+ */
+size_t decodePlannerString(const unsigned char *data, size_t length, char *out);
+
+/// Convert one of the planner's hex encoded text columns to plain text
+std::string plannerString(const std::string &hex);
+
+
+/// Where a recording's video is on the image, and whether it can be read
+class ResolvedRecording
+{
+  public:
+    ResolvedRecording() : found(false), chainValid(false) {}
+
+    std::string path;   ///< The video file, from Recording::streamPath()
+    bool found;         ///< Whether the video file exists
+    DirEntry entry;     ///< The video file's entry, with its true size
+    Extents extents;    ///< Where its clusters are
+    bool chainValid;    ///< Whether the chain's length matches the size, and it ends properly
+};
+
+typedef std::vector<ResolvedRecording> ResolvedRecordings;
+
+
+/**
+ * Find the video of every recording, one result per recording.
+ * The root and each stream directory are read only once, however many recordings there are,
+ * and the chains are followed through allocation tables read into memory. The tables are
+ * loaded with FileSystem::cacheAllocationTables(), so do this before sharing the image between threads.
+ */
+ResolvedRecordings resolveRecordings(FileSystem &image, const Recordings &recordings);
+
+
+/**
+ * Read-only access to the planner database, either a copy of it or in place
+ * on an image.
+ * The queries are prepared when the database is opened, and the recordings are
+ * read once then kept, so looking a recording up never goes back to SQLite.
+ */
+class Planner
+{
+public:
+    Planner();
+    ~Planner();
+
+    /// Open a copy of PCAT.DB
+    bool open(const std::string &dbPath);
+
+    /**
+     * Open the database straight off an image, without copying it out.
+     * Only the pages SQLite asks for are read. The image must stay open
+     * until the planner is closed.
+     */
+    bool open(FileSystem &image, const std::string &path = "FSN_DATA/PCAT.DB");
+
+    void close();
+
+    bool isOpen() const { return m_db != NULL; }
+
+    /// Schema version from DB_INFO, or -1 if unknown
+    int majorVersion() const { return m_majorVersion; }
+    int minorVersion() const { return m_minorVersion; }
+
+    /// All recordings that have been made, i.e. not on-demand downloads or channel data.
+    Recordings recordings();
+
+    /// The same recordings, decoded in one pass into a flat table
+    bool readRecordings(RecordingTable &table);
+
+    /// The recordings, read the first time they're asked for and kept until the planner is closed
+    const RecordingTable &recordingTable();
+
+    /// Look up the recording of an event
+    bool recordingFor(int eventId, Recording &recording);
+
+    /// The last error reported by SQLite
+    std::string lastError() const;
+
+private:
+    Planner(const Planner &);
+    Planner &operator=(const Planner &);
+
+    void readVersion();
+    void prepare();
+
+    sqlite3 *m_db;
+    int m_majorVersion;
+    int m_minorVersion;
+
+    sqlite3_stmt *m_recordingsStmt;     ///< All recordings, excluding two service types given as parameters
+    RecordingTable m_table;
+    bool m_tableRead;
+};
+
+} // end of namespace fs
+
+#endif // XTVFS_PLANNER_H
@@ -0,0 +1,223 @@
+/* This file is part of XTVFS Reader.
+ * Copyright (C) 2014 S. Blackburn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * XTVFS Reader is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with XTVFS Reader.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "probe.h"
+#include "log.h"
+
+#include <algorithm>
+#include <cstring>
+
+using namespace std;
+using namespace fs;
+
+
+ProbedVolume::ProbedVolume() :
+    partition(0),
+    typeCode(0),
+    firstSector(0),
+    sectors(0),
+    xtvfs(false)
+{
+}
+
+
+/// Bytes in a sector, which is all FAT32 or an MBR will use
+static const size_t sectorSize = 512;
+
+/// The boot sector, FSInfo and the sector with XTVFS's marker, read in one go
+static const size_t probeSectors = 3;
+
+
+static unsigned int read16(const unsigned char *p)
+{
+    return p[0] | p[1] << 8;
+}
+
+
+static unsigned long long read32(const unsigned char *p)
+{
+    return (unsigned long long)p[3] << 24 | p[2] << 16 | p[1] << 8 | p[0];
+}
+
+
+static bool hasBootSignature(const unsigned char *sector)
+{
+    return sector[510] == 0x55 && sector[511] == 0xAA;
+}
+
+
+/**
+ * Does a sector look like the boot sector of a FAT32 volume?
+ * An MBR has the same signature, so the BIOS Parameter Block has to be checked too.
+ * Sky boxes don't fill in the "FAT32   " type string, so that can't be relied on.
+ */
+static bool isFat32BootSector(const unsigned char *sector)
+{
+    const unsigned int bytesPerSector = read16(sector + 0x0B);
+    const unsigned int sectorsPerCluster = sector[0x0D];
+    const unsigned int fats = sector[0x10];
+    const unsigned int rootEntries = read16(sector + 0x11);    // Only FAT12/16 have a fixed root directory
+    const unsigned int fatSize16 = read16(sector + 0x16);      // Only FAT12/16 keep their FAT size here
+    const unsigned long long fatSize32 = read32(sector + 0x24);
+
+    return hasBootSignature(sector)
+            && (sector[0] == 0xEB || sector[0] == 0xE9)         // x86 jump over the BPB
+            && bytesPerSector == sectorSize
+            && sectorsPerCluster != 0 && (sectorsPerCluster & (sectorsPerCluster - 1)) == 0
+            && fats == 2
+            && rootEntries == 0 && fatSize16 == 0 && fatSize32 != 0;
+}
+
+
+/// Does the MBR's partition table make sense? Each entry's status byte can only be 0 or 0x80.
+static bool isPartitionTable(const unsigned char *mbr)
+{
+    if (!hasBootSignature(mbr))
+        return false;
+
+    bool any = false;
+    for (unsigned int p=0; p<4; ++p)
+    {
+        const unsigned char *entry = mbr + 446 + p * 16;
+        if ((entry[0] & 0x7F) != 0)
+            return false;
+        any = any || (entry[4] != 0 && read32(entry + 12) != 0);
+    }
+    return any;
+}
+
+
+/// Open a volume whose first sectors have been read and look like FAT32
+static bool openVolume(const BlockDevicePtr &device, const unsigned char *sectors, size_t cacheSize, ProbedVolume &volume)
+{
+    volume.xtvfs = (memcmp(sectors + 2 * sectorSize, "XFS0", 4) == 0);
+
+    shared_ptr<FileSystem> fileSystem;
+    if (volume.xtvfs)
+        fileSystem.reset(new Xtvfs());
+    else
+        fileSystem.reset(new Fat32());
+    fileSystem->setCacheSize(cacheSize);
+
+    if (!fileSystem->open(device))
+    {
+        XTVFS_WARNING("Unable to open the " << volume.format() << " volume at sector " << volume.firstSector);
+        return false;
+    }
+
+    XTVFS_INFO("Found a " << volume.format() << " volume at sector " << volume.firstSector
+               << " (" << volume.sectors << " sectors)");
+    volume.fileSystem = fileSystem;
+    return true;
+}
+
+
+bool fs::probeImage(const BlockDevicePtr &device, ProbedVolumes &volumes, size_t cacheSize)
+{
+    volumes.clear();
+    if (!device)
+        return false;
+
+    // Anything past the end of a tiny image just reads as zeros, which won't match anything
+    unsigned char first[probeSectors * sectorSize];
+    device->read(0, first, sizeof(first));
+
+    if (isFat32BootSector(first))
+    {
+        // No partition table, which is how Sky boxes format their disks
+        ProbedVolume volume;
+        volume.sectors = device->size() / sectorSize;
+        if (openVolume(device, first, cacheSize, volume))
+            volumes.push_back(volume);
+        return !volumes.empty();
+    }
+
+    if (!isPartitionTable(first))
+    {
+        XTVFS_INFO("No FAT32 boot sector or partition table at the start of the image");
+        return false;
+    }
+
+    for (unsigned int p=0; p<4; ++p)
+    {
+        // Each entry is:
+        // [0] = boot flag
+        // [1-3] = CHS begin
+        // [4] = Type code
+        // [5-7] = CHS end
+        // [8-11] = LBA begin
+        // [12-15] = Number of sectors
+        const unsigned char *entry = first + 446 + p * 16;
+        ProbedVolume volume;
+        volume.partition = p + 1;
+        volume.typeCode = entry[4];
+        volume.firstSector = read32(entry + 8);
+        volume.sectors = read32(entry + 12);
+
+        XTVFS_DEBUG("Partition " << volume.partition << ": type 0x" << hex << (int)volume.typeCode << dec
+                    << ", LBA " << volume.firstSector << ", " << volume.sectors << " sectors");
+
+        if (volume.typeCode == 0 || volume.sectors == 0)
+            continue;
+        if (volume.typeCode == 0xEE)
+        {
+            XTVFS_WARNING("The image has a GPT partition table, which isn't supported");
+            break;
+        }
+        if (volume.typeCode == 0x05 || volume.typeCode == 0x0F || volume.typeCode == 0x85)
+        {
+            XTVFS_INFO("Partition " << volume.partition << " is an extended partition, whose logical partitions aren't read");
+            continue;
+        }
+
+        const unsigned long long begin = volume.firstSector * sectorSize;
+        if (begin >= device->size())
+        {
+            XTVFS_WARNING("Partition " << volume.partition << " starts beyond the end of the image");
+            continue;
+        }
+
+        // A truncated image still gives what it has of the partition
+        const unsigned long long length = min(volume.sectors * sectorSize, device->size() - begin);
+        BlockDevicePtr partition(new PartitionBlockDevice(device, begin, length));
+
+        unsigned char sectors[probeSectors * sectorSize];
+        partition->read(0, sectors, sizeof(sectors));
+        if (!isFat32BootSector(sectors))
+        {
+            XTVFS_INFO("Partition " << volume.partition << " (type 0x" << hex << (int)volume.typeCode << dec << ") isn't FAT32");
+            continue;
+        }
+
+        if (openVolume(partition, sectors, cacheSize, volume))
+            volumes.push_back(volume);
+    }
+
+    return !volumes.empty();
+}
+
+
+bool fs::probeImage(const std::string &filepath, ProbedVolumes &volumes, size_t cacheSize)
+{
+    BlockDevicePtr device = BlockDevice::open(filepath);
+    if (!device)
+    {
+        XTVFS_ERROR("Error opening " << filepath);
+        return false;
+    }
+
+    return probeImage(device, volumes, cacheSize);
+}
@@ -0,0 +1,69 @@
+/* This file is part of XTVFS Reader.
+ * Copyright (C) 2014 S. Blackburn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * XTVFS Reader is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with XTVFS Reader.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef XTVFS_PROBE_H
+#define XTVFS_PROBE_H
+
+#include "blockdevice.h"
+#include "filesystem.h"
+
+#include <memory>
+#include <vector>
+
+namespace fs
+{
+
+
+/// A file system found on an image, opened and ready to read
+class ProbedVolume
+{
+  public:
+    ProbedVolume();
+
+    unsigned int partition;             ///< MBR partition number, 1 to 4, or 0 if the volume starts at the beginning of the image
+    unsigned char typeCode;             ///< The partition's type in the MBR, 0 without one
+    unsigned long long firstSector;     ///< Where the volume starts on the image
+    unsigned long long sectors;
+    bool xtvfs;                         ///< Has the "XFS0" marker, so is opened as Xtvfs rather than plain Fat32
+    std::shared_ptr<FileSystem> fileSystem;
+
+    /// "xtvfs" or "fat32"
+    const char *format() const { return xtvfs ? "xtvfs" : "fat32"; }
+};
+
+typedef std::vector<ProbedVolume> ProbedVolumes;
+
+
+/**
+ * Find every XTVFS and FAT32 volume on an image.
+ *
+ * The first few sectors are read once and looked at for a FAT32 boot sector,
+ * which is how Sky boxes format their disks, or else for an MBR. Each primary
+ * partition of an MBR is then probed the same way, through a PartitionBlockDevice.
+ * Either way the "XFS0" marker picks between Xtvfs and Fat32, so each volume is
+ * opened just once, as the right class.
+ *
+ * @param cacheSize Bytes of block cache for each volume's file system
+ * @return False if no volume was found
+ */
+bool probeImage(const BlockDevicePtr &device, ProbedVolumes &volumes, size_t cacheSize = CachedBlockDevice::defaultCacheSize);
+
+/// Open an image or disk and probe it
+bool probeImage(const std::string &filepath, ProbedVolumes &volumes, size_t cacheSize = CachedBlockDevice::defaultCacheSize);
+
+} // end of namespace fs
+
+#endif // XTVFS_PROBE_H
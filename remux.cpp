@@ -0,0 +1,549 @@
+/* This file is part of XTVFS Reader.
+ * Copyright (C) 2014 S. Blackburn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * XTVFS Reader is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with XTVFS Reader.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "remux.h"
+#include "log.h"
+
+#include <algorithm>
+#include <cstring>
+
+using namespace std;
+using namespace fs;
+
+
+/// The start of every transport stream packet
+static const unsigned char syncByte = 0x47;
+
+/// No PID has been found for this yet
+static const unsigned int noPid = 0x1FFF;
+
+/// 20 Mbit/s, in units of 50 bytes a second. Players work the rate out for themselves, so it only has to be big enough.
+static const unsigned int muxRate = 50000;
+
+/// Bytes in a pack header, with no stuffing
+static const size_t packHeaderSize = 14;
+
+
+/// CRC-32/MPEG-2, as used by the program stream map
+static unsigned int crc32(const char *data, size_t length)
+{
+    unsigned int crc = 0xFFFFFFFF;
+    for (size_t i=0; i<length; ++i)
+    {
+        crc ^= (unsigned int)(unsigned char)data[i] << 24;
+        for (int bit=0; bit<8; ++bit)
+            crc = (crc & 0x80000000) ? (crc << 1) ^ 0x04C11DB7 : crc << 1;
+    }
+    return crc;
+}
+
+
+static void put8(vector<char> &out, unsigned int value)
+{
+    out.push_back((char)value);
+}
+
+
+static void put16(vector<char> &out, unsigned int value)
+{
+    out.push_back((char)(value >> 8));
+    out.push_back((char)value);
+}
+
+
+static void putStartCode(vector<char> &out, unsigned char code)
+{
+    out.push_back(0);
+    out.push_back(0);
+    out.push_back(1);
+    out.push_back((char)code);
+}
+
+
+ProgramStreamRemuxer::Stream::Stream() :
+    streamType(0),
+    streamId(0),
+    subStreamId(0),
+    started(false),
+    hasPts(false),
+    hasDts(false),
+    aligned(false)
+{
+}
+
+
+ProgramStreamRemuxer::ProgramStreamRemuxer() :
+    m_pmtPid(noPid),
+    m_pcrPid(noPid),
+    m_pmtVersion(-1),
+    m_pcr(0),
+    m_bytesSincePcr(0),
+    m_headersDue(true),
+    m_streamMapVersion(0),
+    m_packets(0),
+    m_droppedPackets(0),
+    m_streamPackets(0),
+    m_syncLosses(0)
+{
+}
+
+
+void ProgramStreamRemuxer::write(const char *data, size_t length, vector<char> &out)
+{
+    const unsigned char *p = reinterpret_cast<const unsigned char*>(data);
+    const unsigned char *const end = p + length;
+
+    // Finish off a packet the last piece ended part way through
+    if (!m_carry.empty())
+    {
+        const size_t needed = min<size_t>(tsPacketSize - m_carry.size(), end - p);
+        m_carry.insert(m_carry.end(), p, p + needed);
+        p += needed;
+        if (m_carry.size() < tsPacketSize)
+            return;
+        packet(&m_carry[0], out);
+        m_carry.clear();
+    }
+
+    while (end - p >= (ptrdiff_t)tsPacketSize)
+    {
+        if (p[0] == syncByte)
+        {
+            packet(p, out);
+            p += tsPacketSize;
+            continue;
+        }
+
+        // Lost sync, so look for a sync byte followed by another a packet later
+        ++m_syncLosses;
+        ++p;
+        while (end - p >= (ptrdiff_t)tsPacketSize &&
+               (p[0] != syncByte || (end - p > (ptrdiff_t)tsPacketSize && p[tsPacketSize] != syncByte)))
+            ++p;
+    }
+
+    // Keep the start of the next packet for next time
+    while (p != end && p[0] != syncByte)
+        ++p;
+    m_carry.assign(p, end);
+}
+
+
+void ProgramStreamRemuxer::finish(vector<char> &out)
+{
+    for (map<unsigned int, Stream>::iterator s = m_streams.begin(); s != m_streams.end(); ++s)
+        flush(s->second, true, out);
+
+    putStartCode(out, 0xB9); // MPEG program end
+    m_carry.clear();
+}
+
+
+void ProgramStreamRemuxer::packet(const unsigned char *p, vector<char> &out)
+{
+    ++m_packets;
+
+    const bool transportError = p[1] & 0x80;
+    const bool unitStart = p[1] & 0x40;
+    const unsigned int pid = (p[1] & 0x1F) << 8 | p[2];
+    const bool scrambled = p[3] & 0xC0;
+    const unsigned int adaptationFieldControl = (p[3] >> 4) & 3;
+
+    size_t offset = 4;
+    if (adaptationFieldControl & 2)
+    {
+        const size_t adaptationLength = p[4];
+        if (adaptationLength > tsPacketSize - 5)
+            return;
+
+        // The PCR is the clock the program stream's SCR follows
+        if (pid == m_pcrPid && adaptationLength >= 7 && (p[5] & 0x10) && !transportError)
+        {
+            const unsigned long long base = (unsigned long long)p[6] << 25 | p[7] << 17 | p[8] << 9 | p[9] << 1 | p[10] >> 7;
+            const unsigned int extension = (p[10] & 1) << 8 | p[11];
+            m_pcr = base * 300 + extension;
+            m_bytesSincePcr = 0;
+        }
+        offset += 1 + adaptationLength;
+    }
+    if (!(adaptationFieldControl & 1) || offset >= tsPacketSize)
+        return;
+
+    if (pid == 0 || pid == m_pmtPid)
+    {
+        if (!transportError)
+            section(pid, p + offset, tsPacketSize - offset, unitStart, out);
+        return;
+    }
+
+    map<unsigned int, Stream>::iterator s = m_streams.find(pid);
+    if (s == m_streams.end())
+        return;
+
+    ++m_streamPackets;
+    if (transportError || scrambled)
+    {
+        // Whatever PES packet this was part of is no good now
+        ++m_droppedPackets;
+        s->second.started = false;
+        s->second.header.clear();
+        return;
+    }
+
+    payload(s->second, p + offset, tsPacketSize - offset, unitStart, out);
+}
+
+
+void ProgramStreamRemuxer::section(unsigned int pid, const unsigned char *payload, size_t length, bool unitStart, vector<char> &out)
+{
+    ByteArray &section = m_sections[pid];
+    if (unitStart)
+    {
+        // The pointer field says where the new section starts, after the end of the last one
+        const size_t pointer = payload[0];
+        if (pointer + 1 >= length)
+            return;
+        section.assign(payload + 1 + pointer, payload + length);
+    }
+    else if (!section.empty())
+        section.insert(section.end(), payload, payload + length);
+    else
+        return;
+
+    if (section.size() < 3)
+        return;
+    const size_t sectionLength = 3 + ((section[1] & 0x0F) << 8 | section[2]);
+    if (section.size() < sectionLength)
+        return;
+
+    section.resize(sectionLength);
+    if (pid == 0)
+        readPat(section);
+    else
+        readPmt(section, out);
+    section.clear();
+}
+
+
+void ProgramStreamRemuxer::readPat(const ByteArray &section)
+{
+    if (section[0] != 0x00 || section.size() < 12)
+        return;
+
+    // Follow the first program, skipping the network information table's entry (program 0)
+    for (size_t i = 8; i + 4 <= section.size() - 4; i += 4)
+    {
+        const unsigned int program = section[i] << 8 | section[i+1];
+        const unsigned int pid = (section[i+2] & 0x1F) << 8 | section[i+3];
+        if (program == 0)
+            continue;
+        if (pid != m_pmtPid)
+        {
+            XTVFS_DEBUG("Program " << program << " has its PMT on PID " << pid);
+            m_pmtPid = pid;
+            m_pmtVersion = -1;
+        }
+        return;
+    }
+}
+
+
+void ProgramStreamRemuxer::readPmt(const ByteArray &section, vector<char> &out)
+{
+    if (section[0] != 0x02 || section.size() < 16)
+        return;
+
+    const int version = (section[5] >> 1) & 0x1F;
+    if (version == m_pmtVersion)
+        return;
+    m_pmtVersion = version;
+    m_pcrPid = (section[8] & 0x1F) << 8 | section[9];
+
+    map<unsigned int, Stream> streams;
+    vector<unsigned int> added;
+    const size_t end = section.size() - 4; // CRC
+    size_t i = 12 + ((section[10] & 0x0F) << 8 | section[11]);
+    while (i + 5 <= end)
+    {
+        const unsigned char streamType = section[i];
+        const unsigned int pid = (section[i+1] & 0x1F) << 8 | section[i+2];
+        const size_t infoLength = (section[i+3] & 0x0F) << 8 | section[i+4];
+        const size_t infoEnd = min(end, i + 5 + infoLength);
+
+        // DVB carries AC-3 as private data, with a descriptor saying what it is
+        bool ac3 = (streamType == 0x81);
+        for (size_t d = i + 5; streamType == 0x06 && d + 2 <= infoEnd; d += 2 + section[d+1])
+            ac3 = ac3 || section[d] == 0x6A;
+
+        Stream stream;
+        if (streamType == 0x01 || streamType == 0x02 || streamType == 0x10 || streamType == 0x1B || streamType == 0x24)
+        {
+            stream.streamType = streamType;
+            stream.streamId = 0xE0;
+        }
+        else if (streamType == 0x03 || streamType == 0x04 || streamType == 0x0F || streamType == 0x11)
+        {
+            stream.streamType = streamType;
+            stream.streamId = 0xC0;
+        }
+        else if (ac3)
+        {
+            stream.streamType = 0x81;
+            stream.streamId = 0xBD;
+            stream.subStreamId = 0x80;
+        }
+        i = infoEnd;
+
+        if (stream.streamId == 0)
+            continue;
+
+        // Streams that carry on keep their ids, and what they have pending
+        const map<unsigned int, Stream>::const_iterator old = m_streams.find(pid);
+        if (old != m_streams.end() && old->second.streamType == stream.streamType)
+            streams[pid] = old->second;
+        else
+        {
+            streams[pid] = stream;
+            added.push_back(pid);
+        }
+    }
+
+    // Anything that has gone gets written out before it's forgotten
+    for (map<unsigned int, Stream>::iterator s = m_streams.begin(); s != m_streams.end(); ++s)
+    {
+        const map<unsigned int, Stream>::const_iterator kept = streams.find(s->first);
+        if (kept == streams.end() || kept->second.streamType != s->second.streamType)
+            flush(s->second, true, out);
+    }
+
+    // New streams get the lowest ids that nothing else has.
+    // There is room for 16 video, 32 audio and 8 AC-3 streams, which is far more than a broadcast has.
+    for (size_t a=0; a<added.size(); ++a)
+    {
+        Stream &stream = streams[added[a]];
+        unsigned char &id = (stream.streamId == 0xBD) ? stream.subStreamId : stream.streamId;
+        const unsigned char last = (stream.streamId == 0xBD) ? 0x87 : (stream.streamId == 0xE0) ? 0xEF : 0xDF;
+        bool clash = true;
+        while (clash && id <= last)
+        {
+            clash = false;
+            for (map<unsigned int, Stream>::const_iterator t = streams.begin(); t != streams.end() && !clash; ++t)
+            {
+                const bool assigned = find(added.begin() + a, added.end(), t->first) == added.end();
+                const unsigned char otherId = (t->second.streamId == 0xBD) ? t->second.subStreamId : t->second.streamId;
+                clash = assigned && t->first != added[a] && t->second.streamId == stream.streamId && otherId == id;
+            }
+            if (clash)
+                ++id;
+        }
+        if (id > last)
+            streams.erase(added[a]);
+    }
+
+    m_streams.swap(streams);
+    m_headersDue = true;
+    ++m_streamMapVersion;
+
+    XTVFS_DEBUG("PMT version " << version << ": " << m_streams.size() << " streams to remux, PCR on PID " << m_pcrPid);
+}
+
+
+void ProgramStreamRemuxer::payload(Stream &stream, const unsigned char *data, size_t length, bool unitStart, vector<char> &out)
+{
+    if (unitStart)
+    {
+        // The last PES packet is complete, so write all of it
+        flush(stream, true, out);
+        stream.started = true;
+        stream.header.assign(data, data + length);
+    }
+    else if (!stream.started)
+        return; // Part way through a PES packet we didn't see the start of
+    else if (!stream.header.empty())
+        stream.header.insert(stream.header.end(), data, data + length);
+
+    if (!stream.header.empty())
+    {
+        // Wait until the whole PES header is here, as it can run on into the next packet
+        const ByteArray &h = stream.header;
+        if (h.size() < 9)
+            return;
+        if (h[0] != 0 || h[1] != 0 || h[2] != 1 || (h[6] & 0xC0) != 0x80)
+        {
+            stream.started = false;
+            stream.header.clear();
+            return;
+        }
+        const size_t headerLength = 9 + h[8];
+        if (h.size() < headerLength)
+            return;
+
+        const unsigned int ptsDtsFlags = h[7] >> 6;
+        stream.hasPts = (ptsDtsFlags & 2) && h[8] >= 5;
+        stream.hasDts = (ptsDtsFlags == 3) && h[8] >= 10;
+        if (stream.hasPts)
+            memcpy(stream.pts, &h[9], sizeof(stream.pts));
+        if (stream.hasDts)
+            memcpy(stream.dts, &h[14], sizeof(stream.dts));
+        stream.aligned = h[6] & 0x04;
+
+        stream.pending.insert(stream.pending.end(), h.begin() + headerLength, h.end());
+        stream.header.clear();
+    }
+    else
+        stream.pending.insert(stream.pending.end(), data, data + length);
+
+    flush(stream, false, out);
+}
+
+
+void ProgramStreamRemuxer::flush(Stream &stream, bool all, vector<char> &out)
+{
+    size_t done = 0;
+    while (stream.pending.size() - done >= packSize || (all && done < stream.pending.size()))
+        done += writePes(stream, &stream.pending[done], stream.pending.size() - done, out);
+    stream.pending.erase(stream.pending.begin(), stream.pending.begin() + done);
+}
+
+
+size_t ProgramStreamRemuxer::writePes(Stream &stream, const char *data, size_t length, vector<char> &out)
+{
+    const size_t timeStampLength = stream.hasPts ? (stream.hasDts ? 10 : 5) : 0;
+    const size_t subStreamLength = (stream.streamId == 0xBD) ? 4 : 0;
+    length = min(length, packSize - packHeaderSize - 9 - timeStampLength - subStreamLength);
+
+    const size_t start = out.size();
+    writePackHeader(out);
+
+    putStartCode(out, stream.streamId);
+    put16(out, 3 + timeStampLength + subStreamLength + length);
+    put8(out, 0x80 | (stream.aligned ? 0x04 : 0));
+    put8(out, (stream.hasPts ? 0x80 : 0) | (stream.hasDts ? 0x40 : 0));
+    put8(out, timeStampLength);
+    if (stream.hasPts)
+        out.insert(out.end(), stream.pts, stream.pts + sizeof(stream.pts));
+    if (stream.hasDts)
+        out.insert(out.end(), stream.dts, stream.dts + sizeof(stream.dts));
+
+    if (subStreamLength)
+    {
+        // As on DVDs: the substream, how many AC-3 frames start here, and where the first one starts
+        size_t frames = 0, first = 0;
+        for (size_t i=0; i+1<length; ++i)
+        {
+            if ((unsigned char)data[i] == 0x0B && (unsigned char)data[i+1] == 0x77)
+            {
+                if (frames++ == 0)
+                    first = i + 1;
+            }
+        }
+        put8(out, stream.subStreamId);
+        put8(out, frames);
+        put16(out, first);
+    }
+
+    out.insert(out.end(), data, data + length);
+
+    // Only the first piece of each PES packet has its time stamps
+    stream.hasPts = stream.hasDts = stream.aligned = false;
+    m_bytesSincePcr += out.size() - start;
+    return length;
+}
+
+
+void ProgramStreamRemuxer::writePackHeader(vector<char> &out)
+{
+    // The SCR is when the pack's first byte arrives, so it moves on from the last PCR by the bytes since at muxRate
+    const unsigned long long scr = m_pcr + m_bytesSincePcr * (27000000 / 50) / muxRate;
+    const unsigned long long base = scr / 300;
+    const unsigned int extension = scr % 300;
+
+    putStartCode(out, 0xBA);
+    put8(out, 0x44 | (base >> 27 & 0x38) | (base >> 28 & 0x03));
+    put8(out, base >> 20);
+    put8(out, 0x04 | (base >> 12 & 0xF8) | (base >> 13 & 0x03));
+    put8(out, base >> 5);
+    put8(out, 0x04 | (base << 3 & 0xF8) | (extension >> 7 & 0x03));
+    put8(out, 0x01 | (extension << 1 & 0xFE));
+    put8(out, muxRate >> 14);
+    put8(out, muxRate >> 6);
+    put8(out, 0x03 | (muxRate << 2 & 0xFC));
+    put8(out, 0xF8); // No stuffing
+
+    if (m_headersDue)
+    {
+        writeSystemHeader(out);
+        writeStreamMap(out);
+        m_headersDue = false;
+    }
+}
+
+
+void ProgramStreamRemuxer::writeSystemHeader(vector<char> &out)
+{
+    unsigned int audio = 0, video = 0;
+    vector<unsigned char> ids;
+    for (map<unsigned int, Stream>::const_iterator s = m_streams.begin(); s != m_streams.end(); ++s)
+    {
+        (s->second.streamId >= 0xE0 ? video : audio)++;
+        if (find(ids.begin(), ids.end(), s->second.streamId) == ids.end())
+            ids.push_back(s->second.streamId);
+    }
+
+    putStartCode(out, 0xBB);
+    put16(out, 6 + 3 * ids.size());
+    put8(out, 0x80 | (muxRate >> 15 & 0x7F));
+    put8(out, muxRate >> 7);
+    put8(out, 0x01 | (muxRate << 1 & 0xFE));
+    put8(out, min(audio, 32u) << 2);
+    put8(out, 0xE0 | min(video, 16u));
+    put8(out, 0x7F);
+
+    // Buffer bounds: 232KB for video in 1024 byte units, 4KB for audio in 128 byte units
+    for (size_t i=0; i<ids.size(); ++i)
+    {
+        put8(out, ids[i]);
+        if (ids[i] >= 0xE0)
+            put16(out, 0xE000 | 232);
+        else if (ids[i] == 0xBD)
+            put16(out, 0xE000 | 58);
+        else
+            put16(out, 0xC000 | 32);
+    }
+}
+
+
+void ProgramStreamRemuxer::writeStreamMap(vector<char> &out)
+{
+    const size_t start = out.size();
+
+    putStartCode(out, 0xBC);
+    put16(out, 10 + 4 * m_streams.size());
+    put8(out, 0x80 | 0x60 | (m_streamMapVersion & 0x1F)); // Current, and the version
+    put8(out, 0xFF);
+    put16(out, 0); // No program descriptors
+    put16(out, 4 * m_streams.size());
+    for (map<unsigned int, Stream>::const_iterator s = m_streams.begin(); s != m_streams.end(); ++s)
+    {
+        put8(out, s->second.streamType);
+        put8(out, s->second.streamId);
+        put16(out, 0);
+    }
+
+    const unsigned int crc = crc32(&out[start], out.size() - start);
+    put16(out, crc >> 16);
+    put16(out, crc);
+}
@@ -0,0 +1,133 @@
+/* This file is part of XTVFS Reader.
+ * Copyright (C) 2014 S. Blackburn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * XTVFS Reader is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with XTVFS Reader.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef XTVFS_REMUX_H
+#define XTVFS_REMUX_H
+
+#include <cstddef>
+#include <map>
+#include <vector>
+
+namespace fs
+{
+
+
+/**
+ * Turns a recording's transport stream into an MPEG program stream (a .mpg
+ * file) as it is read, so extracting a recording gives a file players can
+ * use without a second pass through ffmpeg.
+ *
+ * The first program in the PAT is followed. Its video, MPEG and AAC audio
+ * and AC-3 streams are kept, and everything else (subtitles, teletext,
+ * the tables themselves) is left out. Each PES packet of the transport
+ * stream is cut into program stream packs of about 2KB, keeping its time
+ * stamps, and each pack's SCR comes from the last PCR. A system header and
+ * a program stream map, which says which codec each stream is, go in the
+ * first pack and again whenever the PMT changes.
+ *
+ * The input can be split anywhere, not just between packets.
+ */
+class ProgramStreamRemuxer
+{
+public:
+    ProgramStreamRemuxer();
+
+    /// Take the next piece of the transport stream, adding whatever program stream it makes to the end of out
+    void write(const char *data, size_t length, std::vector<char> &out);
+
+    /// Write what is left of each stream, and the program end code
+    void finish(std::vector<char> &out);
+
+    /// Transport stream packets read
+    unsigned long long packets() const { return m_packets; }
+
+    /// Packets of the kept streams that were left out because they were scrambled, or marked as damaged
+    unsigned long long droppedPackets() const { return m_droppedPackets; }
+
+    /// Packets with a payload for one of the kept streams, dropped or not
+    unsigned long long streamPackets() const { return m_streamPackets; }
+
+    /// More than half the audio and video was left out, as happens with an encrypted recording
+    bool mostlyDropped() const { return m_droppedPackets * 2 > m_streamPackets; }
+
+    /// Times the stream had to be searched for the next packet's sync byte
+    unsigned long long syncLosses() const { return m_syncLosses; }
+
+    /// Streams being written, from the last PMT
+    size_t streams() const { return m_streams.size(); }
+
+    static const size_t tsPacketSize = 188;
+
+    /// Most bytes in a pack, apart from the system header and program stream map
+    static const size_t packSize = 2048;
+
+private:
+    typedef std::vector<unsigned char> ByteArray;
+
+    /// One of the elementary streams being written
+    struct Stream
+    {
+        Stream();
+
+        unsigned char streamType;       ///< From the PMT, for the program stream map
+        unsigned char streamId;         ///< 0xE0 on for video, 0xC0 on for audio, 0xBD (private stream 1) for AC-3
+        unsigned char subStreamId;      ///< 0x80 on for AC-3, which shares private stream 1
+        bool started;                   ///< In a PES packet, rather than waiting for the start of one
+        ByteArray header;               ///< The start of the current PES packet, until its header is all there
+        std::vector<char> pending;      ///< Elementary stream data not yet written
+        unsigned char pts[5];
+        unsigned char dts[5];
+        bool hasPts;                    ///< pending starts with a PES packet that has a PTS
+        bool hasDts;
+        bool aligned;                   ///< pending starts with a PES packet that starts with an access unit
+    };
+
+    void packet(const unsigned char *p, std::vector<char> &out);
+    void section(unsigned int pid, const unsigned char *payload, size_t length, bool unitStart, std::vector<char> &out);
+    void readPat(const ByteArray &section);
+    void readPmt(const ByteArray &section, std::vector<char> &out);
+    void payload(Stream &stream, const unsigned char *data, size_t length, bool unitStart, std::vector<char> &out);
+
+    /// Write all the stream's pending data, or as many whole packs of it as there are
+    void flush(Stream &stream, bool all, std::vector<char> &out);
+
+    /// Write up to a pack's worth of the stream's pending data, returning the bytes used
+    size_t writePes(Stream &stream, const char *data, size_t length, std::vector<char> &out);
+
+    void writePackHeader(std::vector<char> &out);
+    void writeSystemHeader(std::vector<char> &out);
+    void writeStreamMap(std::vector<char> &out);
+
+    ByteArray m_carry;                  ///< The start of a packet that the last write() ended part way through
+    std::map<unsigned int, ByteArray> m_sections;   ///< PAT and PMT sections being put together, by PID
+    std::map<unsigned int, Stream> m_streams;       ///< By PID
+    unsigned int m_pmtPid;
+    unsigned int m_pcrPid;
+    int m_pmtVersion;
+    unsigned long long m_pcr;           ///< 27MHz clock, from the last PCR
+    unsigned long long m_bytesSincePcr; ///< Written since the last PCR, for the SCR of the next pack
+    bool m_headersDue;                  ///< The next pack needs a system header and program stream map
+    unsigned char m_streamMapVersion;
+
+    unsigned long long m_packets;
+    unsigned long long m_droppedPackets;
+    unsigned long long m_streamPackets;
+    unsigned long long m_syncLosses;
+};
+
+} // end of namespace fs
+
+#endif // XTVFS_REMUX_H
@@ -0,0 +1,128 @@
+#!/bin/bash
+# This file is part of XTVFS Reader.
+# Copyright (C) 2014 S. Blackburn
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# XTVFS Reader is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with XTVFS Reader.  If not, see <http://www.gnu.org/licenses/>.
+
+#
+# smoketest.sh - check xtvfscli against images written by xtvfsgen
+#
+# Usage: smoketest.sh [directory with xtvfsgen and xtvfscli]
+#
+# Each image's manifest says what xtvfsgen wrote, including the chains it
+# damaged. verify must find exactly those, stat and extract must agree with
+# it on every other file, and df on an undamaged image must count the video
+# clusters it lists.
+#
+
+BIN=${1:-.}
+GEN=$BIN/xtvfsgen
+CLI=$BIN/xtvfscli
+for tool in "$GEN" "$CLI"; do
+    if [ ! -x "$tool" ]; then
+        echo "$tool not found, build the tools first" >&2
+        exit 2
+    fi
+done
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+failures=0
+
+fail()
+{
+    echo "FAIL $*"
+    failures=$((failures + 1))
+}
+
+lower()
+{
+    tr '[:upper:]' '[:lower:]'
+}
+
+# check <name> <xtvfsgen options...>
+check()
+{
+    local name=$1
+    shift
+    local image=$WORK/$name.img manifest=$WORK/$name.manifest
+    echo "== $name: xtvfsgen $*"
+    if ! "$GEN" "$@" "$image" > "$manifest"; then
+        fail "$name: xtvfsgen failed"
+        return
+    fi
+
+    # file|video <path> size N clusters N extents N first N [damaged how]
+    local pattern='^(file|video) (.*) size ([0-9]+) clusters ([0-9]+) extents ([0-9]+) first [0-9]+( damaged (.*))?$'
+
+    # verify: damaged files are BAD, along with anything a damaged chain was joined onto
+    local expectBad=$WORK/$name.expect verify=$WORK/$name.verify
+    sed -nE "s/$pattern/\\2/p" "$manifest" | lower | sort > "$WORK/$name.all"
+    sed -nE "s/$pattern/\\2\\n\\7/p" "$manifest" | sed -nE 's/^cross-linked to //p' | lower > "$expectBad"
+    sed -nE "/ damaged /s/$pattern/\\2/p" "$manifest" | lower >> "$expectBad"
+    sort -u -o "$expectBad" "$expectBad"
+    "$CLI" verify "$image" 2> /dev/null | lower > "$verify"
+    if ! diff <(sed -n '/^bad  /{s///; s/ (.*//; p}' "$verify" | sort) "$expectBad" > /dev/null; then
+        fail "$name: verify's BAD files aren't the damaged ones"
+    fi
+    if ! diff <(sed -n 's/^ok   //p; /^bad  /{s///; s/ (.*//; p}' "$verify" | grep -F -x -f "$WORK/$name.all" | sort) "$WORK/$name.all" > /dev/null; then
+        fail "$name: verify didn't check every file in the manifest"
+    fi
+
+    # stat and extract: every undamaged file has the clusters, extents and size the manifest says
+    local kind path size clusters extents damaged
+    while IFS=$'\t' read -r kind path size clusters extents damaged; do
+        [ -n "$damaged" ] && continue
+        local stat=$("$CLI" stat "$image" "$path" 2> /dev/null)
+        local gotClusters=$(sed -n 's/^Clusters: *//p' <<< "$stat")
+        local gotExtents=$(sed -n 's/^Extents: *//p' <<< "$stat")
+        if [ "$gotClusters" != "$clusters" ] || [ "$gotExtents" != "$extents" ]; then
+            fail "$name: $path has $gotClusters clusters in $gotExtents extents, not $clusters in $extents"
+        fi
+        if ! "$CLI" -q extract "$image" "$path" "$WORK/extracted" 2> /dev/null ||
+           [ "$(wc -c < "$WORK/extracted")" != "$size" ]; then
+            fail "$name: extracting $path didn't give $size bytes"
+        fi
+    done < <(sed -nE "s/$pattern/\\1\\t\\2\\t\\3\\t\\4\\t\\5\\t\\7/p" "$manifest")
+
+    # df: only an undamaged image's counts are known
+    if ! grep -q ' damaged ' "$manifest"; then
+        local videos=$(grep -c '^video ' "$manifest")
+        local videoClusters=$(awk '$1 == "video" { n += $(NF-4) } END { print n + 0 }' "$manifest")
+        local df=$("$CLI" df "$image" 2> /dev/null)
+        if [ "$videos" -gt 0 ] &&
+           ! awk -v used="$videoClusters" -v chains="$videos" \
+                 '$1 == "video" { found = 1; ok = ($4 == used && $7 == chains && $4 + $5 + $6 == $3) } END { exit !(found && ok) }' <<< "$df"; then
+            fail "$name: df doesn't count $videoClusters video clusters in $videos chains"
+        fi
+        if ! awk '$1 == "fat" { found = 1; ok = ($4 + $5 + $6 == $3) } END { exit !(found && ok) }' <<< "$df"; then
+            fail "$name: df's FAT counts don't add up"
+        fi
+    fi
+}
+
+COMMON="--size 1 --recordings 4 --recording-size 20"
+check plain $COMMON
+check fragmented $COMMON --fragmentation 0.3 --long-names --seed 2
+check fat32 --fat32 --size 1
+check damaged-videos $COMMON --fragmentation 0.3 --corrupt 4 --seed 2
+check damaged-files --size 1 --recordings 0 --dirs 2 --corrupt 4 --seed 2
+
+if [ $failures -eq 0 ]; then
+    echo "All passed"
+    exit 0
+fi
+echo "$failures failed"
+exit 1
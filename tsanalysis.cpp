@@ -0,0 +1,698 @@
+/* This file is part of XTVFS Reader.
+ * Copyright (C) 2014 S. Blackburn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * XTVFS Reader is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with XTVFS Reader.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "tsanalysis.h"
+#include "json.h"
+#include "log.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <thread>
+
+using namespace std;
+using namespace fs;
+
+
+/// The start of every transport stream packet
+static const unsigned char syncByte = 0x47;
+
+/// The PCR counts 33 bits of 90kHz, then 300 of 27MHz within each of those
+static const unsigned long long pcrModulus = (1ULL << 33) * 300;
+
+static const double pcrClock = 27000000.0;
+
+/// A longer gap between PCRs than this is a jump in the clock, not a gap in the recording
+static const unsigned long long pcrJumpLimit = 27000000;
+
+/// Gaps between PCRs longer than this are repetition errors, in TR 101 290's terms
+static const double pcrRepetitionLimit = 0.1;
+
+
+ElementaryStream::ElementaryStream() :
+    streamType(0),
+    descriptorTag(0)
+{
+}
+
+
+string ElementaryStream::codec() const
+{
+    switch (streamType)
+    {
+    case 0x01: return "MPEG-1 video";
+    case 0x02: return "MPEG-2 video";
+    case 0x03: return "MPEG-1 audio";
+    case 0x04: return "MPEG-2 audio";
+    case 0x05: return "Private sections";
+    case 0x0B: return "DSM-CC";
+    case 0x0F: return "AAC";
+    case 0x10: return "MPEG-4 video";
+    case 0x11: return "AAC (LATM)";
+    case 0x1B: return "H.264";
+    case 0x24: return "HEVC";
+    case 0x81: return "AC-3";
+    case 0x06:
+        switch (descriptorTag)
+        {
+        case 0x56: return "Teletext";
+        case 0x59: return "DVB subtitles";
+        case 0x6A: return "AC-3";
+        case 0x7A: return "E-AC-3";
+        default: return "Private data";
+        }
+    default:
+        break;
+    }
+
+    ostringstream s;
+    s << "Type 0x" << hex << setw(2) << setfill('0') << (int)streamType;
+    return s.str();
+}
+
+
+PidCounts::PidCounts() :
+    packets(0),
+    scrambled(0),
+    transportErrors(0),
+    continuityErrors(0),
+    duplicates(0),
+    firstCounter(-1),
+    firstDiscontinuity(false),
+    lastCounter(-1)
+{
+}
+
+
+ClusterAnalysis::ClusterAnalysis() :
+    firstPacket(0),
+    packets(0),
+    syncErrors(0),
+    pmtPid(noPid),
+    pcrPid(noPid)
+{
+}
+
+
+/// The section starting in a packet's payload, if all of it is there
+static const unsigned char *wholeSection(const unsigned char *payload, size_t length, size_t &sectionLength)
+{
+    const size_t pointer = payload[0];
+    if (1 + pointer + 3 > length)
+        return NULL;
+
+    const unsigned char *section = payload + 1 + pointer;
+    sectionLength = 3 + ((section[1] & 0x0F) << 8 | section[2]);
+    if (1 + pointer + sectionLength > length)
+        return NULL;
+    return section;
+}
+
+
+static void readPat(const unsigned char *section, size_t length, ClusterAnalysis &analysis)
+{
+    if (section[0] != 0x00 || length < 12)
+        return;
+
+    // Take the first program, skipping the network information table's entry (program 0)
+    for (size_t i = 8; i + 4 <= length - 4; i += 4)
+    {
+        const unsigned int program = section[i] << 8 | section[i+1];
+        if (program != 0)
+        {
+            analysis.pmtPid = (section[i+2] & 0x1F) << 8 | section[i+3];
+            return;
+        }
+    }
+}
+
+
+static void readPmt(const unsigned char *section, size_t length, ClusterAnalysis &analysis)
+{
+    if (section[0] != 0x02 || length < 16)
+        return;
+
+    analysis.pcrPid = (section[8] & 0x1F) << 8 | section[9];
+
+    const size_t end = length - 4; // CRC
+    size_t i = 12 + ((section[10] & 0x0F) << 8 | section[11]);
+    while (i + 5 <= end)
+    {
+        ElementaryStream stream;
+        stream.streamType = section[i];
+        const unsigned int pid = (section[i+1] & 0x1F) << 8 | section[i+2];
+        const size_t infoLength = (section[i+3] & 0x0F) << 8 | section[i+4];
+        const size_t infoEnd = min(end, i + 5 + infoLength);
+
+        // DVB carries AC-3, teletext and subtitles all as private data, with a descriptor saying which
+        for (size_t d = i + 5; stream.streamType == 0x06 && d + 2 <= infoEnd; d += 2 + section[d+1])
+        {
+            if (section[d] == 0x56 || section[d] == 0x59 || section[d] == 0x6A || section[d] == 0x7A)
+            {
+                stream.descriptorTag = section[d];
+                break;
+            }
+        }
+
+        analysis.streams[pid] = stream;
+        i = infoEnd;
+    }
+}
+
+
+void fs::analyseCluster(const unsigned char *data, size_t length, unsigned long long firstPacket, ClusterAnalysis &analysis)
+{
+    analysis.firstPacket = firstPacket;
+
+    const size_t tsPacketSize = ClusterAnalysis::tsPacketSize;
+    for (size_t offset = 0; offset + tsPacketSize <= length; offset += tsPacketSize)
+    {
+        const unsigned char *p = data + offset;
+        const unsigned long long packet = firstPacket + analysis.packets++;
+        if (p[0] != syncByte)
+        {
+            ++analysis.syncErrors;
+            continue;
+        }
+
+        const unsigned int pid = (p[1] & 0x1F) << 8 | p[2];
+        PidCounts &counts = analysis.pids[pid];
+        ++counts.packets;
+
+        // Nothing else in a damaged packet can be trusted
+        if (p[1] & 0x80)
+        {
+            ++counts.transportErrors;
+            continue;
+        }
+
+        const bool scrambled = (p[3] & 0xC0) != 0;
+        if (scrambled)
+            ++counts.scrambled;
+
+        const unsigned int adaptation = (p[3] >> 4) & 3;
+        size_t payloadStart = 4;
+        bool discontinuity = false;
+        if (adaptation & 2)
+        {
+            const size_t adaptationLength = p[4];
+            payloadStart = 5 + adaptationLength;
+            if (adaptationLength > 0)
+            {
+                discontinuity = (p[5] & 0x80) != 0;
+                if ((p[5] & 0x10) && adaptationLength >= 7)
+                {
+                    const unsigned long long base = (unsigned long long)p[6] << 25 | p[7] << 17 | p[8] << 9 | p[9] << 1 | p[10] >> 7;
+                    const unsigned int extension = (p[10] & 1) << 8 | p[11];
+
+                    PcrSample sample;
+                    sample.packet = packet;
+                    sample.value = base * 300 + extension;
+                    sample.discontinuity = discontinuity;
+                    counts.pcrs.push_back(sample);
+                }
+            }
+        }
+
+        // Null packets' counters mean nothing
+        if (pid == ClusterAnalysis::noPid || !(adaptation & 1))
+            continue;
+
+        // The counter goes up with each packet that has a payload. Sending one twice is allowed.
+        const int counter = p[3] & 0x0F;
+        if (counts.firstCounter < 0)
+        {
+            counts.firstCounter = counter;
+            counts.firstDiscontinuity = discontinuity;
+        }
+        else if (!discontinuity)
+        {
+            if (counter == counts.lastCounter)
+                ++counts.duplicates;
+            else if (counter != ((counts.lastCounter + 1) & 0x0F))
+                ++counts.continuityErrors;
+        }
+        counts.lastCounter = counter;
+
+        if (!(p[1] & 0x40) || scrambled || payloadStart >= tsPacketSize)
+            continue;
+
+        size_t sectionLength = 0;
+        const unsigned char *section = NULL;
+        if (pid == 0 && analysis.pmtPid == ClusterAnalysis::noPid)
+        {
+            section = wholeSection(p + payloadStart, tsPacketSize - payloadStart, sectionLength);
+            if (section)
+                readPat(section, sectionLength, analysis);
+        }
+        else if (pid == analysis.pmtPid && analysis.streams.empty())
+        {
+            section = wholeSection(p + payloadStart, tsPacketSize - payloadStart, sectionLength);
+            if (section)
+                readPmt(section, sectionLength, analysis);
+        }
+    }
+}
+
+
+PidReport::PidReport() :
+    pid(0),
+    packets(0),
+    scrambled(0),
+    transportErrors(0),
+    continuityErrors(0),
+    duplicates(0),
+    bitrate(0),
+    pcrs(0),
+    pcrDiscontinuities(0),
+    pcrRepetitionErrors(0),
+    pcrIntervalMean(0),
+    pcrIntervalMax(0),
+    pcrJitter(0)
+{
+}
+
+
+StreamReport::StreamReport() :
+    clusters(0),
+    packets(0),
+    syncErrors(0),
+    missingBytes(0),
+    trailingBytes(0),
+    pmtPid(ClusterAnalysis::noPid),
+    pcrPid(ClusterAnalysis::noPid),
+    duration(0),
+    seconds(0)
+{
+}
+
+
+double StreamReport::bitrate() const
+{
+    return duration > 0 ? packets * ClusterAnalysis::tsPacketSize * 8 / duration : 0;
+}
+
+
+unsigned long long StreamReport::continuityErrors() const
+{
+    unsigned long long total = 0;
+    for (size_t i=0; i<pids.size(); ++i)
+        total += pids[i].continuityErrors;
+    return total;
+}
+
+
+unsigned long long StreamReport::scrambled() const
+{
+    unsigned long long total = 0;
+    for (size_t i=0; i<pids.size(); ++i)
+        total += pids[i].scrambled;
+    return total;
+}
+
+
+unsigned long long StreamReport::transportErrors() const
+{
+    unsigned long long total = 0;
+    for (size_t i=0; i<pids.size(); ++i)
+        total += pids[i].transportErrors;
+    return total;
+}
+
+
+bool StreamReport::healthy() const
+{
+    for (size_t i=0; i<pids.size(); ++i)
+    {
+        if (pids[i].pid == pcrPid && (pids[i].pcrDiscontinuities != 0 || pids[i].pcrRepetitionErrors != 0))
+            return false;
+    }
+    return syncErrors == 0 && missingBytes == 0 && continuityErrors() == 0 && transportErrors() == 0;
+}
+
+
+/// Seconds as h:mm:ss
+static string formatDuration(double seconds)
+{
+    const unsigned long long s = (unsigned long long)(seconds + 0.5);
+    ostringstream out;
+    out << s / 3600 << ':' << setfill('0') << setw(2) << s / 60 % 60 << ':' << setw(2) << s % 60;
+    return out.str();
+}
+
+
+static string formatPid(unsigned int pid)
+{
+    ostringstream out;
+    out << "0x" << hex << setfill('0') << setw(4) << pid;
+    return out.str();
+}
+
+
+void StreamReport::write(std::ostream &s) const
+{
+    const ios::fmtflags flags = s.flags();
+    s << dec << fixed << setprecision(2);
+
+    s << path << ": " << formatDuration(duration) << ", " << bitrate() / 1e6 << " Mbit/s, "
+      << packets << " packets in " << clusters << " clusters, " << (healthy() ? "healthy" : "damaged") << '\n';
+    s << "  " << syncErrors << " sync errors, " << continuityErrors() << " continuity errors, "
+      << transportErrors() << " transport errors, " << scrambled() << " scrambled packets";
+    if (missingBytes)
+        s << ", " << missingBytes << " bytes unreadable";
+    if (trailingBytes)
+        s << ", " << trailingBytes << " bytes of a packet at the end";
+    s << '\n';
+
+    for (size_t i=0; i<pids.size(); ++i)
+    {
+        const PidReport &p = pids[i];
+        if (p.pid != pcrPid || p.pcrs == 0)
+            continue;
+        s << "  PCR on PID " << formatPid(p.pid) << ": " << p.pcrs << " PCRs, "
+          << setprecision(1) << p.pcrIntervalMean * 1000 << "ms apart (at most " << p.pcrIntervalMax * 1000
+          << "ms), jitter " << p.pcrJitter * 1000 << "ms, " << p.pcrRepetitionErrors << " gaps over 100ms, "
+          << p.pcrDiscontinuities << " discontinuities\n" << setprecision(2);
+    }
+
+    s << "     PID  Type                  Packets    Mbit/s  CC errors  Repeats  Scrambled  TEI\n";
+    for (size_t i=0; i<pids.size(); ++i)
+    {
+        const PidReport &p = pids[i];
+        s << "  " << formatPid(p.pid) << "  " << left << setw(18) << p.type << right
+          << setw(11) << p.packets << ' '
+          << setw(9) << p.bitrate / 1e6 << ' '
+          << setw(10) << p.continuityErrors << ' '
+          << setw(8) << p.duplicates << ' '
+          << setw(10) << p.scrambled << ' '
+          << setw(4) << p.transportErrors << '\n';
+    }
+
+    s.flags(flags);
+}
+
+
+void StreamReport::writeJson(std::ostream &s) const
+{
+    const ios::fmtflags flags = s.flags();
+    s << dec << fixed << setprecision(6);
+
+    s << "{\n"
+      << "  \"path\": " << jsonString(path) << ",\n"
+      << "  \"size\": " << entry.filesize << ",\n"
+      << "  \"clusters\": " << clusters << ",\n"
+      << "  \"packets\": " << packets << ",\n"
+      << "  \"sync_errors\": " << syncErrors << ",\n"
+      << "  \"missing_bytes\": " << missingBytes << ",\n"
+      << "  \"trailing_bytes\": " << trailingBytes << ",\n"
+      << "  \"pmt_pid\": " << pmtPid << ",\n"
+      << "  \"pcr_pid\": " << pcrPid << ",\n"
+      << "  \"duration\": " << duration << ",\n"
+      << "  \"bitrate\": " << setprecision(0) << bitrate() << setprecision(6) << ",\n"
+      << "  \"healthy\": " << (healthy() ? "true" : "false") << ",\n"
+      << "  \"seconds\": " << seconds << ",\n"
+      << "  \"pids\": [";
+
+    for (size_t i=0; i<pids.size(); ++i)
+    {
+        const PidReport &p = pids[i];
+        s << (i ? "," : "") << "\n    { \"pid\": " << p.pid
+          << ", \"type\": " << jsonString(p.type)
+          << ", \"packets\": " << p.packets
+          << ", \"bitrate\": " << setprecision(0) << p.bitrate << setprecision(6)
+          << ", \"continuity_errors\": " << p.continuityErrors
+          << ", \"duplicates\": " << p.duplicates
+          << ", \"scrambled\": " << p.scrambled
+          << ", \"transport_errors\": " << p.transportErrors;
+        if (p.pcrs)
+        {
+            s << ", \"pcrs\": " << p.pcrs
+              << ", \"pcr_interval_mean\": " << p.pcrIntervalMean
+              << ", \"pcr_interval_max\": " << p.pcrIntervalMax
+              << ", \"pcr_jitter\": " << p.pcrJitter
+              << ", \"pcr_repetition_errors\": " << p.pcrRepetitionErrors
+              << ", \"pcr_discontinuities\": " << p.pcrDiscontinuities;
+        }
+        s << " }";
+    }
+    s << "\n  ]\n}\n";
+
+    s.flags(flags);
+}
+
+
+RecordingProbe::RecordingProbe() :
+    expectedClusters(0),
+    chainClusters(0),
+    sampledClusters(0),
+    sampledPackets(0),
+    scrambledPackets(0),
+    pmtPid(ClusterAnalysis::noPid),
+    pcrPid(ClusterAnalysis::noPid),
+    duration(0),
+    durationFromClock(false),
+    endMissing(false)
+{
+}
+
+
+RecordingProbe::Scrambling RecordingProbe::scrambling() const
+{
+    if (sampledPackets == 0)
+        return ScramblingUnknown;
+    if (scrambledPackets == 0)
+        return Clear;
+    return scrambledPackets == sampledPackets ? Scrambled : PartlyScrambled;
+}
+
+
+const char *RecordingProbe::scramblingName() const
+{
+    switch (scrambling())
+    {
+    case Clear: return "clear";
+    case PartlyScrambled: return "partly scrambled";
+    case Scrambled: return "scrambled";
+    default: return "unknown";
+    }
+}
+
+
+bool RecordingProbe::hd() const
+{
+    for (ElementaryStreams::const_iterator i = streams.begin(); i != streams.end(); ++i)
+    {
+        if (i->second.streamType == 0x1B || i->second.streamType == 0x24)
+            return true;
+    }
+    return false;
+}
+
+
+/// What a PID carries, from the PMT or the PIDs DVB keeps for its tables
+static string pidType(unsigned int pid, const StreamReport &report)
+{
+    const ElementaryStreams::const_iterator stream = report.streams.find(pid);
+    if (stream != report.streams.end())
+        return stream->second.codec();
+    if (pid == report.pmtPid)
+        return "PMT";
+
+    switch (pid)
+    {
+    case 0x0000: return "PAT";
+    case 0x0001: return "CAT";
+    case 0x0010: return "NIT";
+    case 0x0011: return "SDT";
+    case 0x0012: return "EIT";
+    case 0x0014: return "TDT";
+    case ClusterAnalysis::noPid: return "Null";
+    default: return string();
+    }
+}
+
+
+/// Work out the times between a PID's PCRs, and how long they cover altogether
+static double analysePcrs(const vector<PcrSample> &pcrs, PidReport &report)
+{
+    report.pcrs = pcrs.size();
+
+    double total = 0, totalSquared = 0;
+    size_t intervals = 0;
+    for (size_t i=1; i<pcrs.size(); ++i)
+    {
+        // The clock wraps round every 26.5 hours
+        const unsigned long long ticks = (pcrs[i].value + pcrModulus - pcrs[i-1].value) % pcrModulus;
+        if (pcrs[i].discontinuity)
+            continue;
+        if (ticks > pcrJumpLimit)
+        {
+            ++report.pcrDiscontinuities;
+            continue;
+        }
+
+        const double interval = ticks / pcrClock;
+        total += interval;
+        totalSquared += interval * interval;
+        ++intervals;
+        report.pcrIntervalMax = max(report.pcrIntervalMax, interval);
+        if (interval > pcrRepetitionLimit)
+            ++report.pcrRepetitionErrors;
+    }
+
+    if (intervals)
+    {
+        report.pcrIntervalMean = total / intervals;
+        report.pcrJitter = sqrt(max(0.0, totalSquared / intervals - report.pcrIntervalMean * report.pcrIntervalMean));
+    }
+    return total;
+}
+
+
+bool fs::analyseStream(FileSystem &image, const DirEntry &entry, unsigned int threads, StreamReport &report)
+{
+    const chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+    report = StreamReport();
+    report.entry = entry;
+
+    const unsigned long long size = entry.filesize;
+    const size_t clusterBytes = ClusterAnalysis::clusterPackets * ClusterAnalysis::tsPacketSize;
+    const size_t clusters = (size_t)((size + clusterBytes - 1) / clusterBytes);
+    report.clusters = clusters;
+    if (clusters == 0)
+        return true;
+
+    const Extents extents = image.extentsFor(entry);
+    if (extents.empty())
+    {
+        XTVFS_WARNING("No clusters to analyse in a file of " << size << " bytes");
+        return false;
+    }
+
+    // Each thread takes the next cluster as it finishes the last, so they keep roughly in step through the file
+    vector<ClusterAnalysis> analyses(clusters);
+    vector<size_t> readLengths(clusters);
+    std::atomic<size_t> next(0);
+    vector<std::thread> workers;
+    threads = max(1u, min<unsigned int>(threads, clusters));
+    for (unsigned int t=0; t<threads; ++t)
+    {
+        workers.push_back(std::thread([&]()
+        {
+            vector<unsigned char> buffer(clusterBytes);
+            for (size_t c = next++; c < clusters; c = next++)
+            {
+                const unsigned long long offset = (unsigned long long)c * clusterBytes;
+                const size_t length = (size_t)min<unsigned long long>(clusterBytes, size - offset);
+                readLengths[c] = image.readFile(entry, extents, offset, &buffer[0], length);
+                if (readLengths[c] < length)
+                    XTVFS_WARNING("Only read " << readLengths[c] << " of " << length << " bytes at offset " << offset);
+                analyseCluster(&buffer[0], readLengths[c], (unsigned long long)c * ClusterAnalysis::clusterPackets, analyses[c]);
+            }
+        }));
+    }
+    for (size_t t=0; t<workers.size(); ++t)
+        workers[t].join();
+
+    // Put the clusters together in order, checking each PID's counter carries on from the cluster before
+    map<unsigned int, PidCounts> totals;
+    for (size_t c=0; c<clusters; ++c)
+    {
+        const ClusterAnalysis &a = analyses[c];
+        const unsigned long long length = min<unsigned long long>(clusterBytes, size - (unsigned long long)c * clusterBytes);
+        report.missingBytes += length - readLengths[c];
+        report.packets += a.packets;
+        report.syncErrors += a.syncErrors;
+        if (report.streams.empty() && !a.streams.empty())
+        {
+            report.pmtPid = a.pmtPid;
+            report.pcrPid = a.pcrPid;
+            report.streams = a.streams;
+        }
+
+        for (map<unsigned int, PidCounts>::const_iterator i = a.pids.begin(); i != a.pids.end(); ++i)
+        {
+            const PidCounts &counts = i->second;
+            PidCounts &total = totals[i->first];
+            total.packets += counts.packets;
+            total.scrambled += counts.scrambled;
+            total.transportErrors += counts.transportErrors;
+            total.continuityErrors += counts.continuityErrors;
+            total.duplicates += counts.duplicates;
+            total.pcrs.insert(total.pcrs.end(), counts.pcrs.begin(), counts.pcrs.end());
+
+            if (counts.firstCounter < 0)
+                continue;
+            if (total.lastCounter >= 0 && !counts.firstDiscontinuity)
+            {
+                if (counts.firstCounter == total.lastCounter)
+                    ++total.duplicates;
+                else if (counts.firstCounter != ((total.lastCounter + 1) & 0x0F))
+                    ++total.continuityErrors;
+            }
+            total.lastCounter = counts.lastCounter;
+        }
+    }
+    if (report.missingBytes == 0)
+        report.trailingBytes = size % ClusterAnalysis::tsPacketSize;
+
+    // Without a PMT, the PID with the most PCRs gives the time
+    if (report.pcrPid == ClusterAnalysis::noPid)
+    {
+        size_t most = 0;
+        for (map<unsigned int, PidCounts>::const_iterator i = totals.begin(); i != totals.end(); ++i)
+        {
+            if (i->second.pcrs.size() > most)
+            {
+                most = i->second.pcrs.size();
+                report.pcrPid = i->first;
+            }
+        }
+    }
+
+    for (map<unsigned int, PidCounts>::const_iterator i = totals.begin(); i != totals.end(); ++i)
+    {
+        PidReport p;
+        p.pid = i->first;
+        p.type = pidType(p.pid, report);
+        p.packets = i->second.packets;
+        p.scrambled = i->second.scrambled;
+        p.transportErrors = i->second.transportErrors;
+        p.continuityErrors = i->second.continuityErrors;
+        p.duplicates = i->second.duplicates;
+
+        const double covered = analysePcrs(i->second.pcrs, p);
+        if (p.pid == report.pcrPid)
+            report.duration = covered;
+        report.pids.push_back(p);
+    }
+
+    for (size_t i=0; i<report.pids.size(); ++i)
+    {
+        if (report.duration > 0)
+            report.pids[i].bitrate = report.pids[i].packets * ClusterAnalysis::tsPacketSize * 8 / report.duration;
+    }
+
+    report.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    XTVFS_DEBUG("Analysed " << report.packets << " packets in " << clusters << " clusters on " << threads
+                << " threads in " << report.seconds << "s");
+    return true;
+}
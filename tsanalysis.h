@@ -0,0 +1,233 @@
+/* This file is part of XTVFS Reader.
+ * Copyright (C) 2014 S. Blackburn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * XTVFS Reader is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with XTVFS Reader.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef XTVFS_TSANALYSIS_H
+#define XTVFS_TSANALYSIS_H
+
+#include "filesystem.h"
+
+#include <iosfwd>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace fs
+{
+
+
+/// A program clock reference, and where in the recording it was
+class PcrSample
+{
+  public:
+    unsigned long long packet;          ///< Index of the packet it was in, from the start of the recording
+    unsigned long long value;           ///< 27MHz clock
+    bool discontinuity;                 ///< The packet's adaptation field said the clock jumps here
+};
+
+
+/// One of the program's streams, as the PMT describes it
+class ElementaryStream
+{
+  public:
+    ElementaryStream();
+
+    unsigned char streamType;
+    unsigned char descriptorTag;        ///< For private data (type 0x06), the descriptor saying what it is, e.g. 0x6A for AC-3
+
+    /// "MPEG-2 video", "AC-3", "DVB subtitles" and so on
+    std::string codec() const;
+};
+
+typedef std::map<unsigned int, ElementaryStream> ElementaryStreams;
+
+
+/// What one PID's packets did in part of a recording
+class PidCounts
+{
+  public:
+    PidCounts();
+
+    unsigned long long packets;
+    unsigned long long scrambled;       ///< Packets with their scrambling control bits set
+    unsigned long long transportErrors; ///< Packets the tuner marked as damaged
+    unsigned long long continuityErrors;
+    unsigned long long duplicates;      ///< Packets repeating the continuity counter of the one before, which is allowed
+    int firstCounter;                   ///< Continuity counter of the first packet with a payload, -1 if there wasn't one
+    bool firstDiscontinuity;            ///< That packet flagged a discontinuity, so needn't follow on from the part before
+    int lastCounter;
+    std::vector<PcrSample> pcrs;
+};
+
+
+/**
+ * What one video cluster of a recording held.
+ * Each cluster is a whole number of packets, so clusters can be analysed on
+ * any thread in any order, and then put together with what came before.
+ */
+class ClusterAnalysis
+{
+  public:
+    ClusterAnalysis();
+
+    unsigned long long firstPacket;     ///< Index in the recording of the cluster's first packet
+    size_t packets;
+    size_t syncErrors;                  ///< Packets not starting with the sync byte, which aren't looked into any further
+    std::map<unsigned int, PidCounts> pids;
+
+    /// From the first PAT and PMT in the cluster that each fit in a packet, which Sky's always do
+    unsigned int pmtPid;
+    unsigned int pcrPid;
+    ElementaryStreams streams;
+
+    /// Packets in a video cluster, and in each piece of any other file that is analysed
+    static const size_t clusterPackets = 8192;
+
+    static const size_t tsPacketSize = 188;
+
+    /// The null packets' PID, also used here for a PID that hasn't been found
+    static const unsigned int noPid = 0x1FFF;
+};
+
+
+/**
+ * Count what is in a cluster's packets. Any part of a packet at the end is left out.
+ * @param firstPacket Index in the recording of the first packet, for placing the PCRs
+ */
+void analyseCluster(const unsigned char *data, size_t length, unsigned long long firstPacket, ClusterAnalysis &analysis);
+
+
+/// A PID's packets over the whole recording
+class PidReport
+{
+  public:
+    PidReport();
+
+    unsigned int pid;
+    std::string type;                   ///< The stream's codec, or the table it carries, if known
+    unsigned long long packets;
+    unsigned long long scrambled;
+    unsigned long long transportErrors;
+    unsigned long long continuityErrors;
+    unsigned long long duplicates;
+    double bitrate;                     ///< Bits per second, over the recording's duration
+
+    size_t pcrs;
+    size_t pcrDiscontinuities;          ///< Clock jumps, back or more than a second forwards, that weren't flagged
+    size_t pcrRepetitionErrors;         ///< Gaps of more than 100ms between PCRs
+    double pcrIntervalMean;             ///< Seconds between PCRs
+    double pcrIntervalMax;
+    double pcrJitter;                   ///< Standard deviation of the time between PCRs, in seconds
+};
+
+
+/**
+ * A health report on one recording.
+ *
+ * A recording is a partial transport stream, so its packets' positions say
+ * nothing about when they arrived, and PCR jitter can't be measured against
+ * a constant rate the way it would be on air. The time between PCRs is
+ * looked at instead.
+ */
+class StreamReport
+{
+  public:
+    StreamReport();
+
+    std::string path;                   ///< Left for the caller to fill in
+    DirEntry entry;
+    size_t clusters;
+    unsigned long long packets;
+    unsigned long long syncErrors;
+    unsigned long long missingBytes;    ///< Of the file's size, bytes that couldn't be read
+    size_t trailingBytes;               ///< Of a packet cut short at the end
+    unsigned int pmtPid;
+    unsigned int pcrPid;                ///< Whose PCRs give the duration
+    ElementaryStreams streams;          ///< From the first PMT
+    double duration;                    ///< Seconds, from the PCRs
+    double seconds;                     ///< Taken to analyse it
+    std::vector<PidReport> pids;        ///< In PID order
+
+    /// Bits per second, over all the PIDs
+    double bitrate() const;
+
+    unsigned long long continuityErrors() const;
+    unsigned long long scrambled() const;
+    unsigned long long transportErrors() const;
+
+    /// Nothing lost or damaged, and no gaps in the clock. A packet cut short at the very end is allowed.
+    bool healthy() const;
+
+    /// A summary, then a table of the PIDs
+    void write(std::ostream &s) const;
+
+    /// Everything, as one JSON object
+    void writeJson(std::ostream &s) const;
+};
+
+
+/**
+ * A quick look at a recording, from a few of its clusters rather than all
+ * of it, made by Xtvfs::probeRecording() for sorting through a whole disk.
+ */
+class RecordingProbe
+{
+  public:
+    RecordingProbe();
+
+    enum Scrambling { ScramblingUnknown, Clear, PartlyScrambled, Scrambled };
+
+    size_t expectedClusters;            ///< What the file's size says its chain should have
+    size_t chainClusters;               ///< Found from STREAM.EXN or the VFAT
+    size_t sampledClusters;
+    unsigned long long sampledPackets;  ///< Of the elementary streams, in the sampled clusters
+    unsigned long long scrambledPackets;
+    unsigned int pmtPid;
+    unsigned int pcrPid;
+    ElementaryStreams streams;          ///< From the first PMT
+    double duration;                    ///< Seconds, estimated
+    bool durationFromClock;             ///< From the PCRs of the first and last clusters, rather than a bit rate scaled up
+    bool endMissing;                    ///< The end of the file couldn't be read, or isn't transport stream
+
+    /// The chain has fewer clusters than the file's size needs
+    bool chainShort() const { return chainClusters < expectedClusters; }
+
+    bool truncated() const { return chainShort() || endMissing; }
+
+    Scrambling scrambling() const;
+
+    /// "clear", "partly scrambled" and so on
+    const char *scramblingName() const;
+
+    /// Sky broadcasts HD in H.264, and SD in MPEG-2
+    bool hd() const;
+};
+
+
+/**
+ * Analyse a recording's transport stream, a cluster at a time on several
+ * threads, so a whole recording can be checked about as fast as the disk
+ * can be read. Each thread reads and analyses its next cluster, then the
+ * clusters are put together in order, continuity counters being checked
+ * across the joins. Files outside the video area are taken a cluster's
+ * worth of packets at a time in the same way.
+ * @param threads How many clusters to read and analyse at once
+ * @return False if the file couldn't be read at all
+ */
+bool analyseStream(FileSystem &image, const DirEntry &entry, unsigned int threads, StreamReport &report);
+
+} // end of namespace fs
+
+#endif // XTVFS_TSANALYSIS_H
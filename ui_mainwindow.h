@@ -22,7 +22,7 @@
 #include <QtWidgets/QMenuBar>
 #include <QtWidgets/QSplitter>
 #include <QtWidgets/QStatusBar>
-#include <QtWidgets/QTableWidget>
+#include <QtWidgets/QTableView>
 #include <QtWidgets/QToolBar>
 #include <QtWidgets/QVBoxLayout>
 #include <QtWidgets/QWidget>
@@ -45,10 +45,10 @@ public:
     QGridLayout *gridLayout;
     QLabel *label_2;
     QLabel *pathLbl;
-    QTableWidget *tableWidget;
+    QTableView *tableWidget;
     QFrame *SkyDBFrame;
     QVBoxLayout *verticalLayout;
-    QTableWidget *recordingsTW;
+    QTableView *recordingsTW;
     QMenuBar *menuBar;
     QMenu *menuFile;
     QMenu *menuHelp;
@@ -106,7 +106,7 @@ public:
 
         gridLayout->addWidget(pathLbl, 0, 1, 1, 1);
 
-        tableWidget = new QTableWidget(FilesystemFrame);
+        tableWidget = new QTableView(FilesystemFrame);
         tableWidget->setObjectName(QStringLiteral("tableWidget"));
         tableWidget->setEditTriggers(QAbstractItemView::NoEditTriggers);
         tableWidget->setSelectionMode(QAbstractItemView::SingleSelection);
@@ -123,19 +123,7 @@ public:
         verticalLayout->setSpacing(6);
         verticalLayout->setContentsMargins(11, 11, 11, 11);
         verticalLayout->setObjectName(QStringLiteral("verticalLayout"));
-        recordingsTW = new QTableWidget(SkyDBFrame);
-        if (recordingsTW->columnCount() < 5)
-            recordingsTW->setColumnCount(5);
-        QTableWidgetItem *__qtablewidgetitem = new QTableWidgetItem();
-        recordingsTW->setHorizontalHeaderItem(0, __qtablewidgetitem);
-        QTableWidgetItem *__qtablewidgetitem1 = new QTableWidgetItem();
-        recordingsTW->setHorizontalHeaderItem(1, __qtablewidgetitem1);
-        QTableWidgetItem *__qtablewidgetitem2 = new QTableWidgetItem();
-        recordingsTW->setHorizontalHeaderItem(2, __qtablewidgetitem2);
-        QTableWidgetItem *__qtablewidgetitem3 = new QTableWidgetItem();
-        recordingsTW->setHorizontalHeaderItem(3, __qtablewidgetitem3);
-        QTableWidgetItem *__qtablewidgetitem4 = new QTableWidgetItem();
-        recordingsTW->setHorizontalHeaderItem(4, __qtablewidgetitem4);
+        recordingsTW = new QTableView(SkyDBFrame);
         recordingsTW->setObjectName(QStringLiteral("recordingsTW"));
         recordingsTW->setSelectionBehavior(QAbstractItemView::SelectRows);
         recordingsTW->setSortingEnabled(true);
@@ -197,16 +185,6 @@ public:
         actionExit->setText(QApplication::translate("MainWindow", "Exit", 0));
         label_2->setText(QApplication::translate("MainWindow", "Current Path:", 0));
         pathLbl->setText(QString());
-        QTableWidgetItem *___qtablewidgetitem = recordingsTW->horizontalHeaderItem(0);
-        ___qtablewidgetitem->setText(QApplication::translate("MainWindow", "Time", 0));
-        QTableWidgetItem *___qtablewidgetitem1 = recordingsTW->horizontalHeaderItem(1);
-        ___qtablewidgetitem1->setText(QApplication::translate("MainWindow", "Duration", 0));
-        QTableWidgetItem *___qtablewidgetitem2 = recordingsTW->horizontalHeaderItem(2);
-        ___qtablewidgetitem2->setText(QApplication::translate("MainWindow", "Name", 0));
-        QTableWidgetItem *___qtablewidgetitem3 = recordingsTW->horizontalHeaderItem(3);
-        ___qtablewidgetitem3->setText(QApplication::translate("MainWindow", "Channel", 0));
-        QTableWidgetItem *___qtablewidgetitem4 = recordingsTW->horizontalHeaderItem(4);
-        ___qtablewidgetitem4->setText(QApplication::translate("MainWindow", "Synopsis", 0));
         menuFile->setTitle(QApplication::translate("MainWindow", "File", 0));
         menuHelp->setTitle(QApplication::translate("MainWindow", "Help", 0));
     } // retranslateUi
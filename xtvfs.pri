@@ -0,0 +1,37 @@
+# The file system library, shared by the GUI and the command line tools.
+# Include this from each target's .pro file.
+
+CONFIG += c++11
+
+INCLUDEPATH += $$PWD
+
+SOURCES += $$PWD/filesystem.cpp \
+    $$PWD/blockdevice.cpp \
+    $$PWD/clustercache.cpp \
+    $$PWD/iostats.cpp \
+    $$PWD/json.cpp \
+    $$PWD/layout.cpp \
+    $$PWD/log.cpp \
+    $$PWD/pathcache.cpp \
+    $$PWD/probe.cpp \
+    $$PWD/remux.cpp \
+    $$PWD/tsanalysis.cpp
+
+HEADERS += $$PWD/filesystem.h \
+    $$PWD/blockdevice.h \
+    $$PWD/clustercache.h \
+    $$PWD/iostats.h \
+    $$PWD/json.h \
+    $$PWD/layout.h \
+    $$PWD/log.h \
+    $$PWD/pathcache.h \
+    $$PWD/probe.h \
+    $$PWD/remux.h \
+    $$PWD/tsanalysis.h
+
+# Read seekable zstd compressed images in place, if libzstd is available
+packagesExist(libzstd) {
+    CONFIG += link_pkgconfig
+    PKGCONFIG += libzstd
+    DEFINES += HAVE_ZSTD
+}
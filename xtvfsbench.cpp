@@ -0,0 +1,657 @@
+/* This file is part of XTVFS Reader.
+ * Copyright (C) 2014 S. Blackburn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * XTVFS Reader is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with XTVFS Reader.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * xtvfsbench - time the file system library against an image, so changes to
+ * how it reads can be measured rather than guessed at.
+ *
+ * Usage: xtvfsbench [options] <image>
+ *
+ * Each benchmark records the time of every operation, and reports the
+ * percentiles of those along with the overall rate. Images to run it against
+ * can be made with xtvfsgen, e.g. with more --fragmentation to see how chain
+ * walking copes.
+ */
+#include "filesystem.h"
+#include "iostats.h"
+#include "json.h"
+#include "log.h"
+#include "probe.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <unistd.h>
+
+using namespace std;
+using namespace fs;
+
+namespace
+{
+
+/// Settings from the command line
+struct Options
+{
+    Options() : iterations(5), directIo(false), bufferSize(8 * 1024 * 1024),
+        cacheSize(CachedBlockDevice::defaultCacheSize), extractLimit(256ULL * 1024 * 1024), lookups(1000), json(false) {}
+
+    unsigned int iterations;            ///< Times to repeat each benchmark
+    bool directIo;                      ///< Read the image with O_DIRECT
+    size_t bufferSize;                  ///< Bytes per read when extracting
+    size_t cacheSize;                   ///< Bytes of the image the file system may keep in memory
+    unsigned long long extractLimit;    ///< Bytes to extract of each kind of file per iteration
+    unsigned int lookups;               ///< infoFor() calls per iteration
+    bool json;                          ///< Write the results as JSON rather than a table
+    string only;                        ///< Only run benchmarks whose names start with this
+};
+
+Options options;
+
+typedef std::chrono::steady_clock Clock;
+
+
+void usage(const char *program)
+{
+    cerr << "Usage: " << program << " [options] <image>\n"
+            "\n"
+            "Benchmarks:\n"
+            "  open-cold       Open the image after asking the OS to drop it from its cache\n"
+            "  open-warm       Open the image again\n"
+            "  list-tree       readDirectory() on every directory\n"
+            "  list-packed     scanDirectory() on every directory, into one listing\n"
+            "  info-for        infoFor() on the most deeply nested files\n"
+            "  chain-fat       followChain() on every FAT file, reading the FAT from the disk\n"
+            "  chain-video     followChain() on every video file, reading the VFAT from the disk\n"
+            "  chain-*-cached  The same after cacheAllocationTables()\n"
+            "  extent-file     readExtentFile() on every recording's STREAM.EXN\n"
+            "  extract-fat     readFile() through FAT files\n"
+            "  extract-video   readFile() through video files\n"
+            "  copy-video      copyFile() of video files to a stream\n"
+            "\n"
+            "Options:\n"
+            "  -n, --iterations N  Repeat each benchmark N times (default 5)\n"
+            "      --io MODE       buffered (default) or direct, to bypass the page cache\n"
+            "      --buffer MB     Size of each read when extracting (default 8)\n"
+            "      --cache MB      Memory for caching the image, 0 for none (default 64)\n"
+            "      --extract MB    Data to extract of each kind per iteration (default 256)\n"
+            "      --lookups N     infoFor() calls per iteration (default 1000)\n"
+            "      --only PREFIX   Only run benchmarks whose names start with PREFIX\n"
+            "      --json          Write the results to standard output as JSON\n";
+}
+
+
+/// The timings of one benchmark
+class Result
+{
+public:
+    Result(const string &name) : name(name), bytes(0), items(0), elapsed(0) {}
+
+    string name;
+    vector<double> latencies;       ///< Seconds taken by each operation
+    unsigned long long bytes;       ///< Data moved, for throughput
+    unsigned long long items;       ///< Other things counted, e.g. clusters walked
+    string itemName;
+    double elapsed;                 ///< Seconds for all the iterations
+
+    /// Latency at a percentile (0-100), by the nearest rank
+    double percentile(double p) const
+    {
+        if (latencies.empty())
+            return 0;
+        vector<double> sorted(latencies);
+        std::sort(sorted.begin(), sorted.end());
+        size_t rank = (size_t)(p / 100 * sorted.size() + 0.5);
+        rank = std::min(std::max<size_t>(rank, 1), sorted.size());
+        return sorted[rank - 1];
+    }
+
+    double mean() const
+    {
+        double total = 0;
+        for (size_t i=0; i<latencies.size(); ++i)
+            total += latencies[i];
+        return latencies.empty() ? 0 : total / latencies.size();
+    }
+
+    double opsPerSecond() const { return elapsed > 0 ? latencies.size() / elapsed : 0; }
+    double megabytesPerSecond() const { return elapsed > 0 ? bytes / elapsed / (1024 * 1024) : 0; }
+};
+
+typedef vector<Result> Results;
+
+
+/// Times one operation, adding it to a result
+class Stopwatch
+{
+public:
+    Stopwatch(Result &result) : m_result(result), m_start(Clock::now()) {}
+
+    ~Stopwatch()
+    {
+        const double seconds = std::chrono::duration<double>(Clock::now() - m_start).count();
+        m_result.latencies.push_back(seconds);
+        m_result.elapsed += seconds;
+    }
+
+private:
+    Result &m_result;
+    Clock::time_point m_start;
+};
+
+
+/// Ask the OS to forget what it has cached of a file. Only a hint, but enough for plain images.
+void dropFromCache(const string &path)
+{
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    ::close(fd);
+}
+
+
+/// Probe the image and take the first volume on it
+std::shared_ptr<FileSystem> openImage(const string &path)
+{
+    BlockDevicePtr device = BlockDevice::open(path, options.directIo);
+    ProbedVolumes volumes;
+    if (!device || !probeImage(device, volumes, options.cacheSize))
+        return std::shared_ptr<FileSystem>();
+
+    return volumes.front().fileSystem;
+}
+
+
+/// Everything on the image, found once so the benchmarks don't time finding it
+struct Tree
+{
+    struct File
+    {
+        string path;
+        DirEntry entry;
+        size_t depth;
+    };
+
+    /// A recording's video and the STREAM.EXN beside it
+    struct Recording
+    {
+        DirEntry video;
+        DirEntry exn;
+    };
+
+    vector<size_t> directories;     ///< First clusters, starting with the root's
+    vector<File> files;
+    vector<Recording> recordings;
+};
+
+
+void walk(FileSystem *diskImage, const string &dirPath, size_t cluster, size_t depth, Tree &tree)
+{
+    tree.directories.push_back(cluster);
+
+    const DirEntries entries = diskImage->readDirectory(cluster);
+    const DirEntry *video = NULL, *exn = NULL;
+    for (size_t i=0; i<entries.size(); ++i)
+    {
+        const DirEntry &d = entries[i];
+        if (d.isVolumeId() || d.filename[0] == '.')
+            continue;
+
+        if (d.isDirectory())
+        {
+            if (d.firstCluster != 0)
+                walk(diskImage, dirPath + d.toString() + "/", d.firstCluster, depth + 1, tree);
+        }
+        else if (d.firstCluster != 0 && d.filesize > 0)
+        {
+            Tree::File f;
+            f.path = dirPath + d.toString();
+            f.entry = d;
+            f.depth = depth;
+            tree.files.push_back(f);
+
+            if (d.isDevice())
+                video = &d;
+            else if (d.filename == "STREAM  EXN")
+                exn = &d;
+        }
+    }
+
+    if (video != NULL && exn != NULL)
+    {
+        Tree::Recording recording;
+        recording.video = *video;
+        recording.exn = *exn;
+        tree.recordings.push_back(recording);
+    }
+}
+
+
+/// An ostream that throws away what's written to it
+class NullBuffer : public std::streambuf
+{
+protected:
+    virtual int overflow(int c) { return c; }
+    virtual std::streamsize xsputn(const char *, std::streamsize n) { return n; }
+};
+
+
+
+// ===========================================================================
+// ==                      B E N C H M A R K S                              ==
+// ===========================================================================
+
+void benchmarkOpen(const string &image, Results &results)
+{
+    Result cold("open-cold"), warm("open-warm");
+    for (unsigned int i=0; i<options.iterations; ++i)
+    {
+        dropFromCache(image);
+        {
+            Stopwatch timer(cold);
+            openImage(image);
+        }
+        {
+            Stopwatch timer(warm);
+            openImage(image);
+        }
+    }
+    results.push_back(cold);
+    results.push_back(warm);
+}
+
+
+void benchmarkListing(FileSystem *diskImage, const Tree &tree, Results &results)
+{
+    Result result("list-tree");
+    result.itemName = "entries";
+    for (unsigned int i=0; i<options.iterations; ++i)
+        for (size_t d=0; d<tree.directories.size(); ++d)
+        {
+            Stopwatch timer(result);
+            result.items += diskImage->readDirectory(tree.directories[d]).size();
+        }
+    results.push_back(result);
+
+    // The same into one reused listing, which allocates nothing once it's big enough
+    Result scan("list-packed");
+    scan.itemName = "entries";
+    DirListing listing;
+    for (unsigned int i=0; i<options.iterations; ++i)
+        for (size_t d=0; d<tree.directories.size(); ++d)
+        {
+            Stopwatch timer(scan);
+            diskImage->scanDirectory(listing, tree.directories[d]);
+            scan.items += listing.entries.size();
+        }
+    results.push_back(scan);
+}
+
+
+void benchmarkLookups(FileSystem *diskImage, const Tree &tree, Results &results)
+{
+    if (tree.files.empty())
+        return;
+
+    // The deepest files take the most directories to get to
+    vector<const Tree::File*> deepest;
+    for (size_t i=0; i<tree.files.size(); ++i)
+        deepest.push_back(&tree.files[i]);
+    std::stable_sort(deepest.begin(), deepest.end(),
+                     [](const Tree::File *a, const Tree::File *b) { return a->depth > b->depth; });
+    deepest.resize(std::min<size_t>(deepest.size(), 100));
+
+    Result result("info-for");
+    result.itemName = "levels";
+    result.items = deepest.front()->depth + 1;
+    for (unsigned int i=0; i<options.iterations; ++i)
+        for (unsigned int n=0; n<options.lookups; ++n)
+        {
+            Stopwatch timer(result);
+            diskImage->infoFor(deepest[n % deepest.size()]->path);
+        }
+    results.push_back(result);
+}
+
+
+void benchmarkChains(FileSystem *diskImage, const Tree &tree, const string &suffix, Results &results)
+{
+    Result fat("chain-fat" + suffix), video("chain-video" + suffix);
+    fat.itemName = video.itemName = "clusters";
+    for (unsigned int i=0; i<options.iterations; ++i)
+        for (size_t f=0; f<tree.files.size(); ++f)
+        {
+            const DirEntry &entry = tree.files[f].entry;
+            Result &result = entry.isDevice() ? video : fat;
+            Extents extents;
+            {
+                Stopwatch timer(result);
+                extents = diskImage->followChain(entry);
+            }
+            if (!extents.empty())
+                result.items += extents.back().fileCluster + extents.back().clusterCount;
+        }
+
+    if (!fat.latencies.empty())
+        results.push_back(fat);
+    if (!video.latencies.empty())
+        results.push_back(video);
+}
+
+
+void benchmarkExtentFiles(Xtvfs *diskImage, const Tree &tree, Results &results)
+{
+    Result result("extent-file");
+    result.itemName = "clusters";
+    for (unsigned int i=0; i<options.iterations; ++i)
+        for (size_t r=0; r<tree.recordings.size(); ++r)
+        {
+            const Tree::Recording &recording = tree.recordings[r];
+            Extents extents;
+            bool ok;
+            {
+                Stopwatch timer(result);
+                ok = diskImage->readExtentFile(recording.exn, recording.video, extents);
+            }
+            if (ok && !extents.empty())
+                result.items += extents.back().fileCluster + extents.back().clusterCount;
+        }
+
+    if (!result.latencies.empty())
+        results.push_back(result);
+}
+
+
+void benchmarkExtraction(FileSystem *diskImage, const Tree &tree, bool videos, Results &results)
+{
+    Result result(videos ? "extract-video" : "extract-fat");
+    vector<char> buffer(options.bufferSize);
+
+    for (unsigned int i=0; i<options.iterations; ++i)
+    {
+        unsigned long long budget = options.extractLimit;
+        for (size_t f=0; f<tree.files.size() && budget > 0; ++f)
+        {
+            const DirEntry &entry = tree.files[f].entry;
+            if (entry.isDevice() != videos)
+                continue;
+
+            const Extents extents = diskImage->extentsFor(entry);
+            for (unsigned long long offset=0; offset<entry.filesize && budget > 0; )
+            {
+                size_t got;
+                {
+                    Stopwatch timer(result);
+                    got = diskImage->readFile(entry, extents, offset, &buffer[0], std::min<unsigned long long>(buffer.size(), budget));
+                }
+                if (got == 0)
+                    break;
+                offset += got;
+                budget -= std::min<unsigned long long>(got, budget);
+                result.bytes += got;
+            }
+        }
+    }
+
+    if (result.bytes > 0)
+        results.push_back(result);
+}
+
+
+void benchmarkCopy(FileSystem *diskImage, const Tree &tree, Results &results)
+{
+    Result result("copy-video");
+    NullBuffer discard;
+    std::ostream sink(&discard);
+
+    for (unsigned int i=0; i<options.iterations; ++i)
+    {
+        unsigned long long done = 0;
+        for (size_t f=0; f<tree.files.size() && done < options.extractLimit; ++f)
+        {
+            if (!tree.files[f].entry.isDevice())
+                continue;
+            Stopwatch timer(result);
+            diskImage->copyFile(sink, tree.files[f].path);
+            done += tree.files[f].entry.filesize;
+        }
+        result.bytes += done;
+    }
+
+    if (result.bytes > 0)
+        results.push_back(result);
+}
+
+
+
+// ===========================================================================
+// ==                         R E P O R T I N G                             ==
+// ===========================================================================
+
+void writeJson(std::ostream &s, const string &image, const Results &results, const IoCounters &io)
+{
+    s << std::fixed << std::setprecision(3);
+    s << "{\n"
+      << "  \"image\": " << jsonString(image) << ",\n"
+      << "  \"iterations\": " << options.iterations << ",\n"
+      << "  \"io\": \"" << (options.directIo ? "direct" : "buffered") << "\",\n"
+      << "  \"buffer_bytes\": " << options.bufferSize << ",\n"
+      << "  \"cache_bytes\": " << options.cacheSize << ",\n"
+      << "  \"benchmarks\": [";
+    for (size_t i=0; i<results.size(); ++i)
+    {
+        const Result &r = results[i];
+        s << (i ? "," : "") << "\n    {\n"
+          << "      \"name\": " << jsonString(r.name) << ",\n"
+          << "      \"ops\": " << r.latencies.size() << ",\n"
+          << "      \"seconds\": " << std::setprecision(6) << r.elapsed << std::setprecision(3) << ",\n"
+          << "      \"ops_per_sec\": " << r.opsPerSecond() << ",\n"
+          << "      \"latency_us\": { "
+          << "\"mean\": " << r.mean() * 1e6
+          << ", \"p50\": " << r.percentile(50) * 1e6
+          << ", \"p90\": " << r.percentile(90) * 1e6
+          << ", \"p99\": " << r.percentile(99) * 1e6
+          << ", \"max\": " << r.percentile(100) * 1e6 << " }";
+        if (r.bytes > 0)
+            s << ",\n      \"bytes\": " << r.bytes
+              << ",\n      \"mb_per_sec\": " << r.megabytesPerSecond();
+        if (!r.itemName.empty())
+            s << ",\n      " << jsonString(r.itemName) << ": " << r.items;
+        s << "\n    }";
+    }
+    s << "\n  ],\n  \"io\": ";
+    io.writeJson(s, 2);
+    s << "\n}\n";
+}
+
+
+void writeTable(std::ostream &s, const Results &results)
+{
+    s << std::left << std::setw(20) << "benchmark" << std::right
+      << std::setw(9) << "ops"
+      << std::setw(12) << "p50 us"
+      << std::setw(12) << "p90 us"
+      << std::setw(12) << "p99 us"
+      << std::setw(12) << "max us"
+      << std::setw(12) << "ops/s"
+      << std::setw(10) << "MB/s" << "\n";
+
+    s << std::fixed << std::setprecision(1);
+    for (size_t i=0; i<results.size(); ++i)
+    {
+        const Result &r = results[i];
+        s << std::left << std::setw(20) << r.name << std::right
+          << std::setw(9) << r.latencies.size()
+          << std::setw(12) << r.percentile(50) * 1e6
+          << std::setw(12) << r.percentile(90) * 1e6
+          << std::setw(12) << r.percentile(99) * 1e6
+          << std::setw(12) << r.percentile(100) * 1e6
+          << std::setw(12) << r.opsPerSecond();
+        if (r.bytes > 0)
+            s << std::setw(10) << r.megabytesPerSecond();
+        else
+            s << std::setw(10) << "-";
+        if (!r.itemName.empty())
+            s << "  " << r.items << " " << r.itemName;
+        s << "\n";
+    }
+}
+
+
+/// Whether a benchmark, or a group of them, was asked for
+bool selected(const string &name)
+{
+    const string &only = options.only;
+    return name.compare(0, only.size(), only) == 0 || only.compare(0, name.size(), name) == 0;
+}
+
+} // end of anonymous namespace
+
+
+
+int main(int argc, char *argv[])
+{
+    enum { IoOption = 1000, BufferOption, CacheOption, ExtractOption, LookupsOption, OnlyOption, JsonOption };
+    static const struct option longOptions[] =
+    {
+        { "iterations", required_argument, NULL, 'n' },
+        { "io",         required_argument, NULL, IoOption },
+        { "buffer",     required_argument, NULL, BufferOption },
+        { "cache",      required_argument, NULL, CacheOption },
+        { "extract",    required_argument, NULL, ExtractOption },
+        { "lookups",    required_argument, NULL, LookupsOption },
+        { "only",       required_argument, NULL, OnlyOption },
+        { "json",       no_argument,       NULL, JsonOption },
+        { "help",       no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    Log::setLevel(LogWarning);
+
+    int c;
+    while ((c = getopt_long(argc, argv, "n:h", longOptions, NULL)) != -1)
+    {
+        switch (c)
+        {
+        case 'n':
+            options.iterations = std::max(1, atoi(optarg));
+            break;
+        case IoOption:
+            if (string(optarg) == "direct")
+                options.directIo = true;
+            else if (string(optarg) == "buffered")
+                options.directIo = false;
+            else
+            {
+                cerr << "Unknown I/O mode: " << optarg << endl;
+                return 2;
+            }
+            break;
+        case BufferOption:
+            options.bufferSize = std::max(1, atoi(optarg)) * 1024 * 1024;
+            break;
+        case CacheOption:
+            options.cacheSize = (size_t)std::max(0, atoi(optarg)) * 1024 * 1024;
+            break;
+        case ExtractOption:
+            options.extractLimit = std::max(1, atoi(optarg)) * 1024ULL * 1024;
+            break;
+        case LookupsOption:
+            options.lookups = std::max(1, atoi(optarg));
+            break;
+        case OnlyOption:
+            options.only = optarg;
+            break;
+        case JsonOption:
+            options.json = true;
+            break;
+        default:
+            usage(argv[0]);
+            return (c == 'h') ? 0 : 2;
+        }
+    }
+
+    if (argc - optind != 1)
+    {
+        usage(argv[0]);
+        return 2;
+    }
+
+    const string image = argv[optind];
+    std::shared_ptr<FileSystem> diskImage = openImage(image);
+    if (!diskImage)
+    {
+        cerr << "Unable to find an XTVFS or FAT32 volume on " << image << endl;
+        return 1;
+    }
+
+    Tree tree;
+    walk(diskImage.get(), string(), (size_t)-1, 0, tree);
+
+    const IoCounters startCounters = ioStats().snapshot();
+    Results timings;
+    if (selected("open"))
+        benchmarkOpen(image, timings);
+    if (selected("list"))
+        benchmarkListing(diskImage.get(), tree, timings);
+    if (selected("info-for"))
+        benchmarkLookups(diskImage.get(), tree, timings);
+    if (selected("chain"))
+    {
+        benchmarkChains(diskImage.get(), tree, "", timings);
+
+        // The same again with the tables in memory, on a file system of its own
+        std::shared_ptr<FileSystem> cached = openImage(image);
+        Result load("cache-tables");
+        {
+            Stopwatch timer(load);
+            cached->cacheAllocationTables();
+        }
+        timings.push_back(load);
+        benchmarkChains(cached.get(), tree, "-cached", timings);
+    }
+    if (selected("extent-file"))
+        if (Xtvfs *xtvfs = dynamic_cast<Xtvfs *>(diskImage.get()))
+            benchmarkExtentFiles(xtvfs, tree, timings);
+    if (selected("extract-fat"))
+        benchmarkExtraction(diskImage.get(), tree, false, timings);
+    if (selected("extract-video"))
+        benchmarkExtraction(diskImage.get(), tree, true, timings);
+    if (selected("copy-video"))
+        benchmarkCopy(diskImage.get(), tree, timings);
+
+    // Groups run together, e.g. the chain walks, so leave out what wasn't asked for
+    for (size_t i=timings.size(); i-- > 0; )
+        if (timings[i].name.compare(0, options.only.size(), options.only) != 0)
+            timings.erase(timings.begin() + i);
+
+    if (options.json)
+        writeJson(cout, image, timings, ioStats().snapshot() - startCounters);
+    else
+        writeTable(cout, timings);
+
+    return 0;
+}
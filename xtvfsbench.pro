@@ -0,0 +1,17 @@
+#-------------------------------------------------
+#
+# Benchmarks for the file system library: opening,
+# listing, lookups, chain walking and extraction,
+# reported as latency percentiles and throughput.
+#
+#-------------------------------------------------
+
+TARGET = xtvfsbench
+TEMPLATE = app
+
+CONFIG += console thread
+CONFIG -= app_bundle qt
+
+include(xtvfs.pri)
+
+SOURCES += xtvfsbench.cpp
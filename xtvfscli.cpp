@@ -0,0 +1,1120 @@
+/* This file is part of XTVFS Reader.
+ * Copyright (C) 2014 S. Blackburn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * XTVFS Reader is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with XTVFS Reader.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * xtvfscli - command line access to XTVFS / FAT32 images, for scripts and servers
+ *
+ * Usage: xtvfscli [options] <command> <image> [arguments]
+ */
+#include "filesystem.h"
+#include "iostats.h"
+#include "layout.h"
+#include "log.h"
+#include "pathcache.h"
+#include "planner.h"
+#include "probe.h"
+#include "remux.h"
+#include "tsanalysis.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <unistd.h>
+
+using namespace std;
+using namespace fs;
+
+namespace
+{
+
+/// Settings from the command line
+struct Options
+{
+    Options() : jobs(1), directIo(false), bufferSize(8 * 1024 * 1024),
+                cacheSize(CachedBlockDevice::defaultCacheSize), sweep(false), remux(false),
+                mapBuckets(64), threads(std::max(1u, std::thread::hardware_concurrency())),
+                json(false), partition(0), quiet(false) {}
+
+    unsigned int jobs;      ///< How many files to extract or verify at once
+    bool directIo;          ///< Read the image with O_DIRECT
+    size_t bufferSize;      ///< Bytes per read when copying
+    size_t cacheSize;       ///< Bytes of the image to keep in memory
+    bool sweep;             ///< Extract everything in one pass over the disk
+    bool remux;             ///< Turn transport streams into program streams as they're copied
+    size_t mapBuckets;      ///< Resolution of the layout command's occupancy maps
+    unsigned int threads;   ///< How many clusters of a recording to analyse at once
+    bool json;              ///< Write analyse's reports as JSON
+    unsigned int partition; ///< Which MBR partition to read, 0 for the first volume found
+    bool quiet;
+    string statsPath;       ///< Where to write the I/O counters at the end, "-" for stderr
+    string tracePath;       ///< Where to write a Chrome trace of the reads and writes
+};
+
+Options options;
+std::mutex outputMutex;
+
+
+
+void usage(const char *program)
+{
+    cerr << "Usage: " << program << " [options] <command> <image> [arguments]\n"
+            "\n"
+            "Commands:\n"
+            "  ls <image> [path]                 List a directory (the root by default)\n"
+            "  stat <image> <path>               Show a file's details and layout\n"
+            "  cat <image> <path>                Write a file to standard output\n"
+            "  extract <image> <path> <dest>     Copy a file out of the image\n"
+            "  extract-all <image> <dir>         Copy every recording into a directory\n"
+            "  verify <image> [path...]          Check cluster chains (every file by default)\n"
+            "  layout <image> [json|csv|map]     Report how fragmented each file is, and how full the disk is\n"
+            "  df <image>                        Count the free and used clusters of each area\n"
+            "  probe <image>                     List the XTVFS and FAT32 volumes on the image\n"
+            "  analyse <image> [path...]         Check recordings' transport streams (every recording by default)\n"
+            "  triage <image> [path...]          Size up recordings from a few clusters of each (every recording by default)\n"
+            "\n"
+            "Options:\n"
+            "  -j, --jobs N        Extract, verify or triage N files at once (default 1)\n"
+            "      --io MODE       buffered (default) or direct, to bypass the page cache\n"
+            "      --buffer MB     Size of each read when copying (default 8)\n"
+            "      --cache MB      Memory for caching the image, 0 for none (default 64)\n"
+            "      --sweep         extract-all in one sequential pass over the disk, not file by file\n"
+            "      --remux         Turn recordings into MPEG program streams (.mpg) as they're copied out\n"
+            "      --map N         Pieces to divide each area into for layout's occupancy map (default 64)\n"
+            "      --threads N     Clusters to analyse at once (default one per core)\n"
+            "      --json          analyse writes a JSON object per recording\n"
+            "  -p, --partition N   Read MBR partition N (default the first volume found)\n"
+            "  -q, --quiet         Only report errors\n"
+            "  -v, --verbose       Show what the library is doing (twice for more)\n"
+            "      --stats FILE    Write I/O counters as JSON when done (- for stderr)\n"
+            "      --trace FILE    Write a Chrome trace of every read and write\n";
+}
+
+
+/// Find the volumes on the image, and pick the one --partition asks for
+std::shared_ptr<FileSystem> openImage(const string &path, ProbedVolumes &volumes)
+{
+    BlockDevicePtr device = BlockDevice::open(path, options.directIo);
+    if (!device)
+        return std::shared_ptr<FileSystem>();
+
+    if (!probeImage(device, volumes, options.cacheSize))
+    {
+        cerr << "Unable to find an XTVFS or FAT32 volume on " << path << endl;
+        return std::shared_ptr<FileSystem>();
+    }
+
+    for (size_t v=0; v<volumes.size(); ++v)
+    {
+        if (options.partition == 0 || volumes[v].partition == options.partition)
+            return volumes[v].fileSystem;
+    }
+
+    cerr << "No XTVFS or FAT32 volume in partition " << options.partition << " of " << path << endl;
+    return std::shared_ptr<FileSystem>();
+}
+
+
+/// Look up a path, treating "" and "/" as the root directory
+bool lookup(FileSystem *diskImage, string path, DirEntry &entry)
+{
+    while (!path.empty() && (path[0] == '/' || path[0] == '\\'))
+        path.erase(0, 1);
+
+    if (path.empty())
+    {
+        entry = PathCache::rootEntry();
+        return true;
+    }
+
+    entry = diskImage->infoFor(path);
+    return !entry.filename.empty();
+}
+
+
+/// A file found while walking the directory tree
+struct FoundFile
+{
+    string path;
+    DirEntry entry;
+};
+
+
+/// Collect every file and directory below a directory
+void walk(FileSystem *diskImage, const string &dirPath, size_t cluster, vector<FoundFile> &found)
+{
+    const DirEntries entries = diskImage->readDirectory(cluster);
+    for (size_t i=0; i<entries.size(); ++i)
+    {
+        const DirEntry &d = entries[i];
+        if (d.isVolumeId() || d.filename[0] == '.')
+            continue;
+
+        FoundFile f;
+        f.path = dirPath + d.toString();
+        f.entry = d;
+        found.push_back(f);
+
+        if (d.isDirectory() && d.firstCluster != 0)
+            walk(diskImage, f.path + "/", d.firstCluster, found);
+    }
+}
+
+
+/// Run job(0) ... job(count-1) on the requested number of threads
+template <class Job>
+void runJobs(size_t count, Job job)
+{
+    std::atomic<size_t> next(0);
+    vector<std::thread> workers;
+    const size_t threads = std::max(1u, std::min<unsigned int>(options.jobs, count));
+    for (size_t t=0; t<threads; ++t)
+    {
+        workers.push_back(std::thread([&]()
+        {
+            for (size_t i = next++; i < count; i = next++)
+                job(i);
+        }));
+    }
+    for (size_t t=0; t<workers.size(); ++t)
+        workers[t].join();
+}
+
+
+/// A buffer suitable for direct I/O
+class AlignedBuffer
+{
+public:
+    explicit AlignedBuffer(size_t size) : m_data(NULL), m_size(size)
+    {
+        if (posix_memalign(&m_data, RawBlockDevice::directIoAlignment, size) != 0)
+            m_data = NULL;
+    }
+    ~AlignedBuffer() { free(m_data); }
+
+    char *data() const { return static_cast<char*>(m_data); }
+    size_t size() const { return m_size; }
+
+private:
+    AlignedBuffer(const AlignedBuffer &);
+    AlignedBuffer &operator=(const AlignedBuffer &);
+
+    void *m_data;
+    size_t m_size;
+};
+
+
+bool writeAll(int fd, const char *data, size_t length)
+{
+    while (length > 0)
+    {
+        const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        const ssize_t written = ::write(fd, data, length);
+        const std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+        ioStats().countWrite((written > 0) ? written : 0, std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+        if (ioStats().tracing())
+            ioStats().traceEvent("write", start, end, "fd", fd, "bytes", (written > 0) ? written : 0);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return false;
+        data += written;
+        length -= written;
+    }
+    return true;
+}
+
+
+/// Write all of a block at an offset in a file
+bool pwriteAll(int fd, const char *data, size_t length, off_t offset)
+{
+    while (length > 0)
+    {
+        const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        const ssize_t written = ::pwrite(fd, data, length, offset);
+        const std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+        ioStats().countWrite((written > 0) ? written : 0, std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+        if (ioStats().tracing())
+            ioStats().traceEvent("write", start, end, "fd", fd, "bytes", (written > 0) ? written : 0);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return false;
+        data += written;
+        length -= written;
+        offset += written;
+    }
+    return true;
+}
+
+
+/// Copy a file to a file descriptor, reading a buffer's worth at a time from its extents.
+/// With --remux, its transport stream is turned into a program stream on the way.
+bool copyToFd(FileSystem *diskImage, const DirEntry &entry, const string &srcPath, int fd)
+{
+    const Extents extents = diskImage->extentsFor(entry);
+    AlignedBuffer buffer(options.bufferSize);
+    if (!buffer.data())
+        return false;
+
+    ProgramStreamRemuxer remuxer;
+    vector<char> remuxed;
+
+    unsigned long long offset = 0;
+    while (offset < entry.filesize)
+    {
+        const size_t got = diskImage->readFile(entry, extents, offset, buffer.data(), buffer.size());
+        if (got == 0)
+            break; // Chain ran out before the file size
+
+        const char *data = buffer.data();
+        size_t length = got;
+        if (options.remux)
+        {
+            remuxed.clear();
+            remuxer.write(buffer.data(), got, remuxed);
+            data = remuxed.data();
+            length = remuxed.size();
+        }
+
+        if (!writeAll(fd, data, length))
+        {
+            cerr << "Write error: " << strerror(errno) << endl;
+            return false;
+        }
+        offset += got;
+    }
+
+    if (options.remux)
+    {
+        remuxed.clear();
+        remuxer.finish(remuxed);
+        if (!writeAll(fd, remuxed.data(), remuxed.size()))
+        {
+            cerr << "Write error: " << strerror(errno) << endl;
+            return false;
+        }
+
+        lock_guard<mutex> lock(outputMutex);
+        if (remuxer.streams() == 0)
+        {
+            cerr << srcPath << ": no audio or video found to remux" << endl;
+            return false;
+        }
+        if (remuxer.mostlyDropped())
+        {
+            cerr << srcPath << ": " << remuxer.droppedPackets() << " of " << remuxer.streamPackets()
+                 << " audio and video packets were scrambled or damaged, so it can only be copied as it is" << endl;
+            return false;
+        }
+        if (remuxer.droppedPackets() > 0)
+            cerr << srcPath << ": " << remuxer.droppedPackets() << " of " << remuxer.packets()
+                 << " packets were scrambled or damaged, and left out" << endl;
+    }
+
+    return offset == entry.filesize;
+}
+
+
+bool extractFile(FileSystem *diskImage, const DirEntry &entry, const string &srcPath, const string &destPath)
+{
+    const int fd = ::open(destPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        cerr << "Unable to create " << destPath << ": " << strerror(errno) << endl;
+        return false;
+    }
+
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    const bool okay = copyToFd(diskImage, entry, srcPath, fd);
+    const bool closed = (::close(fd) == 0);
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    lock_guard<mutex> lock(outputMutex);
+    if (!okay || !closed)
+        cerr << "Error extracting " << srcPath << " to " << destPath << endl;
+    else if (!options.quiet)
+        cerr << srcPath << " -> " << destPath << ": " << entry.filesize / (1024 * 1024) << " MB in "
+             << fixed << setprecision(1) << seconds << "s ("
+             << (seconds > 0 ? entry.filesize / seconds / (1024 * 1024) : 0) << " MB/s)" << endl;
+
+    return okay && closed;
+}
+
+
+/// Writes the pieces a sweep finds into one output file per recording
+class SweepFiles : public SweepSink
+{
+public:
+    SweepFiles() : m_failed(false) {}
+
+    ~SweepFiles()
+    {
+        for (size_t i=0; i<m_fds.size(); ++i)
+            if (m_fds[i] >= 0)
+                ::close(m_fds[i]);
+    }
+
+    /// Create the files. Fails if any of them can't be created.
+    bool create(const vector<string> &paths)
+    {
+        m_paths = paths;
+        m_fds.assign(paths.size(), -1);
+        m_written.assign(paths.size(), 0);
+        for (size_t i=0; i<paths.size(); ++i)
+        {
+            m_fds[i] = ::open(paths[i].c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (m_fds[i] < 0)
+            {
+                cerr << "Unable to create " << paths[i] << ": " << strerror(errno) << endl;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    virtual bool write(size_t file, unsigned long long offset, const char *data, size_t length)
+    {
+        if (!pwriteAll(m_fds[file], data, length, offset))
+        {
+            cerr << "Error writing " << m_paths[file] << ": " << strerror(errno) << endl;
+            m_failed = true;
+            return false;
+        }
+        m_written[file] += length;
+        return true;
+    }
+
+    /// Close the files, returning false if any of them couldn't be written
+    bool close()
+    {
+        for (size_t i=0; i<m_fds.size(); ++i)
+        {
+            if (m_fds[i] >= 0 && ::close(m_fds[i]) != 0)
+            {
+                cerr << "Error writing " << m_paths[i] << ": " << strerror(errno) << endl;
+                m_failed = true;
+            }
+            m_fds[i] = -1;
+        }
+        return !m_failed;
+    }
+
+    /// Bytes written to each file
+    unsigned long long written(size_t file) const { return m_written[file]; }
+
+private:
+    vector<string> m_paths;
+    vector<int> m_fds;
+    vector<unsigned long long> m_written;
+    bool m_failed;
+};
+
+
+/// Make a recording's name safe to use as a file name
+string safeFilename(const string &s)
+{
+    string result;
+    for (size_t i=0; i<s.size(); ++i)
+        result += (s[i] == '/' || s[i] == '\\' || s[i] == ':' || (unsigned char)s[i] < 0x20) ? '_' : s[i];
+    return result;
+}
+
+
+/// Where extract-all puts a recording: without any .str, and with .ts, or .mpg if it is being remuxed
+string extractedFilename(const string &destDir, string name)
+{
+    name = safeFilename(name);
+    if (name.size() > 4 && name.compare(name.size() - 4, 4, ".str") == 0)
+        name.erase(name.size() - 4);
+    return destDir + "/" + name + (options.remux ? ".mpg" : ".ts");
+}
+
+
+
+// ===========================================================================
+// ==                        C O M M A N D S                                ==
+// ===========================================================================
+
+int commandLs(FileSystem *diskImage, const string &path)
+{
+    DirEntry dir;
+    if (!lookup(diskImage, path, dir))
+    {
+        cerr << path << ": not found" << endl;
+        return 1;
+    }
+
+    DirEntries entries;
+    if (dir.isDirectory())
+        entries = diskImage->readDirectory(dir.firstCluster);
+    else
+        entries.push_back(dir);
+
+    for (size_t i=0; i<entries.size(); ++i)
+    {
+        const DirEntry &d = entries[i];
+        cout << d.attribToString() << ' ' << setw(14) << d.filesize << ' ' << d.toString()
+             << (d.isDirectory() ? "/" : "") << '\n';
+    }
+
+    return 0;
+}
+
+
+int commandStat(FileSystem *diskImage, const string &path)
+{
+    DirEntry entry;
+    if (!lookup(diskImage, path, entry))
+    {
+        cerr << path << ": not found" << endl;
+        return 1;
+    }
+
+    const Extents extents = diskImage->extentsFor(entry);
+    size_t clusters = 0;
+    for (size_t i=0; i<extents.size(); ++i)
+        clusters += extents[i].clusterCount;
+
+    cout << "Name:          " << entry.toString() << '\n'
+         << "Attributes:    " << entry.attribToString() << '\n'
+         << "Size:          " << entry.filesize << '\n'
+         << "First cluster: " << entry.firstCluster << '\n'
+         << "Cluster size:  " << diskImage->clusterSizeFor(entry) << '\n'
+         << "Clusters:      " << clusters << '\n'
+         << "Extents:       " << extents.size() << '\n'
+         << "Chain:         " << (diskImage->verifyChain(entry) ? "okay" : "BAD") << '\n';
+
+    for (size_t i=0; i<extents.size(); ++i)
+        cout << "  " << extents[i].firstCluster << '-' << extents[i].firstCluster + extents[i].clusterCount - 1
+             << " (" << extents[i].clusterCount << ")\n";
+
+    return 0;
+}
+
+
+int commandCat(FileSystem *diskImage, const string &path)
+{
+    DirEntry entry;
+    if (!lookup(diskImage, path, entry) || entry.isDirectory())
+    {
+        cerr << path << ": not a file" << endl;
+        return 1;
+    }
+
+    return copyToFd(diskImage, entry, path, STDOUT_FILENO) ? 0 : 1;
+}
+
+
+int commandExtract(FileSystem *diskImage, const string &path, const string &dest)
+{
+    DirEntry entry;
+    if (!lookup(diskImage, path, entry) || entry.isDirectory())
+    {
+        cerr << path << ": not a file" << endl;
+        return 1;
+    }
+
+    return extractFile(diskImage, entry, path, dest) ? 0 : 1;
+}
+
+
+/// Extract files in one pass over the disk, rather than one after another
+int sweepExtract(FileSystem *diskImage, const vector<FoundFile> &files, const vector<string> &destinations)
+{
+    if (!options.quiet)
+        cerr << "Extracting " << files.size() << " recordings in one pass over the disk" << endl;
+
+    DirEntries entries;
+    for (size_t i=0; i<files.size(); ++i)
+        entries.push_back(files[i].entry);
+
+    SweepFiles out;
+    if (!out.create(destinations))
+        return 1;
+
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    const bool swept = diskImage->sweepFiles(entries, out, options.bufferSize);
+    const bool closed = out.close();
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    int failures = (swept && closed) ? 0 : 1;
+    unsigned long long total = 0;
+    for (size_t i=0; i<files.size(); ++i)
+    {
+        total += out.written(i);
+        if (out.written(i) != files[i].entry.filesize)
+        {
+            cerr << "Error extracting " << files[i].path << " to " << destinations[i] << ": only "
+                 << out.written(i) << " of " << files[i].entry.filesize << " bytes found" << endl;
+            ++failures;
+        }
+        else if (!options.quiet)
+            cerr << files[i].path << " -> " << destinations[i] << ": " << files[i].entry.filesize / (1024 * 1024) << " MB" << endl;
+    }
+
+    if (!options.quiet)
+        cerr << total / (1024 * 1024) << " MB in " << fixed << setprecision(1) << seconds << "s ("
+             << (seconds > 0 ? total / seconds / (1024 * 1024) : 0) << " MB/s)" << endl;
+
+    return failures == 0 ? 0 : 1;
+}
+
+
+int commandExtractAll(FileSystem *diskImage, const string &destDir)
+{
+    // Work out what to extract, and what to call it.
+    // Use the planner's names where we can, otherwise take every video file there is.
+    vector<FoundFile> files;
+    vector<string> destinations;
+
+    Planner planner;
+    if (planner.open(*diskImage))
+    {
+        // Find all the videos up front, before the image is shared between the jobs
+        const Recordings recordings = planner.recordings();
+        const ResolvedRecordings resolved = resolveRecordings(*diskImage, recordings);
+        for (size_t i=0; i<recordings.size(); ++i)
+        {
+            const Recording &r = recordings[i];
+            if (!resolved[i].found)
+            {
+                cerr << "Recording " << r.eventId << " (" << r.name << "): " << resolved[i].path << " not found" << endl;
+                continue;
+            }
+            if (!resolved[i].chainValid)
+                cerr << "Recording " << r.eventId << " (" << r.name << "): " << resolved[i].path << " is damaged, extracting what there is" << endl;
+
+            FoundFile f;
+            f.path = resolved[i].path;
+            f.entry = resolved[i].entry;
+            files.push_back(f);
+
+            const string stream = f.path.substr(0, f.path.find('/'));
+            destinations.push_back(extractedFilename(destDir, stream + " " + r.name));
+        }
+    }
+    else
+    {
+        vector<FoundFile> all;
+        walk(diskImage, "", (size_t)-1, all);
+        for (size_t i=0; i<all.size(); ++i)
+        {
+            if (!all[i].entry.isDevice() || all[i].entry.isDirectory())
+                continue;
+            files.push_back(all[i]);
+
+            destinations.push_back(extractedFilename(destDir, all[i].path));
+        }
+    }
+
+    if (options.sweep)
+        return sweepExtract(diskImage, files, destinations);
+
+    if (!options.quiet)
+        cerr << "Extracting " << files.size() << " recordings with " << options.jobs << " job(s)" << endl;
+
+    std::atomic<int> failures(0);
+    runJobs(files.size(), [&](size_t i)
+    {
+        if (!extractFile(diskImage, files[i].entry, files[i].path, destinations[i]))
+            ++failures;
+    });
+
+    return failures == 0 ? 0 : 1;
+}
+
+
+int commandVerify(FileSystem *diskImage, const vector<string> &paths)
+{
+    vector<FoundFile> files;
+    if (paths.empty())
+        walk(diskImage, "", (size_t)-1, files);
+    else
+    {
+        for (size_t i=0; i<paths.size(); ++i)
+        {
+            FoundFile f;
+            f.path = paths[i];
+            if (!lookup(diskImage, f.path, f.entry))
+            {
+                cerr << f.path << ": not found" << endl;
+                return 1;
+            }
+
+            // The root has no chain of its own to check, so check everything in it, as with no paths
+            if (f.entry.firstCluster == (size_t)-1)
+                walk(diskImage, "", (size_t)-1, files);
+            else
+                files.push_back(f);
+        }
+    }
+
+    // Check each chain on its own...
+    vector<char> chainOkay(files.size());
+    vector<Extents> extents(files.size());
+    runJobs(files.size(), [&](size_t i)
+    {
+        const DirEntry &entry = files[i].entry;
+        if (entry.firstCluster == 0)
+        {
+            chainOkay[i] = (entry.filesize == 0);
+            return;
+        }
+        chainOkay[i] = diskImage->verifyChain(entry);
+        extents[i] = diskImage->extentsFor(entry);
+    });
+
+    // ...then look for clusters claimed by more than one file. FAT and VFAT clusters are counted separately.
+    struct Claim
+    {
+        bool video;
+        size_t first, last;
+        size_t file;
+        bool operator<(const Claim &o) const { return video != o.video ? video < o.video : first < o.first; }
+    };
+    vector<Claim> claims;
+    for (size_t i=0; i<files.size(); ++i)
+    {
+        for (size_t e=0; e<extents[i].size(); ++e)
+        {
+            Claim c;
+            c.video = files[i].entry.isDevice();
+            c.first = extents[i][e].firstCluster;
+            c.last = c.first + extents[i][e].clusterCount - 1;
+            c.file = i;
+            claims.push_back(c);
+        }
+    }
+    sort(claims.begin(), claims.end());
+
+    // Each claim is checked against whichever claim before it in its area reaches furthest,
+    // as a long extent can overlap several that start after it
+    vector<string> crossLinks(files.size());
+    size_t reach = 0;
+    for (size_t i=1; i<claims.size(); ++i)
+    {
+        const Claim &a = claims[reach], &b = claims[i];
+        if (a.video != b.video)
+        {
+            reach = i;
+            continue;
+        }
+        if (b.first <= a.last && a.file != b.file)
+        {
+            crossLinks[a.file] = files[b.file].path;
+            crossLinks[b.file] = files[a.file].path;
+        }
+        if (b.last > a.last)
+            reach = i;
+    }
+
+    int problems = 0;
+    for (size_t i=0; i<files.size(); ++i)
+    {
+        const bool okay = chainOkay[i] && crossLinks[i].empty();
+        if (!okay)
+            ++problems;
+        if (!okay || !options.quiet)
+        {
+            cout << (okay ? "OK   " : "BAD  ") << files[i].path;
+            if (!chainOkay[i])
+                cout << " (chain doesn't match the file size)";
+            if (!crossLinks[i].empty())
+                cout << " (shares clusters with " << crossLinks[i] << ")";
+            cout << '\n';
+        }
+    }
+
+    if (!options.quiet)
+        cout << files.size() << " checked, " << problems << " bad" << endl;
+
+    return problems == 0 ? 0 : 1;
+}
+
+
+int commandDf(FileSystem *diskImage)
+{
+    if (!diskImage->cacheAllocationTables())
+    {
+        cerr << "Unable to read the allocation tables" << endl;
+        return 1;
+    }
+
+    cout << "area  cluster size    clusters        used        free     bad      chains    free MB\n";
+    for (int video=0; video<2; ++video)
+    {
+        const AllocationTable *table = diskImage->allocationTable(video);
+        if (!table)
+            continue;
+
+        const AllocationCensus census = takeCensus(*table);
+        const unsigned long long freeBytes = (unsigned long long)census.freeClusters * diskImage->areaClusterSize(video);
+        cout << left << setw(5) << (video ? "video" : "fat") << right << ' '
+             << setw(12) << diskImage->areaClusterSize(video) << ' '
+             << setw(11) << census.clusters << ' '
+             << setw(11) << census.usedClusters() << ' '
+             << setw(11) << census.freeClusters << ' '
+             << setw(7) << census.badClusters << ' '
+             << setw(11) << census.chainEnds << ' '
+             << setw(10) << freeBytes / (1024 * 1024) << '\n';
+
+        // FSInfo only covers the FAT, and is often out of date
+        const Fat32 *fat32 = dynamic_cast<const Fat32*>(diskImage);
+        if (!video && fat32 && fat32->fsInfoFreeClusters() != 0xFFFFFFFF && fat32->fsInfoFreeClusters() != census.freeClusters)
+            cout << "      (FSInfo says " << fat32->fsInfoFreeClusters() << " free)\n";
+    }
+
+    return 0;
+}
+
+
+int commandProbe(const ProbedVolumes &volumes)
+{
+    cout << "part type format        first sector      sectors    size MB\n";
+    for (size_t v=0; v<volumes.size(); ++v)
+    {
+        const ProbedVolume &volume = volumes[v];
+        cout << setw(4) << volume.partition << ' '
+             << "0x" << hex << setfill('0') << setw(2) << (int)volume.typeCode << dec << setfill(' ') << ' '
+             << left << setw(6) << volume.format() << right << ' '
+             << setw(20) << volume.firstSector << ' '
+             << setw(12) << volume.sectors << ' '
+             << setw(10) << volume.sectors / 2048 << '\n';
+    }
+    return 0;
+}
+
+
+int commandLayout(FileSystem *diskImage, const string &format)
+{
+    if (format != "json" && format != "csv" && format != "map")
+    {
+        cerr << "Unknown layout format: " << format << endl;
+        return 2;
+    }
+
+    LayoutReport report;
+    if (!analyseLayout(*diskImage, options.mapBuckets, report))
+        return 1;
+
+    if (format == "csv")
+        report.writeFilesCsv(cout);
+    else if (format == "map")
+        report.writeMapCsv(cout);
+    else
+        report.writeJson(cout);
+    return 0;
+}
+
+
+int commandAnalyse(FileSystem *diskImage, const vector<string> &paths)
+{
+    vector<FoundFile> files;
+    if (paths.empty())
+    {
+        vector<FoundFile> all;
+        walk(diskImage, "", (size_t)-1, all);
+        for (size_t i=0; i<all.size(); ++i)
+        {
+            if (all[i].entry.isDevice() && !all[i].entry.isDirectory())
+                files.push_back(all[i]);
+        }
+    }
+    else
+    {
+        for (size_t i=0; i<paths.size(); ++i)
+        {
+            FoundFile f;
+            f.path = paths[i];
+            if (!lookup(diskImage, f.path, f.entry) || f.entry.isDirectory())
+            {
+                cerr << f.path << ": not a file" << endl;
+                return 1;
+            }
+            files.push_back(f);
+        }
+    }
+
+    // One recording at a time, each spread over all the threads
+    int result = 0;
+    for (size_t i=0; i<files.size(); ++i)
+    {
+        StreamReport report;
+        if (!analyseStream(*diskImage, files[i].entry, options.threads, report))
+        {
+            cerr << files[i].path << ": unable to read" << endl;
+            result = 1;
+            continue;
+        }
+        report.path = files[i].path;
+
+        if (options.json)
+            report.writeJson(cout);
+        else
+            report.write(cout);
+
+        if (!options.quiet)
+            cerr << files[i].path << ": " << report.entry.filesize / (1024 * 1024) << " MB in " << fixed << setprecision(1)
+                 << report.seconds << "s (" << (report.seconds > 0 ? report.entry.filesize / report.seconds / (1024 * 1024) : 0)
+                 << " MB/s)" << endl;
+        if (!report.healthy())
+            result = 1;
+    }
+
+    return result;
+}
+
+int commandTriage(FileSystem *diskImage, const vector<string> &paths)
+{
+    Xtvfs *xtvfs = dynamic_cast<Xtvfs *>(diskImage);
+    if (!xtvfs)
+    {
+        cerr << "Only XTVFS volumes have recordings to triage" << endl;
+        return 1;
+    }
+
+    vector<FoundFile> files;
+    if (paths.empty())
+        walk(diskImage, "", (size_t)-1, files);
+    else
+    {
+        for (size_t i=0; i<paths.size(); ++i)
+        {
+            FoundFile f;
+            f.path = paths[i];
+            if (!lookup(diskImage, f.path, f.entry))
+            {
+                cerr << f.path << ": not found" << endl;
+                return 1;
+            }
+            files.push_back(f);
+        }
+    }
+    files.erase(remove_if(files.begin(), files.end(), [](const FoundFile &f)
+    {
+        return !f.entry.isDevice() || f.entry.isDirectory();
+    }), files.end());
+
+    vector<RecordingProbe> probes(files.size());
+    vector<char> probed(files.size());
+    runJobs(files.size(), [&](size_t i)
+    {
+        probed[i] = xtvfs->probeRecording(files[i].entry, probes[i]);
+    });
+
+    cout << left << setw(24) << "Path" << right << "      MB  Duration  HD  Scrambling        State      Streams\n";
+    int result = 0;
+    for (size_t i=0; i<files.size(); ++i)
+    {
+        const RecordingProbe &p = probes[i];
+        cout << left << setw(24) << files[i].path << right << ' ' << setw(7) << files[i].entry.filesize / (1024 * 1024) << ' ';
+        if (!probed[i])
+        {
+            cout << " unreadable\n";
+            result = 1;
+            continue;
+        }
+
+        // A ~ marks a duration scaled up from the bit rate, when the clock jumps between the samples
+        const unsigned long long seconds = (unsigned long long)(p.duration + 0.5);
+        if (p.duration > 0)
+            cout << setw(3) << seconds / 3600 << ':' << setfill('0') << setw(2) << seconds / 60 % 60 << ':' << setw(2) << seconds % 60
+                 << setfill(' ') << (p.durationFromClock ? ' ' : '~') << ' ';
+        else
+            cout << setw(9) << "-" << "  ";
+        cout << setw(3) << (p.hd() ? "yes" : "no") << "  "
+             << left << setw(16) << p.scramblingName() << "  "
+             << setw(9) << (p.chainShort() ? "short" : p.endMissing ? "truncated" : "complete") << right << "  ";
+        for (ElementaryStreams::const_iterator s = p.streams.begin(); s != p.streams.end(); ++s)
+            cout << (s == p.streams.begin() ? "" : ", ") << s->second.codec();
+        cout << '\n';
+    }
+
+    return result;
+}
+
+} // end of anonymous namespace
+
+
+
+int main(int argc, char *argv[])
+{
+    enum { IoOption = 1000, BufferOption, CacheOption, SweepOption, RemuxOption, MapOption, ThreadsOption, JsonOption, StatsOption, TraceOption };
+    static const struct option longOptions[] =
+    {
+        { "jobs",   required_argument, NULL, 'j' },
+        { "io",     required_argument, NULL, IoOption },
+        { "buffer", required_argument, NULL, BufferOption },
+        { "cache",  required_argument, NULL, CacheOption },
+        { "sweep",  no_argument,       NULL, SweepOption },
+        { "remux",  no_argument,       NULL, RemuxOption },
+        { "map",    required_argument, NULL, MapOption },
+        { "threads", required_argument, NULL, ThreadsOption },
+        { "json",   no_argument,       NULL, JsonOption },
+        { "partition", required_argument, NULL, 'p' },
+        { "quiet",  no_argument,       NULL, 'q' },
+        { "verbose", no_argument,      NULL, 'v' },
+        { "stats",  required_argument, NULL, StatsOption },
+        { "trace",  required_argument, NULL, TraceOption },
+        { "help",   no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    // The library is silent unless told otherwise
+    Log::setLevel(LogWarning);
+
+    int c;
+    while ((c = getopt_long(argc, argv, "j:p:qvh", longOptions, NULL)) != -1)
+    {
+        switch (c)
+        {
+        case 'j':
+            options.jobs = std::max(1, atoi(optarg));
+            break;
+        case IoOption:
+            if (string(optarg) == "direct")
+                options.directIo = true;
+            else if (string(optarg) == "buffered")
+                options.directIo = false;
+            else
+            {
+                cerr << "Unknown I/O mode: " << optarg << endl;
+                return 2;
+            }
+            break;
+        case BufferOption:
+            // Keep it a multiple of the direct I/O alignment
+            options.bufferSize = std::max(1, atoi(optarg)) * 1024 * 1024;
+            break;
+        case CacheOption:
+            options.cacheSize = (size_t)std::max(0, atoi(optarg)) * 1024 * 1024;
+            break;
+        case SweepOption:
+            options.sweep = true;
+            break;
+        case RemuxOption:
+            options.remux = true;
+            break;
+        case MapOption:
+            options.mapBuckets = std::max(1, atoi(optarg));
+            break;
+        case ThreadsOption:
+            options.threads = std::max(1, atoi(optarg));
+            break;
+        case JsonOption:
+            options.json = true;
+            break;
+        case 'p':
+            options.partition = std::max(0, atoi(optarg));
+            break;
+        case 'q':
+            options.quiet = true;
+            Log::setLevel(LogError);
+            break;
+        case 'v':
+            Log::setLevel(Log::level() > LogInfo ? LogInfo : LogDebug);
+            break;
+        case StatsOption:
+            options.statsPath = optarg;
+            break;
+        case TraceOption:
+            options.tracePath = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return (c == 'h') ? 0 : 2;
+        }
+    }
+
+    if (argc - optind < 2)
+    {
+        usage(argv[0]);
+        return 2;
+    }
+
+    if (options.sweep && options.remux)
+    {
+        cerr << "--sweep and --remux can't be used together, as remuxing needs each recording in order" << endl;
+        return 2;
+    }
+
+    const string command = argv[optind];
+    const string image = argv[optind + 1];
+    vector<string> args(argv + optind + 2, argv + argc);
+
+    if (!options.tracePath.empty() && !ioStats().startTrace(options.tracePath))
+        return 1;
+
+    ProbedVolumes volumes;
+    std::shared_ptr<FileSystem> diskImage = openImage(image, volumes);
+    if (!diskImage)
+        return 1;
+
+    int result = 2;
+    if (command == "probe" && args.empty())
+        result = commandProbe(volumes);
+    else if (command == "ls" && args.size() <= 1)
+        result = commandLs(diskImage.get(), args.empty() ? string() : args[0]);
+    else if (command == "stat" && args.size() == 1)
+        result = commandStat(diskImage.get(), args[0]);
+    else if (command == "cat" && args.size() == 1)
+        result = commandCat(diskImage.get(), args[0]);
+    else if (command == "extract" && args.size() == 2)
+        result = commandExtract(diskImage.get(), args[0], args[1]);
+    else if (command == "extract-all" && args.size() == 1)
+        result = commandExtractAll(diskImage.get(), args[0]);
+    else if (command == "verify")
+        result = commandVerify(diskImage.get(), args);
+    else if (command == "df" && args.empty())
+        result = commandDf(diskImage.get());
+    else if (command == "layout" && args.size() <= 1)
+        result = commandLayout(diskImage.get(), args.empty() ? string("json") : args[0]);
+    else if (command == "analyse")
+        result = commandAnalyse(diskImage.get(), args);
+    else if (command == "triage")
+        result = commandTriage(diskImage.get(), args);
+    else
+        usage(argv[0]);
+
+    ioStats().stopTrace();
+    if (options.statsPath == "-")
+        ioStats().writeJson(cerr);
+    else if (!options.statsPath.empty())
+    {
+        std::ofstream stats(options.statsPath.c_str());
+        ioStats().writeJson(stats);
+        if (!stats)
+            cerr << "Unable to write " << options.statsPath << endl;
+    }
+
+    return result;
+}
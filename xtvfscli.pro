@@ -0,0 +1,23 @@
+#-------------------------------------------------
+#
+# Headless command line tool for XTVFS / FAT32 images:
+# ls, stat, cat, extract, extract-all, verify, layout, df, probe, analyse
+# and triage.
+# Needs SQLite for reading the planner (FSN_DATA/PCAT.DB).
+#
+#-------------------------------------------------
+
+TARGET = xtvfscli
+TEMPLATE = app
+
+CONFIG += console thread
+CONFIG -= app_bundle qt
+
+include(xtvfs.pri)
+
+LIBS += -lsqlite3
+
+SOURCES += xtvfscli.cpp \
+    planner.cpp
+
+HEADERS += planner.h
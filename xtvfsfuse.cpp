@@ -0,0 +1,295 @@
+/* This file is part of XTVFS Reader.
+ * Copyright (C) 2014 S. Blackburn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * XTVFS Reader is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with XTVFS Reader.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * xtvfsfuse - mount an XTVFS or FAT32 image read-only with FUSE
+ *
+ * Usage: xtvfsfuse [FUSE options] [-o readahead=N] [-o cache=MB] [-o partition=N] <image> <mountpoint>
+ *
+ * Recordings appear as ordinary files, e.g. /mnt/sky/s9/stream.str, so any
+ * tool can read them without extracting them first.
+ */
+#define FUSE_USE_VERSION 26
+
+#include "clustercache.h"
+#include "filesystem.h"
+#include "log.h"
+#include "pathcache.h"
+#include "probe.h"
+
+#include <fuse.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace std;
+using namespace fs;
+
+namespace
+{
+
+/// Command line options, filled in by fuse_opt_parse
+struct Options
+{
+    char *image;
+    unsigned int readAhead;  ///< Clusters to read ahead when a file is read sequentially
+    unsigned int cacheMB;    ///< Memory for caching, shared between the cluster cache and the file system's block cache
+    unsigned int partition;  ///< Which MBR partition to mount, 0 for the first volume found
+};
+
+#define XTVFS_OPT(t, p) { t, offsetof(Options, p), 0 }
+
+const struct fuse_opt optionSpecs[] =
+{
+    XTVFS_OPT("readahead=%u", readAhead),
+    XTVFS_OPT("cache=%u", cacheMB),
+    XTVFS_OPT("partition=%u", partition),
+    FUSE_OPT_END
+};
+
+
+/// Everything the FUSE callbacks need, shared by all threads
+class Mount : public PathCache
+{
+public:
+    Mount(FileSystem *fileSystem, const Options &options) :
+        PathCache(fileSystem),
+        m_fs(fileSystem),
+        m_readAhead(options.readAhead),
+        m_cache(CacheBudget((size_t)options.cacheMB * 1024 * 1024).clusterCache),
+        m_mountTime(time(NULL))
+    {
+    }
+
+    int read(OpenFile &file, char *buffer, size_t length, unsigned long long offset);
+
+    void fillStat(const DirEntry &entry, struct stat *st) const;
+
+private:
+    FileSystem *m_fs;
+    size_t m_readAhead;
+    ClusterCache m_cache;
+    time_t m_mountTime;
+};
+
+
+int Mount::read(OpenFile &file, char *buffer, size_t length, unsigned long long offset)
+{
+    bool sequential;
+    {
+        lock_guard<mutex> lock(file.mutex);
+        sequential = (offset == file.nextOffset);
+        file.nextOffset = offset + length;
+    }
+
+    size_t bytesRead = 0;
+    while (bytesRead < length && offset < file.entry.filesize)
+    {
+        const size_t fileCluster = offset / file.clusterSize;
+        const size_t offsetInCluster = offset % file.clusterSize;
+
+        // Sequential readers get the clusters after this one read with it
+        const ClusterCache::ClusterPtr data = m_cache.read(*m_fs, file.entry, file.extents, fileCluster, sequential ? m_readAhead : 0);
+        if (!data || offsetInCluster >= data->size())
+            break;
+
+        const size_t bytesThisCluster = std::min(length - bytesRead, data->size() - offsetInCluster);
+        memcpy(buffer + bytesRead, &(*data)[offsetInCluster], bytesThisCluster);
+        bytesRead += bytesThisCluster;
+        offset += bytesThisCluster;
+    }
+
+    return bytesRead;
+}
+
+
+void Mount::fillStat(const DirEntry &entry, struct stat *st) const
+{
+    memset(st, 0, sizeof(*st));
+    if (entry.isDirectory())
+    {
+        st->st_mode = S_IFDIR | 0555;
+        st->st_nlink = 2;
+    }
+    else
+    {
+        st->st_mode = S_IFREG | 0444;
+        st->st_nlink = 1;
+        st->st_size = entry.filesize;
+        st->st_blocks = (entry.filesize + 511) / 512;
+        st->st_blksize = m_fs->clusterSizeFor(entry);
+    }
+    st->st_uid = getuid();
+    st->st_gid = getgid();
+    st->st_atime = st->st_mtime = st->st_ctime = m_mountTime;
+}
+
+
+Mount *currentMount()
+{
+    return static_cast<Mount*>(fuse_get_context()->private_data);
+}
+
+
+// ===========================================================================
+// ==                  F U S E   C A L L B A C K S                          ==
+// ===========================================================================
+
+void *xtvfs_init(struct fuse_conn_info *)
+{
+    return currentMount();
+}
+
+
+int xtvfs_getattr(const char *path, struct stat *st)
+{
+    DirEntry entry;
+    if (!currentMount()->lookup(path, entry))
+        return -ENOENT;
+
+    currentMount()->fillStat(entry, st);
+    return 0;
+}
+
+
+int xtvfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t, struct fuse_file_info *)
+{
+    const ListingPtr entries = currentMount()->listing(path);
+    if (!entries)
+        return -ENOENT;
+
+    filler(buf, ".", NULL, 0);
+    filler(buf, "..", NULL, 0);
+    for (size_t i=0; i<entries->size(); ++i)
+    {
+        const DirEntry &entry = (*entries)[i];
+        struct stat st;
+        currentMount()->fillStat(entry, &st);
+        if (filler(buf, entry.toString().c_str(), &st, 0))
+            break;
+    }
+
+    return 0;
+}
+
+
+int xtvfs_open(const char *path, struct fuse_file_info *fi)
+{
+    if ((fi->flags & O_ACCMODE) != O_RDONLY)
+        return -EROFS;
+
+    const OpenFilePtr file = currentMount()->openFile(path);
+    if (!file)
+        return -ENOENT;
+
+    // The mount owns the OpenFile, so it outlives this handle
+    fi->fh = reinterpret_cast<uint64_t>(file.get());
+    fi->keep_cache = 1; // The image never changes underneath us
+    return 0;
+}
+
+
+int xtvfs_read(const char *, char *buffer, size_t length, off_t offset, struct fuse_file_info *fi)
+{
+    OpenFile *file = reinterpret_cast<OpenFile*>(fi->fh);
+    return currentMount()->read(*file, buffer, length, offset);
+}
+
+
+int processArgument(void *data, const char *arg, int key, struct fuse_args *)
+{
+    Options *options = static_cast<Options*>(data);
+    if (key == FUSE_OPT_KEY_NONOPT && options->image == NULL)
+    {
+        // The first plain argument is the image, the rest belong to FUSE
+        options->image = strdup(arg);
+        return 0;
+    }
+    return 1;
+}
+
+} // end of anonymous namespace
+
+
+int main(int argc, char *argv[])
+{
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+
+    Log::setLevel(LogWarning);
+
+    Options options;
+    options.image = NULL;
+    options.readAhead = 4;
+    options.cacheMB = 64;
+    options.partition = 0;
+    if (fuse_opt_parse(&args, &options, optionSpecs, processArgument) != 0 || options.image == NULL)
+    {
+        cerr << "Usage: " << argv[0] << " [FUSE options] [-o readahead=N] [-o cache=MB] [-o partition=N] <image> <mountpoint>" << endl;
+        return 1;
+    }
+
+    // Find the XTVFS or FAT32 volumes on the image, partitioned or not
+    ProbedVolumes volumes;
+    if (!probeImage(options.image, volumes, CacheBudget((size_t)options.cacheMB * 1024 * 1024).blockCache))
+    {
+        cerr << "Unable to find an XTVFS or FAT32 volume on " << options.image << endl;
+        return 1;
+    }
+
+    std::shared_ptr<FileSystem> diskImage;
+    for (size_t v=0; v<volumes.size() && !diskImage; ++v)
+    {
+        if (options.partition == 0 || volumes[v].partition == options.partition)
+            diskImage = volumes[v].fileSystem;
+    }
+    if (!diskImage)
+    {
+        cerr << "No XTVFS or FAT32 volume in partition " << options.partition << " of " << options.image << endl;
+        return 1;
+    }
+
+    fuse_opt_add_arg(&args, "-oro,fsname=xtvfs,subtype=xtvfs");
+
+    struct fuse_operations operations;
+    memset(&operations, 0, sizeof(operations));
+    operations.init = xtvfs_init;
+    operations.getattr = xtvfs_getattr;
+    operations.readdir = xtvfs_readdir;
+    operations.open = xtvfs_open;
+    operations.read = xtvfs_read;
+
+    // FUSE serves requests from several threads unless -s is given
+    Mount mount(diskImage.get(), options);
+    const int result = fuse_main(args.argc, args.argv, &operations, &mount);
+
+    fuse_opt_free_args(&args);
+    free(options.image);
+
+    return result;
+}
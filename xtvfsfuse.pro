@@ -0,0 +1,19 @@
+#-------------------------------------------------
+#
+# Read-only FUSE mount of XTVFS / FAT32 images.
+# Needs libfuse 2.x and its development headers.
+#
+#-------------------------------------------------
+
+TARGET = xtvfsfuse
+TEMPLATE = app
+
+CONFIG += console
+CONFIG -= app_bundle qt
+
+include(xtvfs.pri)
+
+CONFIG += link_pkgconfig
+PKGCONFIG += fuse
+
+SOURCES += xtvfsfuse.cpp
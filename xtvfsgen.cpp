@@ -0,0 +1,876 @@
+/* This file is part of XTVFS Reader.
+ * Copyright (C) 2014 S. Blackburn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * XTVFS Reader is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with XTVFS Reader.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * xtvfsgen - write synthetic XTVFS / FAT32 images, for testing and benchmarking
+ * without a real Sky+ disk.
+ *
+ * Usage: xtvfsgen [options] <image>
+ *
+ * The image is written as a sparse file, so only the file system structures and
+ * the start of each video cluster take up space unless --fill is given.
+ * A manifest of what was written, including any corruption, goes to standard output.
+ */
+#include "filesystem.h"
+#include "log.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <unistd.h>
+
+#include <sqlite3.h>
+
+using namespace std;
+using namespace fs;
+
+namespace
+{
+
+// The layout Sky+ boxes use
+const size_t sectorSize = 512;
+const size_t sectorsPerCluster = 64;
+const size_t reservedSectors = 32;
+const size_t numFats = 2;
+const size_t videoSectorsPerCluster = 3008;
+const size_t videoClusterSize = videoSectorsPerCluster * sectorSize;
+const unsigned int endOfChain = 0x0FFFFFFF;
+const size_t tsPacketSize = 188;
+
+// Directory entry attributes
+const unsigned char attrVolumeId = 0x08;
+const unsigned char attrDirectory = 0x10;
+const unsigned char attrArchive = 0x20;
+const unsigned char attrDevice = 0x40;
+
+
+/// Settings from the command line
+struct Options
+{
+    Options() :
+        sectors(2 * 1024 * 1024 * 2), fat32(false), dirs(4), files(16), fileSize(64 * 1024),
+        recordings(8), recordingSize(100 * 1024 * 1024), fragmentation(0), corrupt(0),
+        seed(1), fill(false), planner(true), longNames(false) {}
+
+    unsigned long long sectors;
+    bool fat32;                         ///< Plain FAT32: no XFS0 marker, VFAT or recordings
+    unsigned int dirs;
+    unsigned int files;                 ///< Per directory
+    size_t fileSize;
+    unsigned int recordings;
+    unsigned long long recordingSize;   ///< Average; each is between half and one and a half times this
+    double fragmentation;               ///< Chance of a gap before each cluster after a file's first
+    unsigned int corrupt;               ///< Recordings (or files) to damage
+    unsigned int seed;
+    bool fill;                          ///< Write every byte of the video, not just the first packet of each cluster
+    bool planner;
+    bool longNames;                     ///< Give the ordinary files VFAT long names as well
+};
+
+Options options;
+std::mt19937 rng;
+
+
+void usage(const char *program)
+{
+    cerr << "Usage: " << program << " [options] <image>\n"
+            "\n"
+            "Options:\n"
+            "      --size GB             Size of the image (default 2)\n"
+            "      --sectors N           Size of the image in sectors, instead of --size\n"
+            "      --fat32               Plain FAT32, without the XTVFS video area\n"
+            "      --dirs N              Directories of ordinary files (default 4)\n"
+            "      --files N             Files in each directory (default 16)\n"
+            "      --file-size KB        Size of each file (default 64)\n"
+            "      --recordings N        Video recordings (default 8)\n"
+            "      --recording-size MB   Average recording size (default 100)\n"
+            "      --fragmentation F     Chance, 0 to 1, of a gap before each cluster (default 0)\n"
+            "      --corrupt N           Damage the chains of N recordings, or files if there are none\n"
+            "      --seed N              Random seed (default 1)\n"
+            "      --fill                Write all of the video, not just the start of each cluster\n"
+            "      --no-planner          Don't write FSN_DATA/PCAT.DB\n"
+            "      --long-names          Give the files long names as well as 8.3 ones\n";
+}
+
+
+void put16(unsigned char *p, unsigned int v)
+{
+    p[0] = v; p[1] = v >> 8;
+}
+
+void put32(unsigned char *p, unsigned int v)
+{
+    p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+}
+
+
+/// A 32-byte directory entry
+class RawEntry
+{
+public:
+    RawEntry(const string &name, unsigned char attrib, size_t firstCluster, unsigned long long size)
+    {
+        memset(bytes, 0, sizeof(bytes));
+        const string eleven = (name == "." || name == "..") ? (name + "          ").substr(0, 11) : to11CharFormat(name);
+        memcpy(bytes, eleven.data(), 11);
+        bytes[0x0B] = attrib;
+        bytes[0x10] = size >> 32;     // XTVFS keeps the top of a video's size here
+        put16(bytes + 0x14, firstCluster >> 16);
+        put16(bytes + 0x1A, firstCluster & 0xFFFF);
+        put32(bytes + 0x1C, size & 0xFFFFFFFF);
+    }
+
+    unsigned char bytes[32];
+};
+
+typedef vector<RawEntry> RawEntries;
+
+
+/// Add the VFAT long file name entries for a short entry, which must follow them
+void addLongName(RawEntries &entries, const string &longName, const RawEntry &shortEntry)
+{
+    unsigned char sum = 0;
+    for (int i=0; i<11; ++i)
+        sum = ((sum & 1) << 7) + (sum >> 1) + shortEntry.bytes[i];
+
+    // ASCII only, which is all the generator needs. The name is ended with 0x0000 then padded with 0xFFFF.
+    static const int offsets[13] = { 1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30 };
+    const size_t parts = (longName.size() + 13) / 13;
+    for (size_t part = parts; part > 0; --part)
+    {
+        RawEntry slot("", 0x0F, 0, 0);
+        memset(slot.bytes, 0, sizeof(slot.bytes));
+        slot.bytes[0] = part | (part == parts ? 0x40 : 0);
+        slot.bytes[0x0B] = 0x0F;
+        slot.bytes[0x0D] = sum;
+        for (int i=0; i<13; ++i)
+        {
+            const size_t c = (part - 1) * 13 + i;
+            const unsigned int ch = (c < longName.size()) ? (unsigned char)longName[c] : (c == longName.size()) ? 0x0000 : 0xFFFF;
+            put16(slot.bytes + offsets[i], ch);
+        }
+        entries.push_back(slot);
+    }
+}
+
+
+/// A file written to the image, for the manifest
+struct Written
+{
+    string path;
+    unsigned long long size;
+    vector<size_t> clusters;
+    string damage;
+};
+
+
+/// Writes the image, keeping the allocation tables in memory until the end
+class ImageWriter
+{
+public:
+    ImageWriter() : m_fd(-1), m_failed(false), m_nextCluster(2), m_nextVideoCluster(2) {}
+
+    ~ImageWriter()
+    {
+        if (m_fd >= 0)
+            ::close(m_fd);
+    }
+
+    bool create(const string &path)
+    {
+        m_fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (m_fd < 0)
+        {
+            cerr << "Unable to create " << path << ": " << strerror(errno) << endl;
+            return false;
+        }
+
+        m_totalSectors = options.sectors;
+        layout();
+
+        // Everything not written reads back as zero, which is what a freshly formatted disk would have
+        if (ftruncate(m_fd, m_totalSectors * sectorSize) != 0)
+        {
+            cerr << "Unable to size " << path << ": " << strerror(errno) << endl;
+            return false;
+        }
+
+        m_fat.assign(m_fatEntries, 0);
+        m_fat[0] = 0x0FFFFFF8;
+        m_fat[1] = endOfChain;
+        if (!options.fat32)
+        {
+            m_vfat.assign(m_vfatEntries, 0);
+
+            // The VFAT sits in the first clusters of the FAT area, so keep them from being used for anything else
+            const size_t vfatSectors = (m_vfatEntries * 4 + sectorSize - 1) / sectorSize;
+            vector<size_t> clusters;
+            allocate(m_fat, m_nextCluster, m_fatEntries, (vfatSectors + sectorsPerCluster - 1) / sectorsPerCluster, false, clusters);
+        }
+
+        return true;
+    }
+
+    /// Write an ordinary file, returning its first cluster (0 if empty) or -1 if the disk is full
+    size_t writeFile(const vector<unsigned char> &data, vector<size_t> &clusters)
+    {
+        clusters.clear();
+        if (data.empty())
+            return 0;
+
+        const size_t clusterBytes = sectorsPerCluster * sectorSize;
+        if (!allocate(m_fat, m_nextCluster, m_fatEntries, (data.size() + clusterBytes - 1) / clusterBytes, true, clusters))
+            return (size_t)-1;
+
+        for (size_t i=0; i<clusters.size(); ++i)
+        {
+            const size_t n = min(clusterBytes, data.size() - i * clusterBytes);
+            write(clusterOffset(clusters[i]), &data[i * clusterBytes], n);
+        }
+        return clusters.front();
+    }
+
+    /// Write a directory, returning its first cluster
+    size_t writeDirectory(const RawEntries &entries, vector<size_t> &clusters)
+    {
+        // The clusters are zeroed already, so the entry after the last one marks the end
+        vector<unsigned char> data(max<size_t>(1, entries.size()) * 32);
+        for (size_t i=0; i<entries.size(); ++i)
+            memcpy(&data[i * 32], entries[i].bytes, 32);
+        return writeFile(data, clusters);
+    }
+
+    /// Allocate a directory's clusters before its contents are known, e.g. so "." can refer to it
+    size_t reserveDirectory(size_t entryCount, vector<size_t> &clusters)
+    {
+        const size_t perCluster = sectorsPerCluster * sectorSize / 32;
+        if (!allocate(m_fat, m_nextCluster, m_fatEntries, (entryCount + 1 + perCluster - 1) / perCluster, true, clusters))
+            return (size_t)-1;
+        return clusters.front();
+    }
+
+    void fillDirectory(const RawEntries &entries, const vector<size_t> &clusters)
+    {
+        const size_t perCluster = sectorsPerCluster * sectorSize / 32;
+        for (size_t i=0; i<entries.size(); ++i)
+            write(clusterOffset(clusters[i / perCluster]) + (i % perCluster) * 32, entries[i].bytes, 32);
+    }
+
+    /// Write a recording's video, returning its first cluster
+    size_t writeVideo(unsigned int recording, unsigned long long size, vector<size_t> &clusters)
+    {
+        // Sky+ chains always have one more cluster than the size needs
+        if (!allocate(m_vfat, m_nextVideoCluster, m_vfatEntries, size / videoClusterSize + 1, true, clusters))
+            return (size_t)-1;
+
+        vector<unsigned char> cluster(options.fill ? videoClusterSize : tsPacketSize);
+        for (size_t i=0; i<clusters.size(); ++i)
+        {
+            // Transport stream packets on PID 0x100, each saying which recording and cluster they're from
+            for (size_t p=0; p<cluster.size(); p+=tsPacketSize)
+            {
+                unsigned char *packet = &cluster[p];
+                memset(packet, 0xFF, tsPacketSize);
+                packet[0] = 0x47;
+                packet[1] = 0x01;
+                packet[2] = 0x00;
+                packet[3] = 0x10 | ((p / tsPacketSize) & 0x0F);
+                put32(packet + 4, recording);
+                put32(packet + 8, i);
+                put32(packet + 12, p / tsPacketSize);
+            }
+            write(videoClusterOffset(clusters[i]), &cluster[0], cluster.size());
+        }
+        return clusters.front();
+    }
+
+    /// Finish off with the boot sector, FSInfo, marker and the tables
+    bool finish(size_t rootCluster)
+    {
+        unsigned char boot[sectorSize];
+        memset(boot, 0, sizeof(boot));
+        boot[0] = 0xEB; boot[1] = 0x58; boot[2] = 0x90;
+        memcpy(boot + 3, "SKY     ", 8);
+        put16(boot + 0x0B, sectorSize);
+        boot[0x0D] = sectorsPerCluster;
+        put16(boot + 0x0E, reservedSectors);
+        boot[0x10] = numFats;
+        boot[0x15] = 0xF8;
+        put16(boot + 0x18, 63);
+        put16(boot + 0x1A, 255);
+        put32(boot + 0x20, m_totalSectors);
+        put32(boot + 0x24, m_fatSectors);
+        put32(boot + 0x2C, rootCluster);
+        boot[510] = 0x55; boot[511] = 0xAA;
+        write(0, boot, sizeof(boot));
+
+        size_t freeClusters = 0;
+        for (size_t c=2; c<m_fat.size(); ++c)
+            freeClusters += (m_fat[c] == 0);
+        unsigned char fsInfo[sectorSize];
+        memset(fsInfo, 0, sizeof(fsInfo));
+        put32(fsInfo, 0x41615252);
+        put32(fsInfo + 0x1E4, 0x61417272);
+        put32(fsInfo + 0x1E8, freeClusters);
+        put32(fsInfo + 0x1EC, m_nextCluster - 1);
+        put32(fsInfo + 0x1FC, 0xAA550000);
+        write(sectorSize, fsInfo, sizeof(fsInfo));
+
+        if (!options.fat32)
+            write(2 * sectorSize, "XFS0", 4);
+
+        for (size_t f=0; f<numFats; ++f)
+            writeTable(m_fat, reservedSectors + f * m_fatSectors);
+        if (!options.fat32)
+            writeTable(m_vfat, clusterBeginLBA());
+
+        return !m_failed;
+    }
+
+    vector<unsigned int> &fat() { return m_fat; }
+    vector<unsigned int> &vfat() { return m_vfat; }
+
+    unsigned long clusterBeginLBA() const { return reservedSectors + numFats * m_fatSectors; }
+    unsigned long videoBeginLBA() const { return m_videoBeginLBA; }
+
+private:
+    /// Work out where everything goes, the same way Fat32 and Xtvfs will when they read it
+    void layout()
+    {
+        // The FAT covers the clusters up to the video area, whose start depends on the size of the FAT
+        m_fatSectors = 1;
+        for (;;)
+        {
+            const unsigned long clusterBegin = reservedSectors + numFats * m_fatSectors;
+            m_videoBeginLBA = videoBegin(clusterBegin);
+            const unsigned long long dataEnd = options.fat32 ? m_totalSectors : m_videoBeginLBA;
+            m_fatEntries = (dataEnd - clusterBegin) / sectorsPerCluster + 2;
+            const size_t needed = (m_fatEntries + 127) / 128;
+            if (needed <= m_fatSectors)
+                break;
+            m_fatSectors = needed;
+        }
+        m_vfatEntries = options.fat32 ? 0 : (m_totalSectors - m_videoBeginLBA) / videoSectorsPerCluster + 2;
+    }
+
+    /// As in Xtvfs::convertToVolumeId(), 2% of the disk rounded up to a whole cluster
+    unsigned long videoBegin(unsigned long clusterBegin) const
+    {
+        const double lbaVidEstimate = (int)m_totalSectors * 0.02;
+        return ceil((lbaVidEstimate - clusterBegin) / (int)sectorsPerCluster) * sectorsPerCluster + clusterBegin;
+    }
+
+    unsigned long long clusterOffset(size_t cluster) const
+    {
+        return (clusterBeginLBA() + (unsigned long long)(cluster - 2) * sectorsPerCluster) * sectorSize;
+    }
+
+    unsigned long long videoClusterOffset(size_t cluster) const
+    {
+        return (m_videoBeginLBA + (unsigned long long)(cluster - 2) * videoSectorsPerCluster) * sectorSize;
+    }
+
+    /// Take count clusters from a table, leaving gaps now and then if asked to fragment, and chain them
+    bool allocate(vector<unsigned int> &table, size_t &next, size_t limit, size_t count, bool fragment, vector<size_t> &clusters)
+    {
+        std::uniform_real_distribution<double> chance(0, 1);
+        std::uniform_int_distribution<size_t> gap(1, 8);
+
+        clusters.clear();
+        while (clusters.size() < count)
+        {
+            if (fragment && !clusters.empty() && chance(rng) < options.fragmentation)
+                next += gap(rng);
+            if (next >= limit)
+            {
+                cerr << "The image is too small for everything asked for" << endl;
+                m_failed = true;
+                return false;
+            }
+            clusters.push_back(next++);
+        }
+
+        for (size_t i=0; i+1<clusters.size(); ++i)
+            table[clusters[i]] = clusters[i+1];
+        table[clusters.back()] = endOfChain;
+        return true;
+    }
+
+    void writeTable(const vector<unsigned int> &table, unsigned long lba)
+    {
+        vector<unsigned char> bytes(table.size() * 4);
+        for (size_t i=0; i<table.size(); ++i)
+            put32(&bytes[i * 4], table[i]);
+        write((unsigned long long)lba * sectorSize, &bytes[0], bytes.size());
+    }
+
+    void write(unsigned long long offset, const void *data, size_t length)
+    {
+        const char *p = static_cast<const char*>(data);
+        while (length > 0)
+        {
+            const ssize_t n = pwrite(m_fd, p, length, offset);
+            if (n <= 0)
+            {
+                cerr << "Error writing the image: " << strerror(errno) << endl;
+                m_failed = true;
+                return;
+            }
+            p += n;
+            offset += n;
+            length -= n;
+        }
+    }
+
+    int m_fd;
+    bool m_failed;
+    unsigned long long m_totalSectors;
+    size_t m_fatSectors;
+    size_t m_fatEntries;
+    size_t m_vfatEntries;
+    unsigned long m_videoBeginLBA;
+    vector<unsigned int> m_fat;
+    vector<unsigned int> m_vfat;
+    size_t m_nextCluster;
+    size_t m_nextVideoCluster;
+};
+
+
+/// A planner text column: len, unknown, 13ff1a19, then the text, all hex encoded
+string plannerText(const string &s)
+{
+    const string text = s.substr(0, 255);
+    char hex[3];
+    snprintf(hex, sizeof(hex), "%02x", (unsigned int)text.size());
+    string result = string(hex) + "0013ff1a19";
+    for (size_t i=0; i<text.size(); ++i)
+    {
+        snprintf(hex, sizeof(hex), "%02x", (unsigned char)text[i]);
+        result += hex;
+    }
+    return result;
+}
+
+
+/// Write a planner database listing the recordings, and read it back
+bool makePlanner(const vector<Written> &videos, vector<unsigned char> &data)
+{
+    const char *tmpdir = getenv("TMPDIR");
+    string path = string(tmpdir ? tmpdir : "/tmp") + "/xtvfsgen-pcat-XXXXXX";
+    const int fd = mkstemp(&path[0]);
+    if (fd < 0)
+        return false;
+    ::close(fd);
+
+    sqlite3 *db = NULL;
+    bool okay = sqlite3_open(path.c_str(), &db) == SQLITE_OK;
+    okay = okay && sqlite3_exec(db,
+        "BEGIN;"
+        "CREATE TABLE DB_INFO(DB_SCHEMA_MAJOR_VERSION INT, DB_SCHEMA_MINOR_VERSION INT);"
+        "INSERT INTO DB_INFO VALUES(3, 7);"
+        "CREATE TABLE item(event_id INT, service_type INT, event_name BLOB, local_start_time INT, duration INT, channel_name BLOB, synopsis BLOB);"
+        "CREATE TABLE booking_info(event_id INT, av_content_id INT);"
+        "CREATE TABLE av_content(av_content_id INT, shrec_locator TEXT, vfile_locator TEXT);",
+        NULL, NULL, NULL) == SQLITE_OK;
+
+    sqlite3_stmt *item = NULL, *booking = NULL, *content = NULL;
+    okay = okay && sqlite3_prepare_v2(db, "INSERT INTO item VALUES(?,?,?,?,?,?,?)", -1, &item, NULL) == SQLITE_OK;
+    okay = okay && sqlite3_prepare_v2(db, "INSERT INTO booking_info VALUES(?,?)", -1, &booking, NULL) == SQLITE_OK;
+    okay = okay && sqlite3_prepare_v2(db, "INSERT INTO av_content VALUES(?,?,?)", -1, &content, NULL) == SQLITE_OK;
+
+    // One row for each recording, plus an on-demand download the readers should leave out
+    for (size_t i=0; okay && i<=videos.size(); ++i)
+    {
+        const bool onDemand = (i == videos.size());
+        const int eventId = 1000 + i;
+        ostringstream name, synopsis, locator;
+        name << (onDemand ? "On Demand" : "Recording") << " " << (i + 1);
+        synopsis << "Synthetic recording " << (i + 1) << ".";
+        locator << "0:1:s" << (i + 1);
+        const string nameText = plannerText(name.str());
+        const string channelText = plannerText("Channel " + to_string(i % 10 + 1));
+        const string synopsisText = plannerText(synopsis.str());
+        const string locatorText = locator.str();
+
+        sqlite3_reset(item);
+        sqlite3_bind_int(item, 1, eventId);
+        sqlite3_bind_int(item, 2, onDemand ? 5 : 1);
+        sqlite3_bind_text(item, 3, nameText.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int64(item, 4, 1400000000LL + i * 3600);
+        sqlite3_bind_int(item, 5, 30 * 60 * 1000);
+        sqlite3_bind_text(item, 6, channelText.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(item, 7, synopsisText.c_str(), -1, SQLITE_TRANSIENT);
+        okay = sqlite3_step(item) == SQLITE_DONE;
+
+        sqlite3_reset(booking);
+        sqlite3_bind_int(booking, 1, eventId);
+        sqlite3_bind_int(booking, 2, 2000 + i);
+        okay = okay && sqlite3_step(booking) == SQLITE_DONE;
+
+        sqlite3_reset(content);
+        sqlite3_bind_int(content, 1, 2000 + i);
+        sqlite3_bind_text(content, 2, locatorText.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(content, 3, "", -1, SQLITE_TRANSIENT);
+        okay = okay && sqlite3_step(content) == SQLITE_DONE;
+    }
+    sqlite3_finalize(item);
+    sqlite3_finalize(booking);
+    sqlite3_finalize(content);
+    okay = okay && sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL) == SQLITE_OK;
+    if (!okay)
+        cerr << "Error writing the planner: " << sqlite3_errmsg(db) << endl;
+    sqlite3_close(db);
+
+    FILE *f = okay ? fopen(path.c_str(), "rb") : NULL;
+    if (f)
+    {
+        fseek(f, 0, SEEK_END);
+        data.resize(ftell(f));
+        fseek(f, 0, SEEK_SET);
+        okay = fread(&data[0], 1, data.size(), f) == data.size();
+        fclose(f);
+    }
+    unlink(path.c_str());
+
+    return okay && f;
+}
+
+
+/// The contents of an ordinary file, different for each file so misplaced clusters show up
+vector<unsigned char> fileContents(unsigned int file, size_t size)
+{
+    vector<unsigned char> data(size);
+    for (size_t i=0; i<size; ++i)
+        data[i] = (file * 31 + i / 4) & 0xFF;
+    return data;
+}
+
+
+/// Damage a chain in one of a handful of ways, returning a description
+string damage(vector<unsigned int> &table, Written &file, const vector<Written> &others, unsigned int kind)
+{
+    const vector<size_t> &c = file.clusters;
+    switch (kind % 4)
+    {
+    case 0:
+        // End the chain half way through
+        table[c[c.size() / 2 - 1]] = endOfChain;
+        return "truncated";
+    case 1:
+        // Mark a cluster in the middle as free
+        table[c[c.size() / 2 - 1]] = 0;
+        return "freed";
+    case 2:
+        // Point the end back at the start
+        table[c.back()] = c.front();
+        return "loop";
+    default:
+        // Join the end onto another file's chain
+        for (size_t i=0; i<others.size(); ++i)
+            if (&others[i] != &file && !others[i].clusters.empty())
+            {
+                table[c.back()] = others[i].clusters.front();
+                return "cross-linked to " + others[i].path;
+            }
+        table[c.back()] = 0;
+        return "unterminated";
+    }
+}
+
+
+int generate(const string &path)
+{
+    ImageWriter image;
+    if (!image.create(path))
+        return 1;
+
+    std::uniform_real_distribution<double> spread(0.5, 1.5);
+    RawEntries root;
+    root.push_back(RawEntry("SKYDISK", attrVolumeId, 0, 0));
+
+    // Ordinary files, in directories of their own
+    vector<Written> files;
+    for (unsigned int d=0; d<options.dirs; ++d)
+    {
+        char dirName[16];
+        snprintf(dirName, sizeof(dirName), "DIR%05u", d);
+
+        vector<size_t> dirClusters;
+        const size_t slotsPerFile = options.longNames ? 4 : 1;
+        const size_t dirCluster = image.reserveDirectory(options.files * slotsPerFile + 2, dirClusters);
+        if (dirCluster == (size_t)-1)
+            return 1;
+
+        RawEntries entries;
+        entries.push_back(RawEntry(".", attrDirectory, dirCluster, 0));
+        entries.push_back(RawEntry("..", attrDirectory, 0, 0));
+        for (unsigned int f=0; f<options.files; ++f)
+        {
+            char fileName[16];
+            snprintf(fileName, sizeof(fileName), "F%07u.DAT", f);
+
+            Written w;
+            w.path = string(dirName) + "/" + fileName;
+            w.size = options.fileSize;
+            const size_t first = image.writeFile(fileContents(files.size(), w.size), w.clusters);
+            if (first == (size_t)-1)
+                return 1;
+
+            const RawEntry entry(fileName, attrArchive, first, w.size);
+            if (options.longNames)
+            {
+                // Long enough to take three entries, so names cross cluster boundaries now and then
+                char longName[40];
+                snprintf(longName, sizeof(longName), "Synthetic File Number %07u.data", f);
+                addLongName(entries, longName, entry);
+                w.path = string(dirName) + "/" + longName;
+            }
+            entries.push_back(entry);
+            files.push_back(w);
+        }
+        image.fillDirectory(entries, dirClusters);
+        root.push_back(RawEntry(dirName, attrDirectory, dirCluster, 0));
+    }
+
+    // Recordings, each in a stream directory with its extent file
+    vector<Written> videos;
+    if (!options.fat32)
+    {
+        for (unsigned int r=0; r<options.recordings; ++r)
+        {
+            Written w;
+            w.path = "s" + to_string(r + 1) + "/STREAM.STR";
+            w.size = (unsigned long long)(options.recordingSize * spread(rng));
+            if (image.writeVideo(r, w.size, w.clusters) == (size_t)-1)
+                return 1;
+            videos.push_back(w);
+        }
+
+        // Damage some of them, now that there are others to cross-link to
+        vector<Written> &targets = videos.empty() ? files : videos;
+        vector<unsigned int> &table = videos.empty() ? image.fat() : image.vfat();
+        for (unsigned int i=0; i<options.corrupt && i<targets.size(); ++i)
+        {
+            Written &w = targets[(i * 7919) % targets.size()];
+            if (w.clusters.size() < 2 || !w.damage.empty())
+                continue;
+            w.damage = damage(table, w, targets, i);
+        }
+
+        for (size_t r=0; r<videos.size(); ++r)
+        {
+            // STREAM.EXN lists the runs of video clusters as pairs of first and last cluster
+            const vector<size_t> &c = videos[r].clusters;
+            vector<unsigned char> exn;
+            for (size_t i=0; i<c.size(); ++i)
+            {
+                if (i > 0 && c[i] == c[i-1] + 1)
+                    put32(&exn[exn.size() - 4], c[i]);
+                else
+                {
+                    exn.resize(exn.size() + 8);
+                    put32(&exn[exn.size() - 8], c[i]);
+                    put32(&exn[exn.size() - 4], c[i]);
+                }
+            }
+
+            vector<size_t> exnClusters, dirClusters;
+            const size_t exnCluster = image.writeFile(exn, exnClusters);
+            const size_t dirCluster = image.reserveDirectory(4, dirClusters);
+            if (exnCluster == (size_t)-1 || dirCluster == (size_t)-1)
+                return 1;
+
+            RawEntries entries;
+            entries.push_back(RawEntry(".", attrDirectory, dirCluster, 0));
+            entries.push_back(RawEntry("..", attrDirectory, 0, 0));
+            entries.push_back(RawEntry("STREAM.STR", attrDevice | 0x80, c.front(), videos[r].size));
+            entries.push_back(RawEntry("STREAM.EXN", attrArchive, exnCluster, exn.size()));
+            image.fillDirectory(entries, dirClusters);
+            root.push_back(RawEntry("s" + to_string(r + 1), attrDirectory, dirCluster, 0));
+        }
+    }
+    else if (options.corrupt)
+    {
+        for (unsigned int i=0; i<options.corrupt && i<files.size(); ++i)
+        {
+            Written &w = files[(i * 7919) % files.size()];
+            if (w.clusters.size() < 2 || !w.damage.empty())
+                continue;
+            w.damage = damage(image.fat(), w, files, i);
+        }
+    }
+
+    if (options.planner && !options.fat32)
+    {
+        vector<unsigned char> pcat;
+        if (!makePlanner(videos, pcat))
+            return 1;
+
+        vector<size_t> pcatClusters, dirClusters;
+        const size_t pcatCluster = image.writeFile(pcat, pcatClusters);
+        const size_t dirCluster = image.reserveDirectory(3, dirClusters);
+        if (pcatCluster == (size_t)-1 || dirCluster == (size_t)-1)
+            return 1;
+
+        RawEntries entries;
+        entries.push_back(RawEntry(".", attrDirectory, dirCluster, 0));
+        entries.push_back(RawEntry("..", attrDirectory, 0, 0));
+        entries.push_back(RawEntry("PCAT.DB", attrArchive, pcatCluster, pcat.size()));
+        image.fillDirectory(entries, dirClusters);
+        root.push_back(RawEntry("FSN_DATA", attrDirectory, dirCluster, 0));
+    }
+
+    vector<size_t> rootClusters;
+    const size_t rootCluster = image.writeDirectory(root, rootClusters);
+    if (rootCluster == (size_t)-1 || !image.finish(rootCluster))
+        return 1;
+
+    // The manifest, for tests to check what they read against
+    cout << "image " << path << " sectors " << options.sectors << (options.fat32 ? " fat32" : " xtvfs")
+         << " cluster-begin " << image.clusterBeginLBA();
+    if (!options.fat32)
+        cout << " video-begin " << image.videoBeginLBA();
+    cout << "\n";
+    const vector<Written> *lists[] = { &files, &videos };
+    for (size_t l=0; l<2; ++l)
+        for (size_t i=0; i<lists[l]->size(); ++i)
+        {
+            const Written &w = (*lists[l])[i];
+            size_t runs = 0;
+            for (size_t c=0; c<w.clusters.size(); ++c)
+                runs += (c == 0 || w.clusters[c] != w.clusters[c-1] + 1);
+            cout << (l ? "video " : "file ") << w.path << " size " << w.size << " clusters " << w.clusters.size()
+                 << " extents " << runs << " first " << (w.clusters.empty() ? 0 : w.clusters.front());
+            if (!w.damage.empty())
+                cout << " damaged " << w.damage;
+            cout << "\n";
+        }
+
+    return 0;
+}
+
+} // end of anonymous namespace
+
+
+
+int main(int argc, char *argv[])
+{
+    enum { SizeOption = 1000, SectorsOption, Fat32Option, DirsOption, FilesOption, FileSizeOption,
+           RecordingsOption, RecordingSizeOption, FragmentationOption, CorruptOption, SeedOption,
+           FillOption, NoPlannerOption, LongNamesOption };
+    static const struct option longOptions[] =
+    {
+        { "size",           required_argument, NULL, SizeOption },
+        { "sectors",        required_argument, NULL, SectorsOption },
+        { "fat32",          no_argument,       NULL, Fat32Option },
+        { "dirs",           required_argument, NULL, DirsOption },
+        { "files",          required_argument, NULL, FilesOption },
+        { "file-size",      required_argument, NULL, FileSizeOption },
+        { "recordings",     required_argument, NULL, RecordingsOption },
+        { "recording-size", required_argument, NULL, RecordingSizeOption },
+        { "fragmentation",  required_argument, NULL, FragmentationOption },
+        { "corrupt",        required_argument, NULL, CorruptOption },
+        { "seed",           required_argument, NULL, SeedOption },
+        { "fill",           no_argument,       NULL, FillOption },
+        { "no-planner",     no_argument,       NULL, NoPlannerOption },
+        { "long-names",     no_argument,       NULL, LongNamesOption },
+        { "help",           no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    Log::setLevel(LogWarning);
+
+    int c;
+    while ((c = getopt_long(argc, argv, "h", longOptions, NULL)) != -1)
+    {
+        switch (c)
+        {
+        case SizeOption:
+            options.sectors = (unsigned long long)(atof(optarg) * 1024 * 1024 * 1024 / sectorSize);
+            break;
+        case SectorsOption:
+            options.sectors = strtoull(optarg, NULL, 0);
+            break;
+        case Fat32Option:
+            options.fat32 = true;
+            break;
+        case DirsOption:
+            options.dirs = atoi(optarg);
+            break;
+        case FilesOption:
+            options.files = atoi(optarg);
+            break;
+        case FileSizeOption:
+            options.fileSize = (size_t)atoi(optarg) * 1024;
+            break;
+        case RecordingsOption:
+            options.recordings = atoi(optarg);
+            break;
+        case RecordingSizeOption:
+            options.recordingSize = (unsigned long long)(atof(optarg) * 1024 * 1024);
+            break;
+        case FragmentationOption:
+            options.fragmentation = std::min(1.0, std::max(0.0, atof(optarg)));
+            break;
+        case CorruptOption:
+            options.corrupt = atoi(optarg);
+            break;
+        case SeedOption:
+            options.seed = strtoul(optarg, NULL, 0);
+            break;
+        case FillOption:
+            options.fill = true;
+            break;
+        case NoPlannerOption:
+            options.planner = false;
+            break;
+        case LongNamesOption:
+            options.longNames = true;
+            break;
+        default:
+            usage(argv[0]);
+            return (c == 'h') ? 0 : 2;
+        }
+    }
+
+    if (argc - optind != 1)
+    {
+        usage(argv[0]);
+        return 2;
+    }
+
+    // The readers keep the sector count in an int
+    if (options.sectors < 64 * 1024 || options.sectors > 0x7FFFFFFF)
+    {
+        cerr << "The image must be between 32MB and 1TB" << endl;
+        return 2;
+    }
+
+    rng.seed(options.seed);
+    return generate(argv[optind]);
+}
@@ -0,0 +1,19 @@
+#-------------------------------------------------
+#
+# Writes synthetic XTVFS / FAT32 images for testing
+# and benchmarking the readers without a Sky+ disk.
+# Needs SQLite for writing the planner (FSN_DATA/PCAT.DB).
+#
+#-------------------------------------------------
+
+TARGET = xtvfsgen
+TEMPLATE = app
+
+CONFIG += console thread
+CONFIG -= app_bundle qt
+
+include(xtvfs.pri)
+
+LIBS += -lsqlite3
+
+SOURCES += xtvfsgen.cpp
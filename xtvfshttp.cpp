@@ -0,0 +1,793 @@
+/* This file is part of XTVFS Reader.
+ * Copyright (C) 2014 S. Blackburn
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * XTVFS Reader is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with XTVFS Reader.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * xtvfshttp - serve an XTVFS or FAT32 image read-only over HTTP
+ *
+ * Usage: xtvfshttp [options] <image>
+ *
+ * Directories are listed as web pages, and files can be fetched or played
+ * straight off the image, e.g. mpv http://localhost:8080/s9/stream.str.
+ * Byte ranges are supported, so players can seek.
+ */
+#include "clustercache.h"
+#include "filesystem.h"
+#include "log.h"
+#include "pathcache.h"
+#include "probe.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#endif
+
+using namespace std;
+using namespace fs;
+
+namespace
+{
+
+/// Settings from the command line
+struct Options
+{
+    Options() : address("127.0.0.1"), port("8080"), readAhead(4), cacheMB(64), partition(0),
+                connections(32), zeroCopy(true), quiet(false) {}
+
+    string address;             ///< Interface to listen on
+    string port;
+    unsigned int readAhead;     ///< Clusters to read ahead of each stream
+    unsigned int cacheMB;       ///< Memory for caching, shared between the cluster cache and the file system's block cache
+    unsigned int partition;     ///< Which MBR partition to serve, 0 for the first volume found
+    unsigned int connections;   ///< Most connections served at once
+    bool zeroCopy;              ///< Send runs of clusters with sendfile() where the image allows
+    bool quiet;
+};
+
+Options options;
+std::mutex outputMutex;
+
+/// How long an idle connection is kept open, in seconds
+const int idleTimeout = 60;
+
+/// The most a request's line and headers can take up
+const size_t maxRequestSize = 16 * 1024;
+
+
+void usage(const char *program)
+{
+    cerr << "Usage: " << program << " [options] <image>\n"
+            "\n"
+            "Serves the image's files read-only over HTTP, with byte ranges for seeking.\n"
+            "\n"
+            "Options:\n"
+            "  -l, --listen ADDR   Interface to listen on (default 127.0.0.1, 0.0.0.0 for all)\n"
+            "      --port N        Port to listen on (default 8080)\n"
+            "      --readahead N   Clusters to read ahead of each stream (default 4)\n"
+            "      --cache MB      Memory for caching the image (default 64)\n"
+            "      --connections N Most connections at once (default 32)\n"
+            "      --no-sendfile   Copy everything through the cache, rather than having the kernel send it\n"
+            "  -p, --partition N   Serve MBR partition N (default the first volume found)\n"
+            "  -q, --quiet         Don't log each request\n"
+            "  -v, --verbose       Show what the library is doing (twice for more)\n";
+}
+
+
+/// A request's line and headers
+struct Request
+{
+    string method;
+    string path;                        ///< Decoded, without the query
+    string version;
+    map<string, string> headers;        ///< Names in lower case
+
+    string header(const string &name) const
+    {
+        map<string, string>::const_iterator i = headers.find(name);
+        return i == headers.end() ? string() : i->second;
+    }
+};
+
+
+/// Everything the connections need, shared by all their threads
+class Server : private PathCache
+{
+public:
+    Server(FileSystem *fileSystem, size_t clusterCacheSize) :
+        PathCache(fileSystem),
+        m_fs(fileSystem),
+        m_cache(clusterCacheSize)
+    {
+    }
+
+    /// Answer requests on a connection until it is closed
+    void serve(int socket, const string &client);
+
+private:
+    /// Answer one request. Returns false if the connection should be closed.
+    bool respond(int socket, const Request &request, bool keepAlive, int &status);
+
+    bool sendDirectory(int socket, const Request &request, bool keepAlive);
+
+    /// Send part of a file, cluster by cluster or, where the image allows, straight from the kernel
+    bool sendRange(int socket, const OpenFile &file, unsigned long long offset, unsigned long long length);
+
+    FileSystem *m_fs;
+    ClusterCache m_cache;
+};
+
+
+// ===========================================================================
+// ==                          H T T P                                      ==
+// ===========================================================================
+
+bool sendAll(int socket, const char *data, size_t length)
+{
+    while (length > 0)
+    {
+        const ssize_t sent = send(socket, data, length, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR)
+            continue;
+        if (sent <= 0)
+            return false;
+        data += sent;
+        length -= sent;
+    }
+    return true;
+}
+
+
+bool sendAll(int socket, const string &s)
+{
+    return sendAll(socket, s.data(), s.size());
+}
+
+
+string lowerCase(string s)
+{
+    transform(s.begin(), s.end(), s.begin(), ::tolower);
+    return s;
+}
+
+
+string trim(const string &s)
+{
+    const size_t begin = s.find_first_not_of(" \t");
+    const size_t end = s.find_last_not_of(" \t");
+    return begin == string::npos ? string() : s.substr(begin, end - begin + 1);
+}
+
+
+/// Undo a URL's %XX escapes
+bool percentDecode(const string &s, string &decoded)
+{
+    decoded.clear();
+    for (size_t i=0; i<s.size(); ++i)
+    {
+        if (s[i] != '%')
+        {
+            decoded += s[i];
+            continue;
+        }
+        if (i + 2 >= s.size() || !isxdigit((unsigned char)s[i+1]) || !isxdigit((unsigned char)s[i+2]))
+            return false;
+        decoded += (char)strtol(s.substr(i + 1, 2).c_str(), NULL, 16);
+        i += 2;
+    }
+    return true;
+}
+
+
+/// Escape a file name for use in a link
+string percentEncode(const string &s)
+{
+    static const char hexDigits[] = "0123456789ABCDEF";
+    string encoded;
+    for (size_t i=0; i<s.size(); ++i)
+    {
+        const unsigned char c = s[i];
+        if (isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~')
+            encoded += c;
+        else
+        {
+            encoded += '%';
+            encoded += hexDigits[c >> 4];
+            encoded += hexDigits[c & 15];
+        }
+    }
+    return encoded;
+}
+
+
+string htmlEscape(const string &s)
+{
+    string escaped;
+    for (size_t i=0; i<s.size(); ++i)
+    {
+        switch (s[i])
+        {
+        case '&': escaped += "&amp;"; break;
+        case '<': escaped += "&lt;"; break;
+        case '>': escaped += "&gt;"; break;
+        case '"': escaped += "&quot;"; break;
+        default: escaped += s[i]; break;
+        }
+    }
+    return escaped;
+}
+
+
+/**
+ * Read the next request's line and headers.
+ * Anything read beyond them, i.e. the start of the next request, is kept in pending.
+ * @return False if the connection closed, went quiet or sent something that isn't HTTP
+ */
+bool readRequest(int socket, string &pending, Request &request)
+{
+    size_t end;
+    while ((end = pending.find("\r\n\r\n")) == string::npos)
+    {
+        if (pending.size() > maxRequestSize)
+            return false;
+
+        char buffer[4096];
+        const ssize_t got = recv(socket, buffer, sizeof(buffer), 0);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            return false;
+        pending.append(buffer, got);
+    }
+
+    istringstream head(pending.substr(0, end));
+    pending.erase(0, end + 4);
+
+    string line, target;
+    getline(head, line);
+    istringstream requestLine(line);
+    if (!(requestLine >> request.method >> target >> request.version) || request.version.compare(0, 5, "HTTP/") != 0)
+        return false;
+
+    target = target.substr(0, target.find('?'));
+    if (target.empty() || target[0] != '/' || !percentDecode(target, request.path))
+        return false;
+
+    request.headers.clear();
+    while (getline(head, line))
+    {
+        const size_t colon = line.find(':');
+        if (colon != string::npos)
+            request.headers[lowerCase(trim(line.substr(0, colon)))] = trim(line.substr(colon + 1, line.find_last_not_of('\r') - colon));
+    }
+    return true;
+}
+
+
+const char *statusText(int status)
+{
+    switch (status)
+    {
+    case 200: return "OK";
+    case 206: return "Partial Content";
+    case 301: return "Moved Permanently";
+    case 400: return "Bad Request";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 416: return "Range Not Satisfiable";
+    case 500: return "Internal Server Error";
+    case 503: return "Service Unavailable";
+    default: return "Unknown";
+    }
+}
+
+
+/// A response's status line and headers, with Content-Length and Connection added
+string responseHead(int status, const string &headers, unsigned long long contentLength, bool keepAlive)
+{
+    char date[64];
+    const time_t now = time(NULL);
+    struct tm utc;
+    gmtime_r(&now, &utc);
+    strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &utc);
+
+    ostringstream s;
+    s << "HTTP/1.1 " << status << ' ' << statusText(status) << "\r\n"
+      << "Date: " << date << "\r\n"
+      << "Server: xtvfshttp\r\n"
+      << headers
+      << "Content-Length: " << contentLength << "\r\n"
+      << "Connection: " << (keepAlive ? "keep-alive" : "close") << "\r\n"
+      << "\r\n";
+    return s.str();
+}
+
+
+/// A short page explaining an error
+bool sendError(int socket, int status, bool keepAlive, const string &headers = string())
+{
+    ostringstream body;
+    body << "<html><head><title>" << status << ' ' << statusText(status) << "</title></head>"
+         << "<body><h1>" << status << ' ' << statusText(status) << "</h1></body></html>\n";
+    const string page = body.str();
+    return sendAll(socket, responseHead(status, headers + "Content-Type: text/html; charset=utf-8\r\n", page.size(), keepAlive) + page);
+}
+
+
+const char *contentType(const DirEntry &entry)
+{
+    if (entry.isDevice())
+        return "video/mp2t";
+
+    const string name = lowerCase(entry.toString());
+    const size_t period = name.rfind('.');
+    const string extension = (period == string::npos) ? string() : name.substr(period + 1);
+    if (extension == "ts" || extension == "str")
+        return "video/mp2t";
+    if (extension == "txt")
+        return "text/plain; charset=utf-8";
+    if (extension == "xml")
+        return "text/xml";
+    return "application/octet-stream";
+}
+
+
+enum RangeRequest { WholeFile, PartOfFile, Unsatisfiable };
+
+/**
+ * Work out which bytes a Range header asks for.
+ * Only a single range is served. Several at once, or a header that can't be
+ * understood, get the whole file, which is always allowed.
+ */
+RangeRequest parseRange(const string &header, unsigned long long size, unsigned long long &first, unsigned long long &last)
+{
+    if (header.compare(0, 6, "bytes=") != 0 || header.find(',') != string::npos)
+        return WholeFile;
+
+    const string spec = trim(header.substr(6));
+    const size_t dash = spec.find('-');
+    if (dash == string::npos)
+        return WholeFile;
+    const string from = trim(spec.substr(0, dash)), to = trim(spec.substr(dash + 1));
+    if (from.find_first_not_of("0123456789") != string::npos || to.find_first_not_of("0123456789") != string::npos)
+        return WholeFile;
+
+    if (from.empty())
+    {
+        // The last n bytes
+        if (to.empty())
+            return WholeFile;
+        const unsigned long long n = strtoull(to.c_str(), NULL, 10);
+        if (n == 0 || size == 0)
+            return Unsatisfiable;
+        first = size - min(n, size);
+        last = size - 1;
+        return PartOfFile;
+    }
+
+    first = strtoull(from.c_str(), NULL, 10);
+    if (first >= size)
+        return Unsatisfiable;
+    last = to.empty() ? size - 1 : min(strtoull(to.c_str(), NULL, 10), size - 1);
+    if (last < first)
+        return WholeFile;
+    return PartOfFile;
+}
+
+
+void Server::serve(int socket, const string &client)
+{
+    string pending;
+    Request request;
+    while (readRequest(socket, pending, request))
+    {
+        // HTTP/1.1 keeps the connection open unless asked not to; 1.0 closes it unless asked not to
+        const string connection = lowerCase(request.header("connection"));
+        const bool keepAlive = (request.version == "HTTP/1.0") ? connection == "keep-alive" : connection != "close";
+
+        int status = 0;
+        const bool okay = respond(socket, request, keepAlive, status);
+
+        if (!options.quiet)
+        {
+            lock_guard<mutex> lock(outputMutex);
+            cerr << client << ' ' << request.method << ' ' << request.path;
+            if (!request.header("range").empty())
+                cerr << " (" << request.header("range") << ')';
+            cerr << ' ' << status << (okay ? "" : " (dropped)") << endl;
+        }
+
+        if (!okay || !keepAlive)
+            break;
+    }
+}
+
+
+bool Server::respond(int socket, const Request &request, bool keepAlive, int &status)
+{
+    const bool head = (request.method == "HEAD");
+    if (request.method != "GET" && !head)
+    {
+        status = 405;
+        return sendError(socket, status, keepAlive, "Allow: GET, HEAD\r\n");
+    }
+
+    // Directories are asked for with a slash on the end, so the links in their listings work
+    const bool slash = request.path.size() > 1 && request.path[request.path.size() - 1] == '/';
+    const string path = slash ? request.path.substr(0, request.path.size() - 1) : request.path;
+
+    DirEntry entry;
+    if (!lookup(path, entry) || (slash && !entry.isDirectory()))
+    {
+        status = 404;
+        return sendError(socket, status, keepAlive);
+    }
+
+    if (entry.isDirectory())
+    {
+        if (!slash && path != "/")
+        {
+            status = 301;
+            return sendError(socket, status, keepAlive, "Location: " + percentEncode(entry.toString()) + "/\r\n");
+        }
+        status = 200;
+        return sendDirectory(socket, request, keepAlive);
+    }
+
+    const OpenFilePtr file = openFile(path);
+    if (!file)
+    {
+        status = 404;
+        return sendError(socket, status, keepAlive);
+    }
+
+    const unsigned long long size = file->entry.filesize;
+    unsigned long long first = 0, last = size ? size - 1 : 0;
+    string headers = string("Content-Type: ") + contentType(file->entry) + "\r\nAccept-Ranges: bytes\r\n";
+    const RangeRequest range = parseRange(request.header("range"), size, first, last);
+    if (range == Unsatisfiable)
+    {
+        status = 416;
+        ostringstream contentRange;
+        contentRange << "Content-Range: bytes */" << size << "\r\n";
+        return sendError(socket, status, keepAlive, contentRange.str());
+    }
+
+    const unsigned long long length = size ? last - first + 1 : 0;
+    status = 200;
+    if (range == PartOfFile)
+    {
+        status = 206;
+        ostringstream contentRange;
+        contentRange << "Content-Range: bytes " << first << '-' << last << '/' << size << "\r\n";
+        headers += contentRange.str();
+    }
+
+    if (!sendAll(socket, responseHead(status, headers, length, keepAlive)))
+        return false;
+    return head || sendRange(socket, *file, first, length);
+}
+
+
+bool Server::sendDirectory(int socket, const Request &request, bool keepAlive)
+{
+    const string path = (request.path == "/") ? request.path : request.path.substr(0, request.path.size() - 1);
+    const ListingPtr entries = listing(path);
+    if (!entries)
+        return sendError(socket, 404, keepAlive);
+
+    const string title = "Index of " + htmlEscape(request.path);
+    ostringstream page;
+    page << "<!DOCTYPE html>\n<html><head><meta charset=\"utf-8\"><title>" << title << "</title></head>\n"
+         << "<body><h1>" << title << "</h1>\n<table>\n";
+    if (request.path != "/")
+        page << "<tr><td><a href=\"../\">../</a></td><td></td></tr>\n";
+    for (size_t i=0; i<entries->size(); ++i)
+    {
+        const DirEntry &d = (*entries)[i];
+        const string name = d.toString() + (d.isDirectory() ? "/" : "");
+        page << "<tr><td><a href=\"" << percentEncode(d.toString()) << (d.isDirectory() ? "/" : "") << "\">"
+             << htmlEscape(name) << "</a></td><td align=\"right\">";
+        if (!d.isDirectory())
+            page << d.filesize;
+        page << "</td></tr>\n";
+    }
+    page << "</table></body></html>\n";
+
+    const string body = page.str();
+    const string head = responseHead(200, "Content-Type: text/html; charset=utf-8\r\n", body.size(), keepAlive);
+    return sendAll(socket, head) && (request.method == "HEAD" || sendAll(socket, body));
+}
+
+
+bool Server::sendRange(int socket, const OpenFile &file, unsigned long long offset, unsigned long long length)
+{
+    // Send a few clusters at a time, so what comes next can be read while they go
+    const size_t step = file.clusterSize * max(1u, options.readAhead);
+    while (length > 0)
+    {
+        const size_t want = (size_t)min<unsigned long long>(length, step);
+
+#if defined(__linux__)
+        int fd = -1;
+        unsigned long long fileOffset = 0;
+        const size_t run = options.zeroCopy ? m_fs->locateFile(file.entry, file.extents, offset, want, fd, fileOffset) : 0;
+        if (run > 0)
+        {
+            // The kernel reads ahead of where it is asked to, but not across a jump to the next extent
+            int nextFd = -1;
+            unsigned long long nextOffset = 0;
+            const size_t next = m_fs->locateFile(file.entry, file.extents, offset + run,
+                                                 (size_t)min<unsigned long long>(length - run, step), nextFd, nextOffset);
+            if (next > 0)
+                posix_fadvise(nextFd, nextOffset, next, POSIX_FADV_WILLNEED);
+
+            off_t from = fileOffset;
+            size_t left = run;
+            while (left > 0)
+            {
+                const ssize_t sent = sendfile(socket, fd, &from, left);
+                if (sent < 0 && errno == EINTR)
+                    continue;
+                if (sent <= 0)
+                    return false;
+                left -= sent;
+            }
+
+            offset += run;
+            length -= run;
+            continue;
+        }
+#endif
+
+        // Read through the cache, along with however many of the following clusters the range wants
+        const size_t fileCluster = offset / file.clusterSize;
+        const size_t offsetInCluster = offset % file.clusterSize;
+        const size_t clustersLeft = (size_t)((offsetInCluster + length + file.clusterSize - 1) / file.clusterSize);
+        const ClusterCache::ClusterPtr data = m_cache.read(*m_fs, file.entry, file.extents, fileCluster,
+                                                           min<size_t>(options.readAhead, clustersLeft - 1));
+
+        // The length has already been sent, so if the chain runs out early all that can be done is hang up
+        if (!data || offsetInCluster >= data->size())
+        {
+            XTVFS_WARNING("Unable to read " << file.entry.toString() << " at offset " << offset);
+            return false;
+        }
+
+        const size_t bytes = (size_t)min<unsigned long long>(length, data->size() - offsetInCluster);
+        if (!sendAll(socket, &(*data)[offsetInCluster], bytes))
+            return false;
+        offset += bytes;
+        length -= bytes;
+    }
+
+    return true;
+}
+
+
+/// Listen on the address and port, or return -1
+int listenOn(const string &address, const string &port)
+{
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    struct addrinfo *addresses = NULL;
+    const int error = getaddrinfo(address.c_str(), port.c_str(), &hints, &addresses);
+    if (error != 0)
+    {
+        cerr << "Unable to find " << address << ": " << gai_strerror(error) << endl;
+        return -1;
+    }
+
+    int listener = -1;
+    for (struct addrinfo *a = addresses; a && listener < 0; a = a->ai_next)
+    {
+        listener = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (listener < 0)
+            continue;
+
+        const int yes = 1;
+        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+        if (bind(listener, a->ai_addr, a->ai_addrlen) != 0 || listen(listener, 64) != 0)
+        {
+            close(listener);
+            listener = -1;
+        }
+    }
+    freeaddrinfo(addresses);
+
+    if (listener < 0)
+        cerr << "Unable to listen on " << address << " port " << port << ": " << strerror(errno) << endl;
+    return listener;
+}
+
+
+/// The client's address, for the log
+string peerName(const struct sockaddr_storage &peer, socklen_t length)
+{
+    char host[NI_MAXHOST];
+    if (getnameinfo(reinterpret_cast<const struct sockaddr*>(&peer), length, host, sizeof(host), NULL, 0, NI_NUMERICHOST) != 0)
+        return "?";
+    return host;
+}
+
+} // end of anonymous namespace
+
+
+
+int main(int argc, char *argv[])
+{
+    enum { PortOption = 1000, ReadAheadOption, CacheOption, ConnectionsOption, NoSendfileOption };
+    static const struct option longOptions[] =
+    {
+        { "listen",      required_argument, NULL, 'l' },
+        { "port",        required_argument, NULL, PortOption },
+        { "readahead",   required_argument, NULL, ReadAheadOption },
+        { "cache",       required_argument, NULL, CacheOption },
+        { "connections", required_argument, NULL, ConnectionsOption },
+        { "no-sendfile", no_argument,       NULL, NoSendfileOption },
+        { "partition",   required_argument, NULL, 'p' },
+        { "quiet",       no_argument,       NULL, 'q' },
+        { "verbose",     no_argument,       NULL, 'v' },
+        { "help",        no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    Log::setLevel(LogWarning);
+
+    int c;
+    while ((c = getopt_long(argc, argv, "l:p:qvh", longOptions, NULL)) != -1)
+    {
+        switch (c)
+        {
+        case 'l':
+            options.address = optarg;
+            break;
+        case PortOption:
+            options.port = optarg;
+            break;
+        case ReadAheadOption:
+            options.readAhead = std::max(0, atoi(optarg));
+            break;
+        case CacheOption:
+            options.cacheMB = std::max(1, atoi(optarg));
+            break;
+        case ConnectionsOption:
+            options.connections = std::max(1, atoi(optarg));
+            break;
+        case NoSendfileOption:
+            options.zeroCopy = false;
+            break;
+        case 'p':
+            options.partition = std::max(0, atoi(optarg));
+            break;
+        case 'q':
+            options.quiet = true;
+            Log::setLevel(LogError);
+            break;
+        case 'v':
+            Log::setLevel(Log::level() > LogInfo ? LogInfo : LogDebug);
+            break;
+        default:
+            usage(argv[0]);
+            return (c == 'h') ? 0 : 2;
+        }
+    }
+
+    if (argc - optind != 1)
+    {
+        usage(argv[0]);
+        return 2;
+    }
+    const string image = argv[optind];
+
+    const CacheBudget budget((size_t)options.cacheMB * 1024 * 1024);
+
+    ProbedVolumes volumes;
+    if (!probeImage(image, volumes, budget.blockCache))
+    {
+        cerr << "Unable to find an XTVFS or FAT32 volume on " << image << endl;
+        return 1;
+    }
+
+    std::shared_ptr<FileSystem> diskImage;
+    for (size_t v=0; v<volumes.size() && !diskImage; ++v)
+    {
+        if (options.partition == 0 || volumes[v].partition == options.partition)
+            diskImage = volumes[v].fileSystem;
+    }
+    if (!diskImage)
+    {
+        cerr << "No XTVFS or FAT32 volume in partition " << options.partition << " of " << image << endl;
+        return 1;
+    }
+
+    const int listener = listenOn(options.address, options.port);
+    if (listener < 0)
+        return 1;
+
+    // A player hanging up part way through a file mustn't take the server with it
+    signal(SIGPIPE, SIG_IGN);
+
+    if (!options.quiet)
+        cerr << "Serving " << image << " on http://" << options.address << ':' << options.port << "/" << endl;
+
+    // Each connection gets its own thread, all sharing the one file system and cluster cache
+    Server server(diskImage.get(), budget.clusterCache);
+    std::atomic<unsigned int> active(0);
+    for (;;)
+    {
+        struct sockaddr_storage peer;
+        socklen_t peerLength = sizeof(peer);
+        const int client = accept(listener, reinterpret_cast<struct sockaddr*>(&peer), &peerLength);
+        if (client < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            cerr << "Unable to accept connections: " << strerror(errno) << endl;
+            break;
+        }
+
+        if (active >= options.connections)
+        {
+            sendError(client, 503, false);
+            close(client);
+            continue;
+        }
+
+        struct timeval timeout;
+        timeout.tv_sec = idleTimeout;
+        timeout.tv_usec = 0;
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+        ++active;
+        const string name = peerName(peer, peerLength);
+        std::thread([&server, &active, client, name]()
+        {
+            server.serve(client, name);
+            close(client);
+            --active;
+        }).detach();
+    }
+
+    close(listener);
+    return 1;
+}
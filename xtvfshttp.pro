@@ -0,0 +1,16 @@
+#-------------------------------------------------
+#
+# Read-only HTTP server for XTVFS / FAT32 images, with byte ranges
+# so recordings can be streamed and seeked in any player.
+#
+#-------------------------------------------------
+
+TARGET = xtvfshttp
+TEMPLATE = app
+
+CONFIG += console thread
+CONFIG -= app_bundle qt
+
+include(xtvfs.pri)
+
+SOURCES += xtvfshttp.cpp
@@ -4,18 +4,26 @@
 #
 #-------------------------------------------------
 
-QT       += core gui sql
+QT       += core gui
 
 greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
 
 TARGET = xtvfsreader
 TEMPLATE = app
 
+include(xtvfs.pri)
+
 SOURCES += main.cpp\
         mainwindow.cpp \
-    filesystem.cpp
+        jobs.cpp \
+        models.cpp \
+        planner.cpp
 
 HEADERS  += mainwindow.h \
-    filesystem.h
+        jobs.h \
+        models.h \
+        planner.h
+
+LIBS += -lsqlite3
 
 FORMS    += mainwindow.ui